@@ -0,0 +1,237 @@
+#ifndef _RTMA_HPP
+#define _RTMA_HPP
+
+#include "rtma_client.h"
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Header only C++17 interface over the C client. A message type is a plain
+// struct that carries its id, a struct without members is a signal:
+//
+//	struct Position { static constexpr MSG_TYPE msg_type = 1234; double x, y, z; };
+//	struct Stop { static constexpr MSG_TYPE msg_type = 1235; };
+//
+//	rtma::Client c;
+//	c.connect("127.0.0.1", 7111);
+//	c.subscribe<Position, Stop>();
+//	c.send(Position{ 1.0, 2.0, 3.0 });
+//
+//	rtma::Dispatcher on_message(
+//		rtma::on<Position>([&](const Position& p) { ... }),
+//		rtma::on<Stop>([&](const Stop&, const RTMA_MSG_HEADER& h) { ... }));
+//	while (c.dispatch(on_message, BLOCKING)) ...
+//
+// The layout and size of a message are checked at compile time, so send
+// passes constants straight to rtma_client_send_message_to_module. The
+// dispatcher compiles to the switch over msg_type one would write by hand and
+// only checks that the payload size matches the struct. rtma_bench -typed
+// compares both against the same code written with the C API.
+
+namespace rtma {
+
+	template <typename T, typename = void>
+	struct has_msg_type : std::false_type {};
+
+	template <typename T>
+	struct has_msg_type<T, std::void_t<std::integral_constant<MSG_TYPE, T::msg_type>>> : std::true_type {};
+
+	// Bytes of T on the wire, signals have none
+	template <typename T>
+	constexpr size_t payload_size() {
+		return std::is_empty<T>::value ? 0 : sizeof(T);
+	}
+
+	// Messages are copied as raw bytes and read by C modules, so they have to
+	// look like C structs
+	template <typename T>
+	constexpr bool check_message() {
+		static_assert(has_msg_type<T>::value, "message structs need a static constexpr MSG_TYPE msg_type");
+		static_assert(std::is_trivially_copyable<T>::value, "messages must be trivially copyable");
+		static_assert(std::is_standard_layout<T>::value, "messages must have standard layout");
+		static_assert(payload_size<T>() <= MAX_DATA_BYTES, "message larger than MAX_DATA_BYTES, send it through the C API");
+		if constexpr (has_msg_type<T>::value)
+			static_assert(T::msg_type >= 0, "msg_type must not be negative");
+		return true;
+	}
+
+	// The payload as a T. It may not be aligned for T in the receive buffer,
+	// so it is copied into a T, which the compiler turns into loads of the
+	// members the handler reads. Signals carry no bytes to copy.
+	template <typename T>
+	T load_message(const MessageView& view) {
+		if constexpr (std::is_empty<T>::value) {
+			return T{};
+		}
+		else {
+			T msg;
+			memcpy(&msg, view.data, sizeof(T));
+			return msg;
+		}
+	}
+
+	// Hand the payload of view to fn as a T
+	template <typename T, typename F>
+	bool deliver(F& fn, const MessageView& view) {
+		if (view.rtma_header.num_data_bytes != (int)payload_size<T>())
+			return false;
+
+		const T msg = load_message<T>(view);
+		if constexpr (std::is_invocable<F&, const T&, const RTMA_MSG_HEADER&>::value)
+			fn(msg, view.rtma_header);
+		else
+			fn(msg);
+		return true;
+	}
+
+	template <typename T, typename F>
+	struct Handler {
+		using message_type = T;
+		F fn;
+	};
+
+	// Handler for messages of type T. fn takes a const T& and optionally the
+	// RTMA_MSG_HEADER after it.
+	template <typename T, typename F>
+	Handler<T, std::decay_t<F>> on(F&& fn) {
+		static_assert(check_message<T>(), "");
+		static_assert(std::is_invocable<std::decay_t<F>&, const T&>::value || std::is_invocable<std::decay_t<F>&, const T&, const RTMA_MSG_HEADER&>::value,
+			"handler must take a const T& and optionally a const RTMA_MSG_HEADER&");
+		return { std::forward<F>(fn) };
+	}
+
+	namespace detail {
+		template <typename... Ts>
+		constexpr bool unique_types() {
+			const MSG_TYPE types[] = { Ts::msg_type... };
+			for (size_t i = 0; i < sizeof...(Ts); i++) {
+				for (size_t j = i + 1; j < sizeof...(Ts); j++) {
+					if (types[i] == types[j])
+						return false;
+				}
+			}
+			return true;
+		}
+	}
+
+	// Calls the handler registered for the msg_type of a message. Build one
+	// from rtma::on<T>(fn) entries, one per message type.
+	//
+	// The handler list is unrolled into one comparison against each constant
+	// msg_type, which the compiler lowers like a switch over those cases: a
+	// jump table when the types are dense, a search otherwise, with the
+	// handlers inlined into it. An explicit table of function pointers stops
+	// the inlining and measured several times slower.
+	template <typename... Handlers>
+	class Dispatcher {
+		static_assert(sizeof...(Handlers) > 0, "a dispatcher needs at least one handler");
+		static_assert(detail::unique_types<typename Handlers::message_type...>(), "two handlers for the same msg_type");
+
+		std::tuple<Handlers...> handlers;
+
+		template <size_t I>
+		using message_at = typename std::tuple_element_t<I, std::tuple<Handlers...>>::message_type;
+
+		template <size_t... Is>
+		bool dispatch(const MessageView& view, std::index_sequence<Is...>) {
+			MSG_TYPE msg_type = view.rtma_header.msg_type;
+			bool handled = false;
+			((msg_type == message_at<Is>::msg_type && (handled = deliver<message_at<Is>>(std::get<Is>(handlers).fn, view), true)) || ...);
+			return handled;
+		}
+
+	public:
+		explicit Dispatcher(Handlers... h) : handlers(std::move(h)...) {}
+
+		// False if no handler takes the message or its payload size does not
+		// match the struct
+		bool operator()(const MessageView& view) {
+			return dispatch(view, std::index_sequence_for<Handlers...>{});
+		}
+	};
+
+	// Owns a C client. Move only, destroying it disconnects and frees the
+	// client.
+	class Client {
+		::Client* c;
+
+	public:
+		explicit Client(MODULE_ID module_id = 0, HOST_ID host_id = 0) : c(rtma_create_client(module_id, host_id)) {}
+		~Client() { reset(); }
+
+		Client(const Client&) = delete;
+		Client& operator=(const Client&) = delete;
+
+		Client(Client&& other) noexcept : c(other.c) {
+			other.c = nullptr;
+		}
+
+		Client& operator=(Client&& other) noexcept {
+			if (this != &other) {
+				reset();
+				c = other.c;
+				other.c = nullptr;
+			}
+			return *this;
+		}
+
+		void reset() {
+			rtma_client_disconnect(c);
+			rtma_destroy_client(&c);
+		}
+
+		// For everything the wrapper does not cover
+		::Client* get() const { return c; }
+		explicit operator bool() const { return c != nullptr; }
+
+		int connect(const char* server, uint16_t port) { return rtma_client_connect(c, const_cast<char*>(server), port); }
+		void disconnect() { rtma_client_disconnect(c); }
+		void send_module_ready() { rtma_client_send_module_ready(c); }
+		int get_last_error() const { return rtma_client_get_last_error(c); }
+		MODULE_ID module_id() const { return c->module_id; }
+
+		template <typename... Ts>
+		int subscribe(int* status = nullptr) {
+			static_assert(sizeof...(Ts) > 0, "subscribe needs at least one message type");
+			static_assert((check_message<Ts>() && ...), "");
+			const MSG_TYPE types[] = { Ts::msg_type... };
+			return rtma_client_subscribe_many(c, types, (int)sizeof...(Ts), status);
+		}
+
+		template <typename... Ts>
+		int unsubscribe(int* status = nullptr) {
+			static_assert(sizeof...(Ts) > 0, "unsubscribe needs at least one message type");
+			static_assert((check_message<Ts>() && ...), "");
+			const MSG_TYPE types[] = { Ts::msg_type... };
+			return rtma_client_unsubscribe_many(c, types, (int)sizeof...(Ts), status);
+		}
+
+		template <typename T>
+		int send(const T& msg, int dest_mod_id = MID_MESSAGE_MANAGER, int dest_host_id = HID_LOCAL_HOST, double timeout = BLOCKING) {
+			static_assert(check_message<T>(), "");
+			void* data = payload_size<T>() ? const_cast<T*>(&msg) : nullptr;
+			return rtma_client_send_message_to_module(c, T::msg_type, data, payload_size<T>(), dest_mod_id, dest_host_id, timeout);
+		}
+
+		void begin_batch() { rtma_client_begin_batch(c); }
+		int flush() { return rtma_client_flush(c); }
+		int end_batch() { return rtma_client_end_batch(c); }
+
+		int read(MessageView& view, double timeout = BLOCKING) { return rtma_client_read_message_view(c, &view, timeout); }
+
+		// Read a message and pass it to the dispatcher. Returns GOT_MESSAGE
+		// whether or not a handler took it.
+		template <typename... Handlers>
+		int dispatch(Dispatcher<Handlers...>& dispatcher, double timeout = BLOCKING) {
+			MessageView view;
+			int got = rtma_client_read_message_view(c, &view, timeout);
+			if (got == GOT_MESSAGE)
+				dispatcher(view);
+			return got;
+		}
+	};
+}
+
+#endif //_RTMA_HPP
@@ -18,10 +18,36 @@
 #define BLOCKING -1
 #define NONBLOCKING 0
 #define MAX_DATA_BYTES 4096
+#define RTMA_RECV_BUFFER_SIZE (256 * 1024)
+#define RTMA_MAX_SEGMENTS 16
+#define RTMA_SEND_BUFFER_SIZE (64 * 1024)
+#define RTMA_MAX_ASSEMBLIES 8
+#define RTMA_REQUEST_HISTORY 1024	// Must be a power of two
+#define MAX_MESSAGE_TYPES 10000
+
+// is_dynamic values of the fragments of a message larger than MAX_DATA_BYTES
+#define RTMA_DYNAMIC_FIRST 1
+#define RTMA_DYNAMIC_NEXT 2
 
 // Error Codes
 #define RTMA_NO_ERROR 0
 #define RTMA_ERROR_ALREADY_CONNECTED 1
+#define RTMA_ERROR_FAIL_SUBSCRIBE 2
+#define RTMA_ERROR_ACK_TIMEOUT 3
+#define RTMA_ERROR_UNKNOWN_REQUEST 4
+#define RTMA_ERROR_RESOLVE 5			// Bad server name or address
+#define RTMA_ERROR_CONNECT 6			// Nothing accepted the connection
+#define RTMA_ERROR_CONNECTION_LOST 7	// The connection went away
+#define RTMA_ERROR_NOT_CONNECTED 8
+#define RTMA_ERROR_SEND_FAILED 9		// The message could not be sent or queued
+
+// Backoff between reconnect attempts
+#define RTMA_RECONNECT_MIN_BACKOFF 0.001
+#define RTMA_RECONNECT_MAX_BACKOFF 0.25
+#define RTMA_MAX_SERVER_NAME 256
+
+// Request status while the acknowledgement is outstanding
+#define RTMA_REQUEST_PENDING -1
 
 #ifdef __WINDOWS__
 #include <process.h>
@@ -39,20 +65,6 @@ typedef short MODULE_ID;
 typedef short HOST_ID;
 typedef int MSG_TYPE;
 
-typedef struct {
-	sockfd_t sockfd;
-	struct sockaddr_storage serv_addr;
-	MODULE_ID module_id;
-	HOST_ID host_id;
-	double start_time;
-	int pid;
-	int msg_count;
-	int connected;
-#ifdef __WINDOWS__
-	double perf_counter_freq;
-#endif
-}Client;
-
 typedef struct {
 	MSG_TYPE	msg_type;
 	int			msg_count;
@@ -68,12 +80,153 @@ typedef struct {
 	int			reserved;
 } RTMA_MSG_HEADER;
 
+typedef void* (*RTMA_ALLOC_FN)(void* ctx, size_t len);
+typedef void (*RTMA_FREE_FN)(void* ctx, void* buf);
+
+// Reassembly state of a dynamic message whose fragments are still arriving
+typedef struct {
+	RTMA_MSG_HEADER header;
+	char* buf;
+	size_t capacity;
+	size_t total;		// Size announced by the first fragment
+	size_t received;
+	double started;		// Timestamp of the first fragment
+	int active;
+}MessageAssembly;
+
+// Control message awaiting acknowledgement from the message manager
+typedef struct {
+	int id;
+	MSG_TYPE ctrl_type;
+	MSG_TYPE msg_type;	// Subject of subscription control messages
+	double deadline;
+	int status;
+	int sent;	// Went out, so an acknowledgement is owed
+}RequestRecord;
+
+typedef struct LatencyHistograms LatencyHistograms;
+typedef struct RtmaShm RtmaShm;
+typedef struct SendQueue SendQueue;
+typedef struct RecvQueue RecvQueue;
+typedef struct OutboundQueue OutboundQueue;
+typedef struct MessageRecorder MessageRecorder;
+
+typedef struct {
+	sockfd_t sockfd;
+	struct sockaddr_storage serv_addr;
+	MODULE_ID module_id;
+	HOST_ID host_id;
+	double start_time;
+	int pid;
+	int msg_count;
+	int connected;
+#ifdef __WINDOWS__
+	double perf_counter_freq;
+#endif
+	// Receive buffer. Bytes in [recv_head, recv_tail) have been read from
+	// the socket but not yet handed out as messages.
+	char* recv_buf;
+	size_t recv_buf_size;
+	size_t recv_head;
+	size_t recv_tail;
+	size_t recv_borrowed;	// Size of the message currently lent out by rtma_client_read_message_view
+	// Outbound batch. While batching, sent messages are appended to send_buf
+	// and written out together when a limit is reached or on rtma_client_flush.
+	char* send_buf;
+	size_t send_buf_size;
+	size_t send_len;
+	int batching;
+	int batch_count;
+	size_t batch_max_bytes;
+	int batch_max_count;
+	double batch_max_delay;
+	double batch_start_time;
+	// Dynamic messages larger than MAX_DATA_BYTES being reassembled
+	MessageAssembly assemblies[RTMA_MAX_ASSEMBLIES];
+	int assembly_lent;	// Index of the assembled message lent out, -1 if none
+	RTMA_ALLOC_FN large_alloc;
+	RTMA_FREE_FN large_free;
+	void* large_alloc_ctx;
+	// Control requests. Acknowledgements arrive in request order, so ids in
+	// [oldest_pending_id, next_request_id) are awaiting theirs. Request id
+	// lives in requests[id & (RTMA_REQUEST_HISTORY - 1)].
+	RequestRecord* requests;
+	int next_request_id;
+	int oldest_pending_id;
+	// Messages that arrived while waiting on a request. They are handed out
+	// before anything newer from the receive buffer.
+	char* stash_buf;
+	size_t stash_size;
+	size_t stash_head;
+	size_t stash_tail;
+	size_t stash_borrowed;
+	int clock;	// Timestamp source, see rtma_time.h
+	LatencyHistograms* latency;	// Enabled with rtma_client_enable_latency_histograms
+	RtmaShm* shm;	// Shared memory transport, NULL on TCP. sockfd then only tracks the peer.
+	SendQueue* send_queue;	// Set while sends go through the I/O thread, see rtma_send_queue.h
+	RecvQueue* recv_queue;	// Set while the receive thread feeds the reads, see rtma_recv_queue.h
+	// Conflated message types. conflate_latest[msg_type] is the receive stream
+	// position of the newest message of the type seen so far, -1 for types
+	// that are not conflated. Older messages of a conflated type are skipped.
+	long long* conflate_latest;
+	long long recv_base;		// Receive stream position of recv_buf[0]
+	long long conflate_scan;	// Frames before this stream position have been indexed
+	long long conflated;		// Messages skipped for a newer one of their type
+	double busy_poll;	// Seconds a read spins before it blocks, 0 to block right away
+	int busy_poll_usec;	// SO_BUSY_POLL for TCP connections, 0 if not set
+	OutboundQueue* outbound;	// Set while sends go through the outbound queue, see rtma_outbound.h
+	int recv_failed;	// The receive stream is broken, the connection has to go
+	int last_error;		// RTMA_ERROR_* of the last failed call
+	// Server of the last rtma_client_connect and the subscriptions made since,
+	// for rtma_client_reconnect. subscriptions holds an RTMA_SUBSCRIPTION_*
+	// state per msg_type, ALL_MESSAGE_TYPES in the last slot.
+	char server_name[RTMA_MAX_SERVER_NAME];
+	uint16_t server_port;
+	int auto_reconnect;
+	double reconnect_timeout;
+	int reconnecting;
+	unsigned char* subscriptions;
+	long long reconnects;	// Successful reconnects
+	MessageRecorder* recorder;	// Records what the reads hand out, see rtma_recorder.h
+	// Message lent out when a call waiting on a request started. It stays
+	// valid until the next read, see rtma_client_hold_message.
+	int recv_held;		// It lies before recv_head, recv_buf must not move
+	char* recv_retired;	// Receive buffer replaced while holding it
+	char* stash_retired;	// Stash buffer replaced while holding it
+	int assembly_held;	// Index of its reassembly buffer, -1 if none
+	struct PooledMessage* pooled_held;	// From the receive thread, NULL if none
+	int expired_acks;	// Acknowledgements still owed to requests given up on
+	// Progress of a reconnect made in steps, see rtma_client_reconnect_step.
+	// While reconnect_in_steps is set sends and reads leave it to those.
+	int reconnect_in_steps;
+	int reconnect_stage;
+	double reconnect_deadline;	// The step in progress gives up after this
+	int replay_next;	// Next msg_type to restore
+	int replay_first_id;	// Requests of the batch of subscriptions in flight
+	int replay_last_id;
+	int replay_failed;
+}Client;
+
 
 typedef struct {
 	RTMA_MSG_HEADER rtma_header;
 	char data[MAX_DATA_BYTES];
 }Message;
 
+// Borrowed view of a message that still lives in the client's receive buffer.
+// data is valid until the next read on the client or rtma_client_release_message.
+typedef struct {
+	RTMA_MSG_HEADER rtma_header;
+	char* data;
+}MessageView;
+
+// One piece of a message payload for rtma_client_send_segments_to_module.
+// Segments are written to the socket back to back without being copied.
+typedef struct {
+	const void* data;
+	size_t len;
+}DataSegment;
+
 typedef MSG_TYPE Signal;
 
 // Module ID-s of core modules
@@ -174,18 +327,42 @@ extern "C" {
 
 	RTMA_C_API Client* rtma_create_client(MODULE_ID, HOST_ID);
 	RTMA_C_API int rtma_client_wait_for_acknowledgement(Client* c, Message* msg, double timeout);
+	RTMA_C_API int rtma_client_send_request(Client* c, MSG_TYPE ctrl_type, const void* data, size_t len, double timeout);
+	RTMA_C_API int rtma_client_poll_request(Client* c, int request_id);
+	RTMA_C_API int rtma_client_wait_for_request(Client* c, int request_id, double timeout);
 	RTMA_C_API double rtma_client_get_timestamp(Client* c);
 	RTMA_C_API int rtma_client_connect(Client* c, char* server_name, uint16_t port);
+	RTMA_C_API int rtma_client_reconnect(Client* c, double timeout);
+	RTMA_C_API int rtma_client_set_auto_reconnect(Client* c, int enable, double timeout);
+	RTMA_C_API int rtma_client_get_last_error(Client* c);
 	RTMA_C_API void rtma_client_send_module_ready(Client* c);
 	RTMA_C_API int rtma_client_send_message_to_module(Client* c, MSG_TYPE msg_type, void* msg, size_t len, int dest_mod_id, int dest_host_id, double timeout);
+	RTMA_C_API int rtma_client_send_segments_to_module(Client* c, MSG_TYPE msg_type, const DataSegment* segments, int num_segments, int dest_mod_id, int dest_host_id, double timeout);
+	RTMA_C_API void rtma_client_begin_batch(Client* c);
+	RTMA_C_API void rtma_client_set_batch_limits(Client* c, size_t max_bytes, int max_count, double max_delay);
+	RTMA_C_API int rtma_client_flush(Client* c);
+	RTMA_C_API int rtma_client_end_batch(Client* c);
 	RTMA_C_API int rtma_client_send_signal_to_module(Client* c, Signal sig_type, int dest_mod_id, int dest_host_id, double timeout);
 	RTMA_C_API int rtma_client_send_message(Client* c, MSG_TYPE msg_type, void* msg, size_t len);
 	RTMA_C_API int rtma_client_send_signal(Client* c, Signal s);
 	RTMA_C_API int rtma_client_read_message(Client* c, Message* msg, double timeout);
+	RTMA_C_API int rtma_client_read_message_view(Client* c, MessageView* view, double timeout);
+	RTMA_C_API void rtma_client_release_message(Client* c);
+	RTMA_C_API int rtma_client_has_buffered_message(Client* c);
+	RTMA_C_API sockfd_t rtma_client_get_fd(Client* c);
+	RTMA_C_API int rtma_client_set_busy_poll(Client* c, double spin_time, int so_busy_poll_usec);
+	RTMA_C_API int rtma_pin_thread_to_cpu(int cpu);
+	RTMA_C_API int rtma_client_set_conflation(Client* c, MSG_TYPE msg_type, int enable);
+	RTMA_C_API long long rtma_client_get_conflated_count(Client* c);
+	RTMA_C_API void rtma_client_set_large_message_allocator(Client* c, RTMA_ALLOC_FN alloc_fn, RTMA_FREE_FN free_fn, void* ctx);
 	RTMA_C_API void rtma_client_subscribe(Client* c, MSG_TYPE msg_type);
 	RTMA_C_API void rtma_client_unsubscribe(Client* c, MSG_TYPE msg_type);
 	RTMA_C_API void rtma_client_resume_subscription(Client* c, MSG_TYPE msg_type);
 	RTMA_C_API void rtma_client_pause_subscription(Client* c, MSG_TYPE msg_type);
+	RTMA_C_API int rtma_client_subscribe_many(Client* c, const MSG_TYPE* msg_types, int count, int* status);
+	RTMA_C_API int rtma_client_unsubscribe_many(Client* c, const MSG_TYPE* msg_types, int count, int* status);
+	RTMA_C_API int rtma_client_resume_subscription_many(Client* c, const MSG_TYPE* msg_types, int count, int* status);
+	RTMA_C_API int rtma_client_pause_subscription_many(Client* c, const MSG_TYPE* msg_types, int count, int* status);
 	RTMA_C_API void rtma_client_disconnect(Client* c);
 	RTMA_C_API void rtma_destroy_client(Client** c);
 
@@ -0,0 +1,48 @@
+#ifndef _RTMA_EVENT_LOOP_H
+#define _RTMA_EVENT_LOOP_H
+
+#include "rtma_client.h"
+
+// Single threaded epoll loop servicing any number of clients, plain file
+// descriptors and timers. Messages are dispatched through a table indexed by
+// msg_type; types without a handler go to the default handler, if any.
+// Linux only.
+
+// Events for fd sources
+#define RTMA_EVENT_READ 1
+#define RTMA_EVENT_WRITE 2
+#define RTMA_EVENT_ERROR 4
+
+// Messages read from one client before the other sources get a turn
+#define RTMA_EVENT_LOOP_MAX_BATCH 64
+
+typedef struct EventLoop EventLoop;
+
+// msg is borrowed and only valid until the handler returns
+typedef void (*RTMA_MSG_HANDLER)(EventLoop* loop, Client* c, MessageView* msg, void* ctx);
+typedef void (*RTMA_FD_HANDLER)(EventLoop* loop, int fd, int events, void* ctx);
+typedef void (*RTMA_TIMER_HANDLER)(EventLoop* loop, int timer_id, void* ctx);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	RTMA_C_API EventLoop* rtma_create_event_loop(void);
+	RTMA_C_API void rtma_destroy_event_loop(EventLoop** loop);
+	RTMA_C_API int rtma_event_loop_add_client(EventLoop* loop, Client* c);
+	RTMA_C_API int rtma_event_loop_remove_client(EventLoop* loop, Client* c);
+	RTMA_C_API int rtma_event_loop_set_handler(EventLoop* loop, MSG_TYPE msg_type, RTMA_MSG_HANDLER handler, void* ctx);
+	RTMA_C_API void rtma_event_loop_set_default_handler(EventLoop* loop, RTMA_MSG_HANDLER handler, void* ctx);
+	RTMA_C_API int rtma_event_loop_add_fd(EventLoop* loop, int fd, int events, RTMA_FD_HANDLER handler, void* ctx);
+	RTMA_C_API int rtma_event_loop_remove_fd(EventLoop* loop, int fd);
+	RTMA_C_API int rtma_event_loop_add_timer(EventLoop* loop, double interval, int repeat, RTMA_TIMER_HANDLER handler, void* ctx);
+	RTMA_C_API int rtma_event_loop_remove_timer(EventLoop* loop, int timer_id);
+	RTMA_C_API int rtma_event_loop_run_once(EventLoop* loop, double timeout);
+	RTMA_C_API void rtma_event_loop_run(EventLoop* loop);
+	RTMA_C_API void rtma_event_loop_stop(EventLoop* loop);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_RTMA_EVENT_LOOP_H
@@ -0,0 +1,53 @@
+#ifndef _RTMA_HISTOGRAM_H
+#define _RTMA_HISTOGRAM_H
+
+#include "rtma_client.h"
+
+// Latency (recv_time - send_time) histograms kept per (msg_type, src_mod_id).
+// Buckets are log-linear: values below RTMA_HIST_SUB_BUCKETS ns are exact and
+// every power of two above that is split into RTMA_HIST_SUB_BUCKETS buckets,
+// so a bucket is never wider than 1/16 of its value. The last bucket also
+// collects everything above RTMA_HIST_MAX_NS.
+#define RTMA_HIST_SUB_BUCKET_BITS 4
+#define RTMA_HIST_SUB_BUCKETS (1 << RTMA_HIST_SUB_BUCKET_BITS)
+#define RTMA_HIST_MAGNITUDES 40
+#define RTMA_HIST_NUM_BUCKETS (RTMA_HIST_MAGNITUDES * RTMA_HIST_SUB_BUCKETS)
+#define RTMA_HIST_MAX_NS ((1LL << (RTMA_HIST_MAGNITUDES + RTMA_HIST_SUB_BUCKET_BITS - 1)) - 1)
+
+#define RTMA_HIST_DEFAULT_KEYS 64
+
+// Snapshot of one histogram. Times are in nanoseconds.
+typedef struct {
+	MSG_TYPE msg_type;
+	MODULE_ID src_mod_id;
+	long long count;
+	long long sum_ns;
+	long long max_ns;
+	long long buckets[RTMA_HIST_NUM_BUCKETS];
+}LatencyHistogram;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	RTMA_C_API int rtma_client_enable_latency_histograms(Client* c, int max_keys);
+	RTMA_C_API void rtma_client_disable_latency_histograms(Client* c);
+	RTMA_C_API void rtma_client_record_latency(Client* c, const RTMA_MSG_HEADER* header);
+	RTMA_C_API int rtma_client_get_latency_histograms(Client* c, LatencyHistogram* hists, int max_hists, int reset);
+	RTMA_C_API void rtma_client_reset_latency_histograms(Client* c);
+	RTMA_C_API long long rtma_client_latency_dropped(Client* c);
+	RTMA_C_API void rtma_client_print_latency_histograms(Client* c);
+
+	RTMA_C_API int rtma_histogram_bucket_index(long long value_ns);
+	RTMA_C_API long long rtma_histogram_bucket_lower(int index);
+	RTMA_C_API long long rtma_histogram_bucket_upper(int index);
+	RTMA_C_API void rtma_histogram_record(LatencyHistogram* hist, long long value_ns);
+	RTMA_C_API long long rtma_histogram_percentile(const LatencyHistogram* hist, double percentile);
+	RTMA_C_API long long rtma_histogram_min(const LatencyHistogram* hist);
+	RTMA_C_API void rtma_histogram_print(const LatencyHistogram* hist);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_RTMA_HISTOGRAM_H
@@ -0,0 +1,56 @@
+#ifndef _RTMA_OUTBOUND_H
+#define _RTMA_OUTBOUND_H
+
+#include "rtma_client.h"
+
+// Outbound queue. Once enabled, sends append to a per client queue and write
+// out whatever the transport takes without blocking; the rest goes out on
+// later sends, reads, rtma_client_service_outbound or rtma_client_flush.
+// When the queued bytes pass the high watermark backpressure engages and
+// every message is handled by the policy of its type until the queue has
+// drained to the low watermark. Messages larger than MAX_DATA_BYTES, the
+// manager's control messages (msg_type below 100) and types outside
+// 0..MAX_MESSAGE_TYPES-1 always block.
+#define RTMA_OUTBOUND_DEFAULT_HIGH_WATERMARK (1024 * 1024)
+#define RTMA_OUTBOUND_DEFAULT_LOW_WATERMARK (256 * 1024)
+
+// What a send does under backpressure
+#define RTMA_OUTBOUND_BLOCK 0		// Write until below the low watermark, up to the send timeout
+#define RTMA_OUTBOUND_DROP_NEWEST 1	// Drop the new message
+#define RTMA_OUTBOUND_DROP_OLDEST 2	// Drop the oldest queued message of the same type
+#define RTMA_OUTBOUND_CONFLATE 3	// Replace the queued message of the same type. Applies at all times.
+
+// Policy for every type without one of its own
+#define RTMA_OUTBOUND_ALL_TYPES -1
+
+typedef struct {
+	long long queued;		// Messages accepted into the queue
+	long long sent;			// Messages written out completely
+	long long dropped;		// Dropped by policy or after a blocking send timed out
+	long long conflated;	// Replaced by a newer message of their type
+	long long backpressure_events;	// Times the high watermark was crossed
+	size_t bytes;			// Currently queued
+	size_t high_water_bytes;	// Most bytes queued at once
+	int backpressure;		// TRUE while backpressure is engaged
+}OutboundStats;
+
+// Called with engaged TRUE when the queue crosses the high watermark and with
+// FALSE once it has drained to the low watermark
+typedef void (*RTMA_BACKPRESSURE_FN)(Client* c, int engaged, void* ctx);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	RTMA_C_API int rtma_client_enable_outbound_queue(Client* c, size_t high_watermark, size_t low_watermark);
+	RTMA_C_API void rtma_client_disable_outbound_queue(Client* c);
+	RTMA_C_API int rtma_client_set_outbound_policy(Client* c, MSG_TYPE msg_type, int policy);
+	RTMA_C_API void rtma_client_set_backpressure_callback(Client* c, RTMA_BACKPRESSURE_FN fn, void* ctx);
+	RTMA_C_API size_t rtma_client_service_outbound(Client* c);
+	RTMA_C_API void rtma_client_get_outbound_stats(Client* c, OutboundStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_RTMA_OUTBOUND_H
@@ -0,0 +1,69 @@
+#ifndef _RTMA_POOL_H
+#define _RTMA_POOL_H
+
+#include "rtma_client.h"
+
+// Payload size classes are RTMA_POOL_MIN_SIZE << (2 * class), i.e.
+// 64 B, 256 B, 1 KB, 4 KB, 16 KB, 64 KB, 256 KB and 1 MB. Larger messages
+// are allocated individually and freed on release.
+#define RTMA_POOL_NUM_CLASSES 8
+#define RTMA_POOL_MIN_SIZE 64
+#define RTMA_POOL_DEFAULT_CACHE 256
+
+typedef struct MessagePool MessagePool;
+
+// Reference counted message buffer. data points to capacity bytes of payload
+// storage directly behind the struct. Share a message by taking a reference
+// with rtma_pooled_message_ref and drop each reference with
+// rtma_pooled_message_release.
+typedef struct PooledMessage {
+	RTMA_MSG_HEADER rtma_header;
+	char* data;
+	size_t capacity;
+	MessagePool* pool;
+	int size_class;
+	int refcount;
+	struct PooledMessage* next_free;
+}PooledMessage;
+
+typedef struct {
+	size_t buffer_size;
+	int allocated;		// Buffers owned by the pool, in use or cached
+	int in_use;
+	int high_water;		// Largest in_use seen since creation or the last reset
+	int cached;
+	long long acquires;
+	long long mallocs;	// Acquires that found no cached buffer
+}MessagePoolClassStats;
+
+typedef struct {
+	MessagePoolClassStats classes[RTMA_POOL_NUM_CLASSES];
+	int oversize_in_use;
+	int oversize_high_water;
+	long long oversize_acquires;
+}MessagePoolStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	RTMA_C_API MessagePool* rtma_create_message_pool(int max_cached_per_class);
+	RTMA_C_API void rtma_destroy_message_pool(MessagePool** pool);
+	RTMA_C_API void rtma_message_pool_reserve(MessagePool* pool, size_t len, int count);
+	RTMA_C_API PooledMessage* rtma_message_pool_acquire(MessagePool* pool, size_t len);
+	RTMA_C_API void rtma_message_pool_get_stats(MessagePool* pool, MessagePoolStats* stats);
+	RTMA_C_API void rtma_message_pool_reset_high_water(MessagePool* pool);
+	RTMA_C_API void rtma_message_pool_print_stats(MessagePool* pool);
+
+	RTMA_C_API PooledMessage* rtma_pooled_message_ref(PooledMessage* msg);
+	RTMA_C_API void rtma_pooled_message_release(PooledMessage* msg);
+
+	RTMA_C_API void rtma_client_use_message_pool(Client* c, MessagePool* pool);
+	RTMA_C_API int rtma_client_read_pooled_message(Client* c, MessagePool* pool, PooledMessage** msg, double timeout);
+	RTMA_C_API int rtma_client_send_pooled_message_to_module(Client* c, PooledMessage* msg, int dest_mod_id, int dest_host_id, double timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_RTMA_POOL_H
@@ -0,0 +1,70 @@
+#ifndef _RTMA_RECORDER_H
+#define _RTMA_RECORDER_H
+
+#include "rtma_client.h"
+
+// Message recorder (unix only). Messages are appended as raw header and
+// payload records to preallocated, memory mapped segment files PATH.000000.seg,
+// PATH.000001.seg, ..., so recording a message is a copy into the mapping and
+// no system call. Every RTMA_RECORDER_INDEX_BYTES of records or
+// RTMA_RECORDER_INDEX_INTERVAL seconds of recv_time the recorder closes a
+// block and appends an index entry to PATH.idx holding where the block
+// starts, its recv_time range and which message types it contains. Readers
+// binary search the index to seek by time and skip blocks without the types
+// they want.
+//
+// A record is an 8 byte prefix holding the record size, the RTMA_MSG_HEADER
+// and the payload, padded to 8 bytes. The size is stored last, so a reader
+// following a live recording only sees complete records, and a size of 0
+// marks the end of the segment.
+#define RTMA_RECORDER_DEFAULT_SEGMENT_SIZE (256 * 1024 * 1024)
+#define RTMA_RECORDER_INDEX_BYTES (1024 * 1024)
+#define RTMA_RECORDER_INDEX_INTERVAL 1.0
+
+typedef struct MessageRecording MessageRecording;
+
+typedef struct {
+	long long messages;
+	long long bytes;		// Record bytes, including prefixes and padding
+	int segments;
+	int index_entries;
+	double first_recv_time;
+	double last_recv_time;
+}RecorderStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// segment_size 0 selects RTMA_RECORDER_DEFAULT_SEGMENT_SIZE. A message
+	// larger than a segment gets a segment of its own. An earlier recording
+	// at path is replaced.
+	RTMA_C_API MessageRecorder* rtma_create_recorder(const char* path, size_t segment_size);
+	RTMA_C_API void rtma_destroy_recorder(MessageRecorder** r);
+	RTMA_C_API int rtma_recorder_write(MessageRecorder* r, const RTMA_MSG_HEADER* header, const void* data);
+	// Start writing the segments back to disk and push out the index
+	RTMA_C_API void rtma_recorder_flush(MessageRecorder* r);
+	RTMA_C_API void rtma_recorder_get_stats(MessageRecorder* r, RecorderStats* stats);
+
+	// Record every message the client's reads hand out, NULL to stop. The
+	// recorder is used from the reading thread and not locked.
+	RTMA_C_API void rtma_client_set_recorder(Client* c, MessageRecorder* r);
+
+	// Reading a recording. Views point into the mapped segment and stay valid
+	// until the reader moves on to another segment or is closed.
+	RTMA_C_API MessageRecording* rtma_open_recording(const char* path);
+	RTMA_C_API void rtma_close_recording(MessageRecording** rec);
+	RTMA_C_API int rtma_recording_next(MessageRecording* rec, MessageView* view);
+	// Position at the first message received at or after recv_time
+	RTMA_C_API int rtma_recording_seek_time(MessageRecording* rec, double recv_time);
+	RTMA_C_API void rtma_recording_rewind(MessageRecording* rec);
+	// Only hand out these types, NULL or count 0 for all
+	RTMA_C_API void rtma_recording_set_filter(MessageRecording* rec, const MSG_TYPE* msg_types, int count);
+	// Totals from the index, complete once the recorder has been destroyed
+	RTMA_C_API void rtma_recording_get_stats(MessageRecording* rec, RecorderStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_RTMA_RECORDER_H
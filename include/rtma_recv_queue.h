@@ -0,0 +1,41 @@
+#ifndef _RTMA_RECV_QUEUE_H
+#define _RTMA_RECV_QUEUE_H
+
+#include "rtma_client.h"
+
+// Background receiving. Once the receive thread is started it keeps draining
+// the transport into a bounded lock-free single-producer single-consumer
+// queue of pooled messages, so a reader that stalls does not stall the
+// socket. The read calls then pop from the queue; they must all be made
+// from one thread. Messages are timestamped and recorded in the latency
+// histograms when they come off the transport, not when they are read.
+// Set a large message allocator before starting the thread, it is called
+// from the receive thread.
+#define RTMA_RECV_QUEUE_DEFAULT_SLOTS 4096
+
+// What the receive thread does when the queue is full
+#define RTMA_RECV_QUEUE_BLOCK 0			// Stop reading until there is room
+#define RTMA_RECV_QUEUE_DROP_OLDEST 1	// Drop the oldest queued message and count it
+#define RTMA_RECV_QUEUE_DROP_NEWEST 2	// Drop the new message and count it
+
+typedef struct {
+	long long received;	// Messages read off the transport, dropped ones included
+	long long dropped;
+	int depth;
+	int high_water;	// Largest depth seen since the thread was started
+	int capacity;
+}RecvQueueStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	RTMA_C_API int rtma_client_start_receive_thread(Client* c, int num_slots, int full_policy);
+	RTMA_C_API void rtma_client_stop_receive_thread(Client* c);
+	RTMA_C_API void rtma_client_get_recv_queue_stats(Client* c, RecvQueueStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_RTMA_RECV_QUEUE_H
@@ -0,0 +1,37 @@
+#ifndef _RTMA_SEND_QUEUE_H
+#define _RTMA_SEND_QUEUE_H
+
+#include "rtma_client.h"
+
+// Thread-safe sending. Once the send thread is started, messages sent from
+// any thread are copied into a bounded lock-free multi-producer queue and a
+// dedicated I/O thread writes them out, gathering everything queued into as
+// few writes as possible. Messages from one thread keep their order. Reading
+// stays single threaded.
+#define RTMA_SEND_QUEUE_DEFAULT_SLOTS 1024
+
+// What a send does when the queue is full
+#define RTMA_SEND_QUEUE_BLOCK 0	// Wait for room, up to the send timeout
+#define RTMA_SEND_QUEUE_DROP 1	// Drop the message and count it
+
+typedef struct {
+	long long sent;
+	long long dropped;
+	int depth;
+	int capacity;
+	long long failed;	// Messages lost with the connection
+}SendQueueStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	RTMA_C_API int rtma_client_start_send_thread(Client* c, int num_slots, int full_policy);
+	RTMA_C_API void rtma_client_stop_send_thread(Client* c);
+	RTMA_C_API void rtma_client_get_send_queue_stats(Client* c, SendQueueStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_RTMA_SEND_QUEUE_H
@@ -0,0 +1,58 @@
+#ifndef _RTMA_SHM_H
+#define _RTMA_SHM_H
+
+#include "rtma_client.h"
+
+// Shared memory transport for modules on the same host as the message
+// manager (Linux only). Selected by connecting to "shm://host"; the client
+// falls back to TCP on host when the message manager does not offer it.
+//
+// Each client gets a region with one single-producer single-consumer byte
+// ring per direction carrying the same framed stream as the socket. An idle
+// reader parks on an eventfd which the writer only signals while the reader
+// is marked waiting, and a writer blocked on a full ring sleeps on a futex
+// (or asks for an eventfd signal when it cannot block, like the message
+// manager). A Unix domain socket stays open next to the region so that
+// either side notices when the other goes away.
+#define RTMA_SHM_PREFIX "shm://"
+#define RTMA_SHM_RING_SIZE (4 * 1024 * 1024)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// Client side. Returns NULL when no message manager offers shared memory
+	// on this port. conn receives the liveness socket, owned by the caller.
+	RTMA_C_API RtmaShm* rtma_shm_connect(uint16_t port, sockfd_t* conn);
+
+	// Message manager side
+	RTMA_C_API sockfd_t rtma_shm_listen(uint16_t port);
+	RTMA_C_API RtmaShm* rtma_shm_accept(sockfd_t listen_fd, sockfd_t* conn);
+
+	RTMA_C_API void rtma_shm_close(RtmaShm** shm);
+
+	// Descriptor that becomes readable when the peer signals
+	RTMA_C_API int rtma_shm_fd(RtmaShm* shm);
+	RTMA_C_API size_t rtma_shm_readable(RtmaShm* shm);
+
+	// Blocking gather write of the whole iovec. Returns the number of bytes
+	// written, less than requested only if the peer went away.
+	RTMA_C_API int rtma_shm_writev(RtmaShm* shm, socket_iovec_t* iov, int iovcnt);
+
+	// Non-blocking write of what fits. When the ring fills up the peer signals
+	// rtma_shm_fd once it has made room. Call rtma_shm_notify after a burst.
+	RTMA_C_API size_t rtma_shm_write(RtmaShm* shm, const char* buf, size_t len);
+	RTMA_C_API void rtma_shm_notify(RtmaShm* shm);
+
+	// Copy out up to len bytes. Returns 0 when the ring is empty.
+	RTMA_C_API size_t rtma_shm_read(RtmaShm* shm, char* buf, size_t len);
+
+	// Like socket_wait. Reports ready for reading once the peer has gone away
+	// so that the following read returns 0.
+	RTMA_C_API int rtma_shm_wait(RtmaShm* shm, int events, double timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_RTMA_SHM_H
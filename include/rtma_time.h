@@ -0,0 +1,40 @@
+#ifndef _RTMA_TIME_H
+#define _RTMA_TIME_H
+
+#include "rtma_client.h"
+
+// Clock sources for message timestamps. All return seconds as a double.
+//
+// RTMA_CLOCK_REALTIME	Wall clock time since the epoch. Comparable across
+//						hosts but not monotonic, and a double only resolves
+//						about 0.25 us at today's epoch values.
+// RTMA_CLOCK_MONOTONIC	Seconds since boot. Monotonic and comparable between
+//						processes on the same host.
+// RTMA_CLOCK_TSC		CPU cycle counter converted to RTMA_CLOCK_MONOTONIC
+//						seconds with a frequency calibrated once per process.
+//						Cheapest to read. Falls back to RTMA_CLOCK_MONOTONIC
+//						where no invariant counter is available.
+#define RTMA_CLOCK_REALTIME 0
+#define RTMA_CLOCK_MONOTONIC 1
+#define RTMA_CLOCK_TSC 2
+#define RTMA_NUM_CLOCKS 3
+
+#define RTMA_DEFAULT_CLOCK RTMA_CLOCK_REALTIME
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	RTMA_C_API double rtma_time_now(int clock);
+	RTMA_C_API const char* rtma_time_clock_name(int clock);
+	RTMA_C_API int rtma_time_tsc_available(void);
+	RTMA_C_API double rtma_time_tsc_frequency(void);
+	RTMA_C_API void rtma_time_calibrate(void);
+
+	RTMA_C_API int rtma_client_set_clock(Client* c, int clock);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_RTMA_TIME_H
@@ -25,9 +25,17 @@
 typedef SOCKET sockfd_t;
 typedef int sa_family_t;
 typedef int socklen_t;
+typedef WSABUF socket_iovec_t;
+
+#define SOCKET_IOVEC_SET(iov, base, n) do { (iov).buf = (char*)(base); (iov).len = (ULONG)(n); } while (0)
+#define SOCKET_IOVEC_BASE(iov) ((iov).buf)
+#define SOCKET_IOVEC_LEN(iov) ((iov).len)
 
 #pragma comment(lib, "Ws2_32.lib")
 
+// Winsock never raises SIGPIPE
+#define MSG_NOSIGNAL 0
+
 void winsock_init();
 void winsock_cleanup();
 
@@ -40,18 +48,31 @@ void winsock_cleanup();
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #define INVALID_SOCKET (-1)
 #define SOCKET_ERROR (-1)
 #define closesocket(x) close(x)
 
 typedef int sockfd_t;
+typedef struct iovec socket_iovec_t;
+
+#define SOCKET_IOVEC_SET(iov, base, n) do { (iov).iov_base = (void*)(base); (iov).iov_len = (size_t)(n); } while (0)
+#define SOCKET_IOVEC_BASE(iov) ((char*)(iov).iov_base)
+#define SOCKET_IOVEC_LEN(iov) ((iov).iov_len)
+
+// Writes to a closed connection fail with EPIPE instead of raising SIGPIPE.
+// Where the flag is missing the socket gets SO_NOSIGPIPE instead.
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
 #define SD_BOTH SHUT_RDWR
 #define SD_SEND SHUT_WR
@@ -59,6 +80,10 @@ typedef int sockfd_t;
 
 #endif
 
+// socket_wait events
+#define SOCKET_WAIT_READ 1
+#define SOCKET_WAIT_WRITE 2
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -66,15 +91,18 @@ extern "C" {
 /* SOCKET FUNCTIONS */
 
 sockfd_t socket_create(int family, int type, int protocol);
-void socket_connect(sockfd_t sockfd, const struct sockaddr* servaddr, socklen_t addrlen);
-void socket_bind(sockfd_t sockfd, const struct sockaddr* addr, socklen_t addrlen);
-void socket_listen(sockfd_t sockfd);
+int socket_connect(sockfd_t sockfd, const struct sockaddr* servaddr, socklen_t addrlen);
+int socket_bind(sockfd_t sockfd, const struct sockaddr* addr, socklen_t addrlen);
+int socket_listen(sockfd_t sockfd);
 sockfd_t socket_accept(sockfd_t sockfd, struct sockaddr* addr, socklen_t* addrlen);
 void socket_close(sockfd_t sockfd);
 void socket_shutdown(sockfd_t sockfd, int how);
 int socket_recv(sockfd_t sockfd, char* buf, int len, int flags);
 int socket_send(sockfd_t sockfd, const char* buf, int len, int flags);
 int socket_sendall(sockfd_t sockfd, const char* buf, int len, int flags);
+int socket_sendallv(sockfd_t sockfd, socket_iovec_t* iov, int iovcnt, int flags);
+int socket_trysendv(sockfd_t sockfd, socket_iovec_t* iov, int iovcnt);
+int socket_wait(sockfd_t sockfd, int events, double timeout);
 void socket_setsockopt(sockfd_t sockfd, int level, int optname, int* optval, socklen_t optlen);
 void socket_getsockopt(sockfd_t sockfd, int level, int optname, int* optval, socklen_t* optlen);
 
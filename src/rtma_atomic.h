@@ -0,0 +1,62 @@
+#ifndef _RTMA_ATOMIC_H
+#define _RTMA_ATOMIC_H
+
+// Minimal atomics shared by the library sources. Operates on plain int,
+// long long and pointer fields so that public structs stay usable from C++.
+
+#if defined(_MSC_VER)
+
+#include <intrin.h>
+
+#define rtma_atomic_load(p) (*(volatile long*)(p))
+#define rtma_atomic_store(p, v) (_InterlockedExchange((volatile long*)(p), (long)(v)))
+#define rtma_atomic_add(p, v) (_InterlockedExchangeAdd((volatile long*)(p), (long)(v)) + (long)(v))
+#define rtma_atomic_cas(p, expected, desired) (_InterlockedCompareExchange((volatile long*)(p), (long)(desired), (long)(expected)) == (long)(expected))
+#define rtma_atomic_exchange(p, v) (_InterlockedExchange((volatile long*)(p), (long)(v)))
+#define rtma_atomic_load64(p) (*(volatile long long*)(p))
+#define rtma_atomic_store64(p, v) (_InterlockedExchange64((volatile long long*)(p), (long long)(v)))
+#define rtma_atomic_add64(p, v) (_InterlockedExchangeAdd64((volatile long long*)(p), (long long)(v)) + (long long)(v))
+#define rtma_atomic_exchange64(p, v) (_InterlockedExchange64((volatile long long*)(p), (long long)(v)))
+#define rtma_atomic_cas64(p, expected, desired) (_InterlockedCompareExchange64((volatile long long*)(p), (long long)(desired), (long long)(expected)) == (long long)(expected))
+#define rtma_atomic_fence() _mm_mfence()
+#define rtma_cpu_relax() _mm_pause()
+
+#else
+
+#define rtma_atomic_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define rtma_atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define rtma_atomic_add(p, v) __atomic_add_fetch((p), (v), __ATOMIC_ACQ_REL)
+#define rtma_atomic_cas(p, expected, desired) __rtma_atomic_cas((p), (expected), (desired))
+#define rtma_atomic_exchange(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define rtma_atomic_load64(p) rtma_atomic_load(p)
+#define rtma_atomic_store64(p, v) rtma_atomic_store(p, v)
+#define rtma_atomic_add64(p, v) rtma_atomic_add(p, v)
+#define rtma_atomic_cas64(p, expected, desired) rtma_atomic_cas(p, expected, desired)
+#define rtma_atomic_exchange64(p, v) rtma_atomic_exchange(p, v)
+#define rtma_atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define __rtma_atomic_cas(p, expected, desired) ({ \
+	__typeof__(*(p)) __expected = (expected); \
+	__atomic_compare_exchange_n((p), &__expected, (desired), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); })
+
+#if defined(__x86_64__) || defined(__i386__)
+#define rtma_cpu_relax() __builtin_ia32_pause()
+#else
+#define rtma_cpu_relax() ((void)0)
+#endif
+
+#endif
+
+// Test-and-test-and-set spinlock for short critical sections
+static inline void rtma_spin_lock(int* lock) {
+	while (rtma_atomic_exchange(lock, 1)) {
+		while (rtma_atomic_load(lock))
+			rtma_cpu_relax();
+	}
+}
+
+static inline void rtma_spin_unlock(int* lock) {
+	rtma_atomic_store(lock, 0);
+}
+
+#endif //_RTMA_ATOMIC_H
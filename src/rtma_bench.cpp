@@ -1,34 +1,95 @@
 #include "rtma_client.h"
+#include "rtma_time.h"
+#include "rtma_histogram.h"
+#include "rtma_send_queue.h"
+#include "rtma_recv_queue.h"
+#include "rtma_recorder.h"
+#include "rtma.hpp"
 #include <vector>
+#include <algorithm>
 #include <thread>
 #include <chrono>
+#include <mutex>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <math.h>
+
+#ifdef __UNIX__
+#include <signal.h>
+#endif
 
 #define MT_TEST_MSG 1234
 #define MT_PUBLISHER_READY 5677
 #define MT_PUBLISHER_DONE 5678
 #define MT_SUBSCRIBER_READY 5679
 #define MT_SUBSCRIBER_DONE 5680
+#define MT_TEST_REPLY 5681
+
+std::mutex print_mutex;
+
+// Per thread progress lines are only printed in text output mode
+int verbose = 1;
+
+// Publisher threads share one client and its send thread instead of each
+// opening a connection
+int shared_client = 0;
+
+// Subscribers read through a receive thread
+int receive_thread = 0;
+
+// Seconds latency mode clients spin before blocking in a read, and the CPU
+// the pinging thread is pinned to (the echo module gets the next one)
+double busy_poll = 0.0;
+int pin_cpu = -1;
+
+// Subscribers record what they receive to record_path.ID
+const char* record_path = NULL;
 
+typedef struct {
+	int msgs;
+	double duration;
+} LoopResult;
 
-int subscriber_loop(int id, char* server, int port, int num_msgs, int msg_size) {
+// Outcome of one run_test
+typedef struct {
+	double pub_msgs_per_sec;	// All publishers together
+	double sub_msgs_per_sec;	// Mean over subscribers
+	double sub_mb_per_sec;		// Mean over subscribers
+	double delivery_ratio;		// Mean fraction of the published messages a subscriber received
+} TestResult;
+
+
+int subscriber_loop(int id, char* server, int port, int num_msgs, int msg_size, int histograms, LoopResult* result) {
 	Client* c = rtma_create_client(0, 0);
 	rtma_client_connect(c, server, port);
-	rtma_client_subscribe(c, MT_EXIT);
-	rtma_client_subscribe(c, MT_TEST_MSG);
+	if (histograms)
+		rtma_client_enable_latency_histograms(c, 0);
+	if (receive_thread)
+		rtma_client_start_receive_thread(c, 0, RTMA_RECV_QUEUE_BLOCK);
+
+	MessageRecorder* recorder = NULL;
+	if (record_path) {
+		char path[1024];
+		snprintf(path, sizeof(path), "%s.%d", record_path, id);
+		recorder = rtma_create_recorder(path, 0);
+		rtma_client_set_recorder(c, recorder);
+	}
+
+	MSG_TYPE subscriptions[] = { MT_EXIT, MT_TEST_MSG };
+	rtma_client_subscribe_many(c, subscriptions, 2, NULL);
 	rtma_client_send_module_ready(c);
 
 	int msg_rcvd = 0;
 	std::chrono::time_point<std::chrono::high_resolution_clock> start;
 	std::chrono::time_point<std::chrono::high_resolution_clock> end;
 
-	int nbytes = rtma_client_send_signal(c, MT_SUBSCRIBER_READY);
+	rtma_client_send_signal(c, MT_SUBSCRIBER_READY);
 
-	Message msg;
+	MessageView msg;
 	while (msg_rcvd < num_msgs) {
-		if (rtma_client_read_message(c, &msg, BLOCKING)) {
+		if (rtma_client_read_message_view(c, &msg, BLOCKING)) {
 			switch (MSG_TYPE(msg)) {
 			case MT_TEST_MSG:
 				if (msg_rcvd == 0)
@@ -45,11 +106,28 @@ int subscriber_loop(int id, char* server, int port, int num_msgs, int msg_size)
 quit:
 	rtma_client_send_signal(c, MT_SUBSCRIBER_DONE);
 	std::chrono::duration<double> dur = end - start;
+
+	RecvQueueStats queue_stats;
+	rtma_client_get_recv_queue_stats(c, &queue_stats);
 	double data_transfer = (double(msg_rcvd) - 1.0) * double(msg_size + sizeof(RTMA_MSG_HEADER)) / double(1e6) / dur.count();
 
+	if (histograms && verbose) {
+		std::lock_guard<std::mutex> lock(print_mutex);
+		printf("Subscriber[%d] ", id);
+		rtma_client_print_latency_histograms(c);
+	}
+
 	rtma_client_disconnect(c);
 	rtma_destroy_client(&c);
+	rtma_destroy_recorder(&recorder);
+
+	result->msgs = msg_rcvd;
+	result->duration = dur.count();
+
+	if (!verbose)
+		return 0;
 
+	std::lock_guard<std::mutex> lock(print_mutex);
 	if (msg_rcvd == num_msgs) {
 		printf("Subscriber[%d] -> %d messages | %d messages/sec | %0.1lf MB/sec | %0.6lf sec\n",
 			id,
@@ -68,14 +146,20 @@ quit:
 			dur.count());
 		}
 
+	if (receive_thread)
+		printf("Subscriber[%d] -> receive queue high water %d of %d\n", id, queue_stats.high_water, queue_stats.capacity);
+
 	return 0;
 }
 
-int publisher_loop(int id, char* server, int port, int num_msgs, int msg_size, int num_subscribers) {
+int publisher_loop(int id, char* server, int port, int num_msgs, int msg_size, int num_subscribers, int batch_size, LoopResult* result) {
 	Client* c = rtma_create_client(0, 0);
-	rtma_client_connect(c, server, port);
-	rtma_client_subscribe(c, MT_EXIT);
-	rtma_client_subscribe(c, MT_SUBSCRIBER_READY);
+	if (rtma_client_connect(c, server, port) != RTMA_NO_ERROR) {
+		rtma_destroy_client(&c);
+		return -1;
+	}
+	MSG_TYPE subscriptions[] = { MT_EXIT, MT_SUBSCRIBER_READY };
+	rtma_client_subscribe_many(c, subscriptions, 2, NULL);
 	rtma_client_send_module_ready(c);
 
 	rtma_client_send_signal(c, MT_PUBLISHER_READY);
@@ -102,11 +186,18 @@ int publisher_loop(int id, char* server, int port, int num_msgs, int msg_size, i
 
 	auto start = std::chrono::high_resolution_clock::now();
 
+	// Coalesce every batch_size messages into a single write
+	if (batch_size > 1) {
+		rtma_client_begin_batch(c);
+		rtma_client_set_batch_limits(c, 0, batch_size, 0);
+	}
+
 	for (int i = 0; i < num_msgs; i++) {
-		int nbytes = rtma_client_send_message(c, MT_TEST_MSG, msg_data, packet_size);
+		rtma_client_send_message(c, MT_TEST_MSG, msg_data, packet_size);
 	}
 
 	rtma_client_send_signal(c, MT_PUBLISHER_DONE);
+	rtma_client_end_batch(c);
 
 	auto end = std::chrono::high_resolution_clock::now();
 	std::chrono::duration<double> dur = end - start;
@@ -117,6 +208,13 @@ int publisher_loop(int id, char* server, int port, int num_msgs, int msg_size, i
 	rtma_destroy_client(&c);
 	free(msg_data);
 
+	result->msgs = num_msgs;
+	result->duration = dur.count();
+
+	if (!verbose)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(print_mutex);
 	printf("Publisher[%d] -> %d messages | %d messages/sec | %0.1lf MB/sec | %0.6lf sec\n",
 		id,
 		num_msgs,
@@ -127,40 +225,813 @@ int publisher_loop(int id, char* server, int port, int num_msgs, int msg_size, i
 	return 0;
 }
 
+// All publisher threads send through one client. It announces itself once
+// per publisher so the controller sees the usual number of ready and done
+// signals.
+int shared_publisher_loop(int num_publishers, char* server, int port, int num_msgs, int msg_size, int num_subscribers, LoopResult* results) {
+	Client* c = rtma_create_client(0, 0);
+	rtma_client_connect(c, server, port);
+	MSG_TYPE subscriptions[] = { MT_EXIT, MT_SUBSCRIBER_READY };
+	rtma_client_subscribe_many(c, subscriptions, 2, NULL);
+	rtma_client_send_module_ready(c);
+	rtma_client_start_send_thread(c, 0, RTMA_SEND_QUEUE_BLOCK);
+
+	for (int i = 0; i < num_publishers; i++)
+		rtma_client_send_signal(c, MT_PUBLISHER_READY);
+
+	int subscribers_ready = 0;
+	Message msg;
+	while (subscribers_ready < num_subscribers) {
+		if (rtma_client_read_message(c, &msg, BLOCKING) && MSG_TYPE(msg) == MT_SUBSCRIBER_READY)
+			subscribers_ready++;
+	}
+
+	std::vector<char> msg_data(msg_size);
+	for (int i = 0; i < msg_size; i++)
+		msg_data[i] = i % 128;
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < num_publishers; i++) {
+		threads.push_back(std::thread([&, i]() {
+			auto start = std::chrono::high_resolution_clock::now();
+
+			for (int n = 0; n < num_msgs; n++)
+				rtma_client_send_message(c, MT_TEST_MSG, msg_data.data(), msg_size);
+
+			auto end = std::chrono::high_resolution_clock::now();
+			std::chrono::duration<double> dur = end - start;
+			results[i].msgs = num_msgs;
+			results[i].duration = dur.count();
+		}));
+	}
+
+	for (auto& t : threads)
+		t.join();
+
+	for (int i = 0; i < num_publishers; i++)
+		rtma_client_send_signal(c, MT_PUBLISHER_DONE);
+
+	SendQueueStats stats;
+	rtma_client_flush(c);
+	rtma_client_get_send_queue_stats(c, &stats);
+	rtma_client_disconnect(c);
+	rtma_destroy_client(&c);
+
+	if (!verbose)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(print_mutex);
+	for (int i = 0; i < num_publishers; i++) {
+		printf("Publisher[%d] -> %d messages | %d messages/sec | %0.1lf MB/sec | %0.6lf sec\n",
+			i + 1,
+			results[i].msgs,
+			(int)((double)results[i].msgs / results[i].duration),
+			(double)results[i].msgs * (double)(msg_size + sizeof(RTMA_MSG_HEADER)) / 1e6 / results[i].duration,
+			results[i].duration);
+	}
+	printf("Shared client -> %lld messages written by the send thread, %lld dropped, %lld failed\n", stats.sent, stats.dropped, stats.failed);
+
+	return 0;
+}
+
+TestResult run_test(Client* c, char* server, int port, int num_publishers, int num_subscribers, int num_msgs, int msg_size, int batch_size, int histograms) {
+	std::vector<std::thread> publishers;
+	std::vector<std::thread> subscribers;
+	std::vector<LoopResult> publisher_results(num_publishers);
+	std::vector<LoopResult> subscriber_results(num_subscribers);
+
+	// Every subscriber expects everything the publishers send together
+	int msgs_per_publisher = num_msgs / num_publishers;
+	num_msgs = msgs_per_publisher * num_publishers;
+
+	if (verbose) {
+		printf("Packet Size: %d bytes\n", msg_size);
+		printf("Batch Size: %d messages\n", batch_size);
+		printf("Sending %d messsage...\n", num_msgs);
+	}
+
+	//printf("Initializing publisher threads...\n");
+	if (shared_client) {
+		publishers.push_back(std::thread(shared_publisher_loop, num_publishers, server, port, msgs_per_publisher, msg_size, num_subscribers, publisher_results.data()));
+	}
+	else {
+		for (int i = 0; i < num_publishers; i++)
+			publishers.push_back(std::thread(publisher_loop, i + 1, server, port, msgs_per_publisher, msg_size, num_subscribers, batch_size, &publisher_results[i]));
+	}
+
+	// Wait for publisher threads to be established
+	Message msg;
+	int publishers_ready = 0;
+	while (publishers_ready < num_publishers) {
+		if (rtma_client_read_message(c, &msg, BLOCKING)) {
+			switch (MSG_TYPE(msg)) {
+			case MT_PUBLISHER_READY:
+				publishers_ready++;
+				continue;
+			}
+		}
+	}
+
+	//printf("Waiting for subscriber threads...\n");
+	for (int i = 0; i < num_subscribers; i++)
+		subscribers.push_back(std::thread(subscriber_loop, i + 1, server, port, num_msgs, msg_size, histograms, &subscriber_results[i]));
+
+	//printf("Starting Test...\n");
+	
+	//Wait for subscribers to finish
+	double abort_timeout = 30;
+	auto abort_start = std::chrono::high_resolution_clock::now();
+
+	int subscribers_done = 0;
+	int publishers_done = 0;
+
+	while ( (subscribers_done < num_subscribers) || (publishers_done < num_publishers) ) {
+		if (rtma_client_read_message(c, &msg, 0.100)) {
+			switch (MSG_TYPE(msg)) {
+			case MT_SUBSCRIBER_DONE:
+				subscribers_done++;
+				continue;
+			case MT_PUBLISHER_DONE:
+				publishers_done++;
+				continue;
+			}
+		}
+
+		auto now = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<double> dur = now - abort_start;
+
+		if (dur.count() > abort_timeout) {
+			fprintf(stderr, "Test Timeout! Sending Exit Signal...\n");
+			rtma_client_send_signal(c, MT_EXIT);
+		}
+	}
+
+	for (auto& publisher : publishers)
+		publisher.join();
+
+	for (auto& subscriber : subscribers)
+		subscriber.join();
+
+	TestResult result;
+	memset(&result, 0, sizeof(result));
+
+	double pub_duration = 0;
+	for (auto& r : publisher_results) {
+		if (r.duration > pub_duration)
+			pub_duration = r.duration;
+	}
+	if (pub_duration > 0)
+		result.pub_msgs_per_sec = (double)num_msgs / pub_duration;
+
+	for (auto& r : subscriber_results) {
+		if (r.duration > 0) {
+			double rate = (double(r.msgs) - 1.0) / r.duration;
+			result.sub_msgs_per_sec += rate / num_subscribers;
+			result.sub_mb_per_sec += rate * double(msg_size + sizeof(RTMA_MSG_HEADER)) / 1e6 / num_subscribers;
+		}
+		result.delivery_ratio += double(r.msgs) / double(num_msgs) / num_subscribers;
+	}
+
+	return result;
+}
+
+// Parse "N", "A:B[:FACTOR]" (A, A*FACTOR, ... up to B, FACTOR defaults to 2)
+// or "A,B,C" into values
+int parse_range(const char* arg, std::vector<int>& values) {
+	values.clear();
+
+	if (strchr(arg, ',')) {
+		for (const char* p = arg; p; p = strchr(p, ',')) {
+			if (*p == ',')
+				p++;
+			values.push_back(atoi(p));
+		}
+	}
+	else {
+		int start = atoi(arg);
+		int end = start;
+		int factor = 2;
+		const char* p = strchr(arg, ':');
+		if (p) {
+			end = atoi(p + 1);
+			p = strchr(p + 1, ':');
+			if (p)
+				factor = atoi(p + 1);
+		}
+
+		if (start <= 0 || factor < 2)
+			return -1;
+
+		for (long long v = start; v <= end; v *= factor)
+			values.push_back((int)v);
+	}
+
+	for (int v : values) {
+		if (v <= 0)
+			return -1;
+	}
+
+	return values.empty() ? -1 : 0;
+}
+
+void mean_stddev(const std::vector<double>& samples, double* mean, double* stddev) {
+	double sum = 0;
+	for (double x : samples)
+		sum += x;
+	*mean = sum / samples.size();
+
+	double sq = 0;
+	for (double x : samples)
+		sq += (x - *mean) * (x - *mean);
+	*stddev = samples.size() > 1 ? sqrt(sq / (samples.size() - 1)) : 0.0;
+}
+
+#define FORMAT_TEXT 0
+#define FORMAT_JSON 1
+#define FORMAT_CSV 2
+
+const char* metric_names[] = { "pub_msgs_per_sec", "sub_msgs_per_sec", "sub_mb_per_sec", "delivery_ratio" };
+#define NUM_METRICS 4
+
+void write_header(FILE* out, int format) {
+	if (format == FORMAT_JSON) {
+		fprintf(out, "[\n");
+	}
+	else if (format == FORMAT_CSV) {
+		fprintf(out, "msg_size,publishers,subscribers,num_msgs,batch_size,repeats");
+		for (int m = 0; m < NUM_METRICS; m++)
+			fprintf(out, ",%s_mean,%s_stddev", metric_names[m], metric_names[m]);
+		fprintf(out, "\n");
+	}
+}
+
+// Summarize the repeats of one sweep point
+void write_point(FILE* out, int format, int first, int msg_size, int num_publishers, int num_subscribers, int num_msgs, int batch_size, const std::vector<TestResult>& results) {
+	double mean[NUM_METRICS];
+	double stddev[NUM_METRICS];
+
+	for (int m = 0; m < NUM_METRICS; m++) {
+		std::vector<double> samples;
+		for (auto& r : results) {
+			const double values[NUM_METRICS] = { r.pub_msgs_per_sec, r.sub_msgs_per_sec, r.sub_mb_per_sec, r.delivery_ratio };
+			samples.push_back(values[m]);
+		}
+		mean_stddev(samples, &mean[m], &stddev[m]);
+	}
+
+	if (format == FORMAT_JSON) {
+		fprintf(out, "%s  {\"msg_size\": %d, \"publishers\": %d, \"subscribers\": %d, \"num_msgs\": %d, \"batch_size\": %d, \"repeats\": %d",
+			first ? "" : ",\n", msg_size, num_publishers, num_subscribers, num_msgs, batch_size, (int)results.size());
+		for (int m = 0; m < NUM_METRICS; m++)
+			fprintf(out, ", \"%s\": {\"mean\": %0.6g, \"stddev\": %0.6g}", metric_names[m], mean[m], stddev[m]);
+		fprintf(out, "}");
+	}
+	else if (format == FORMAT_CSV) {
+		fprintf(out, "%d,%d,%d,%d,%d,%d", msg_size, num_publishers, num_subscribers, num_msgs, batch_size, (int)results.size());
+		for (int m = 0; m < NUM_METRICS; m++)
+			fprintf(out, ",%0.6g,%0.6g", mean[m], stddev[m]);
+		fprintf(out, "\n");
+	}
+	else {
+		fprintf(out, "Summary: %d bytes | %d publishers | %d subscribers | %d runs\n", msg_size, num_publishers, num_subscribers, (int)results.size());
+		for (int m = 0; m < NUM_METRICS; m++)
+			fprintf(out, "\t%-18s %14.3lf +/- %0.3lf\n", metric_names[m], mean[m], stddev[m]);
+	}
+
+	fflush(out);
+}
+
+void write_footer(FILE* out, int format) {
+	if (format == FORMAT_JSON)
+		fprintf(out, "\n]\n");
+}
+
+// Leading bytes of every ping. Replies echo them back unchanged.
+typedef struct {
+	int phase;
+	int seq;
+	double send_time;
+} PingData;
+
+// Reply to every MT_TEST_MSG with the same payload until MT_EXIT
+int echo_loop(char* server, int port) {
+	if (pin_cpu >= 0)
+		rtma_pin_thread_to_cpu(pin_cpu + 1);
+
+	Client* c = rtma_create_client(0, 0);
+	rtma_client_connect(c, server, port);
+	rtma_client_set_busy_poll(c, busy_poll, 0);
+	MSG_TYPE subscriptions[] = { MT_EXIT, MT_TEST_MSG };
+	rtma_client_subscribe_many(c, subscriptions, 2, NULL);
+	rtma_client_send_module_ready(c);
+
+	rtma_client_send_signal(c, MT_SUBSCRIBER_READY);
+
+	MessageView msg;
+	for (;;) {
+		if (rtma_client_read_message_view(c, &msg, BLOCKING)) {
+			switch (MSG_TYPE(msg)) {
+			case MT_TEST_MSG:
+				rtma_client_send_message(c, MT_TEST_REPLY, msg.data, msg.rtma_header.num_data_bytes);
+				break;
+			case MT_EXIT:
+				goto quit;
+			}
+		}
+	}
+
+quit:
+	rtma_client_disconnect(c);
+	rtma_destroy_client(&c);
+	return 0;
+}
+
+// Send pings and collect the replies. Runs for duration seconds if duration
+// is positive and for num_pings pings otherwise. With period 0 the next ping
+// goes out as soon as the previous reply is in (closed loop). Otherwise pings
+// are sent on a fixed schedule whether or not replies have arrived and the
+// round trip is measured from the scheduled send time, so a stall shows up in
+// the latency of every ping it delayed. Returns the number of lost pings.
+int ping_phase(Client* c, int phase, char* data, int msg_size, int num_pings, double duration, double period, LatencyHistogram* hist) {
+	PingData ping;
+	MessageView msg;
+	int sent = 0;
+	int rcvd = 0;
+	double start = rtma_time_now(RTMA_CLOCK_TSC);
+	double next_send = start;
+	double last_activity = start;
+
+	for (;;) {
+		double now = rtma_time_now(RTMA_CLOCK_TSC);
+		int sending_done = duration > 0 ? now - start >= duration : sent >= num_pings;
+
+		if (sending_done && rcvd >= sent)
+			break;
+
+		// Replies that have not shown up after a second are lost
+		if (now - last_activity > 1.0)
+			break;
+
+		if (!sending_done && (period > 0 ? now >= next_send : rcvd == sent)) {
+			ping.phase = phase;
+			ping.seq = sent++;
+			ping.send_time = period > 0 ? next_send : now;
+			memcpy(data, &ping, sizeof(ping));
+			rtma_client_send_message(c, MT_TEST_MSG, data, msg_size);
+			next_send += period;
+			last_activity = now;
+			continue;
+		}
+
+		// Poll timeouts are in milliseconds, so spin for the last stretch
+		// before a scheduled send
+		double timeout = 0.1;
+		if (!sending_done && period > 0)
+			timeout = next_send - now < 0.002 ? NONBLOCKING : next_send - now - 0.001;
+
+		if (rtma_client_read_message_view(c, &msg, timeout) && MSG_TYPE(msg) == MT_TEST_REPLY) {
+			memcpy(&ping, msg.data, sizeof(ping));
+			if (ping.phase != phase)
+				continue;
+
+			now = rtma_time_now(RTMA_CLOCK_TSC);
+			if (hist)
+				rtma_histogram_record(hist, (long long)((now - ping.send_time) * 1e9));
+			rcvd++;
+			last_activity = now;
+		}
+	}
+
+	return sent - rcvd;
+}
+
+void run_latency_test(Client* c, int num_pings, int msg_size, double rate, double warmup) {
+	static int phase = 0;
+	char* data = (char*)calloc(msg_size, 1);
+	LatencyHistogram* hist = (LatencyHistogram*)calloc(1, sizeof(LatencyHistogram));
+	double period = rate > 0 ? 1.0 / rate : 0.0;
+
+	printf("Packet Size: %d bytes\n", msg_size);
+	if (rate > 0)
+		printf("Send Rate: %0.0lf messages/sec (open loop)\n", rate);
+	else
+		printf("Send Rate: closed loop\n");
+	if (busy_poll > 0)
+		printf("Reads: busy poll for %0.0lf us before blocking\n", busy_poll * 1e6);
+	else
+		printf("Reads: blocking\n");
+
+	if (warmup > 0)
+		ping_phase(c, ++phase, data, msg_size, INT_MAX, warmup, period, NULL);
+
+	int lost = ping_phase(c, ++phase, data, msg_size, num_pings, 0, period, hist);
+
+	printf("%lld round trips", hist->count);
+	if (lost)
+		printf(" (%d lost)", lost);
+	printf(" | RTT us: min %0.1lf | p50 %0.1lf | p90 %0.1lf | p99 %0.1lf | p99.9 %0.1lf | max %0.1lf\n",
+		rtma_histogram_min(hist) / 1e3,
+		rtma_histogram_percentile(hist, 50.0) / 1e3,
+		rtma_histogram_percentile(hist, 90.0) / 1e3,
+		rtma_histogram_percentile(hist, 99.0) / 1e3,
+		rtma_histogram_percentile(hist, 99.9) / 1e3,
+		hist->max_ns / 1e3);
+	rtma_histogram_print(hist);
+
+	free(hist);
+	free(data);
+}
+
+// Per call cost of each timestamp source
+void run_clock_test(int num_calls) {
+	printf("TSC frequency: %0.3lf MHz%s\n\n", rtma_time_tsc_frequency() / 1e6, rtma_time_tsc_available() ? "" : " (not available, tsc falls back to monotonic)");
+	printf("%10s %12s %14s\n", "clock", "ns/call", "resolution(ns)");
+
+	for (int clock = 0; clock < RTMA_NUM_CLOCKS; clock++) {
+		double sink = 0.0;
+		double min_step = 1.0;
+		double prev = rtma_time_now(clock);
+
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < num_calls; i++) {
+			double t = rtma_time_now(clock);
+			if (t > prev && t - prev < min_step)
+				min_step = t - prev;
+			prev = t;
+			sink += t;
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<double> dur = end - start;
+
+		printf("%10s %12.2lf %14.1lf\n", rtma_time_clock_name(clock), dur.count() * 1e9 / num_calls, min_step * 1e9);
+
+		if (sink == 0.0)
+			printf("\n");
+	}
+
+	// Cost of recording one message into the latency histograms
+	Client* c = rtma_create_client(0, 0);
+	rtma_client_enable_latency_histograms(c, 0);
+
+	RTMA_MSG_HEADER header;
+	memset(&header, 0, sizeof(header));
+	header.src_mod_id = 10;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < num_calls; i++) {
+		header.msg_type = MT_TEST_MSG + (i & 3);
+		header.recv_time = header.send_time + (double)(i & 1023) * 1e-6;
+		rtma_client_record_latency(c, &header);
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	std::chrono::duration<double> dur = end - start;
+
+	printf("\n%10s %12.2lf\n", "histogram", dur.count() * 1e9 / num_calls);
+	rtma_destroy_client(&c);
+}
+
+// Typed versions of the bench messages for the C++ interface
+struct TypedTestMsg {
+	static constexpr MSG_TYPE msg_type = MT_TEST_MSG;
+	int seq;
+	int reserved;
+	double value;
+	char data[112];
+};
+
+struct TypedTestReply {
+	static constexpr MSG_TYPE msg_type = MT_TEST_REPLY;
+	int seq;
+	int status;
+};
+
+struct TypedPublisherDone { static constexpr MSG_TYPE msg_type = MT_PUBLISHER_DONE; };
+struct TypedSubscriberDone { static constexpr MSG_TYPE msg_type = MT_SUBSCRIBER_DONE; };
+
+// Dispatch a mix of messages that are already in memory. The C version checks
+// payload sizes like rtma::Dispatcher does.
+void raw_dispatch_loop(const std::vector<MessageView>& views, int num_msgs, long long* sink) {
+	for (int i = 0; i < num_msgs; i++) {
+		const MessageView& msg = views[i & (views.size() - 1)];
+		switch (MSG_TYPE(msg)) {
+		case MT_TEST_MSG:
+			if (msg.rtma_header.num_data_bytes == sizeof(TypedTestMsg))
+				*sink += ((TypedTestMsg*)msg.data)->seq;
+			break;
+		case MT_TEST_REPLY:
+			if (msg.rtma_header.num_data_bytes == sizeof(TypedTestReply))
+				*sink += ((TypedTestReply*)msg.data)->seq + 1;
+			break;
+		case MT_PUBLISHER_DONE:
+			if (msg.rtma_header.num_data_bytes == 0)
+				*sink += 2;
+			break;
+		case MT_SUBSCRIBER_DONE:
+			if (msg.rtma_header.num_data_bytes == 0)
+				*sink += 3;
+			break;
+		}
+	}
+}
+
+void typed_dispatch_loop(const std::vector<MessageView>& views, int num_msgs, long long* sink) {
+	rtma::Dispatcher dispatcher(
+		rtma::on<TypedTestMsg>([&](const TypedTestMsg& m) { *sink += m.seq; }),
+		rtma::on<TypedTestReply>([&](const TypedTestReply& m) { *sink += m.seq + 1; }),
+		rtma::on<TypedPublisherDone>([&](const TypedPublisherDone&) { *sink += 2; }),
+		rtma::on<TypedSubscriberDone>([&](const TypedSubscriberDone&) { *sink += 3; }));
+
+	for (int i = 0; i < num_msgs; i++)
+		dispatcher(views[i & (views.size() - 1)]);
+}
+
+// Publish TypedTestMsg to the manager, batch_size messages per write
+void raw_send_loop(rtma::Client& c, int num_msgs, int batch_size) {
+	TypedTestMsg msg;
+	memset(&msg, 0, sizeof(msg));
+
+	if (batch_size > 1) {
+		rtma_client_begin_batch(c.get());
+		rtma_client_set_batch_limits(c.get(), 0, batch_size, 0);
+	}
+	for (int i = 0; i < num_msgs; i++) {
+		msg.seq = i;
+		rtma_client_send_message_to_module(c.get(), MT_TEST_MSG, &msg, sizeof(msg), MID_MESSAGE_MANAGER, HID_LOCAL_HOST, BLOCKING);
+	}
+	rtma_client_end_batch(c.get());
+}
+
+void typed_send_loop(rtma::Client& c, int num_msgs, int batch_size) {
+	TypedTestMsg msg;
+	memset(&msg, 0, sizeof(msg));
+
+	if (batch_size > 1) {
+		c.begin_batch();
+		rtma_client_set_batch_limits(c.get(), 0, batch_size, 0);
+	}
+	for (int i = 0; i < num_msgs; i++) {
+		msg.seq = i;
+		c.send(msg);
+	}
+	c.end_batch();
+}
+
+// The same work written against the C API and against rtma.hpp. Rounds
+// alternate which of the two goes first and the best of each is reported.
+int run_typed_test(char* server, int port, int num_msgs, int batch_size) {
+	const int num_views = 4096;
+	const int rounds = 6;
+	const MSG_TYPE types[] = { MT_TEST_MSG, MT_TEST_REPLY, MT_PUBLISHER_DONE, MT_SUBSCRIBER_DONE, MT_TEST_MSG + 1 };
+	std::vector<MessageView> views(num_views);
+	std::vector<TypedTestMsg> payloads(num_views);
+
+	srand(1);
+	for (int i = 0; i < num_views; i++) {
+		MSG_TYPE msg_type = types[rand() % 5];
+		memset(&views[i], 0, sizeof(MessageView));
+		views[i].rtma_header.msg_type = msg_type;
+		views[i].rtma_header.num_data_bytes = msg_type == MT_TEST_MSG ? sizeof(TypedTestMsg) : msg_type == MT_TEST_REPLY ? sizeof(TypedTestReply) : 0;
+		views[i].data = (char*)&payloads[i];
+		payloads[i].seq = i;
+	}
+
+	long long sinks[2] = { 0, 0 };
+	double dispatch_best[2] = { 1e9, 1e9 };
+
+	for (int round = 0; round < rounds; round++) {
+		for (int k = 0; k < 2; k++) {
+			int typed = (round + k) & 1;
+			auto start = std::chrono::high_resolution_clock::now();
+			if (typed)
+				typed_dispatch_loop(views, num_msgs, &sinks[typed]);
+			else
+				raw_dispatch_loop(views, num_msgs, &sinks[typed]);
+			std::chrono::duration<double> dur = std::chrono::high_resolution_clock::now() - start;
+			dispatch_best[typed] = std::min(dispatch_best[typed], dur.count());
+		}
+	}
+
+	printf("Dispatch ns/msg: C switch %0.2lf | rtma::Dispatcher %0.2lf%s\n",
+		dispatch_best[0] * 1e9 / num_msgs, dispatch_best[1] * 1e9 / num_msgs, sinks[0] == sinks[1] ? "" : " (results differ)");
+
+	rtma::Client c;
+	if (c.connect(server, port) != RTMA_NO_ERROR)
+		return -1;
+
+	double send_best[2] = { 1e9, 1e9 };
+
+	for (int round = 0; round < rounds; round++) {
+		for (int k = 0; k < 2; k++) {
+			int typed = (round + k) & 1;
+			auto start = std::chrono::high_resolution_clock::now();
+			if (typed)
+				typed_send_loop(c, num_msgs, batch_size);
+			else
+				raw_send_loop(c, num_msgs, batch_size);
+			std::chrono::duration<double> dur = std::chrono::high_resolution_clock::now() - start;
+			send_best[typed] = std::min(send_best[typed], dur.count());
+		}
+	}
+
+	printf("Send msgs/sec:   C API %d | rtma::Client %d\n", (int)(num_msgs / send_best[0]), (int)(num_msgs / send_best[1]));
+	return 0;
+}
+
+#ifdef __UNIX__
+// Message manager listening on port, and on the Unix socket server if it is
+// a path
+pid_t start_mm(const char* mm_path, const char* server, int port) {
+	char port_str[16];
+	snprintf(port_str, sizeof(port_str), "%d", port);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (freopen("/dev/null", "w", stdout) == NULL)
+			_exit(127);
+		if (server[0] == '/' || server[0] == '@')
+			execl(mm_path, mm_path, "-p", port_str, "-u", server, (char*)NULL);
+		else
+			execl(mm_path, mm_path, "-p", port_str, (char*)NULL);
+		perror(mm_path);
+		_exit(127);
+	}
+	if (pid < 0)
+		perror("fork");
+
+	return pid;
+}
+
+// Kill the message manager under a publisher and a subscriber, restart it
+// and time how long it takes until messages flow again. Both clients
+// recover through auto reconnect.
+int run_reconnect_test(const char* mm_path, char* server, int port, int rounds) {
+	pid_t mm = start_mm(mm_path, server, port);
+	if (mm < 0)
+		return -1;
+
+	Client* sub = rtma_create_client(0, 0);
+	Client* pub = rtma_create_client(0, 0);
+	Client* clients[] = { sub, pub };
+
+	// Give the manager up to a second to come up
+	for (Client* c : clients) {
+		rtma_client_set_auto_reconnect(c, 1, 1.0);
+		if (rtma_client_connect(c, server, port) != RTMA_NO_ERROR && rtma_client_reconnect(c, 1.0) != RTMA_NO_ERROR) {
+			fprintf(stderr, "rtma_bench: unable to connect to %s started on port %d\n", mm_path, port);
+			kill(mm, SIGKILL);
+			waitpid(mm, NULL, 0);
+			rtma_destroy_client(&sub);
+			rtma_destroy_client(&pub);
+			return -1;
+		}
+	}
+	rtma_client_subscribe(sub, MT_TEST_MSG);
+	MODULE_ID sub_id = sub->module_id, pub_id = pub->module_id;
+
+	std::vector<double> downtime, recovery;
+	Message msg;
+	int failed = 0;
+
+	for (int round = 1; round <= rounds; round++) {
+		kill(mm, SIGKILL);
+		waitpid(mm, NULL, 0);
+		double killed = rtma_time_now(RTMA_CLOCK_MONOTONIC);
+
+		mm = start_mm(mm_path, server, port);
+		if (mm < 0)
+			break;
+		double restarted = rtma_time_now(RTMA_CLOCK_MONOTONIC);
+
+		// Publish the round number until the subscriber sees it again
+		double deadline = restarted + 5.0;
+		int recovered = 0;
+		while (!recovered && rtma_time_now(RTMA_CLOCK_MONOTONIC) < deadline) {
+			rtma_client_send_message(pub, MT_TEST_MSG, &round, sizeof(round));
+			while (rtma_client_read_message(sub, &msg, 0.001)) {
+				if (MSG_TYPE(msg) == MT_TEST_MSG && *(int*)msg.data == round)
+					recovered = 1;
+			}
+		}
+
+		if (!recovered) {
+			failed++;
+			continue;
+		}
+
+		double now = rtma_time_now(RTMA_CLOCK_MONOTONIC);
+		downtime.push_back((now - killed) * 1e3);
+		recovery.push_back((now - restarted) * 1e3);
+	}
+
+	if (mm > 0) {
+		kill(mm, SIGKILL);
+		waitpid(mm, NULL, 0);
+	}
+
+	printf("Reconnect rounds: %d (%d failed) | module ids kept: %s\n", rounds, failed,
+		sub->module_id == sub_id && pub->module_id == pub_id ? "yes" : "no");
+
+	if (!recovery.empty()) {
+		double mean, stddev;
+		mean_stddev(recovery, &mean, &stddev);
+		printf("Restart to first message ms: min %0.2lf | mean %0.2lf | max %0.2lf\n",
+			*std::min_element(recovery.begin(), recovery.end()), mean, *std::max_element(recovery.begin(), recovery.end()));
+		mean_stddev(downtime, &mean, &stddev);
+		printf("Kill to first message ms:    min %0.2lf | mean %0.2lf | max %0.2lf\n",
+			*std::min_element(downtime.begin(), downtime.end()), mean, *std::max_element(downtime.begin(), downtime.end()));
+	}
+
+	rtma_destroy_client(&sub);
+	rtma_destroy_client(&pub);
+	return failed ? -1 : 0;
+}
+#endif //__UNIX__
+
 void usage(void) {
-	printf("Usage: rtma-bench [-s server(127.0.0.1:7111)] [-np NUM_PUBLISHERS] [-ns NUM_SUBSCRIBERS] [-n NUM_MSGS] [-ms MESSAGE_SIZE]\n");
+	printf("Usage: rtma-bench [-s server(127.0.0.1:7111)] [-np NUM_PUBLISHERS] [-ns NUM_SUBSCRIBERS] [-n NUM_MSGS] [-ms MESSAGE_SIZE] [-b BATCH_SIZE] [-r REPEATS] [-format text|json|csv] [-o FILE] [-large] [-hist] [-clocks] [-latency] [-rate RATE] [-warmup SECONDS] [-shared] [-recvthread] [-busypoll USEC] [-cpu CPU] [-record PATH] [-reconnect ROUNDS] [-mm PATH] [-typed]\n");
+	printf("\n-ms, -np and -ns take a single value, a list A,B,C or a range A:B[:FACTOR] (A, A*FACTOR, ... up to B, FACTOR defaults to 2). Every combination is run REPEATS times.\n\n");
 
+	printf("- shared\n\tPublisher threads send through one client with a send thread instead of one connection each\n");
+	printf("- recvthread\n\tSubscribers read through a receive thread that drains the socket into a queue\n");
+	printf("- large\n\tRun the test for 64 KB to 1 MB dynamic messages instead of MESSAGE_SIZE\n");
+	printf("- latency\n\tMeasure round trip times against an echo module instead of throughput. Sweeps 16 B to MAX_DATA_BYTES unless -ms is given\n");
+	printf("- rate float\n\tSend pings at a fixed rate in messages/sec instead of one after the other (default 0 = closed loop)\n");
+	printf("- warmup float\n\tSeconds of pings sent before measuring in latency mode (default 1)\n");
+	printf("- busypoll int\n\tMicroseconds latency mode reads spin on the socket before blocking (default 0 = block right away)\n");
+	printf("- cpu int\n\tPin the pinging thread to CPU and the echo module to CPU + 1 in latency mode\n");
+	printf("- record string\n\tSubscribers record every message they receive to PATH.ID with a message recorder\n");
+	printf("- reconnect int\n\tStart a message manager on PORT, kill and restart it ROUNDS times and report how fast a publisher and a subscriber with auto reconnect get messages through again\n");
+	printf("- mm string\n\tMessage manager the reconnect test starts (default rtma_mm next to rtma_bench)\n");
+	printf("- typed\n\tCompare dispatching and publishing NUM_MSGS messages through the C API and through the C++ interface in rtma.hpp, -b batches the sends\n");
+	printf("- hist\n\tPrint per message type latency histograms for each subscriber\n");
+	printf("- clocks\n\tMeasure the cost of each timestamp source and exit\n");
+	printf("- b int\n\tNumber of messages publishers coalesce per write. 1 disables batching (default 1)\n");
+	printf("- r int\n\tNumber of runs per combination. Results report mean and standard deviation (default 1)\n");
+	printf("- format string\n\tOutput format of the results: text, json or csv (default text)\n");
+	printf("- o string\n\tWrite the results to a file instead of stdout\n");
 	printf("- h\n\tShow help message\n");
 	printf("- ms int\n\tSize of the message. (default 128)\n");
 	printf("- n int\n\tNumber of Messages to Publish(default 100000)\n");
 	printf("- np int\n\tNumber of Concurrent Publishers(default 1)\n");
 	printf("- ns int\n\tNumber of Concurrent Subscribers\n");
-	printf("- s string\n\tRTMA message manager ip address (default 127.0.0.1)\n");
+	printf("- s string\n\tRTMA message manager address, optionally with the port as host:port (default 127.0.0.1). A path (/tmp/rtma.sock) selects a Unix domain socket, a shm:// prefix the shared memory transport\n");
 	printf("- p string\n\tRTMA message manager port (default 7111)\n");
 }
 
 int main(int argc, char** argv) {
 
-	char server[] = "127.0.0.1";
-	int num_publishers = 1;
-	int num_subscribers = 1;
+	char server[256] = "127.0.0.1";
+	std::vector<int> publisher_counts(1, 1);
+	std::vector<int> subscriber_counts(1, 1);
+	std::vector<int> msg_sizes(1, 128);
 	int num_msgs = 100000;
-	int msg_size = 128;
 	int port = 7111;
+	int batch_size = 1;
+	int repeats = 1;
+	int format = FORMAT_TEXT;
+	const char* output_path = NULL;
+	int large = 0;
+	int clocks = 0;
+	int histograms = 0;
+	int latency = 0;
+	int msg_size_set = 0;
+	double rate = 0;
+	double warmup = 1.0;
+	int reconnect_rounds = 0;
+	int typed = 0;
+	char mm_path[1024];
 
 	char* flag;
 
 	const char* prog_name = argv[0];
 
+	// rtma_mm next to this binary unless -mm says otherwise
+	snprintf(mm_path, sizeof(mm_path), "%s", prog_name);
+	char* slash = strrchr(mm_path, '/');
+	snprintf(slash ? slash + 1 : mm_path, sizeof(mm_path) - (slash ? slash + 1 - mm_path : 0), "rtma_mm");
+
 	while (--argc > 0 && (*++argv)[0] == '-') {
 		flag = &((*argv)[1]);
 
+		// Every remaining flag except the switches takes a value
+		if (argc < 2 && strcmp(flag, "large") && strcmp(flag, "shared") && strcmp(flag, "recvthread") && strcmp(flag, "latency") && strcmp(flag, "hist") && strcmp(flag, "clocks") && strcmp(flag, "typed") && strcmp(flag, "h")) {
+			fprintf(stderr, "%s: missing value for %s\n", prog_name, *argv);
+			usage();
+			return -1;
+		}
+
 		if (strcmp(flag, "np") == 0) {
-			num_publishers = atoi((*++argv));
+			if (parse_range(*++argv, publisher_counts)) {
+				fprintf(stderr, "%s: bad value for -np: %s\n", prog_name, *argv);
+				return -1;
+			}
 			argc--;
 		}
 		else if (strcmp(flag, "ns") == 0) {
-			num_subscribers = atoi((*++argv));
+			if (parse_range(*++argv, subscriber_counts)) {
+				fprintf(stderr, "%s: bad value for -ns: %s\n", prog_name, *argv);
+				return -1;
+			}
 			argc--;
 		}
 		else if (strcmp(flag, "n") == 0) {
@@ -168,7 +1039,98 @@ int main(int argc, char** argv) {
 			argc--;
 		}
 		else if (strcmp(flag, "ms") == 0) {
-			msg_size = atoi((*++argv));
+			if (parse_range(*++argv, msg_sizes)) {
+				fprintf(stderr, "%s: bad value for -ms: %s\n", prog_name, *argv);
+				return -1;
+			}
+			msg_size_set = 1;
+			argc--;
+		}
+		else if (strcmp(flag, "s") == 0) {
+			strncpy(server, *++argv, sizeof(server) - 1);
+			argc--;
+
+			// [shm://]host:port, but leave IPv6 addresses alone
+			char* host = strstr(server, "://") ? strstr(server, "://") + 3 : server;
+			char* colon = strrchr(host, ':');
+			if (colon && colon == strchr(host, ':')) {
+				*colon = '\0';
+				port = atoi(colon + 1);
+			}
+		}
+		else if (strcmp(flag, "r") == 0) {
+			repeats = atoi((*++argv));
+			argc--;
+		}
+		else if (strcmp(flag, "format") == 0) {
+			++argv;
+			argc--;
+			if (strcmp(*argv, "text") == 0)
+				format = FORMAT_TEXT;
+			else if (strcmp(*argv, "json") == 0)
+				format = FORMAT_JSON;
+			else if (strcmp(*argv, "csv") == 0)
+				format = FORMAT_CSV;
+			else {
+				fprintf(stderr, "%s: unknown format %s\n", prog_name, *argv);
+				return -1;
+			}
+		}
+		else if (strcmp(flag, "o") == 0) {
+			output_path = *++argv;
+			argc--;
+		}
+		else if (strcmp(flag, "shared") == 0) {
+			shared_client = 1;
+		}
+		else if (strcmp(flag, "recvthread") == 0) {
+			receive_thread = 1;
+		}
+		else if (strcmp(flag, "large") == 0) {
+			large = 1;
+		}
+		else if (strcmp(flag, "latency") == 0) {
+			latency = 1;
+		}
+		else if (strcmp(flag, "rate") == 0) {
+			rate = atof((*++argv));
+			argc--;
+		}
+		else if (strcmp(flag, "warmup") == 0) {
+			warmup = atof((*++argv));
+			argc--;
+		}
+		else if (strcmp(flag, "busypoll") == 0) {
+			busy_poll = atof((*++argv)) * 1e-6;
+			argc--;
+		}
+		else if (strcmp(flag, "cpu") == 0) {
+			pin_cpu = atoi((*++argv));
+			argc--;
+		}
+		else if (strcmp(flag, "hist") == 0) {
+			histograms = 1;
+		}
+		else if (strcmp(flag, "clocks") == 0) {
+			clocks = 1;
+		}
+		else if (strcmp(flag, "typed") == 0) {
+			typed = 1;
+		}
+		else if (strcmp(flag, "record") == 0) {
+			record_path = *++argv;
+			argc--;
+		}
+		else if (strcmp(flag, "reconnect") == 0) {
+			reconnect_rounds = atoi((*++argv));
+			argc--;
+		}
+		else if (strcmp(flag, "mm") == 0) {
+			snprintf(mm_path, sizeof(mm_path), "%s", *++argv);
+			argc--;
+		}
+		else if (strcmp(flag, "b") == 0) {
+			batch_size = atoi((*++argv));
 			argc--;
 		}
 		else if (strcmp(flag, "p") == 0) {
@@ -186,79 +1148,116 @@ int main(int argc, char** argv) {
 		}
 	}
 
+	if (repeats < 1)
+		repeats = 1;
+
+	if (clocks) {
+		run_clock_test(10000000);
+		return 0;
+	}
+
+	if (reconnect_rounds > 0) {
+#ifdef __UNIX__
+		return run_reconnect_test(mm_path, server, port, reconnect_rounds);
+#else
+		fprintf(stderr, "%s: -reconnect is only available on unix\n", prog_name);
+		return -1;
+#endif
+	}
+
+	if (typed)
+		return run_typed_test(server, port, num_msgs, batch_size);
+
+	FILE* out = stdout;
+	if (output_path) {
+		out = fopen(output_path, "w");
+		if (out == NULL) {
+			perror(output_path);
+			return -1;
+		}
+	}
+
+	// Keep stdout parseable when the results go there
+	if (format != FORMAT_TEXT && out == stdout)
+		verbose = 0;
+
 	// Main Thread RTMA module
 	Client* c = rtma_create_client(0, 0);
 	rtma_client_connect(c, server, port);
-	rtma_client_subscribe(c, MT_EXIT);
-	rtma_client_subscribe(c, MT_PUBLISHER_READY);
-	rtma_client_subscribe(c, MT_PUBLISHER_DONE);
-	rtma_client_subscribe(c, MT_SUBSCRIBER_DONE);
+	MSG_TYPE subscriptions[] = { MT_EXIT, MT_PUBLISHER_READY, MT_PUBLISHER_DONE, MT_SUBSCRIBER_DONE };
+	rtma_client_subscribe_many(c, subscriptions, sizeof(subscriptions) / sizeof(subscriptions[0]), NULL);
 	rtma_client_send_module_ready(c);
 
-	std::vector<std::thread> publishers;
-	std::vector<std::thread> subscribers;
+	if (latency) {
+		MSG_TYPE latency_subscriptions[] = { MT_SUBSCRIBER_READY, MT_TEST_REPLY };
+		rtma_client_subscribe_many(c, latency_subscriptions, 2, NULL);
 
-	printf("Packet Size: %d bytes\n", msg_size);
-	printf("Sending %d messsage...\n", num_msgs);
+		if (pin_cpu >= 0)
+			rtma_pin_thread_to_cpu(pin_cpu);
+		rtma_client_set_busy_poll(c, busy_poll, 0);
 
-	//printf("Initializing publisher threads...\n");
-	for (int i = 0; i < num_publishers; i++) {
-		publishers.push_back(std::thread(publisher_loop, i + 1, server, port, num_msgs / num_publishers, msg_size, num_subscribers));
-	}
+		std::thread echo(echo_loop, server, port);
 
-	// Wait for publisher threads to be established
-	Message msg;
-	int publishers_ready = 0;
-	while (publishers_ready < num_publishers) {
-		if (rtma_client_read_message(c, &msg, BLOCKING)) {
-			switch (MSG_TYPE(msg)) {
-			case MT_PUBLISHER_READY:
-				publishers_ready++;
-				continue;
-			}
+		Message msg;
+		while (!rtma_client_read_message(c, &msg, BLOCKING) || MSG_TYPE(msg) != MT_SUBSCRIBER_READY)
+			continue;
+
+		if (!msg_size_set) {
+			msg_sizes.clear();
+			for (int size = 16; size <= MAX_DATA_BYTES; size *= 4)
+				msg_sizes.push_back(size);
 		}
+
+		for (int size : msg_sizes) {
+			run_latency_test(c, num_msgs, size < (int)sizeof(PingData) ? (int)sizeof(PingData) : size, rate, warmup);
+			printf("\n");
+		}
+
+		rtma_client_send_signal(c, MT_EXIT);
+		echo.join();
 	}
+	else {
+		if (large) {
+			// Sweep dynamic message sizes from 64 KB to 1 MB
+			msg_sizes.clear();
+			for (int size = 64 * 1024; size <= 1024 * 1024; size *= 2)
+				msg_sizes.push_back(size);
+		}
 
-	//printf("Waiting for subscriber threads...\n");
-	for (int i = 0; i < num_subscribers; i++)
-		subscribers.push_back(std::thread(subscriber_loop, i + 1, server, port, num_msgs, msg_size));
+		int single_run = repeats == 1 && msg_sizes.size() == 1 && publisher_counts.size() == 1 && subscriber_counts.size() == 1;
+		int first = 1;
 
-	//printf("Starting Test...\n");
-	
-	//Wait for subscribers to finish
-	double abort_timeout = 30;
-	auto abort_start = std::chrono::high_resolution_clock::now();
+		write_header(out, format);
 
-	int subscribers_done = 0;
-	int publishers_done = 0;
+		for (int size : msg_sizes) {
+			for (int num_publishers : publisher_counts) {
+				for (int num_subscribers : subscriber_counts) {
+					std::vector<TestResult> results;
 
-	while ( (subscribers_done < num_subscribers) || (publishers_done < num_publishers) ) {
-		if (rtma_client_read_message(c, &msg, 0.100)) {
-			switch (MSG_TYPE(msg)) {
-			case MT_SUBSCRIBER_DONE:
-				subscribers_done++;
-				continue;
-			case MT_PUBLISHER_DONE:
-				publishers_done++;
-				continue;
+					for (int r = 0; r < repeats; r++) {
+						results.push_back(run_test(c, server, port, num_publishers, num_subscribers, num_msgs, size, batch_size, histograms));
+						if (verbose)
+							printf("\n");
+					}
+
+					if (format != FORMAT_TEXT || !single_run) {
+						write_point(out, format, first, size, num_publishers, num_subscribers, num_msgs, batch_size, results);
+						first = 0;
+					}
+				}
 			}
 		}
 
-		auto now = std::chrono::high_resolution_clock::now();
-		std::chrono::duration<double> dur = now - abort_start;
-
-		if (dur.count() > abort_timeout) {
-			printf("Test Timeout! Sending Exit Signal...\n");
-			rtma_client_send_signal(c, MT_EXIT);
-		}
+		write_footer(out, format);
 	}
 
-	for (auto& publisher : publishers)
-		publisher.join();
+	rtma_client_disconnect(c);
+	rtma_destroy_client(&c);
 
-	for (auto& subscriber : subscribers)
-		subscriber.join();
+	if (out != stdout)
+		fclose(out);
 
-	printf("Done!\n");
+	if (verbose)
+		printf("Done!\n");
 	return 0;
 }
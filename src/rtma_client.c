@@ -1,20 +1,41 @@
+#ifdef __linux__
+#define _GNU_SOURCE	// sched_setaffinity
+#endif
+
 #include "rtma_client.h"
+#include "rtma_client_internal.h"
+#include "rtma_send_queue.h"
+#include "rtma_recv_queue.h"
+#include "rtma_outbound.h"
+#include "rtma_atomic.h"
+#include "rtma_time.h"
+#include "rtma_histogram.h"
+#include "rtma_shm.h"
+#include "rtma_recorder.h"
+#include "rtma_pool.h"
+#include "rtma_thread.h"
+
+#include <float.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// Number of dynamic message fragments gathered into a single write
+#define RTMA_FRAGMENTS_PER_WRITE 32
+
+// Tracked state of each message type, replayed after a reconnect
+#define RTMA_SUBSCRIPTION_NONE 0
+#define RTMA_SUBSCRIPTION_ACTIVE 1
+#define RTMA_SUBSCRIPTION_PAUSED 2
+
+static void rtma_client_close_transport(Client* c);
+static void rtma_client_retire_recv_buffer(Client* c);
+static void rtma_client_release_transport(Client* c);
+static int rtma_client_read_socket_frame(Client* c, MessageView* view, double timeout, int stop_on_reply);
 
 double rtma_client_get_timestamp(Client *c){
-#ifdef __UNIX__
-    struct timeval tim;
-    if ( gettimeofday(&tim, NULL)  == 0 )
-    {
-        double t = tim.tv_sec + (tim.tv_usec/1000000.0);
-        return t;
-    }else{
-        return 0.0;
-    }
-#else
-    LONGLONG current_time;
-    QueryPerformanceCounter( (LARGE_INTEGER*) &current_time);
-    return (double) current_time / c->perf_counter_freq;
-#endif
+	return rtma_time_now(c->clock);
 }
 
 Client* rtma_create_client(MODULE_ID module_id, HOST_ID host_id) {
@@ -52,10 +73,116 @@ Client* rtma_create_client(MODULE_ID module_id, HOST_ID host_id) {
 
 	// Start time is set after connect is called
 	c->start_time = 0.0;
+	c->clock = RTMA_DEFAULT_CLOCK;
+	c->latency = NULL;
+	c->shm = NULL;
+	c->send_queue = NULL;
+	c->recv_queue = NULL;
+	c->conflate_latest = NULL;
+	c->recv_base = 0;
+	c->conflate_scan = 0;
+	c->conflated = 0;
+	c->busy_poll = 0.0;
+	c->busy_poll_usec = 0;
+	c->outbound = NULL;
+	c->recv_failed = FALSE;
+	c->last_error = RTMA_NO_ERROR;
+	c->server_name[0] = '\0';
+	c->server_port = 0;
+	c->auto_reconnect = FALSE;
+	c->reconnect_timeout = BLOCKING;
+	c->reconnecting = FALSE;
+	c->subscriptions = NULL;
+	c->reconnects = 0;
+	c->recorder = NULL;
+
+	c->recv_buf_size = RTMA_RECV_BUFFER_SIZE;
+	c->recv_buf = (char*)malloc(c->recv_buf_size);
+	c->recv_head = 0;
+	c->recv_tail = 0;
+	c->recv_borrowed = 0;
+
+	if (c->recv_buf == NULL) {
+		perror("rtma_create_client:malloc failed");
+		exit(EXIT_FAILURE);
+	}
+
+	c->send_buf_size = RTMA_SEND_BUFFER_SIZE;
+	c->send_buf = (char*)malloc(c->send_buf_size);
+	c->send_len = 0;
+	c->batching = 0;
+	c->batch_count = 0;
+	c->batch_max_bytes = c->send_buf_size;
+	c->batch_max_count = 0;
+	c->batch_max_delay = 0.0;
+	c->batch_start_time = 0.0;
+
+	if (c->send_buf == NULL) {
+		perror("rtma_create_client:malloc failed");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(c->assemblies, 0, sizeof(c->assemblies));
+	c->assembly_lent = -1;
+	c->large_alloc = NULL;
+	c->large_free = NULL;
+	c->large_alloc_ctx = NULL;
+
+	c->requests = (RequestRecord*)calloc(RTMA_REQUEST_HISTORY, sizeof(RequestRecord));
+	c->next_request_id = 1;
+	c->oldest_pending_id = 1;
+
+	if (c->requests == NULL) {
+		perror("rtma_create_client:calloc failed");
+		exit(EXIT_FAILURE);
+	}
+
+	c->stash_buf = NULL;
+	c->stash_size = 0;
+	c->stash_head = 0;
+	c->stash_tail = 0;
+	c->stash_borrowed = 0;
+
+	c->recv_held = FALSE;
+	c->recv_retired = NULL;
+	c->stash_retired = NULL;
+	c->assembly_held = -1;
+	c->pooled_held = NULL;
+	c->expired_acks = 0;
+
+	c->reconnect_in_steps = FALSE;
+	c->reconnect_stage = RTMA_RECONNECT_IDLE;
+	c->reconnect_deadline = 0.0;
+	c->replay_next = 0;
+	c->replay_first_id = 0;
+	c->replay_last_id = -1;
+	c->replay_failed = 0;
 
 	return c;
 }
 
+// Abandon all partially received dynamic messages. Buffers are kept for
+// reuse unless free_buffers is set. A held message keeps its buffer.
+static void rtma_client_reset_assemblies(Client* c, int free_buffers) {
+	for (int i = 0; i < RTMA_MAX_ASSEMBLIES; i++) {
+		MessageAssembly* a = &c->assemblies[i];
+
+		if (i == c->assembly_held)
+			continue;
+
+		if (free_buffers && a->buf != NULL) {
+			if (c->large_free)
+				c->large_free(c->large_alloc_ctx, a->buf);
+			else
+				free(a->buf);
+			a->buf = NULL;
+			a->capacity = 0;
+		}
+		a->active = 0;
+	}
+	c->assembly_lent = -1;
+}
+
 void rtma_destroy_client(Client **c) {
 
 	Client* cp = *c;
@@ -63,13 +190,27 @@ void rtma_destroy_client(Client **c) {
 	if (cp == NULL)
 		return;
 
+	rtma_client_stop_receive_thread(cp);
+	rtma_client_stop_send_thread(cp);
+	rtma_outbound_free(cp);
+
 	// Close the underlying socket
 	if (cp->sockfd != INVALID_SOCKET) {
 		socket_shutdown(cp->sockfd, SD_BOTH);
 		socket_close(cp->sockfd);
 	}
+	rtma_shm_close(&cp->shm);
 	
 	// Free the Client struct
+	rtma_client_release_message(cp);
+	rtma_client_reset_assemblies(cp, 1);
+	free(cp->recv_buf);
+	free(cp->send_buf);
+	free(cp->requests);
+	free(cp->latency);
+	free(cp->stash_buf);
+	free(cp->conflate_latest);
+	free(cp->subscriptions);
 	free(cp);
 	*c = NULL;
 
@@ -78,15 +219,32 @@ void rtma_destroy_client(Client **c) {
 #endif //__WINDOWS__
 }
 
-int rtma_client_connect(Client *c, char* server_name, uint16_t port) {
-	struct addrinfo hints;
-	struct addrinfo* res = NULL;
+// Ask the kernel to busy poll the device queue on blocking reads. Only
+// Linux has it and raising it above net.core.busy_read needs CAP_NET_ADMIN.
+static int rtma_client_set_so_busy_poll(Client* c) {
+#ifdef SO_BUSY_POLL
+	int usec = c->busy_poll_usec;
+	if (setsockopt(c->sockfd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == 0)
+		return 0;
+
+	perror("rtma_client_set_busy_poll: SO_BUSY_POLL");
+#else
+	fprintf(stderr, "rtma_client_set_busy_poll: SO_BUSY_POLL is not supported on this platform.\n");
+#endif
+	return -1;
+}
 
+// Refused attempts are expected while the manager restarts, so reconnects
+// don't report them
+static int rtma_client_socket_connect(Client* c, const struct sockaddr* addr, socklen_t addrlen) {
+	if (c->reconnecting)
+		return connect(c->sockfd, addr, addrlen) == 0 ? 0 : SOCKET_ERROR;
+	return socket_connect(c->sockfd, addr, addrlen);
+}
 
-	if (c->connected) {
-		fprintf(stderr, "Client already has an active connection.\n");
-		return RTMA_ERROR_ALREADY_CONNECTED;
-	}
+static int rtma_client_connect_tcp(Client* c, const char* server_name, uint16_t port) {
+	struct addrinfo hints;
+	struct addrinfo* res = NULL;
 
 	memset(&hints, '\0', sizeof hints);
 
@@ -101,12 +259,18 @@ int rtma_client_connect(Client *c, char* server_name, uint16_t port) {
 	int ret = getaddrinfo(server_name, port_str, &hints, &res);
 
 	if (ret) {
-		perror(gai_strerror(ret));
-		exit(1);
+		fprintf(stderr, "rtma_client_connect: %s: %s\n", server_name, gai_strerror(ret));
+		return RTMA_ERROR_RESOLVE;
 	}
 
 	c->sockfd = socket_create(res->ai_family, res->ai_socktype, res->ai_protocol);
-	socket_connect(c->sockfd, res->ai_addr, res->ai_addrlen);
+	if (c->sockfd == INVALID_SOCKET || rtma_client_socket_connect(c, res->ai_addr, (socklen_t)res->ai_addrlen) == SOCKET_ERROR) {
+		if (c->sockfd != INVALID_SOCKET)
+			socket_close(c->sockfd);
+		c->sockfd = INVALID_SOCKET;
+		freeaddrinfo(res);
+		return RTMA_ERROR_CONNECT;
+	}
 	
 	int optval = TRUE;
 	socket_setsockopt(c->sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
@@ -116,241 +280,1797 @@ int rtma_client_connect(Client *c, char* server_name, uint16_t port) {
 	socklen_t optlen = sizeof(opt);
 	socket_getsockopt(c->sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, &optlen);
 
-	if (opt != TRUE) {
-		perror("Unable to set TCP_NODELAY socket option.\n");
-		exit(1);
-	}
+	if (opt != TRUE)
+		fprintf(stderr, "rtma_client_connect: unable to set TCP_NODELAY socket option.\n");
+
+	if (c->busy_poll_usec > 0)
+		rtma_client_set_so_busy_poll(c);
 
 	memset(&c->serv_addr, '\0', sizeof(c->serv_addr));
 	memcpy(&c->serv_addr, res->ai_addr, res->ai_addrlen);
 
 	freeaddrinfo(res);
+	return RTMA_NO_ERROR;
+}
+
+#ifdef __UNIX__
+// Stream socket at a filesystem path, or in the abstract namespace for names
+// starting with '@'. No TCP stack, so no Nagle to turn off either.
+static int rtma_client_connect_unix(Client* c, const char* path) {
+	struct sockaddr_un addr;
+	size_t len = strlen(path);
+
+	if (len >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "rtma_client_connect: socket path too long: %s\n", path);
+		return RTMA_ERROR_RESOLVE;
+	}
+
+	memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path, len);
+	if (path[0] == '@')
+		addr.sun_path[0] = '\0';
+
+	socklen_t addrlen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len + (path[0] == '@' ? 0 : 1));
+
+	c->sockfd = socket_create(AF_UNIX, SOCK_STREAM, 0);
+	if (c->sockfd == INVALID_SOCKET || rtma_client_socket_connect(c, (struct sockaddr*)&addr, addrlen) == SOCKET_ERROR) {
+		if (c->sockfd != INVALID_SOCKET)
+			socket_close(c->sockfd);
+		c->sockfd = INVALID_SOCKET;
+		return RTMA_ERROR_CONNECT;
+	}
+
+	memset(&c->serv_addr, '\0', sizeof(c->serv_addr));
+	memcpy(&c->serv_addr, &addr, addrlen);
+	return RTMA_NO_ERROR;
+}
+#endif //__UNIX__
+
+// TRUE if server_name is an address of this host. The shared memory
+// rendezvous only names the port, so it would reach whatever manager runs
+// here on that port.
+static int rtma_client_is_local_address(const char* server_name) {
+	struct addrinfo hints;
+	struct addrinfo* res = NULL;
+
+	memset(&hints, '\0', sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	if (getaddrinfo(server_name, "0", &hints, &res))
+		return FALSE;
+
+	// Only addresses of local interfaces can be bound
+	sockfd_t fd = socket_create(res->ai_family, res->ai_socktype, res->ai_protocol);
+	int local = fd != INVALID_SOCKET && bind(fd, res->ai_addr, (socklen_t)res->ai_addrlen) == 0;
+	if (fd != INVALID_SOCKET)
+		socket_close(fd);
+
+	freeaddrinfo(res);
+	return local;
+}
+
+// Open the transport to the saved server and send MT_CONNECT
+static int rtma_client_open_transport(Client* c) {
+	const char* server_name = c->server_name;
+	uint16_t port = c->server_port;
+	int err = RTMA_NO_ERROR;
+
+	if (strncmp(server_name, RTMA_SHM_PREFIX, strlen(RTMA_SHM_PREFIX)) == 0) {
+		server_name += strlen(RTMA_SHM_PREFIX);
+		if (*server_name == '\0')
+			server_name = "127.0.0.1";
+
+		if (!rtma_client_is_local_address(server_name)) {
+			if (!c->reconnecting)
+				fprintf(stderr, "rtma_client_connect: %s is not a local address, using TCP.\n", server_name);
+		}
+		else {
+			c->shm = rtma_shm_connect(port, &c->sockfd);
+			if (c->shm == NULL && !c->reconnecting)
+				fprintf(stderr, "rtma_client_connect: shared memory unavailable, using TCP.\n");
+		}
+	}
+
+#ifdef __UNIX__
+	if (c->shm == NULL && (server_name[0] == '/' || server_name[0] == '@'))
+		err = rtma_client_connect_unix(c, server_name);
+#endif //__UNIX__
+
+	if (err == RTMA_NO_ERROR && c->shm == NULL && c->sockfd == INVALID_SOCKET)
+		err = rtma_client_connect_tcp(c, server_name, port);
+
+	if (err != RTMA_NO_ERROR)
+		return err;
 
 	MDF_CONNECT msg = { .logger_status = 0, .daemon_status = 0 };
 	rtma_client_send_message(c, MT_CONNECT, &msg, sizeof(MDF_CONNECT));
+	return RTMA_NO_ERROR;
+}
 
-	Message ack_msg;
-	if (rtma_client_wait_for_acknowledgement(c, &ack_msg, DEFAULT_ACK_TIMEOUT)) {
-		c->connected = 1;
+// The manager acknowledged MT_CONNECT
+static void rtma_client_accept_connect(Client* c, const RTMA_MSG_HEADER* ack) {
+	c->connected = 1;
+	c->start_time = rtma_client_get_timestamp(c);
 
-		if (c->module_id == 0) {
-			//Save own module ID from ACK if asked to be assigned dynamic ID
-			c->module_id = ack_msg.rtma_header.dest_mod_id;
-			//rtma_message_free(ack_msg);
-		}
+	if (c->module_id == 0) {
+		//Save own module ID from ACK if asked to be assigned dynamic ID
+		c->module_id = ack->dest_mod_id;
 	}
-	else {
-		rtma_destroy_client(&c);
+}
+
+// Open the transport to the saved server and announce the module. The
+// manager keeps the module id the client asks for, so after a reconnect the
+// module carries on under the same id.
+static int rtma_client_open(Client* c) {
+	int err = rtma_client_open_transport(c);
+	if (err != RTMA_NO_ERROR)
+		return err;
+
+	Message ack_msg;
+	if (!rtma_client_wait_for_acknowledgement(c, &ack_msg, DEFAULT_ACK_TIMEOUT)) {
 		fprintf(stderr, "rtma_client_connect:Failed to receive acknowledgement from server.\n");
+		rtma_client_close_transport(c);
+		return RTMA_ERROR_ACK_TIMEOUT;
 	}
 
+	rtma_client_accept_connect(c, &ack_msg.rtma_header);
 	return RTMA_NO_ERROR;
 }
 
+// server_name is one of
+//   a numeric IPv4 or IPv6 address to connect over TCP on port
+//   a path ("/tmp/rtma.sock") or abstract name ("@rtma") of a Unix domain socket
+//   "shm://" and an address, to attach over shared memory and fall back to
+//   TCP on that address if refused
+// Returns RTMA_NO_ERROR, RTMA_ERROR_ALREADY_CONNECTED, RTMA_ERROR_RESOLVE,
+// RTMA_ERROR_CONNECT or RTMA_ERROR_ACK_TIMEOUT.
+int rtma_client_connect(Client *c, char* server_name, uint16_t port) {
+	if (c->connected) {
+		fprintf(stderr, "Client already has an active connection.\n");
+		return RTMA_ERROR_ALREADY_CONNECTED;
+	}
+
+	if (strlen(server_name) >= sizeof(c->server_name)) {
+		fprintf(stderr, "rtma_client_connect: server name too long: %s\n", server_name);
+		return c->last_error = RTMA_ERROR_RESOLVE;
+	}
+
+	strcpy(c->server_name, server_name);
+	c->server_port = port;
+
+	int err = rtma_client_open(c);
+	if (err != RTMA_NO_ERROR)
+		c->last_error = err;
+
+	return err;
+}
+
+// Drop the connection and the state tied to it. The module id, the
+// subscriptions and messages already set aside in the stash are kept.
+static void rtma_client_close_transport(Client* c) {
+	if (c->outbound)
+		rtma_outbound_clear(c);
+
+	if (c->sockfd != INVALID_SOCKET) {
+		socket_close(c->sockfd);
+		c->sockfd = INVALID_SOCKET;
+	}
+	rtma_shm_close(&c->shm);
+	memset(&c->serv_addr, '\0', sizeof(c->serv_addr));
+	c->connected = 0;
+	c->recv_failed = FALSE;
+
+	// A held message must outlive what the next connection reads
+	if (c->recv_held)
+		rtma_client_retire_recv_buffer(c);
+
+	c->recv_base += c->recv_tail;
+	c->conflate_scan = c->recv_base;
+	c->recv_head = 0;
+	c->recv_tail = 0;
+	c->recv_borrowed = 0;
+	c->send_len = 0;
+	c->batch_count = 0;
+	rtma_client_reset_assemblies(c, c->large_free != NULL);
+
+	// No acknowledgement is coming over a new connection
+	for (int id = c->oldest_pending_id; id != c->next_request_id; id++) {
+		RequestRecord* r = &c->requests[id & (RTMA_REQUEST_HISTORY - 1)];
+		if (r->status == RTMA_REQUEST_PENDING)
+			r->status = RTMA_ERROR_CONNECTION_LOST;
+	}
+	c->oldest_pending_id = c->next_request_id;
+	c->expired_acks = 0;
+}
+
 void rtma_client_disconnect(Client *c) {
-	if (c == NULL)
+	if (c == NULL || (c->sockfd == INVALID_SOCKET && c->server_name[0] == '\0'))
 		return;
 
-	// Close the underlying socket
+	// Not to be undone by auto reconnect
+	c->server_name[0] = '\0';
+	free(c->subscriptions);
+	c->subscriptions = NULL;
+
 	if (c->sockfd != INVALID_SOCKET) {
+		// Stop reading before the manager hangs up on us
+		rtma_client_stop_receive_thread(c);
 		rtma_client_send_signal(c, MT_DISCONNECT);
-		socket_shutdown(c->sockfd, SD_BOTH);
-		socket_close(c->sockfd);
-		c->sockfd = INVALID_SOCKET;
-		memset(&c->serv_addr, '\0', sizeof(c->serv_addr));
-		c->module_id = 0;
-		c->host_id = 0;
-		c->start_time = 0.0;
-		c->msg_count = 0;
-		c->connected = 0;
+		rtma_client_stop_send_thread(c);
+		rtma_client_end_batch(c);
+
+		// The goodbye may have found the connection gone already
+		if (c->sockfd != INVALID_SOCKET)
+			socket_shutdown(c->sockfd, SD_BOTH);
 	}
+
+	rtma_client_close_transport(c);
+	c->reconnect_stage = RTMA_RECONNECT_IDLE;
+	c->reconnecting = FALSE;
+	c->module_id = 0;
+	c->host_id = 0;
+	c->start_time = 0.0;
+	c->msg_count = 0;
+	c->stash_head = 0;
+	c->stash_tail = 0;
+	c->stash_borrowed = 0;
 }
 
-int rtma_client_send_message_to_module(Client *c, MSG_TYPE msg_type, void* data, size_t len, int dest_mod_id, int dest_host_id, double timeout) {
-	Message msg;
-
-	msg.rtma_header.msg_type = msg_type;
-	msg.rtma_header.msg_count = ++(c->msg_count);
-	msg.rtma_header.send_time = rtma_client_get_timestamp(c);
-	msg.rtma_header.recv_time = 0.0;
-	msg.rtma_header.src_host_id = c->host_id;
-	msg.rtma_header.src_mod_id = c->module_id;
-	msg.rtma_header.dest_host_id = dest_host_id;
-	msg.rtma_header.dest_mod_id = dest_mod_id;
-	msg.rtma_header.num_data_bytes = len;
-	msg.rtma_header.is_dynamic = 0;
-	msg.rtma_header.reserved = 0;
-
-	// Copy the user data into message struct buffer.
-	if (len > 0){
-		if (len < sizeof(msg.data))
-			memcpy(msg.data, data, len);
-		else {
-			perror("rtma_client_send_message: data is too large.\n");
-			exit(1);
+// The transport failed. Stop the background threads and drop the
+// connection; with auto reconnect the next call on the client brings it back.
+// Only called from the thread that owns the client.
+void rtma_client_connection_lost(Client* c) {
+	if (c->sockfd == INVALID_SOCKET)
+		return;
+
+	fprintf(stderr, "Connection has been closed.\n");
+	c->last_error = RTMA_ERROR_CONNECTION_LOST;
+
+	rtma_client_stop_receive_thread(c);
+	rtma_client_stop_send_thread(c);
+	rtma_client_close_transport(c);
+}
+
+// Remember what a control message asks of the manager, for replay after a
+// reconnect. ALL_MESSAGE_TYPES is kept in the slot after the last type.
+static void rtma_client_track_subscription(Client* c, MSG_TYPE ctrl_type, MSG_TYPE msg_type) {
+	int index = msg_type == ALL_MESSAGE_TYPES ? MAX_MESSAGE_TYPES : msg_type;
+
+	if (index < 0 || index > MAX_MESSAGE_TYPES)
+		return;
+
+	if (c->subscriptions == NULL) {
+		if (ctrl_type != MT_SUBSCRIBE)
+			return;
+
+		c->subscriptions = (unsigned char*)calloc(MAX_MESSAGE_TYPES + 1, 1);
+		if (c->subscriptions == NULL) {
+			perror("rtma_client_subscribe:calloc failed");
+			return;
 		}
 	}
 
-	struct timeval wait, * pWait;
-	if (timeout < 0) { // Negative timeout value means we are willing to wait forever
-		pWait = NULL;
+	unsigned char* state = &c->subscriptions[index];
+
+	switch (ctrl_type) {
+	case MT_SUBSCRIBE:
+		*state = RTMA_SUBSCRIPTION_ACTIVE;
+		break;
+	case MT_UNSUBSCRIBE:
+		*state = RTMA_SUBSCRIPTION_NONE;
+		break;
+	case MT_PAUSE_SUBSCRIPTION:
+		if (*state == RTMA_SUBSCRIPTION_ACTIVE)
+			*state = RTMA_SUBSCRIPTION_PAUSED;
+		break;
+	case MT_RESUME_SUBSCRIPTION:
+		if (*state == RTMA_SUBSCRIPTION_PAUSED)
+			*state = RTMA_SUBSCRIPTION_ACTIVE;
+		break;
 	}
-	else {
-		wait.tv_sec = (long)timeout;
-		double remainder = timeout - ((double)(wait.tv_sec));
-		wait.tv_usec = (long)(remainder * 1000000.0);
-		pWait = &wait;
+}
+
+// Send the requests restoring the subscriptions of the types from *next on
+// as one batch, stopping after about RTMA_REQUEST_HISTORY / 2 so that none
+// drops out of the history before it is checked. Acknowledgements update the
+// table, but only for types already sent.
+static void rtma_client_replay_batch(Client* c, int* next) {
+	int was_batching = c->batching;
+	int first_id = c->next_request_id;
+	int i = *next;
+
+	if (c->subscriptions == NULL) {
+		*next = MAX_MESSAGE_TYPES + 1;
+		return;
 	}
 
-	fd_set writefds;
-	FD_ZERO(&writefds);
-	FD_SET(c->sockfd, &writefds);
-	int nfds = c->sockfd + 1;
+	rtma_client_begin_batch(c);
+	for (; i <= MAX_MESSAGE_TYPES && c->next_request_id - first_id < RTMA_REQUEST_HISTORY / 2; i++) {
+		int state = c->subscriptions[i];
+		MSG_TYPE msg = i == MAX_MESSAGE_TYPES ? ALL_MESSAGE_TYPES : i;
 
-	int nbytes = 0;
+		if (state == RTMA_SUBSCRIPTION_NONE)
+			continue;
 
-	// Wait for socket
-	int status = select(nfds, NULL, &writefds, NULL, pWait);
+		rtma_client_send_request(c, MT_SUBSCRIBE, &msg, sizeof(msg), DEFAULT_ACK_TIMEOUT);
+		if (state == RTMA_SUBSCRIPTION_PAUSED)
+			rtma_client_send_request(c, MT_PAUSE_SUBSCRIPTION, &msg, sizeof(msg), DEFAULT_ACK_TIMEOUT);
+	}
+	*next = i;
 
-	if (status == SOCKET_ERROR)
-		socket_error();
-	if (status == 0)
-		return NO_MESSAGE;
-	if (status > 0) {
-		if (FD_ISSET(c->sockfd, &writefds)) {
-			nbytes = socket_sendall(c->sockfd, (char*)&msg, sizeof(msg.rtma_header) + len, 0);
-		}
-		else {
-			//Socket could not accept data without blocking, data discarded!
-			printf("x");
-		}
+	if (was_batching)
+		rtma_client_flush(c);
+	else
+		rtma_client_end_batch(c);
+}
+
+static int rtma_client_count_failed_requests(Client* c, int first_id, int last_id) {
+	int num_failed = 0;
+
+	for (int id = first_id; id <= last_id; id++) {
+		if (rtma_client_poll_request(c, id) != RTMA_NO_ERROR)
+			num_failed++;
 	}
 
-	return nbytes;
+	return num_failed;
 }
 
-int rtma_client_send_signal_to_module(Client* c, Signal sig_type, int dest_mod_id, int dest_host_id, double timeout) {
-	return rtma_client_send_message_to_module(c, sig_type, NULL, 0, dest_mod_id, dest_host_id, timeout);
+// Subscribe again to everything that was subscribed, and pause what was
+// paused, as batches of pipelined requests. Costs about one round trip per
+// RTMA_REQUEST_HISTORY / 2 types. Returns the number of failed requests.
+static int rtma_client_replay_subscriptions(Client* c) {
+	int num_failed = 0;
+	int next = 0;
+
+	while (next <= MAX_MESSAGE_TYPES && c->connected) {
+		int first_id = c->next_request_id;
+
+		rtma_client_replay_batch(c, &next);
+
+		int last_id = c->next_request_id - 1;
+		if (last_id < first_id)
+			break;
+
+		// Requests are acknowledged in order, so waiting on the last one covers all
+		rtma_client_wait_for_request(c, last_id, DEFAULT_ACK_TIMEOUT);
+		num_failed += rtma_client_count_failed_requests(c, first_id, last_id);
+	}
+
+	return num_failed;
 }
 
-int rtma_client_send_message(Client* c, MSG_TYPE msg_type, void* data, size_t len) {
-	return rtma_client_send_message_to_module(c, msg_type, data, len, MID_MESSAGE_MANAGER, HID_LOCAL_HOST, BLOCKING);
+// Connect again to the server of the last rtma_client_connect under the same
+// module id and replay the subscriptions. Attempts back off exponentially
+// from RTMA_RECONNECT_MIN_BACKOFF to RTMA_RECONNECT_MAX_BACKOFF until timeout
+// runs out; a timeout of 0 makes a single attempt and BLOCKING keeps trying.
+int rtma_client_reconnect(Client* c, double timeout) {
+	if (c->connected)
+		return RTMA_NO_ERROR;
+
+	if (c->server_name[0] == '\0') {
+		fprintf(stderr, "rtma_client_reconnect: client was never connected.\n");
+		return c->last_error = RTMA_ERROR_NOT_CONNECTED;
+	}
+
+	double start = rtma_time_now(RTMA_CLOCK_MONOTONIC);
+	double backoff = RTMA_RECONNECT_MIN_BACKOFF;
+	int err;
+
+	c->reconnecting = TRUE;
+	for (;;) {
+		err = rtma_client_open(c);
+		if (err == RTMA_NO_ERROR) {
+			if (rtma_client_replay_subscriptions(c) > 0)
+				fprintf(stderr, "rtma_client_reconnect: not all subscriptions were restored.\n");
+
+			// Lost again while replaying
+			if (c->connected)
+				break;
+			err = RTMA_ERROR_CONNECTION_LOST;
+		}
+
+		double elapsed = rtma_time_now(RTMA_CLOCK_MONOTONIC) - start;
+		if (timeout >= 0 && elapsed + backoff > timeout)
+			break;
+
+		rtma_thread_sleep(backoff);
+		backoff *= 2;
+		if (backoff > RTMA_RECONNECT_MAX_BACKOFF)
+			backoff = RTMA_RECONNECT_MAX_BACKOFF;
+	}
+	c->reconnecting = FALSE;
+
+	if (err != RTMA_NO_ERROR)
+		return c->last_error = err;
+
+	c->reconnects++;
+	return RTMA_NO_ERROR;
 }
 
-int rtma_client_send_signal(Client *c, Signal sig_type) {
-	return rtma_client_send_signal_to_module(c, sig_type, NULL, 0, MID_MESSAGE_MANAGER, HID_LOCAL_HOST, BLOCKING);
+static int rtma_client_reconnect_failed(Client* c, int err) {
+	if (c->sockfd != INVALID_SOCKET)
+		rtma_client_close_transport(c);
+
+	c->reconnect_stage = RTMA_RECONNECT_IDLE;
+	c->reconnecting = FALSE;
+	return c->last_error = err;
 }
 
-int rtma_client_read_message(Client *c, Message *msg, double timeout) {
-	struct timeval wait, * pWait;
-	if (timeout < 0) { // Negative timeout value means we are willing to wait forever
-		pWait = NULL;
+// One attempt of rtma_client_reconnect, driven by repeated calls instead of
+// waits. Only what has already arrived is read, the caller polls the
+// descriptor and calls again when it is readable or reconnect_deadline has
+// passed. reconnecting stays set throughout, so sends made in the meantime
+// fail rather than start an attempt of their own.
+int rtma_client_reconnect_step(Client* c) {
+	MessageView view;
+
+	switch (c->reconnect_stage) {
+	case RTMA_RECONNECT_IDLE: {
+		if (c->connected)
+			return RTMA_NO_ERROR;
+
+		if (c->server_name[0] == '\0')
+			return c->last_error = RTMA_ERROR_NOT_CONNECTED;
+
+		c->reconnecting = TRUE;
+		int err = rtma_client_open_transport(c);
+		if (err != RTMA_NO_ERROR)
+			return rtma_client_reconnect_failed(c, err);
+
+		c->reconnect_stage = RTMA_RECONNECT_ACK;
+		c->reconnect_deadline = rtma_client_get_timestamp(c) + DEFAULT_ACK_TIMEOUT;
 	}
-	else {
-		wait.tv_sec = (long)timeout;
-		double remainder = timeout - ((double)(wait.tv_sec));
-		wait.tv_usec = (long)(remainder * 1000000.0);
-		pWait = &wait;
-	}
-
-	//Setup select file descriptors
-	fd_set readfds;
-	FD_ZERO(&readfds);
-	FD_SET(c->sockfd, &readfds);
-	int nfds = c->sockfd + 1; //This argument is ignored in windows
-
-	// Wait for message header
-	int status = select(nfds, &readfds, NULL, NULL, pWait);
-	if (status == SOCKET_ERROR)
-		socket_error();
-	if (status == 0)
-		return NO_MESSAGE;
-	if (status > 0) {
-		if (FD_ISSET(c->sockfd, &readfds)) {
-			int bytes_left = sizeof(RTMA_MSG_HEADER);
-			char* buf = (char*)&(msg->rtma_header);
-			int bytes_read = socket_recv(c->sockfd, buf, bytes_left, MSG_WAITALL);
-
-			if (bytes_read != bytes_left) {
-				fprintf(stderr, "Something went wrong in recv:header\n");
-				exit(-1);
+	// Fall through, the acknowledgement may be in already
+	case RTMA_RECONNECT_ACK:
+		while (c->reconnect_stage == RTMA_RECONNECT_ACK && rtma_client_read_socket_frame(c, &view, NONBLOCKING, FALSE)) {
+			if (view.rtma_header.msg_type == MT_ACKNOWLEDGE) {
+				rtma_client_accept_connect(c, &view.rtma_header);
+				c->reconnect_stage = RTMA_RECONNECT_REPLAY;
+				c->replay_next = 0;
+				c->replay_first_id = c->next_request_id;
+				c->replay_last_id = c->replay_first_id - 1;
+				c->replay_failed = 0;
 			}
+			else {
+				rtma_client_stash_message(c, &view);
+			}
+			rtma_client_release_transport(c);
 		}
-		else
-			return NO_MESSAGE;
-	}
 
-	// Check for data portion of message (Always blocking)
-	if (msg->rtma_header.num_data_bytes > 0) {
-		int bytes_left = msg->rtma_header.num_data_bytes;
-		char* buf = msg->data;
-		int bytes_read = socket_recv(c->sockfd, buf, bytes_left, MSG_WAITALL);
-		
-		if (bytes_read != bytes_left) {
-			fprintf(stderr, "Something went wrong recv:data\n");
-			exit(-1);
+		if (c->reconnect_stage == RTMA_RECONNECT_ACK) {
+			if (c->sockfd == INVALID_SOCKET)
+				return rtma_client_reconnect_failed(c, RTMA_ERROR_CONNECTION_LOST);
+
+			if (rtma_client_get_timestamp(c) > c->reconnect_deadline) {
+				fprintf(stderr, "rtma_client_connect:Failed to receive acknowledgement from server.\n");
+				return rtma_client_reconnect_failed(c, RTMA_ERROR_ACK_TIMEOUT);
+			}
+			return RTMA_REQUEST_PENDING;
 		}
+	// Fall through
+	case RTMA_RECONNECT_REPLAY:
+		for (;;) {
+			if (!c->connected)
+				return rtma_client_reconnect_failed(c, RTMA_ERROR_CONNECTION_LOST);
+
+			// The batch in flight, acknowledged in order
+			if (c->replay_last_id >= c->replay_first_id) {
+				if (rtma_client_poll_request(c, c->replay_last_id) == RTMA_REQUEST_PENDING)
+					return RTMA_REQUEST_PENDING;
+				c->replay_failed += rtma_client_count_failed_requests(c, c->replay_first_id, c->replay_last_id);
+			}
 
+			if (c->replay_next > MAX_MESSAGE_TYPES)
+				break;
+
+			c->replay_first_id = c->next_request_id;
+			rtma_client_replay_batch(c, &c->replay_next);
+			c->replay_last_id = c->next_request_id - 1;
+			c->reconnect_deadline = rtma_client_get_timestamp(c) + DEFAULT_ACK_TIMEOUT;
+		}
+		break;
 	}
 
-	// Add timestamp to header
-	msg->rtma_header.recv_time = rtma_client_get_timestamp(c);
+	if (c->replay_failed > 0)
+		fprintf(stderr, "rtma_client_reconnect: not all subscriptions were restored.\n");
 
-	return GOT_MESSAGE;
+	c->reconnect_stage = RTMA_RECONNECT_IDLE;
+	c->reconnecting = FALSE;
+	c->reconnects++;
+	return RTMA_NO_ERROR;
 }
 
-int rtma_client_wait_for_acknowledgement(Client *c, Message *msg, double timeout) {
-	double start = rtma_client_get_timestamp(c);
-	double time_remaining = start;
+// With auto reconnect on, a lost connection is re-established by the next
+// send or read, which keeps trying for up to timeout seconds (BLOCKING for
+// no limit) or its own timeout, whichever is shorter. For a client in an
+// event loop the loop does it without blocking. Not available with the send
+// or receive thread.
+int rtma_client_set_auto_reconnect(Client* c, int enable, double timeout) {
+	if (enable && (c->send_queue != NULL || c->recv_queue != NULL)) {
+		fprintf(stderr, "rtma_client_set_auto_reconnect: not available with the send or receive thread.\n");
+		return -1;
+	}
 
-	//printf("Waiting for Ack...\n");
+	c->auto_reconnect = enable;
+	c->reconnect_timeout = timeout;
+	return 0;
+}
 
-	while (time_remaining > 0) {
-		if (rtma_client_read_message(c, msg, 3.0)) {
-			if (msg->rtma_header.msg_type == MT_ACKNOWLEDGE) {
-				//printf("Got ACK!\n");
-				return GOT_MESSAGE;
-			}
-		}
-		double time_waited = rtma_client_get_timestamp(c) - start;
-		time_remaining = timeout - time_waited;
+// RTMA_ERROR_* of the last failed call, RTMA_NO_ERROR if none has failed
+int rtma_client_get_last_error(Client* c) {
+	return c->last_error;
+}
+
+// TRUE once the transport is gone and it is up to auto reconnect, if
+// enabled, to bring it back. Updates timeout by the time spent reconnecting.
+static int rtma_client_transport_closed(Client* c, double* timeout) {
+	if (c->sockfd != INVALID_SOCKET)
+		return FALSE;
+
+	if (!c->auto_reconnect || c->reconnecting || c->reconnect_in_steps || c->server_name[0] == '\0') {
+		if (c->last_error == RTMA_NO_ERROR)
+			c->last_error = RTMA_ERROR_NOT_CONNECTED;
+		return TRUE;
 	}
 
-	return NO_MESSAGE;
+	double start = rtma_time_now(RTMA_CLOCK_MONOTONIC);
+	double window = c->reconnect_timeout;
+	if (*timeout >= 0 && (window < 0 || *timeout < window))
+		window = *timeout;
+
+	int err = rtma_client_reconnect(c, window);
+
+	if (*timeout > 0) {
+		*timeout -= rtma_time_now(RTMA_CLOCK_MONOTONIC) - start;
+		if (*timeout < 0)
+			*timeout = 0;
+	}
+
+	return err != RTMA_NO_ERROR;
 }
 
-void rtma_client_send_module_ready(Client *c) {
-	MDF_MODULE_READY msg;
-	msg.pid = c->pid;
-	rtma_client_send_message(c, MT_MODULE_READY, &msg, sizeof(msg));
+// Returns SOCKET_ERROR if the connection is gone. The send thread leaves it
+// to the owning thread to notice on its next call.
+int rtma_client_writev(Client* c, socket_iovec_t* iov, int iovcnt) {
+	int nbytes;
+
+	if (c->sockfd == INVALID_SOCKET)
+		return SOCKET_ERROR;
+
+	if (c->shm == NULL) {
+		nbytes = socket_sendallv(c->sockfd, iov, iovcnt, 0);
+	}
+	else {
+		size_t len = 0;
+		for (int i = 0; i < iovcnt; i++)
+			len += SOCKET_IOVEC_LEN(iov[i]);
+
+		nbytes = rtma_shm_writev(c->shm, iov, iovcnt);
+		if ((size_t)nbytes < len)
+			nbytes = SOCKET_ERROR;
+	}
+
+	if (nbytes == SOCKET_ERROR && c->send_queue == NULL)
+		rtma_client_connection_lost(c);
+
+	return nbytes;
 }
 
-void rtma_client_subscribe(Client *c, MSG_TYPE msg_type) {
-	MDF_SUBSCRIBE msg = msg_type;
-	rtma_client_send_message(c, MT_SUBSCRIBE, &msg, sizeof(msg));
-	Message ack_msg;
-	rtma_client_wait_for_acknowledgement(c, &ack_msg, DEFAULT_ACK_TIMEOUT);
+// Write what the transport takes without blocking. Returns the number of
+// bytes written, SOCKET_ERROR if the connection is gone.
+int rtma_client_try_writev(Client* c, socket_iovec_t* iov, int iovcnt) {
+	int nbytes = 0;
+
+	if (c->sockfd == INVALID_SOCKET)
+		return SOCKET_ERROR;
+
+	if (c->shm == NULL)
+		return socket_trysendv(c->sockfd, iov, iovcnt);
+
+	for (int i = 0; i < iovcnt; i++) {
+		size_t len = SOCKET_IOVEC_LEN(iov[i]);
+		size_t n = rtma_shm_write(c->shm, SOCKET_IOVEC_BASE(iov[i]), len);
+		nbytes += (int)n;
+		if (n < len)
+			break;
+	}
+
+	if (nbytes > 0)
+		rtma_shm_notify(c->shm);
+
+	return nbytes;
 }
 
-void rtma_client_unsubscribe(Client *c, MSG_TYPE msg_type) {
-	MDF_UNSUBSCRIBE msg = msg_type;
-	rtma_client_send_message(c, MT_UNSUBSCRIBE, &msg, sizeof(msg));
-	Message ack_msg;
-	rtma_client_wait_for_acknowledgement(c, &ack_msg, DEFAULT_ACK_TIMEOUT);
+int rtma_client_wait(Client* c, int events, double timeout) {
+	if (c->shm)
+		return rtma_shm_wait(c->shm, events, timeout);
+
+	return socket_wait(c->sockfd, events, timeout);
 }
 
-void rtma_client_resume_subscription(Client *c, MSG_TYPE msg_type) {
-	MDF_RESUME_SUBSCRIPTION msg = msg_type;
-	rtma_client_send_message(c, MT_RESUME_SUBSCRIPTION, &msg, sizeof(msg));
-	Message ack_msg;
-	rtma_client_wait_for_acknowledgement(c, &ack_msg, DEFAULT_ACK_TIMEOUT);
+// Descriptor to wait on for incoming messages, for callers running their own
+// poll or epoll loop
+sockfd_t rtma_client_get_fd(Client* c) {
+	if (c->shm)
+		return rtma_shm_fd(c->shm);
+
+	return c->sockfd;
 }
 
-void rtma_client_pause_subscription(Client *c, MSG_TYPE msg_type) {
-	MDF_PAUSE_SUBSCRIPTION msg = msg_type;
-	rtma_client_send_message(c, MT_PAUSE_SUBSCRIPTION, &msg, sizeof(msg));
-	Message ack_msg;
-	rtma_client_wait_for_acknowledgement(c, &ack_msg, DEFAULT_ACK_TIMEOUT);
+void rtma_client_begin_batch(Client* c) {
+	c->batching = 1;
+}
+
+// Auto-flush limits for batching mode. Zero disables the count and delay
+// limits. The byte limit is always capped by the size of the send buffer.
+void rtma_client_set_batch_limits(Client* c, size_t max_bytes, int max_count, double max_delay) {
+	if (max_bytes == 0 || max_bytes > c->send_buf_size)
+		max_bytes = c->send_buf_size;
+
+	c->batch_max_bytes = max_bytes;
+	c->batch_max_count = max_count;
+	c->batch_max_delay = max_delay;
+}
+
+// Write out all batched messages with as few send calls as the socket allows
+int rtma_client_flush(Client* c) {
+	if (c->send_queue) {
+		if (rtma_send_queue_drain(c, BLOCKING) != SOCKET_ERROR)
+			return 0;
+		rtma_client_connection_lost(c);
+		return SOCKET_ERROR;
+	}
+
+	if (c->outbound)
+		return rtma_outbound_drain(c);
+
+	if (c->send_len == 0)
+		return 0;
+
+	socket_iovec_t iov;
+	SOCKET_IOVEC_SET(iov, c->send_buf, c->send_len);
+	int nbytes = rtma_client_writev(c, &iov, 1);
+
+	c->send_len = 0;
+	c->batch_count = 0;
+
+	return nbytes;
+}
+
+int rtma_client_end_batch(Client* c) {
+	c->batching = 0;
+	return rtma_client_flush(c);
+}
+
+static int rtma_client_append_to_batch(Client* c, socket_iovec_t* iov, int iovcnt, size_t len) {
+	if (c->send_len + len > c->batch_max_bytes)
+		rtma_client_flush(c);
+
+	if (c->batch_count == 0)
+		c->batch_start_time = rtma_client_get_timestamp(c);
+
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(c->send_buf + c->send_len, SOCKET_IOVEC_BASE(iov[i]), SOCKET_IOVEC_LEN(iov[i]));
+		c->send_len += SOCKET_IOVEC_LEN(iov[i]);
+	}
+	c->batch_count++;
+
+	if ((c->batch_max_count > 0 && c->batch_count >= c->batch_max_count) ||
+		(c->batch_max_delay > 0 && rtma_client_get_timestamp(c) - c->batch_start_time >= c->batch_max_delay))
+		rtma_client_flush(c);
+
+	return (int)len;
+}
+
+// Split a payload larger than MAX_DATA_BYTES into dynamic message fragments.
+// Every fragment repeats the message header with its own num_data_bytes and
+// the number of bytes still to follow in remaining_bytes. Fragments are
+// gathered straight from the caller's segments, several fragments per write.
+static int rtma_client_send_fragments(Client* c, const RTMA_MSG_HEADER* header, const DataSegment* segments) {
+	RTMA_MSG_HEADER headers[RTMA_FRAGMENTS_PER_WRITE];
+	socket_iovec_t iov[RTMA_FRAGMENTS_PER_WRITE * (RTMA_MAX_SEGMENTS + 1)];
+	size_t remaining = header->num_data_bytes;
+	int is_dynamic = RTMA_DYNAMIC_FIRST;
+	int seg = 0;
+	size_t seg_offset = 0;
+	int nbytes = 0;
+
+	while (remaining > 0) {
+		int iovcnt = 0;
+		int num_fragments = 0;
+
+		while (remaining > 0 && num_fragments < RTMA_FRAGMENTS_PER_WRITE) {
+			size_t fragment_len = remaining < MAX_DATA_BYTES ? remaining : MAX_DATA_BYTES;
+			remaining -= fragment_len;
+
+			RTMA_MSG_HEADER* h = &headers[num_fragments++];
+			*h = *header;
+			h->num_data_bytes = (int)fragment_len;
+			h->remaining_bytes = (int)remaining;
+			h->is_dynamic = is_dynamic;
+			is_dynamic = RTMA_DYNAMIC_NEXT;
+			SOCKET_IOVEC_SET(iov[iovcnt], h, sizeof(RTMA_MSG_HEADER));
+			iovcnt++;
+
+			while (fragment_len > 0) {
+				size_t n = segments[seg].len - seg_offset;
+				if (n > fragment_len)
+					n = fragment_len;
+
+				if (n > 0) {
+					SOCKET_IOVEC_SET(iov[iovcnt], (const char*)segments[seg].data + seg_offset, n);
+					iovcnt++;
+				}
+
+				fragment_len -= n;
+				seg_offset += n;
+				if (seg_offset == segments[seg].len) {
+					seg++;
+					seg_offset = 0;
+				}
+			}
+		}
+
+		int n = rtma_client_writev(c, iov, iovcnt);
+		if (n == SOCKET_ERROR)
+			return SOCKET_ERROR;
+		nbytes += n;
+	}
+
+	return nbytes;
+}
+
+int rtma_client_send_segments_to_module(Client* c, MSG_TYPE msg_type, const DataSegment* segments, int num_segments, int dest_mod_id, int dest_host_id, double timeout) {
+	RTMA_MSG_HEADER header;
+	socket_iovec_t iov[RTMA_MAX_SEGMENTS + 1];
+	size_t len = 0;
+
+	if (num_segments > RTMA_MAX_SEGMENTS) {
+		fprintf(stderr, "rtma_client_send_message: too many data segments.\n");
+		return SOCKET_ERROR;
+	}
+
+	if (rtma_client_transport_closed(c, &timeout))
+		return SOCKET_ERROR;
+
+	// Header and payload segments are gathered straight from the caller's buffers
+	SOCKET_IOVEC_SET(iov[0], &header, sizeof(header));
+	for (int i = 0; i < num_segments; i++) {
+		SOCKET_IOVEC_SET(iov[i + 1], segments[i].data, segments[i].len);
+		len += segments[i].len;
+	}
+
+	header.msg_type = msg_type;
+	header.msg_count = rtma_atomic_add(&c->msg_count, 1);
+	header.send_time = rtma_client_get_timestamp(c);
+	header.recv_time = 0.0;
+	header.src_host_id = c->host_id;
+	header.src_mod_id = c->module_id;
+	header.dest_host_id = dest_host_id;
+	header.dest_mod_id = dest_mod_id;
+	header.num_data_bytes = (int)len;
+	header.remaining_bytes = 0;
+	header.is_dynamic = 0;
+	header.reserved = 0;
+
+	if (c->send_queue)
+		return rtma_send_queue_push(c, &header, segments, num_segments, timeout);
+
+	if (c->outbound)
+		return rtma_outbound_push(c, &header, segments, num_segments, timeout);
+
+	if (c->batching && len <= MAX_DATA_BYTES)
+		return rtma_client_append_to_batch(c, iov, num_segments + 1, sizeof(header) + len);
+
+	// Large messages bypass the batch but must not overtake it
+	rtma_client_flush(c);
+
+	int nbytes = 0;
+
+	// Wait for socket
+	if (!rtma_client_wait(c, SOCKET_WAIT_WRITE, timeout))
+		return NO_MESSAGE;
+
+	if (len > MAX_DATA_BYTES)
+		nbytes = rtma_client_send_fragments(c, &header, segments);
+	else
+		nbytes = rtma_client_writev(c, iov, num_segments + 1);
+
+	return nbytes;
+}
+
+int rtma_client_send_message_to_module(Client *c, MSG_TYPE msg_type, void* data, size_t len, int dest_mod_id, int dest_host_id, double timeout) {
+	DataSegment segment = { data, len };
+	return rtma_client_send_segments_to_module(c, msg_type, &segment, len > 0 ? 1 : 0, dest_mod_id, dest_host_id, timeout);
+}
+
+int rtma_client_send_signal_to_module(Client* c, Signal sig_type, int dest_mod_id, int dest_host_id, double timeout) {
+	return rtma_client_send_message_to_module(c, sig_type, NULL, 0, dest_mod_id, dest_host_id, timeout);
+}
+
+int rtma_client_send_message(Client* c, MSG_TYPE msg_type, void* data, size_t len) {
+	return rtma_client_send_message_to_module(c, msg_type, data, len, MID_MESSAGE_MANAGER, HID_LOCAL_HOST, BLOCKING);
+}
+
+int rtma_client_send_signal(Client *c, Signal sig_type) {
+	return rtma_client_send_signal_to_module(c, sig_type, MID_MESSAGE_MANAGER, HID_LOCAL_HOST, BLOCKING);
+}
+
+// Returns the next complete message in the receive buffer after the one
+// currently lent out, or NULL if the buffer only holds a partial message
+// (or nothing at all).
+static char* rtma_client_next_frame(Client* c) {
+	size_t head = c->recv_head + c->recv_borrowed;
+	size_t nbytes = c->recv_tail - head;
+
+	if (nbytes < sizeof(RTMA_MSG_HEADER))
+		return NULL;
+
+	char* frame = c->recv_buf + head;
+
+	// The frame may not be aligned for a direct RTMA_MSG_HEADER access
+	int num_data_bytes;
+	memcpy(&num_data_bytes, frame + offsetof(RTMA_MSG_HEADER, num_data_bytes), sizeof(num_data_bytes));
+
+	// Out of step with the stream, nothing after this can be trusted
+	if (num_data_bytes < 0 || num_data_bytes > MAX_DATA_BYTES) {
+		fprintf(stderr, "Something went wrong in recv:header\n");
+		c->recv_failed = TRUE;
+		return NULL;
+	}
+
+	if (nbytes < sizeof(RTMA_MSG_HEADER) + num_data_bytes)
+		return NULL;
+
+	return frame;
+}
+
+// Note the stream position of the newest message of each conflated type
+// among the complete frames that arrived since the last call
+static void rtma_client_index_conflated(Client* c) {
+	long long start = c->conflate_scan - c->recv_base;
+	size_t offset = start > (long long)c->recv_head ? (size_t)start : c->recv_head;
+	RTMA_MSG_HEADER h;
+
+	while (c->recv_tail - offset >= sizeof(RTMA_MSG_HEADER)) {
+		memcpy(&h, c->recv_buf + offset, sizeof(RTMA_MSG_HEADER));
+		if (h.num_data_bytes < 0 || h.num_data_bytes > MAX_DATA_BYTES)
+			break;
+
+		size_t len = sizeof(RTMA_MSG_HEADER) + h.num_data_bytes;
+		if (c->recv_tail - offset < len)
+			break;
+
+		if (!h.is_dynamic && h.msg_type >= 0 && h.msg_type < MAX_MESSAGE_TYPES && c->conflate_latest[h.msg_type] >= 0)
+			c->conflate_latest[h.msg_type] = c->recv_base + offset;
+
+		offset += len;
+	}
+
+	c->conflate_scan = c->recv_base + offset;
+}
+
+// TRUE if a newer message of the same conflated type has been received
+// after the one at stream position pos
+static int rtma_client_superseded(Client* c, const RTMA_MSG_HEADER* h, long long pos) {
+	return c->conflate_latest && !h->is_dynamic && h->msg_type >= 0 && h->msg_type < MAX_MESSAGE_TYPES &&
+		c->conflate_latest[h->msg_type] > pos;
+}
+
+// Spin on non-blocking reads for up to the busy poll budget, and never past
+// timeout, before the caller falls back to blocking. Returns the number of
+// bytes read, 0 if nothing came in. timeout is reduced by the time spent.
+static int rtma_client_busy_poll_recv(Client* c, char* buf, int len, double* timeout) {
+	double budget = c->busy_poll;
+	if (*timeout > 0 && *timeout < budget)
+		budget = *timeout;
+
+	double start = rtma_time_now(RTMA_CLOCK_MONOTONIC);
+	double elapsed = 0.0;
+
+	do {
+		if (c->shm) {
+			if (rtma_shm_readable(c->shm))
+				return (int)rtma_shm_read(c->shm, buf, len);
+		}
+		else {
+#ifdef __WINDOWS__
+			if (socket_wait(c->sockfd, SOCKET_WAIT_READ, 0))
+				return socket_recv(c->sockfd, buf, len, 0);
+#else
+			ssize_t nbytes = recv(c->sockfd, buf, len, MSG_DONTWAIT);
+			if (nbytes > 0)
+				return (int)nbytes;
+
+			// Let the blocking read report a closed connection or an error
+			if (nbytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+				return socket_recv(c->sockfd, buf, len, 0);
+#endif
+		}
+
+		rtma_cpu_relax();
+		elapsed = rtma_time_now(RTMA_CLOCK_MONOTONIC) - start;
+	} while (elapsed < budget);
+
+	if (*timeout > 0)
+		*timeout = *timeout > elapsed ? *timeout - elapsed : 0.0;
+
+	return 0;
+}
+
+// Continue in a new receive buffer and keep the old one, which still holds
+// the held message, until that is released
+static void rtma_client_retire_recv_buffer(Client* c) {
+	char* buf = (char*)malloc(c->recv_buf_size);
+	if (buf == NULL) {
+		perror("rtma_client_read_message:malloc failed");
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(buf, c->recv_buf + c->recv_head, c->recv_tail - c->recv_head);
+	free(c->recv_retired);
+	c->recv_retired = c->recv_buf;
+	c->recv_buf = buf;
+	c->recv_base += c->recv_head;
+	c->recv_tail -= c->recv_head;
+	c->recv_head = 0;
+	c->recv_held = FALSE;
+}
+
+// Wait up to timeout for the socket to become readable and then pull in as
+// many bytes as the kernel has queued with a single recv call. Returns
+// RTMA_CONNECTION_LOST once the connection is gone.
+static int rtma_client_fill_recv_buffer(Client* c, double timeout) {
+	if (c->recv_failed)
+		return RTMA_CONNECTION_LOST;
+
+	// Move any partial message to the front of the buffer to make room. A
+	// held message pins the buffer, which is swapped for a new one instead.
+	if (c->recv_held) {
+		if (c->recv_buf_size - c->recv_tail < sizeof(Message))
+			rtma_client_retire_recv_buffer(c);
+	}
+	else if (c->recv_head == c->recv_tail) {
+		c->recv_base += c->recv_head;
+		c->recv_head = 0;
+		c->recv_tail = 0;
+	}
+	else if (c->recv_buf_size - c->recv_tail < sizeof(Message)) {
+		memmove(c->recv_buf, c->recv_buf + c->recv_head, c->recv_tail - c->recv_head);
+		c->recv_base += c->recv_head;
+		c->recv_tail -= c->recv_head;
+		c->recv_head = 0;
+	}
+
+	int len = (int)(c->recv_buf_size - c->recv_tail);
+	int bytes_read = 0;
+
+	if (c->busy_poll > 0 && timeout != 0)
+		bytes_read = rtma_client_busy_poll_recv(c, c->recv_buf + c->recv_tail, len, &timeout);
+
+	if (bytes_read == 0) {
+		if (!rtma_client_wait(c, SOCKET_WAIT_READ, timeout))
+			return NO_MESSAGE;
+
+		// The socket is readable so this returns whatever is available
+		// without blocking, and nothing only once the peer is gone
+		if (c->shm)
+			bytes_read = (int)rtma_shm_read(c->shm, c->recv_buf + c->recv_tail, len);
+		else
+			bytes_read = socket_recv(c->sockfd, c->recv_buf + c->recv_tail, len, 0);
+
+		if (bytes_read == 0)
+			bytes_read = SOCKET_ERROR;
+	}
+
+	if (bytes_read == SOCKET_ERROR) {
+		c->recv_failed = TRUE;
+		return RTMA_CONNECTION_LOST;
+	}
+	c->recv_tail += bytes_read;
+
+	if (c->conflate_latest)
+		rtma_client_index_conflated(c);
+
+	return GOT_MESSAGE;
+}
+
+// Assembly collecting the fragments of the message h belongs to, NULL if none
+static MessageAssembly* rtma_client_find_assembly(Client* c, const RTMA_MSG_HEADER* h, int* idx) {
+	for (int i = 0; i < RTMA_MAX_ASSEMBLIES; i++) {
+		MessageAssembly* p = &c->assemblies[i];
+		if (p->active &&
+			p->header.msg_count == h->msg_count &&
+			p->header.msg_type == h->msg_type &&
+			p->header.src_mod_id == h->src_mod_id &&
+			p->header.src_host_id == h->src_host_id) {
+			*idx = i;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+// Route a dynamic message fragment into its reassembly buffer. Returns
+// GOT_MESSAGE and points view at the whole message once the last fragment
+// has arrived. The fragment is consumed from the receive buffer either way.
+static int rtma_client_assemble_fragment(Client* c, MessageView* view, const char* data) {
+	RTMA_MSG_HEADER* h = &view->rtma_header;
+	MessageAssembly* a = NULL;
+	int idx;
+
+	if (h->is_dynamic == RTMA_DYNAMIC_FIRST) {
+		if (h->remaining_bytes < 0) {
+			fprintf(stderr, "rtma_client_read_message: bad dynamic message size, message dropped.\n");
+			rtma_client_release_frame(c);
+			return NO_MESSAGE;
+		}
+
+		// A new first fragment from the same sender starts the message over
+		a = rtma_client_find_assembly(c, h, &idx);
+
+		for (int i = 0; a == NULL && i < RTMA_MAX_ASSEMBLIES; i++) {
+			if (!c->assemblies[i].active && i != c->assembly_held) {
+				a = &c->assemblies[i];
+				idx = i;
+			}
+		}
+
+		// Give up on the message that started longest ago, its remaining
+		// fragments have most likely been lost
+		if (a == NULL) {
+			for (int i = 0; i < RTMA_MAX_ASSEMBLIES; i++) {
+				if (i != c->assembly_lent && i != c->assembly_held && (a == NULL || c->assemblies[i].started < a->started)) {
+					a = &c->assemblies[i];
+					idx = i;
+				}
+			}
+			fprintf(stderr, "rtma_client_read_message: too many interleaved dynamic messages, oldest one dropped.\n");
+		}
+
+		size_t total = (size_t)h->num_data_bytes + (size_t)h->remaining_bytes;
+		if (c->large_alloc) {
+			if (a->buf != NULL)
+				c->large_free(c->large_alloc_ctx, a->buf);
+			a->buf = (char*)c->large_alloc(c->large_alloc_ctx, total);
+			a->capacity = a->buf ? total : 0;
+		}
+		else if (a->capacity < total) {
+			free(a->buf);
+			a->buf = (char*)malloc(total);
+			a->capacity = a->buf ? total : 0;
+		}
+
+		if (a->buf == NULL) {
+			fprintf(stderr, "rtma_client_read_message: unable to allocate %zu bytes for dynamic message.\n", total);
+			a->active = 0;
+			rtma_client_release_frame(c);
+			return NO_MESSAGE;
+		}
+
+		a->header = *h;
+		a->total = total;
+		a->received = 0;
+		a->started = rtma_client_get_timestamp(c);
+		a->active = 1;
+	}
+	else {
+		a = rtma_client_find_assembly(c, h, &idx);
+
+		// Remaining fragments of a dropped message
+		if (a == NULL) {
+			rtma_client_release_frame(c);
+			return NO_MESSAGE;
+		}
+	}
+
+	// Each fragment has to start where the previous one ended and announce
+	// what is left of the total, or one went missing
+	if (h->remaining_bytes < 0 || a->received + h->num_data_bytes + h->remaining_bytes != a->total) {
+		fprintf(stderr, "rtma_client_read_message: dynamic message fragment out of sequence, message dropped.\n");
+		a->active = 0;
+		rtma_client_release_frame(c);
+		return NO_MESSAGE;
+	}
+
+	memcpy(a->buf + a->received, data, h->num_data_bytes);
+	a->received += h->num_data_bytes;
+	rtma_client_release_frame(c);
+
+	if (h->remaining_bytes > 0)
+		return NO_MESSAGE;
+
+	view->rtma_header = a->header;
+	view->rtma_header.num_data_bytes = (int)a->received;
+	view->rtma_header.remaining_bytes = 0;
+	view->data = a->buf;
+	c->assembly_lent = idx;
+
+	return GOT_MESSAGE;
+}
+
+// Match acknowledgements and subscription failures against the outstanding
+// requests. Returns TRUE if the message was a reply to a tracked request and
+// must not be handed to the application.
+static int rtma_client_handle_request_reply(Client* c, const RTMA_MSG_HEADER* header, const char* data) {
+	if (header->msg_type == MT_ACKNOWLEDGE) {
+		// Owed to a request that was given up on to make room in the history
+		if (c->expired_acks > 0) {
+			c->expired_acks--;
+			return TRUE;
+		}
+
+		// Requests that never went out get nothing
+		while (c->oldest_pending_id != c->next_request_id && !c->requests[c->oldest_pending_id & (RTMA_REQUEST_HISTORY - 1)].sent)
+			c->oldest_pending_id++;
+
+		if (c->oldest_pending_id == c->next_request_id)
+			return FALSE;
+
+		RequestRecord* r = &c->requests[c->oldest_pending_id & (RTMA_REQUEST_HISTORY - 1)];
+
+		if (r->status == RTMA_REQUEST_PENDING)
+			r->status = RTMA_NO_ERROR;
+
+		c->oldest_pending_id++;
+		return TRUE;
+	}
+
+	if (header->msg_type == MT_FAIL_SUBSCRIBE && header->num_data_bytes >= (int)sizeof(MDF_FAIL_SUBSCRIBE)) {
+		MDF_FAIL_SUBSCRIBE fail;
+		memcpy(&fail, data, sizeof(fail));
+
+		// Charge the failure to the oldest unacknowledged subscribe for that type
+		for (int id = c->oldest_pending_id; id != c->next_request_id; id++) {
+			RequestRecord* r = &c->requests[id & (RTMA_REQUEST_HISTORY - 1)];
+			if (r->ctrl_type == MT_SUBSCRIBE && r->msg_type == fail.msg_type && r->status == RTMA_REQUEST_PENDING) {
+				r->status = RTMA_ERROR_FAIL_SUBSCRIBE;
+				return TRUE;
+			}
+		}
+	}
+
+	return FALSE;
+}
+
+// Wait for the next complete message from the transport and lend it out of
+// the receive buffer (or out of a reassembly buffer for dynamic messages)
+// until rtma_client_release_frame. Runs on the receive thread while there
+// is one. Returns RTMA_CONNECTION_LOST once the connection is gone.
+int rtma_client_read_transport(Client* c, MessageView* view, double timeout) {
+	double deadline = 0.0;
+	double time_remaining = timeout;
+
+	if (timeout > 0)
+		deadline = rtma_client_get_timestamp(c) + timeout;
+
+	for (;;) {
+		// Only touch the socket when no complete message is buffered
+		char* frame = rtma_client_next_frame(c);
+
+		if (frame == NULL) {
+			int filled = rtma_client_fill_recv_buffer(c, time_remaining);
+			if (filled != GOT_MESSAGE)
+				return filled;
+
+			if (timeout > 0) {
+				time_remaining = deadline - rtma_client_get_timestamp(c);
+				if (time_remaining < 0)
+					time_remaining = 0;
+			}
+			else if (timeout == 0 && rtma_client_next_frame(c) == NULL) {
+				return NO_MESSAGE;
+			}
+			continue;
+		}
+
+		memcpy(&view->rtma_header, frame, sizeof(RTMA_MSG_HEADER));
+		c->recv_borrowed = sizeof(RTMA_MSG_HEADER) + view->rtma_header.num_data_bytes;
+
+		if (!view->rtma_header.is_dynamic) {
+			if (rtma_client_superseded(c, &view->rtma_header, c->recv_base + (frame - c->recv_buf))) {
+				rtma_client_release_frame(c);
+				rtma_atomic_add64(&c->conflated, 1);
+				continue;
+			}
+
+			view->data = frame + sizeof(RTMA_MSG_HEADER);
+			break;
+		}
+
+		if (rtma_client_assemble_fragment(c, view, frame + sizeof(RTMA_MSG_HEADER)))
+			break;
+	}
+
+	// Add timestamp to header
+	view->rtma_header.recv_time = rtma_client_get_timestamp(c);
+
+	if (c->latency)
+		rtma_client_record_latency(c, &view->rtma_header);
+
+	return GOT_MESSAGE;
+}
+
+// Next message from the receive queue or, without a receive thread, from
+// the transport. Replies to tracked requests are consumed on the way; with
+// stop_on_reply set the call returns NO_MESSAGE after each one so that a
+// caller waiting on a request can check on it.
+static int rtma_client_read_socket_frame(Client* c, MessageView* view, double timeout, int stop_on_reply) {
+	double deadline = 0.0;
+	double time_remaining = timeout;
+
+	if (timeout > 0)
+		deadline = rtma_client_get_timestamp(c) + timeout;
+
+	for (;;) {
+		int got;
+
+		if (rtma_client_transport_closed(c, &time_remaining))
+			return NO_MESSAGE;
+
+		// Reads keep the outbound queue moving
+		if (c->outbound)
+			rtma_outbound_write(c);
+
+		if (c->recv_queue)
+			got = rtma_recv_queue_pop(c, view, time_remaining);
+		else
+			got = rtma_client_read_transport(c, view, time_remaining);
+
+		// Auto reconnect gets another go with what is left of the timeout
+		if (got == RTMA_CONNECTION_LOST) {
+			rtma_client_connection_lost(c);
+			continue;
+		}
+
+		if (!got)
+			return NO_MESSAGE;
+
+		if ((c->oldest_pending_id == c->next_request_id && c->expired_acks == 0) || !rtma_client_handle_request_reply(c, &view->rtma_header, view->data))
+			return GOT_MESSAGE;
+
+		rtma_client_release_transport(c);
+		if (stop_on_reply)
+			return NO_MESSAGE;
+
+		if (timeout > 0) {
+			time_remaining = deadline - rtma_client_get_timestamp(c);
+			if (time_remaining < 0)
+				time_remaining = 0;
+		}
+	}
+}
+
+// Lend out the next message, oldest first: stashed messages that arrived
+// while waiting on a request go ahead of the receive buffer. The message
+// stays borrowed until the next read or rtma_client_release_message.
+static int rtma_client_read_frame(Client* c, MessageView* view, double timeout) {
+	int got;
+
+	rtma_client_release_message(c);
+
+	if (c->stash_head < c->stash_tail) {
+		char* frame = c->stash_buf + c->stash_head;
+		memcpy(&view->rtma_header, frame, sizeof(RTMA_MSG_HEADER));
+		view->data = frame + sizeof(RTMA_MSG_HEADER);
+		c->stash_borrowed = sizeof(RTMA_MSG_HEADER) + view->rtma_header.num_data_bytes;
+		got = GOT_MESSAGE;
+	}
+	else {
+		got = rtma_client_read_socket_frame(c, view, timeout, FALSE);
+	}
+
+	if (got && c->recorder)
+		rtma_recorder_write(c->recorder, &view->rtma_header, view->data);
+
+	return got;
+}
+
+// TRUE if a message can be read without touching the socket. Lets callers
+// that wait on the socket themselves (epoll, an event loop) know that
+// readiness alone is not enough to find everything the client holds.
+int rtma_client_has_buffered_message(Client* c) {
+	if (c->stash_head + c->stash_borrowed < c->stash_tail)
+		return TRUE;
+
+	if (c->recv_queue)
+		return rtma_recv_queue_has_message(c);
+
+	return rtma_client_next_frame(c) != NULL;
+}
+
+// Set a message aside for a later read
+void rtma_client_stash_message(Client* c, const MessageView* view) {
+	size_t len = sizeof(RTMA_MSG_HEADER) + view->rtma_header.num_data_bytes;
+
+	if (c->stash_head == c->stash_tail) {
+		c->stash_head = 0;
+		c->stash_tail = 0;
+	}
+
+	if (c->stash_tail + len > c->stash_size) {
+		// A message lent out of the stash pins the buffer until released
+		int pinned = c->stash_borrowed > 0 && c->stash_retired == NULL;
+
+		// Compact first and only grow if that is not enough
+		if (!pinned) {
+			memmove(c->stash_buf, c->stash_buf + c->stash_head, c->stash_tail - c->stash_head);
+			c->stash_tail -= c->stash_head;
+			c->stash_head = 0;
+		}
+
+		if (c->stash_tail + len > c->stash_size) {
+			size_t size = c->stash_size ? c->stash_size : RTMA_SEND_BUFFER_SIZE;
+			while (size < c->stash_tail + len)
+				size *= 2;
+
+			char* buf;
+			if (pinned) {
+				buf = (char*)malloc(size);
+				if (buf != NULL) {
+					memcpy(buf, c->stash_buf, c->stash_tail);
+					c->stash_retired = c->stash_buf;
+				}
+			}
+			else {
+				buf = (char*)realloc(c->stash_buf, size);
+			}
+
+			if (buf == NULL) {
+				perror("rtma_client_read_message:realloc failed");
+				exit(EXIT_FAILURE);
+			}
+			c->stash_buf = buf;
+			c->stash_size = size;
+		}
+	}
+
+	memcpy(c->stash_buf + c->stash_tail, &view->rtma_header, sizeof(RTMA_MSG_HEADER));
+	memcpy(c->stash_buf + c->stash_tail + sizeof(RTMA_MSG_HEADER), view->data, view->rtma_header.num_data_bytes);
+	c->stash_tail += len;
+}
+
+// Consume the message lent out by rtma_client_read_transport
+void rtma_client_release_frame(Client* c) {
+	c->recv_head += c->recv_borrowed;
+	c->recv_borrowed = 0;
+
+	if (c->assembly_lent >= 0) {
+		MessageAssembly* a = &c->assemblies[c->assembly_lent];
+		a->active = 0;
+
+		// Buffers from a custom allocator go back after every message
+		if (c->large_free) {
+			c->large_free(c->large_alloc_ctx, a->buf);
+			a->buf = NULL;
+			a->capacity = 0;
+		}
+		c->assembly_lent = -1;
+	}
+}
+
+// Release what the last read lent out of the transport, leaving a message
+// lent out of the stash or held alone
+static void rtma_client_release_transport(Client* c) {
+	// The transport belongs to the receive thread while it runs
+	if (c->recv_queue)
+		rtma_recv_queue_release(c);
+	else
+		rtma_client_release_frame(c);
+}
+
+// Keep the message lent out by the last read valid while a call waits on a
+// request and reads on. The receive buffer moves on past it and is replaced
+// rather than compacted while the message sits in it.
+static void rtma_client_hold_message(Client* c) {
+	if (c->recv_queue) {
+		if (c->pooled_held == NULL)
+			c->pooled_held = rtma_recv_queue_take_lent(c);
+		return;
+	}
+
+	if (c->recv_borrowed > 0) {
+		c->recv_head += c->recv_borrowed;
+		c->recv_borrowed = 0;
+		c->recv_held = TRUE;
+	}
+
+	if (c->assembly_lent >= 0) {
+		c->assemblies[c->assembly_lent].active = 0;
+		c->assembly_held = c->assembly_lent;
+		c->assembly_lent = -1;
+	}
+}
+
+void rtma_client_release_message(Client* c) {
+	c->stash_head += c->stash_borrowed;
+	c->stash_borrowed = 0;
+	free(c->stash_retired);
+	c->stash_retired = NULL;
+
+	rtma_client_release_transport(c);
+
+	c->recv_held = FALSE;
+	free(c->recv_retired);
+	c->recv_retired = NULL;
+
+	if (c->assembly_held >= 0) {
+		MessageAssembly* a = &c->assemblies[c->assembly_held];
+
+		if (c->large_free) {
+			c->large_free(c->large_alloc_ctx, a->buf);
+			a->buf = NULL;
+			a->capacity = 0;
+		}
+		c->assembly_held = -1;
+	}
+
+	rtma_pooled_message_release(c->pooled_held);
+	c->pooled_held = NULL;
+}
+
+// Spin on non-blocking reads for up to spin_time seconds before a read
+// blocks, trading a busy core for the wake-up latency of poll. Also applies
+// to the receive thread. so_busy_poll_usec additionally sets SO_BUSY_POLL on
+// TCP connections, 0 leaves it alone. Returns -1 if the kernel refused it.
+int rtma_client_set_busy_poll(Client* c, double spin_time, int so_busy_poll_usec) {
+	c->busy_poll = spin_time > 0 ? spin_time : 0.0;
+	c->busy_poll_usec = so_busy_poll_usec > 0 ? so_busy_poll_usec : 0;
+
+	if (c->busy_poll_usec > 0 && c->connected && c->shm == NULL &&
+		(c->serv_addr.ss_family == AF_INET || c->serv_addr.ss_family == AF_INET6))
+		return rtma_client_set_so_busy_poll(c);
+
+	return 0;
+}
+
+// Pin the calling thread to one CPU, e.g. the thread running a client's
+// read loop next to a busy polling client. Returns -1 if not possible.
+int rtma_pin_thread_to_cpu(int cpu) {
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	if (sched_setaffinity(0, sizeof(set), &set) == 0)
+		return 0;
+
+	perror("rtma_pin_thread_to_cpu");
+	return -1;
+#elif defined(__WINDOWS__)
+	if (cpu >= 0 && cpu < (int)(8 * sizeof(DWORD_PTR)) && SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu))
+		return 0;
+
+	fprintf(stderr, "rtma_pin_thread_to_cpu: unable to pin to CPU %d.\n", cpu);
+	return -1;
+#else
+	fprintf(stderr, "rtma_pin_thread_to_cpu: not supported on this platform.\n");
+	return -1;
+#endif
+}
+
+// Hand out only the newest message of msg_type: a message is skipped when a
+// newer one of the same type has already been received. Meant for state
+// snapshots, where a reader that fell behind wants the current value rather
+// than every stale one. Other types keep flowing in order. Messages larger
+// than MAX_DATA_BYTES are never skipped.
+int rtma_client_set_conflation(Client* c, MSG_TYPE msg_type, int enable) {
+	if (msg_type < 0 || msg_type >= MAX_MESSAGE_TYPES) {
+		fprintf(stderr, "rtma_client_set_conflation: invalid message type %d.\n", msg_type);
+		return -1;
+	}
+
+	if (c->conflate_latest == NULL) {
+		if (!enable)
+			return 0;
+
+		// The receive thread picks the table up when it starts
+		if (c->recv_queue) {
+			fprintf(stderr, "rtma_client_set_conflation: the first type must be set before starting the receive thread.\n");
+			return -1;
+		}
+
+		c->conflate_latest = (long long*)malloc(MAX_MESSAGE_TYPES * sizeof(long long));
+		if (c->conflate_latest == NULL) {
+			perror("rtma_client_set_conflation:malloc failed");
+			return -1;
+		}
+		for (int i = 0; i < MAX_MESSAGE_TYPES; i++)
+			c->conflate_latest[i] = -1;
+	}
+
+	if (!enable)
+		c->conflate_latest[msg_type] = -1;
+	else if (c->conflate_latest[msg_type] < 0)
+		c->conflate_latest[msg_type] = 0;
+
+	// Catch up on what is already buffered
+	if (c->recv_queue == NULL) {
+		c->conflate_scan = c->recv_base + c->recv_head;
+		rtma_client_index_conflated(c);
+	}
+
+	return 0;
+}
+
+long long rtma_client_get_conflated_count(Client* c) {
+	return rtma_atomic_load64(&c->conflated);
+}
+
+// Route the buffers of dynamic messages larger than MAX_DATA_BYTES through a
+// caller supplied allocator. A buffer is handed back to free_fn when the
+// message is released. Pass NULL to go back to the client's own buffers.
+void rtma_client_set_large_message_allocator(Client* c, RTMA_ALLOC_FN alloc_fn, RTMA_FREE_FN free_fn, void* ctx) {
+	if (c->recv_queue) {
+		fprintf(stderr, "rtma_client_set_large_message_allocator: not allowed while the receive thread runs.\n");
+		return;
+	}
+
+	rtma_client_release_message(c);
+	rtma_client_reset_assemblies(c, 1);
+
+	c->large_alloc = alloc_fn;
+	c->large_free = free_fn;
+	c->large_alloc_ctx = ctx;
+}
+
+int rtma_client_read_message_view(Client* c, MessageView* view, double timeout) {
+	return rtma_client_read_frame(c, view, timeout);
+}
+
+// Copying read. Dynamic messages larger than MAX_DATA_BYTES are truncated
+// to fit in the Message and the number of bytes cut off is reported in
+// remaining_bytes. Use rtma_client_read_message_view to receive them whole.
+int rtma_client_read_message(Client *c, Message *msg, double timeout) {
+	MessageView view;
+
+	if (!rtma_client_read_frame(c, &view, timeout))
+		return NO_MESSAGE;
+
+	msg->rtma_header = view.rtma_header;
+	if (view.rtma_header.num_data_bytes > MAX_DATA_BYTES) {
+		msg->rtma_header.num_data_bytes = MAX_DATA_BYTES;
+		msg->rtma_header.remaining_bytes = view.rtma_header.num_data_bytes - MAX_DATA_BYTES;
+	}
+
+	memcpy(msg->data, view.data, msg->rtma_header.num_data_bytes);
+	rtma_client_release_message(c);
+
+	return GOT_MESSAGE;
+}
+
+// Wait for the next acknowledgement that is not claimed by a tracked
+// request, BLOCKING waits without a limit. Other messages that arrive in the
+// meantime are kept and handed out by later reads. A message the caller has
+// borrowed stays valid.
+int rtma_client_wait_for_acknowledgement(Client *c, Message *msg, double timeout) {
+	// The request being acknowledged may still be sitting in the batch
+	rtma_client_flush(c);
+	rtma_client_hold_message(c);
+
+	double start = rtma_client_get_timestamp(c);
+	double time_remaining = timeout;
+	MessageView view;
+
+	//printf("Waiting for Ack...\n");
+
+	while (timeout < 0 || time_remaining > 0) {
+		if (rtma_client_read_socket_frame(c, &view, timeout < 0 ? BLOCKING : time_remaining, FALSE)) {
+			if (view.rtma_header.msg_type == MT_ACKNOWLEDGE) {
+				//printf("Got ACK!\n");
+				msg->rtma_header = view.rtma_header;
+				rtma_client_release_transport(c);
+				return GOT_MESSAGE;
+			}
+			rtma_client_stash_message(c, &view);
+			rtma_client_release_transport(c);
+		}
+		else if (c->sockfd == INVALID_SOCKET) {
+			return NO_MESSAGE;
+		}
+		double time_waited = rtma_client_get_timestamp(c) - start;
+		time_remaining = timeout - time_waited;
+	}
+
+	return NO_MESSAGE;
+}
+
+// Send a control message whose acknowledgement is tracked in the background.
+// Returns a request id for rtma_client_poll_request and
+// rtma_client_wait_for_request, or -1 if the message could not be sent, with
+// the reason in rtma_client_get_last_error. The acknowledgement is matched
+// whenever messages are read, so the caller does not have to stop reading
+// to wait. A BLOCKING timeout never expires.
+int rtma_client_send_request(Client* c, MSG_TYPE ctrl_type, const void* data, size_t len, double timeout) {
+	// Make room in the history by waiting out the oldest request
+	if (c->next_request_id - c->oldest_pending_id >= RTMA_REQUEST_HISTORY) {
+		RequestRecord* oldest = &c->requests[c->oldest_pending_id & (RTMA_REQUEST_HISTORY - 1)];
+		double deadline = oldest->deadline;
+		rtma_client_wait_for_request(c, oldest->id, deadline == DBL_MAX ? BLOCKING : deadline - rtma_client_get_timestamp(c));
+
+		// Give up on it. Its acknowledgement may still arrive and must not
+		// be taken for that of a later request.
+		if (c->next_request_id - c->oldest_pending_id >= RTMA_REQUEST_HISTORY) {
+			if (oldest->status == RTMA_REQUEST_PENDING)
+				oldest->status = RTMA_ERROR_ACK_TIMEOUT;
+			if (oldest->sent)
+				c->expired_acks++;
+			c->oldest_pending_id++;
+		}
+	}
+
+	int id = c->next_request_id++;
+	RequestRecord* r = &c->requests[id & (RTMA_REQUEST_HISTORY - 1)];
+
+	r->id = id;
+	r->ctrl_type = ctrl_type;
+	r->msg_type = 0;
+	if (len >= sizeof(MSG_TYPE))
+		memcpy(&r->msg_type, data, sizeof(MSG_TYPE));
+	r->deadline = timeout < 0 ? DBL_MAX : rtma_client_get_timestamp(c) + timeout;
+	r->status = RTMA_REQUEST_PENDING;
+	r->sent = TRUE;
+
+	rtma_client_track_subscription(c, ctrl_type, r->msg_type);
+
+	if (rtma_client_send_message(c, ctrl_type, (void*)data, len) <= 0) {
+		// A lost connection has already settled the request
+		if (r->status == RTMA_REQUEST_PENDING)
+			r->status = RTMA_ERROR_SEND_FAILED;
+		r->sent = FALSE;
+		c->last_error = r->status;
+		return -1;
+	}
+
+	return id;
+}
+
+// Current status of a request without doing any I/O: RTMA_REQUEST_PENDING,
+// RTMA_NO_ERROR, RTMA_ERROR_FAIL_SUBSCRIBE, RTMA_ERROR_ACK_TIMEOUT once the
+// deadline has passed, RTMA_ERROR_SEND_FAILED or RTMA_ERROR_CONNECTION_LOST,
+// or RTMA_ERROR_UNKNOWN_REQUEST for ids that have dropped out of the history.
+int rtma_client_poll_request(Client* c, int request_id) {
+	RequestRecord* r = &c->requests[request_id & (RTMA_REQUEST_HISTORY - 1)];
+
+	if (r->id != request_id || request_id >= c->next_request_id)
+		return RTMA_ERROR_UNKNOWN_REQUEST;
+
+	if (r->status == RTMA_REQUEST_PENDING && rtma_client_get_timestamp(c) > r->deadline)
+		r->status = RTMA_ERROR_ACK_TIMEOUT;
+
+	return r->status;
+}
+
+// Block until a request completes or timeout expires, BLOCKING waits
+// without a limit. Messages that arrive in the meantime are kept in order for
+// later reads. A message the caller has borrowed stays valid.
+int rtma_client_wait_for_request(Client* c, int request_id, double timeout) {
+	rtma_client_flush(c);
+	rtma_client_hold_message(c);
+
+	RequestRecord* r = &c->requests[request_id & (RTMA_REQUEST_HISTORY - 1)];
+	double deadline = rtma_client_get_timestamp(c) + timeout;
+	MessageView view;
+	int status;
+
+	while ((status = rtma_client_poll_request(c, request_id)) == RTMA_REQUEST_PENDING) {
+		double now = rtma_client_get_timestamp(c);
+		double time_remaining = BLOCKING;
+		if (timeout >= 0) {
+			time_remaining = deadline - now;
+			if (time_remaining <= 0)
+				break;
+		}
+
+		// Wake up when the request itself times out
+		if (r->deadline != DBL_MAX && (time_remaining < 0 || r->deadline - now < time_remaining))
+			time_remaining = r->deadline > now ? r->deadline - now : 0;
+
+		if (rtma_client_read_socket_frame(c, &view, time_remaining, TRUE)) {
+			rtma_client_stash_message(c, &view);
+			rtma_client_release_transport(c);
+		}
+		else if (c->sockfd == INVALID_SOCKET) {
+			break;
+		}
+	}
+
+	return status;
+}
+
+void rtma_client_send_module_ready(Client *c) {
+	MDF_MODULE_READY msg;
+	msg.pid = c->pid;
+	rtma_client_send_message(c, MT_MODULE_READY, &msg, sizeof(msg));
+}
+
+void rtma_client_subscribe(Client *c, MSG_TYPE msg_type) {
+	MDF_SUBSCRIBE msg = msg_type;
+	int request_id = rtma_client_send_request(c, MT_SUBSCRIBE, &msg, sizeof(msg), DEFAULT_ACK_TIMEOUT);
+	rtma_client_wait_for_request(c, request_id, DEFAULT_ACK_TIMEOUT);
+}
+
+void rtma_client_unsubscribe(Client *c, MSG_TYPE msg_type) {
+	MDF_UNSUBSCRIBE msg = msg_type;
+	int request_id = rtma_client_send_request(c, MT_UNSUBSCRIBE, &msg, sizeof(msg), DEFAULT_ACK_TIMEOUT);
+	rtma_client_wait_for_request(c, request_id, DEFAULT_ACK_TIMEOUT);
+}
+
+void rtma_client_resume_subscription(Client *c, MSG_TYPE msg_type) {
+	MDF_RESUME_SUBSCRIPTION msg = msg_type;
+	int request_id = rtma_client_send_request(c, MT_RESUME_SUBSCRIPTION, &msg, sizeof(msg), DEFAULT_ACK_TIMEOUT);
+	rtma_client_wait_for_request(c, request_id, DEFAULT_ACK_TIMEOUT);
+}
+
+void rtma_client_pause_subscription(Client *c, MSG_TYPE msg_type) {
+	MDF_PAUSE_SUBSCRIPTION msg = msg_type;
+	int request_id = rtma_client_send_request(c, MT_PAUSE_SUBSCRIPTION, &msg, sizeof(msg), DEFAULT_ACK_TIMEOUT);
+	rtma_client_wait_for_request(c, request_id, DEFAULT_ACK_TIMEOUT);
+}
+
+// Send one control message per msg_type back to back and then collect the
+// acknowledgements, so the whole set costs about one round trip. status
+// (optional) receives one of RTMA_NO_ERROR, RTMA_ERROR_FAIL_SUBSCRIBE,
+// RTMA_ERROR_ACK_TIMEOUT, RTMA_ERROR_SEND_FAILED or
+// RTMA_ERROR_CONNECTION_LOST per msg_type. Returns the number of failures.
+static int rtma_client_subscription_control_many(Client* c, MSG_TYPE ctrl_type, const MSG_TYPE* msg_types, int count, int* status, double timeout) {
+	int was_batching = c->batching;
+	int num_failed = 0;
+
+	// Chunk so that no request drops out of the history before it is checked
+	for (int base = 0; base < count; base += RTMA_REQUEST_HISTORY / 2) {
+		int n = count - base < RTMA_REQUEST_HISTORY / 2 ? count - base : RTMA_REQUEST_HISTORY / 2;
+		int first_id = c->next_request_id;
+		int last_sent = -1;
+
+		rtma_client_begin_batch(c);
+		for (int i = 0; i < n; i++) {
+			MSG_TYPE msg = msg_types[base + i];
+			int id = rtma_client_send_request(c, ctrl_type, &msg, sizeof(msg), timeout);
+			if (id >= 0)
+				last_sent = id;
+		}
+
+		if (was_batching)
+			rtma_client_flush(c);
+		else
+			rtma_client_end_batch(c);
+
+		// Requests are acknowledged in order, so waiting on the last one sent
+		// covers all
+		if (last_sent >= 0)
+			rtma_client_wait_for_request(c, last_sent, timeout);
+
+		for (int i = 0; i < n; i++) {
+			int st = rtma_client_poll_request(c, first_id + i);
+			if (st == RTMA_REQUEST_PENDING || st == RTMA_ERROR_UNKNOWN_REQUEST)
+				st = RTMA_ERROR_ACK_TIMEOUT;
+			if (st != RTMA_NO_ERROR)
+				num_failed++;
+			if (status)
+				status[base + i] = st;
+		}
+	}
+
+	return num_failed;
+}
+
+int rtma_client_subscribe_many(Client* c, const MSG_TYPE* msg_types, int count, int* status) {
+	return rtma_client_subscription_control_many(c, MT_SUBSCRIBE, msg_types, count, status, DEFAULT_ACK_TIMEOUT);
+}
+
+int rtma_client_unsubscribe_many(Client* c, const MSG_TYPE* msg_types, int count, int* status) {
+	return rtma_client_subscription_control_many(c, MT_UNSUBSCRIBE, msg_types, count, status, DEFAULT_ACK_TIMEOUT);
+}
+
+int rtma_client_resume_subscription_many(Client* c, const MSG_TYPE* msg_types, int count, int* status) {
+	return rtma_client_subscription_control_many(c, MT_RESUME_SUBSCRIPTION, msg_types, count, status, DEFAULT_ACK_TIMEOUT);
+}
+
+int rtma_client_pause_subscription_many(Client* c, const MSG_TYPE* msg_types, int count, int* status) {
+	return rtma_client_subscription_control_many(c, MT_PAUSE_SUBSCRIPTION, msg_types, count, status, DEFAULT_ACK_TIMEOUT);
 }
 
 void rtma_message_print(Message* msg) {
@@ -0,0 +1,67 @@
+#ifndef _RTMA_CLIENT_INTERNAL_H
+#define _RTMA_CLIENT_INTERNAL_H
+
+// Client functions shared between the library sources but not exported
+
+#include "rtma_client.h"
+
+// Write the whole iovec over the client's transport
+int rtma_client_writev(Client* c, socket_iovec_t* iov, int iovcnt);
+// Write what the transport takes without blocking
+int rtma_client_try_writev(Client* c, socket_iovec_t* iov, int iovcnt);
+// socket_wait on the client's transport
+int rtma_client_wait(Client* c, int events, double timeout);
+// Drop a connection that failed, see rtma_client_set_auto_reconnect
+void rtma_client_connection_lost(Client* c);
+
+// rtma_client_reconnect in steps that never block, for the event loop.
+// Returns RTMA_REQUEST_PENDING until the connection is back and the
+// subscriptions are restored, then RTMA_NO_ERROR, or RTMA_ERROR_* once the
+// attempt failed. The next step is due by reconnect_deadline at the latest.
+int rtma_client_reconnect_step(Client* c);
+
+// Stages of rtma_client_reconnect_step
+#define RTMA_RECONNECT_IDLE 0
+#define RTMA_RECONNECT_ACK 1	// MT_CONNECT sent, the manager has not answered yet
+#define RTMA_RECONNECT_REPLAY 2	// Connected, subscriptions being restored
+
+// read_transport result when the connection is gone
+#define RTMA_CONNECTION_LOST -1
+
+// Next message off the transport, lent out until rtma_client_release_frame
+int rtma_client_read_transport(Client* c, MessageView* view, double timeout);
+void rtma_client_release_frame(Client* c);
+// Keep a copy of a message for a later read
+void rtma_client_stash_message(Client* c, const MessageView* view);
+
+// Send path while the send thread runs, see rtma_send_queue.h
+int rtma_send_queue_push(Client* c, const RTMA_MSG_HEADER* header, const DataSegment* segments, int num_segments, double timeout);
+// Wait until everything queued so far has been written
+int rtma_send_queue_drain(Client* c, double timeout);
+
+// Send path while the outbound queue is enabled, see rtma_outbound.h
+int rtma_outbound_push(Client* c, const RTMA_MSG_HEADER* header, const DataSegment* segments, int num_segments, double timeout);
+// Write without blocking, returns the number of bytes still queued
+size_t rtma_outbound_write(Client* c);
+// Block until everything queued has been written, SOCKET_ERROR if the
+// connection went away first
+int rtma_outbound_drain(Client* c);
+void rtma_outbound_clear(Client* c);
+void rtma_outbound_free(Client* c);
+
+// Read path while the receive thread runs, see rtma_recv_queue.h
+int rtma_recv_queue_pop(Client* c, MessageView* view, double timeout);
+void rtma_recv_queue_release(Client* c);
+int rtma_recv_queue_has_message(Client* c);
+// Pooled message lent out by the last pop, NULL if none
+struct PooledMessage* rtma_recv_queue_lent(Client* c);
+// Take that message over, the next release leaves it alone
+struct PooledMessage* rtma_recv_queue_take_lent(Client* c);
+
+// Pool the client reassembles dynamic messages into, NULL if none
+struct MessagePool* rtma_client_get_message_pool(Client* c);
+// Pooled copy of a message. Dynamic messages reassembled in pool are
+// referenced instead of copied.
+struct PooledMessage* rtma_pool_copy_view(Client* c, struct MessagePool* pool, const MessageView* view);
+
+#endif //_RTMA_CLIENT_INTERNAL_H
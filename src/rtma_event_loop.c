@@ -0,0 +1,453 @@
+#include "rtma_event_loop.h"
+#include "rtma_client_internal.h"
+#include "rtma_time.h"
+
+#ifdef __linux__
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#define RTMA_EVENT_LOOP_MAX_EVENTS 64
+
+#define SOURCE_CLIENT 0
+#define SOURCE_FD 1
+#define SOURCE_TIMER 2
+
+typedef struct {
+	RTMA_MSG_HANDLER handler;
+	void* ctx;
+}MessageHandlerEntry;
+
+// Anything registered with epoll. Removed sources stay allocated until the
+// end of the current iteration because pending epoll events may still point
+// at them.
+typedef struct EventSource {
+	int type;
+	int fd;
+	Client* client;
+	RTMA_FD_HANDLER fd_handler;
+	RTMA_TIMER_HANDLER timer_handler;
+	void* ctx;
+	int removed;
+	long long reconnects;	// Client reconnects seen, the descriptor changes with each
+	double retry_time;		// Next reconnect attempt while the client is down
+	double backoff;
+	struct EventSource* next;
+}EventSource;
+
+struct EventLoop {
+	int epfd;
+	int running;
+	MessageHandlerEntry handlers[MAX_MESSAGE_TYPES];
+	MessageHandlerEntry default_handler;
+	EventSource* sources;
+	int num_removed;
+};
+
+EventLoop* rtma_create_event_loop(void) {
+	EventLoop* loop = (EventLoop*)calloc(1, sizeof(EventLoop));
+
+	if (loop == NULL) {
+		perror("rtma_create_event_loop:calloc failed");
+		exit(EXIT_FAILURE);
+	}
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		perror("rtma_create_event_loop:epoll_create1 failed");
+		exit(EXIT_FAILURE);
+	}
+
+	return loop;
+}
+
+// Clients stay connected and are left to the caller. Timers are closed.
+void rtma_destroy_event_loop(EventLoop** loop) {
+	EventLoop* l = *loop;
+
+	if (l == NULL)
+		return;
+
+	EventSource* s = l->sources;
+	while (s) {
+		EventSource* next = s->next;
+		if (s->type == SOURCE_TIMER && !s->removed)
+			close(s->fd);
+		free(s);
+		s = next;
+	}
+
+	close(l->epfd);
+	free(l);
+	*loop = NULL;
+}
+
+static EventSource* rtma_event_loop_add_source(EventLoop* loop, int type, int fd, uint32_t events) {
+	EventSource* s = (EventSource*)calloc(1, sizeof(EventSource));
+
+	if (s == NULL) {
+		perror("rtma_event_loop_add_source:calloc failed");
+		exit(EXIT_FAILURE);
+	}
+
+	s->type = type;
+	s->fd = fd;
+
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = s;
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("rtma_event_loop_add_source:epoll_ctl failed");
+		free(s);
+		return NULL;
+	}
+
+	s->next = loop->sources;
+	loop->sources = s;
+
+	return s;
+}
+
+static EventSource* rtma_event_loop_find_source(EventLoop* loop, int type, int fd) {
+	for (EventSource* s = loop->sources; s; s = s->next) {
+		if (!s->removed && s->type == type && s->fd == fd)
+			return s;
+	}
+
+	return NULL;
+}
+
+static void rtma_event_loop_remove_source(EventLoop* loop, EventSource* s) {
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+	s->removed = 1;
+	loop->num_removed++;
+}
+
+// Free the sources removed during the last iteration
+static void rtma_event_loop_collect_removed(EventLoop* loop) {
+	EventSource** link = &loop->sources;
+
+	while (*link) {
+		EventSource* s = *link;
+		if (s->removed) {
+			*link = s->next;
+			free(s);
+		}
+		else {
+			link = &s->next;
+		}
+	}
+
+	loop->num_removed = 0;
+}
+
+int rtma_event_loop_add_client(EventLoop* loop, Client* c) {
+	if (c->sockfd == INVALID_SOCKET) {
+		fprintf(stderr, "rtma_event_loop_add_client: client is not connected.\n");
+		return -1;
+	}
+
+	// The socket belongs to the receive thread, readiness says nothing about the queue
+	if (c->recv_queue != NULL) {
+		fprintf(stderr, "rtma_event_loop_add_client: client has a receive thread.\n");
+		return -1;
+	}
+
+	EventSource* s = rtma_event_loop_add_source(loop, SOURCE_CLIENT, rtma_client_get_fd(c), EPOLLIN);
+	if (s == NULL)
+		return -1;
+
+	s->client = c;
+	s->reconnects = c->reconnects;
+
+	// The loop reconnects the client itself, see rtma_event_loop_follow_client
+	c->reconnect_in_steps = TRUE;
+	return 0;
+}
+
+// Must be called before the client is disconnected
+int rtma_event_loop_remove_client(EventLoop* loop, Client* c) {
+	for (EventSource* s = loop->sources; s; s = s->next) {
+		if (!s->removed && s->type == SOURCE_CLIENT && s->client == c) {
+			c->reconnect_in_steps = FALSE;
+			rtma_event_loop_remove_source(loop, s);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int rtma_event_loop_set_handler(EventLoop* loop, MSG_TYPE msg_type, RTMA_MSG_HANDLER handler, void* ctx) {
+	if (msg_type < 0 || msg_type >= MAX_MESSAGE_TYPES) {
+		fprintf(stderr, "rtma_event_loop_set_handler: msg_type %d out of range.\n", msg_type);
+		return -1;
+	}
+
+	loop->handlers[msg_type].handler = handler;
+	loop->handlers[msg_type].ctx = ctx;
+	return 0;
+}
+
+void rtma_event_loop_set_default_handler(EventLoop* loop, RTMA_MSG_HANDLER handler, void* ctx) {
+	loop->default_handler.handler = handler;
+	loop->default_handler.ctx = ctx;
+}
+
+int rtma_event_loop_add_fd(EventLoop* loop, int fd, int events, RTMA_FD_HANDLER handler, void* ctx) {
+	uint32_t ev = 0;
+	if (events & RTMA_EVENT_READ)
+		ev |= EPOLLIN;
+	if (events & RTMA_EVENT_WRITE)
+		ev |= EPOLLOUT;
+
+	EventSource* s = rtma_event_loop_add_source(loop, SOURCE_FD, fd, ev);
+	if (s == NULL)
+		return -1;
+
+	s->fd_handler = handler;
+	s->ctx = ctx;
+	return 0;
+}
+
+int rtma_event_loop_remove_fd(EventLoop* loop, int fd) {
+	EventSource* s = rtma_event_loop_find_source(loop, SOURCE_FD, fd);
+
+	if (s == NULL)
+		return -1;
+
+	rtma_event_loop_remove_source(loop, s);
+	return 0;
+}
+
+// Fire handler after interval seconds, and every interval seconds after that
+// if repeat is set. Returns the timer id or -1.
+int rtma_event_loop_add_timer(EventLoop* loop, double interval, int repeat, RTMA_TIMER_HANDLER handler, void* ctx) {
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (fd < 0) {
+		perror("rtma_event_loop_add_timer:timerfd_create failed");
+		return -1;
+	}
+
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = (time_t)interval;
+	spec.it_value.tv_nsec = (long)((interval - (double)spec.it_value.tv_sec) * 1e9);
+
+	// A zero it_value would disarm the timer
+	if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+		spec.it_value.tv_nsec = 1;
+
+	if (repeat)
+		spec.it_interval = spec.it_value;
+
+	if (timerfd_settime(fd, 0, &spec, NULL) < 0) {
+		perror("rtma_event_loop_add_timer:timerfd_settime failed");
+		close(fd);
+		return -1;
+	}
+
+	EventSource* s = rtma_event_loop_add_source(loop, SOURCE_TIMER, fd, EPOLLIN);
+	if (s == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	s->timer_handler = handler;
+	s->ctx = ctx;
+	return fd;
+}
+
+int rtma_event_loop_remove_timer(EventLoop* loop, int timer_id) {
+	EventSource* s = rtma_event_loop_find_source(loop, SOURCE_TIMER, timer_id);
+
+	if (s == NULL)
+		return -1;
+
+	rtma_event_loop_remove_source(loop, s);
+	close(s->fd);
+	return 0;
+}
+
+static void rtma_event_loop_dispatch(EventLoop* loop, Client* c, MessageView* msg) {
+	MSG_TYPE msg_type = msg->rtma_header.msg_type;
+	MessageHandlerEntry* entry = &loop->default_handler;
+
+	if (msg_type >= 0 && msg_type < MAX_MESSAGE_TYPES && loop->handlers[msg_type].handler)
+		entry = &loop->handlers[msg_type];
+
+	if (entry->handler)
+		entry->handler(loop, c, msg, entry->ctx);
+}
+
+// Register the client's current descriptor. The old one is closed and with
+// it its registration, and its number may belong to another source by now.
+static void rtma_event_loop_watch_client_fd(EventLoop* loop, EventSource* s) {
+	Client* c = s->client;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = s;
+	s->fd = rtma_client_get_fd(c);
+	s->reconnects = c->reconnects;
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, s->fd, &ev) < 0 && errno != EEXIST)
+		perror("rtma_event_loop_follow_client:epoll_ctl failed");
+}
+
+// Keep epoll on the client's current descriptor, which changes when auto
+// reconnect brings a lost connection back. While the connection is down the
+// loop retries with backoff, one rtma_client_reconnect_step at a time so that
+// the other sources are served while the manager answers. timeout is cut
+// short to match.
+static void rtma_event_loop_follow_client(EventLoop* loop, EventSource* s, double* timeout) {
+	Client* c = s->client;
+
+	if (c->sockfd == INVALID_SOCKET || c->reconnect_stage != RTMA_RECONNECT_IDLE) {
+		if (!c->auto_reconnect || c->server_name[0] == '\0')
+			return;
+
+		double now = rtma_time_now(RTMA_CLOCK_MONOTONIC);
+		double wait = s->retry_time - now;
+		int err = RTMA_ERROR_CONNECT;
+
+		if (c->reconnect_stage != RTMA_RECONNECT_IDLE || wait <= 0) {
+			int started = c->reconnect_stage == RTMA_RECONNECT_IDLE;
+
+			err = rtma_client_reconnect_step(c);
+			if (started && c->sockfd != INVALID_SOCKET)
+				rtma_event_loop_watch_client_fd(loop, s);
+
+			if (err == RTMA_REQUEST_PENDING) {
+				wait = c->reconnect_deadline - rtma_client_get_timestamp(c);
+			}
+			else if (err != RTMA_NO_ERROR) {
+				s->backoff = s->backoff > 0 ? s->backoff * 2 : RTMA_RECONNECT_MIN_BACKOFF;
+				if (s->backoff > RTMA_RECONNECT_MAX_BACKOFF)
+					s->backoff = RTMA_RECONNECT_MAX_BACKOFF;
+				s->retry_time = now + s->backoff;
+				wait = s->backoff;
+			}
+		}
+
+		if (err != RTMA_NO_ERROR) {
+			if (wait < 0)
+				wait = 0;
+			if (*timeout < 0 || *timeout > wait)
+				*timeout = wait;
+			return;
+		}
+	}
+
+	s->backoff = 0;
+	if (s->reconnects != c->reconnects)
+		rtma_event_loop_watch_client_fd(loop, s);
+}
+
+// Until the manager has answered MT_CONNECT the reconnect steps read the
+// client, not the handlers
+static int rtma_event_loop_client_ready(EventSource* s) {
+	return !s->removed && s->client->reconnect_stage != RTMA_RECONNECT_ACK;
+}
+
+// Dispatch up to RTMA_EVENT_LOOP_MAX_BATCH messages from a client without
+// blocking. Returns the number of messages dispatched.
+static int rtma_event_loop_service_client(EventLoop* loop, EventSource* s) {
+	MessageView view;
+	int count = 0;
+
+	while (!s->removed && count < RTMA_EVENT_LOOP_MAX_BATCH) {
+		if (!rtma_client_read_message_view(s->client, &view, NONBLOCKING))
+			break;
+
+		rtma_event_loop_dispatch(loop, s->client, &view);
+		count++;
+	}
+
+	if (!s->removed)
+		rtma_client_release_message(s->client);
+
+	return count;
+}
+
+// Wait up to timeout seconds for activity and service every ready source
+// once. Returns the number of messages dispatched.
+int rtma_event_loop_run_once(EventLoop* loop, double timeout) {
+	struct epoll_event events[RTMA_EVENT_LOOP_MAX_EVENTS];
+	int count = 0;
+
+	// Clients may hold complete messages that epoll knows nothing about,
+	// e.g. the rest of a capped batch or messages stashed by a handler
+	// that waited on a request. Serve those first and do not block.
+	for (EventSource* s = loop->sources; s; s = s->next) {
+		if (!s->removed && s->type == SOURCE_CLIENT)
+			rtma_event_loop_follow_client(loop, s, &timeout);
+
+		if (!s->removed && s->type == SOURCE_CLIENT && rtma_event_loop_client_ready(s) && rtma_client_has_buffered_message(s->client)) {
+			count += rtma_event_loop_service_client(loop, s);
+			timeout = NONBLOCKING;
+		}
+	}
+
+	int ms = timeout < 0 ? -1 : (int)(timeout * 1000.0 + 0.999);
+	int nfds = epoll_wait(loop->epfd, events, RTMA_EVENT_LOOP_MAX_EVENTS, ms);
+
+	if (nfds < 0 && errno != EINTR) {
+		perror("rtma_event_loop_run_once:epoll_wait failed");
+		return -1;
+	}
+
+	for (int i = 0; i < nfds; i++) {
+		EventSource* s = (EventSource*)events[i].data.ptr;
+
+		if (s->removed)
+			continue;
+
+		switch (s->type) {
+		case SOURCE_CLIENT:
+			if (rtma_event_loop_client_ready(s))
+				count += rtma_event_loop_service_client(loop, s);
+			break;
+		case SOURCE_FD: {
+			int ev = 0;
+			if (events[i].events & EPOLLIN)
+				ev |= RTMA_EVENT_READ;
+			if (events[i].events & EPOLLOUT)
+				ev |= RTMA_EVENT_WRITE;
+			if (events[i].events & (EPOLLERR | EPOLLHUP))
+				ev |= RTMA_EVENT_ERROR;
+			s->fd_handler(loop, s->fd, ev, s->ctx);
+			break;
+		}
+		case SOURCE_TIMER: {
+			uint64_t expirations;
+			if (read(s->fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+				s->timer_handler(loop, s->fd, s->ctx);
+			break;
+		}
+		}
+	}
+
+	if (loop->num_removed)
+		rtma_event_loop_collect_removed(loop);
+
+	return count;
+}
+
+void rtma_event_loop_run(EventLoop* loop) {
+	loop->running = 1;
+
+	while (loop->running) {
+		if (rtma_event_loop_run_once(loop, BLOCKING) < 0)
+			break;
+	}
+}
+
+// Safe to call from a handler. The loop returns after the current iteration.
+void rtma_event_loop_stop(EventLoop* loop) {
+	loop->running = 0;
+}
+
+#endif //__linux__
@@ -0,0 +1,328 @@
+#include "rtma_histogram.h"
+#include "rtma_atomic.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+typedef struct {
+	long long key;	// rtma_histogram_key of the owner, 0 while unused
+	long long sum_ns;
+	long long max_ns;
+	long long buckets[RTMA_HIST_NUM_BUCKETS];
+}LatencySlot;
+
+// Fixed size open addressing table. Slots are claimed with a CAS on first use
+// and never released, so recording needs neither locks nor allocations.
+struct LatencyHistograms {
+	int mask;
+	long long dropped;	// Messages whose key did not fit in the table
+	LatencySlot slots[1];
+};
+
+// Bit 48 marks the slot as used so that no key is ever 0
+static inline long long rtma_histogram_key(MSG_TYPE msg_type, MODULE_ID src_mod_id) {
+	return (long long)(((unsigned long long)(unsigned int)msg_type << 16) | (unsigned short)src_mod_id | (1ULL << 48));
+}
+
+static inline int rtma_histogram_msb(unsigned long long v) {
+#if defined(_MSC_VER)
+	unsigned long idx;
+	_BitScanReverse64(&idx, v);
+	return (int)idx;
+#else
+	return 63 - __builtin_clzll(v);
+#endif
+}
+
+int rtma_histogram_bucket_index(long long value_ns) {
+	if (value_ns < RTMA_HIST_SUB_BUCKETS)
+		return value_ns < 0 ? 0 : (int)value_ns;
+
+	if (value_ns > RTMA_HIST_MAX_NS)
+		return RTMA_HIST_NUM_BUCKETS - 1;
+
+	int shift = rtma_histogram_msb((unsigned long long)value_ns) - RTMA_HIST_SUB_BUCKET_BITS;
+	return (shift + 1) * RTMA_HIST_SUB_BUCKETS + (int)(value_ns >> shift) - RTMA_HIST_SUB_BUCKETS;
+}
+
+long long rtma_histogram_bucket_lower(int index) {
+	if (index < RTMA_HIST_SUB_BUCKETS)
+		return index;
+
+	int magnitude = index / RTMA_HIST_SUB_BUCKETS;
+	int sub = index % RTMA_HIST_SUB_BUCKETS;
+	return (long long)(RTMA_HIST_SUB_BUCKETS + sub) << (magnitude - 1);
+}
+
+long long rtma_histogram_bucket_upper(int index) {
+	if (index < RTMA_HIST_SUB_BUCKETS)
+		return index;
+
+	return rtma_histogram_bucket_lower(index) + (1LL << (index / RTMA_HIST_SUB_BUCKETS - 1)) - 1;
+}
+
+static inline long long rtma_histogram_latency_ns(const RTMA_MSG_HEADER* header) {
+	// Clock differences between hosts can make this negative
+	double latency = header->recv_time - header->send_time;
+	return latency > 0 ? (long long)(latency * 1e9) : 0;
+}
+
+int rtma_client_enable_latency_histograms(Client* c, int max_keys) {
+	if (c->latency != NULL)
+		return 0;
+
+	if (max_keys <= 0)
+		max_keys = RTMA_HIST_DEFAULT_KEYS;
+
+	// Keep the table at most half full so probes stay short
+	int num_slots = 1;
+	while (num_slots < 2 * max_keys)
+		num_slots <<= 1;
+
+	LatencyHistograms* h = (LatencyHistograms*)calloc(1, sizeof(LatencyHistograms) + (num_slots - 1) * sizeof(LatencySlot));
+	if (h == NULL) {
+		perror("rtma_client_enable_latency_histograms:calloc failed");
+		return -1;
+	}
+
+	h->mask = num_slots - 1;
+	c->latency = h;
+
+	return 0;
+}
+
+// Not safe while another thread reads from the client
+void rtma_client_disable_latency_histograms(Client* c) {
+	free(c->latency);
+	c->latency = NULL;
+}
+
+static LatencySlot* rtma_histogram_find_slot(LatencyHistograms* h, long long key) {
+	unsigned int i = (unsigned int)(((unsigned long long)key * 0x9E3779B97F4A7C15ULL) >> 40);
+
+	for (int probes = 0; probes <= h->mask; probes++, i++) {
+		LatencySlot* slot = &h->slots[i & h->mask];
+		long long slot_key = rtma_atomic_load64(&slot->key);
+
+		if (slot_key == key)
+			return slot;
+
+		if (slot_key == 0) {
+			if (rtma_atomic_cas64(&slot->key, 0LL, key))
+				return slot;
+			// Lost the race for this slot, maybe to the same key
+			if (rtma_atomic_load64(&slot->key) == key)
+				return slot;
+		}
+	}
+
+	return NULL;
+}
+
+// Called on every message read while histograms are enabled
+void rtma_client_record_latency(Client* c, const RTMA_MSG_HEADER* header) {
+	LatencyHistograms* h = c->latency;
+
+	if (h == NULL)
+		return;
+
+	LatencySlot* slot = rtma_histogram_find_slot(h, rtma_histogram_key(header->msg_type, header->src_mod_id));
+	if (slot == NULL) {
+		rtma_atomic_add64(&h->dropped, 1);
+		return;
+	}
+
+	long long latency = rtma_histogram_latency_ns(header);
+
+	rtma_atomic_add64(&slot->buckets[rtma_histogram_bucket_index(latency)], 1);
+	rtma_atomic_add64(&slot->sum_ns, latency);
+
+	long long max = rtma_atomic_load64(&slot->max_ns);
+	while (latency > max && !rtma_atomic_cas64(&slot->max_ns, max, latency))
+		max = rtma_atomic_load64(&slot->max_ns);
+}
+
+// Copy up to max_hists histograms into hists and optionally clear them.
+// Returns the number copied. May run concurrently with recording; a message
+// recorded during the copy lands in either this snapshot or the next one.
+int rtma_client_get_latency_histograms(Client* c, LatencyHistogram* hists, int max_hists, int reset) {
+	LatencyHistograms* h = c->latency;
+	int n = 0;
+
+	if (h == NULL)
+		return 0;
+
+	for (int i = 0; i <= h->mask && n < max_hists; i++) {
+		LatencySlot* slot = &h->slots[i];
+		long long key = rtma_atomic_load64(&slot->key);
+
+		if (key == 0)
+			continue;
+
+		LatencyHistogram* out = &hists[n++];
+		out->msg_type = (MSG_TYPE)(unsigned int)(key >> 16);
+		out->src_mod_id = (MODULE_ID)(key & 0xFFFF);
+		out->count = 0;
+
+		for (int b = 0; b < RTMA_HIST_NUM_BUCKETS; b++) {
+			out->buckets[b] = reset ? rtma_atomic_exchange64(&slot->buckets[b], 0LL) : rtma_atomic_load64(&slot->buckets[b]);
+			out->count += out->buckets[b];
+		}
+
+		out->sum_ns = reset ? rtma_atomic_exchange64(&slot->sum_ns, 0LL) : rtma_atomic_load64(&slot->sum_ns);
+		out->max_ns = reset ? rtma_atomic_exchange64(&slot->max_ns, 0LL) : rtma_atomic_load64(&slot->max_ns);
+	}
+
+	return n;
+}
+
+void rtma_client_reset_latency_histograms(Client* c) {
+	LatencyHistograms* h = c->latency;
+
+	if (h == NULL)
+		return;
+
+	for (int i = 0; i <= h->mask; i++) {
+		LatencySlot* slot = &h->slots[i];
+
+		if (rtma_atomic_load64(&slot->key) == 0)
+			continue;
+
+		for (int b = 0; b < RTMA_HIST_NUM_BUCKETS; b++)
+			rtma_atomic_store64(&slot->buckets[b], 0LL);
+		rtma_atomic_store64(&slot->sum_ns, 0LL);
+		rtma_atomic_store64(&slot->max_ns, 0LL);
+	}
+
+	rtma_atomic_store64(&h->dropped, 0LL);
+}
+
+long long rtma_client_latency_dropped(Client* c) {
+	return c->latency ? rtma_atomic_load64(&c->latency->dropped) : 0;
+}
+
+void rtma_client_print_latency_histograms(Client* c) {
+	LatencyHistograms* h = c->latency;
+
+	if (h == NULL)
+		return;
+
+	LatencyHistogram* hists = (LatencyHistogram*)malloc((h->mask + 1) * sizeof(LatencyHistogram));
+	if (hists == NULL) {
+		perror("rtma_client_print_latency_histograms:malloc failed");
+		return;
+	}
+
+	int n = rtma_client_get_latency_histograms(c, hists, h->mask + 1, FALSE);
+
+	printf("-----Latency (us)-----\n\n");
+	printf("%10s %8s %12s %10s %10s %10s %10s %10s\n", "msg_type", "src_mod", "count", "mean", "p50", "p99", "p99.9", "max");
+	for (int i = 0; i < n; i++) {
+		LatencyHistogram* hist = &hists[i];
+
+		if (hist->count == 0)
+			continue;
+
+		printf("%10d %8d %12lld %10.1lf %10.1lf %10.1lf %10.1lf %10.1lf\n",
+			hist->msg_type,
+			hist->src_mod_id,
+			hist->count,
+			(double)hist->sum_ns / (double)hist->count / 1e3,
+			rtma_histogram_percentile(hist, 50.0) / 1e3,
+			rtma_histogram_percentile(hist, 99.0) / 1e3,
+			rtma_histogram_percentile(hist, 99.9) / 1e3,
+			hist->max_ns / 1e3);
+	}
+
+	long long dropped = rtma_client_latency_dropped(c);
+	if (dropped)
+		printf("%lld messages not recorded, histogram table full\n", dropped);
+
+	free(hists);
+}
+
+/* PLAIN HISTOGRAMS */
+
+// Single threaded recording into a snapshot style histogram
+void rtma_histogram_record(LatencyHistogram* hist, long long value_ns) {
+	if (value_ns < 0)
+		value_ns = 0;
+
+	hist->buckets[rtma_histogram_bucket_index(value_ns)]++;
+	hist->count++;
+	hist->sum_ns += value_ns;
+	if (value_ns > hist->max_ns)
+		hist->max_ns = value_ns;
+}
+
+// Smallest recorded value v such that percentile % of the values are <= v,
+// reported as the upper edge of its bucket and never above the maximum
+long long rtma_histogram_percentile(const LatencyHistogram* hist, double percentile) {
+	if (hist->count == 0)
+		return 0;
+
+	long long target = (long long)(percentile / 100.0 * (double)hist->count + 0.5);
+	if (target < 1)
+		target = 1;
+
+	long long seen = 0;
+	for (int b = 0; b < RTMA_HIST_NUM_BUCKETS; b++) {
+		seen += hist->buckets[b];
+		if (seen >= target) {
+			long long upper = rtma_histogram_bucket_upper(b);
+			return upper < hist->max_ns ? upper : hist->max_ns;
+		}
+	}
+
+	return hist->max_ns;
+}
+
+long long rtma_histogram_min(const LatencyHistogram* hist) {
+	for (int b = 0; b < RTMA_HIST_NUM_BUCKETS; b++) {
+		if (hist->buckets[b])
+			return rtma_histogram_bucket_lower(b);
+	}
+
+	return 0;
+}
+
+// Text rendering of the occupied range, merged down to about 30 rows
+void rtma_histogram_print(const LatencyHistogram* hist) {
+	int first = -1, last = -1;
+	long long peak = 0;
+
+	for (int b = 0; b < RTMA_HIST_NUM_BUCKETS; b++) {
+		if (hist->buckets[b]) {
+			if (first < 0)
+				first = b;
+			last = b;
+		}
+	}
+
+	if (first < 0)
+		return;
+
+	int per_row = (last - first) / 30 + 1;
+
+	for (int b = first; b <= last; b += per_row) {
+		long long n = 0;
+		for (int i = b; i < b + per_row && i <= last; i++)
+			n += hist->buckets[i];
+		if (n > peak)
+			peak = n;
+	}
+
+	for (int b = first; b <= last; b += per_row) {
+		long long n = 0;
+		int end = b + per_row - 1 < last ? b + per_row - 1 : last;
+		for (int i = b; i <= end; i++)
+			n += hist->buckets[i];
+
+		int width = (int)(50 * n / peak);
+		printf("%10.1lf - %10.1lf us %10lld |", rtma_histogram_bucket_lower(b) / 1e3, rtma_histogram_bucket_upper(end) / 1e3, n);
+		for (int i = 0; i < width; i++)
+			printf("#");
+		printf("\n");
+	}
+}
@@ -0,0 +1,823 @@
+// Minimal message manager for running modules, tests and rtma_bench on a
+// single Linux box. Speaks the same protocol as the RTMA MessageManager:
+// connect with dynamic module ids, subscription control with ACKs and
+// fan-out to subscribers, honoring dest_mod_id and dest_host_id.
+//
+// One thread services every connection through epoll. Messages are copied
+// into per-module outbound buffers while the readable sockets are drained and
+// every buffer is written out once per loop iteration, so a burst from one
+// publisher reaches each subscriber in as few writes as possible.
+//
+// Modules connecting with "shm://" attach through a Unix domain socket and
+// exchange messages over shared memory rings instead (see rtma_shm.h).
+
+#include "rtma_client.h"
+#include "rtma_shm.h"
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#define MM_RECV_BUFFER_SIZE (256 * 1024)
+#define MM_OUT_BUFFER_SIZE (64 * 1024)
+#define MM_MAX_OUT_BUFFER (64 * 1024 * 1024)	// Messages for a subscriber this far behind are dropped
+#define MM_MAX_DROPPED_TRAINS 64	// Dynamic messages a module is remembered to be missing
+#define MM_MAX_EVENTS 256
+#define MM_FIRST_DYNAMIC_ID 100
+#define MM_MAX_MODULES 0x8000
+
+// Identifies the fragments of one dynamic message
+typedef struct {
+	MODULE_ID src_mod_id;
+	int msg_count;
+} TrainKey;
+
+typedef struct Module {
+	int fd;		// TCP socket, or the liveness socket of a shared memory module
+	RtmaShm* shm;
+	MODULE_ID mod_id;
+	int pid;
+	int closed;
+	char* recv_buf;
+	size_t recv_head;
+	size_t recv_tail;
+	char* out_buf;
+	size_t out_size;
+	size_t out_head;
+	size_t out_tail;
+	int dirty;		// Queued on the flush list
+	int want_write;	// EPOLLOUT is enabled
+	long long dropped;
+	std::vector<MSG_TYPE> subscriptions;
+	std::vector<TrainKey> dropped_trains;	// Dynamic messages whose remaining fragments are dropped
+} Module;
+
+typedef struct {
+	Module* m;
+	int paused;
+} Subscriber;
+
+typedef struct {
+	long long msgs_in;
+	long long msgs_out;
+	long long bytes_out;
+	long long writes;
+	long long dropped;
+	int connections;
+} MMStats;
+
+static int epfd = -1;
+static volatile sig_atomic_t running = 1;
+static std::vector<Subscriber> subscribers[MAX_MESSAGE_TYPES];
+static std::vector<Subscriber> all_subscribers;	// Subscribed to ALL_MESSAGE_TYPES
+static Module* modules_by_id[MM_MAX_MODULES];
+static std::vector<Module*> dirty_modules;
+static std::vector<Module*> closed_modules;
+static MMStats stats;
+static int verbose = 0;
+
+// epoll data of the listening sockets, everything else is a Module
+static char tcp_listener;
+static char unix_listener;
+static char shm_listener;
+
+static double mm_timestamp(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void mm_set_events(Module* m, uint32_t events) {
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = m;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, m->fd, &ev);
+}
+
+static std::vector<Subscriber>* mm_subscriber_list(MSG_TYPE msg_type) {
+	if (msg_type == ALL_MESSAGE_TYPES)
+		return &all_subscribers;
+	if (msg_type < 0 || msg_type >= MAX_MESSAGE_TYPES)
+		return NULL;
+	return &subscribers[msg_type];
+}
+
+static void mm_remove_subscriber(std::vector<Subscriber>* list, Module* m) {
+	for (size_t i = 0; i < list->size(); i++) {
+		if ((*list)[i].m == m) {
+			list->erase(list->begin() + i);
+			return;
+		}
+	}
+}
+
+static void mm_close(Module* m) {
+	if (m->closed)
+		return;
+
+	if (verbose)
+		printf("Module %d disconnected\n", m->mod_id);
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, m->fd, NULL);
+	close(m->fd);
+	if (m->shm) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, rtma_shm_fd(m->shm), NULL);
+		rtma_shm_close(&m->shm);
+	}
+	m->closed = 1;
+
+	for (MSG_TYPE msg_type : m->subscriptions)
+		mm_remove_subscriber(mm_subscriber_list(msg_type), m);
+	m->subscriptions.clear();
+
+	if (modules_by_id[m->mod_id] == m)
+		modules_by_id[m->mod_id] = NULL;
+
+	stats.dropped += m->dropped;
+	stats.connections--;
+
+	// Events later in this iteration may still refer to the module
+	closed_modules.push_back(m);
+}
+
+// Move what fits of the outbound buffer into the ring and wake the module.
+// If the ring is full the module signals us once it has made room.
+static void mm_flush_shm(Module* m) {
+	if (m->out_head < m->out_tail) {
+		size_t n = rtma_shm_write(m->shm, m->out_buf + m->out_head, m->out_tail - m->out_head);
+		m->out_head += n;
+		stats.bytes_out += n;
+	}
+
+	if (m->out_head == m->out_tail) {
+		m->out_head = 0;
+		m->out_tail = 0;
+	}
+
+	rtma_shm_notify(m->shm);
+	stats.writes++;
+}
+
+// Write out as much of the outbound buffer as the socket takes
+static void mm_flush(Module* m) {
+	if (m->shm) {
+		mm_flush_shm(m);
+		return;
+	}
+
+	while (m->out_head < m->out_tail) {
+		ssize_t n = send(m->fd, m->out_buf + m->out_head, m->out_tail - m->out_head, MSG_NOSIGNAL);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			mm_close(m);
+			return;
+		}
+
+		m->out_head += n;
+		stats.bytes_out += n;
+		stats.writes++;
+	}
+
+	if (m->out_head == m->out_tail) {
+		m->out_head = 0;
+		m->out_tail = 0;
+	}
+
+	// Only ask for writability while data is backed up
+	int backed_up = m->out_tail > m->out_head;
+	if (backed_up != m->want_write) {
+		m->want_write = backed_up;
+		mm_set_events(m, backed_up ? EPOLLIN | EPOLLOUT : EPOLLIN);
+	}
+}
+
+// Append a message to the module's outbound buffer. It goes out with
+// everything else queued for the module at the end of the loop iteration.
+// Only dropped if the buffer cannot grow, see mm_queue_routed for the limit.
+static void mm_queue(Module* m, const char* frame, size_t len) {
+	if (!m->dirty) {
+		m->dirty = 1;
+		dirty_modules.push_back(m);
+	}
+
+	// Straight into the ring unless older messages are still backed up
+	if (m->shm && m->out_head == m->out_tail) {
+		size_t n = rtma_shm_write(m->shm, frame, len);
+		stats.bytes_out += n;
+		frame += n;
+		len -= n;
+
+		if (len == 0) {
+			stats.msgs_out++;
+			return;
+		}
+	}
+
+	if (m->out_tail + len > m->out_size) {
+		// Compact before growing
+		if (m->out_head > 0) {
+			memmove(m->out_buf, m->out_buf + m->out_head, m->out_tail - m->out_head);
+			m->out_tail -= m->out_head;
+			m->out_head = 0;
+		}
+
+		if (m->out_tail + len > m->out_size) {
+			size_t size = m->out_size;
+			while (size < m->out_tail + len)
+				size *= 2;
+
+			char* buf = (char*)realloc(m->out_buf, size);
+			if (buf == NULL) {
+				m->dropped++;
+				return;
+			}
+			m->out_buf = buf;
+			m->out_size = size;
+		}
+	}
+
+	memcpy(m->out_buf + m->out_tail, frame, len);
+	m->out_tail += len;
+	stats.msgs_out++;
+}
+
+static int mm_find_dropped_train(Module* m, const RTMA_MSG_HEADER* header) {
+	for (size_t i = 0; i < m->dropped_trains.size(); i++) {
+		if (m->dropped_trains[i].src_mod_id == header->src_mod_id && m->dropped_trains[i].msg_count == header->msg_count)
+			return (int)i;
+	}
+	return -1;
+}
+
+// Queue a routed message unless the module has fallen MM_MAX_OUT_BUFFER
+// behind. Dynamic messages are queued or dropped whole: the first fragment
+// decides for the size of the entire message and the rest follow it.
+static void mm_queue_routed(Module* m, const RTMA_MSG_HEADER* header, const char* frame, size_t len) {
+	if (header->is_dynamic == RTMA_DYNAMIC_NEXT) {
+		int i = mm_find_dropped_train(m, header);
+		if (i < 0)
+			mm_queue(m, frame, len);
+		else if (header->remaining_bytes <= 0)
+			m->dropped_trains.erase(m->dropped_trains.begin() + i);
+		return;
+	}
+
+	size_t total = len;
+	if (header->is_dynamic == RTMA_DYNAMIC_FIRST && header->remaining_bytes > 0) {
+		size_t fragments = ((size_t)header->remaining_bytes + MAX_DATA_BYTES - 1) / MAX_DATA_BYTES;
+		total += (size_t)header->remaining_bytes + fragments * sizeof(RTMA_MSG_HEADER);
+	}
+
+	if (m->out_tail - m->out_head + total <= MM_MAX_OUT_BUFFER) {
+		mm_queue(m, frame, len);
+		return;
+	}
+
+	m->dropped++;
+	if (header->is_dynamic == RTMA_DYNAMIC_FIRST && header->remaining_bytes > 0) {
+		// Fragments of a publisher that went away are never seen again
+		if (m->dropped_trains.size() >= MM_MAX_DROPPED_TRAINS)
+			m->dropped_trains.erase(m->dropped_trains.begin());
+		m->dropped_trains.push_back({ header->src_mod_id, header->msg_count });
+	}
+}
+
+// Replies from the manager itself are never dropped, the module matches
+// acknowledgements to its requests by their order
+static void mm_send_to_module(Module* m, MSG_TYPE msg_type, const void* data, int len) {
+	char frame[sizeof(RTMA_MSG_HEADER) + 64];
+	RTMA_MSG_HEADER header;
+
+	memset(&header, 0, sizeof(header));
+	header.msg_type = msg_type;
+	header.send_time = mm_timestamp();
+	header.src_mod_id = MID_MESSAGE_MANAGER;
+	header.dest_mod_id = m->mod_id;
+	header.num_data_bytes = len;
+
+	memcpy(frame, &header, sizeof(header));
+	if (len > 0)
+		memcpy(frame + sizeof(header), data, len);
+
+	mm_queue(m, frame, sizeof(header) + len);
+}
+
+static void mm_acknowledge(Module* m) {
+	mm_send_to_module(m, MT_ACKNOWLEDGE, NULL, 0);
+}
+
+static MODULE_ID mm_assign_module_id(void) {
+	static int next_id = MM_FIRST_DYNAMIC_ID;
+
+	for (int i = MM_FIRST_DYNAMIC_ID; i < MM_MAX_MODULES; i++) {
+		int id = next_id++;
+		if (next_id >= MM_MAX_MODULES)
+			next_id = MM_FIRST_DYNAMIC_ID;
+		if (modules_by_id[id] == NULL)
+			return (MODULE_ID)id;
+	}
+
+	return 0;
+}
+
+static void mm_subscription_control(Module* m, MSG_TYPE ctrl_type, const char* data, int len) {
+	MSG_TYPE msg_type;
+
+	if (len < (int)sizeof(msg_type)) {
+		mm_acknowledge(m);
+		return;
+	}
+	memcpy(&msg_type, data, sizeof(msg_type));
+
+	std::vector<Subscriber>* list = mm_subscriber_list(msg_type);
+
+	if (list == NULL) {
+		if (ctrl_type == MT_SUBSCRIBE) {
+			MDF_FAIL_SUBSCRIBE fail;
+			fail.mod_id = m->mod_id;
+			fail.reserved = 0;
+			fail.msg_type = msg_type;
+			mm_send_to_module(m, MT_FAIL_SUBSCRIBE, &fail, sizeof(fail));
+		}
+		mm_acknowledge(m);
+		return;
+	}
+
+	Subscriber* sub = NULL;
+	for (auto& s : *list) {
+		if (s.m == m)
+			sub = &s;
+	}
+
+	switch (ctrl_type) {
+	case MT_SUBSCRIBE:
+		if (sub == NULL) {
+			list->push_back({ m, 0 });
+			m->subscriptions.push_back(msg_type);
+		}
+		break;
+	case MT_UNSUBSCRIBE:
+		if (sub) {
+			mm_remove_subscriber(list, m);
+			for (size_t i = 0; i < m->subscriptions.size(); i++) {
+				if (m->subscriptions[i] == msg_type) {
+					m->subscriptions.erase(m->subscriptions.begin() + i);
+					break;
+				}
+			}
+		}
+		break;
+	case MT_PAUSE_SUBSCRIPTION:
+		if (sub)
+			sub->paused = 1;
+		break;
+	case MT_RESUME_SUBSCRIPTION:
+		if (sub)
+			sub->paused = 0;
+		break;
+	}
+
+	mm_acknowledge(m);
+}
+
+static void mm_forward_to(const std::vector<Subscriber>& list, const RTMA_MSG_HEADER* header, const char* frame, size_t len) {
+	for (const Subscriber& s : list) {
+		if (s.paused || s.m->closed)
+			continue;
+		if (header->dest_mod_id != 0 && header->dest_mod_id != s.m->mod_id)
+			continue;
+		mm_queue_routed(s.m, header, frame, len);
+	}
+}
+
+static void mm_route(const RTMA_MSG_HEADER* header, const char* frame, size_t len) {
+	// Messages for other hosts would be the network relay's business
+	if (header->dest_host_id != HID_LOCAL_HOST && header->dest_host_id != HID_ALL_HOSTS)
+		return;
+
+	if (header->msg_type >= 0 && header->msg_type < MAX_MESSAGE_TYPES)
+		mm_forward_to(subscribers[header->msg_type], header, frame, len);
+
+	if (!all_subscribers.empty())
+		mm_forward_to(all_subscribers, header, frame, len);
+}
+
+static void mm_handle_message(Module* m, const RTMA_MSG_HEADER* header, const char* frame) {
+	const char* data = frame + sizeof(RTMA_MSG_HEADER);
+	size_t len = sizeof(RTMA_MSG_HEADER) + header->num_data_bytes;
+
+	stats.msgs_in++;
+
+	switch (header->msg_type) {
+	case MT_CONNECT:
+		if (m->mod_id == 0) {
+			int mod_id = header->src_mod_id ? header->src_mod_id : mm_assign_module_id();
+
+			// No acknowledgement, the module's connect fails
+			if (mod_id == 0) {
+				fprintf(stderr, "rtma_mm: no module ids left, closing connection.\n");
+				mm_close(m);
+				break;
+			}
+			if (mod_id < 0 || mod_id >= MM_MAX_MODULES || modules_by_id[mod_id] != NULL) {
+				fprintf(stderr, "rtma_mm: module id %d %s, closing connection.\n", mod_id,
+					mod_id < 0 || mod_id >= MM_MAX_MODULES ? "is invalid" : "is already connected");
+				mm_close(m);
+				break;
+			}
+
+			m->mod_id = (MODULE_ID)mod_id;
+			modules_by_id[m->mod_id] = m;
+			if (verbose)
+				printf("Module %d connected\n", m->mod_id);
+		}
+		mm_acknowledge(m);
+		break;
+	case MT_DISCONNECT:
+		mm_close(m);
+		break;
+	case MT_SUBSCRIBE:
+	case MT_UNSUBSCRIBE:
+	case MT_PAUSE_SUBSCRIPTION:
+	case MT_RESUME_SUBSCRIPTION:
+		mm_subscription_control(m, header->msg_type, data, header->num_data_bytes);
+		break;
+	case MT_MODULE_READY:
+		if (header->num_data_bytes >= (int)sizeof(MDF_MODULE_READY)) {
+			MDF_MODULE_READY ready;
+			memcpy(&ready, data, sizeof(ready));
+			m->pid = ready.pid;
+		}
+		mm_route(header, frame, len);
+		break;
+	default:
+		mm_route(header, frame, len);
+		break;
+	}
+}
+
+// One recv per readiness notification keeps a busy publisher from starving
+// the other connections. Level triggered epoll brings us back for the rest.
+static void mm_read(Module* m) {
+	if (m->recv_head == m->recv_tail) {
+		m->recv_head = 0;
+		m->recv_tail = 0;
+	}
+	else if (MM_RECV_BUFFER_SIZE - m->recv_tail < sizeof(Message)) {
+		memmove(m->recv_buf, m->recv_buf + m->recv_head, m->recv_tail - m->recv_head);
+		m->recv_tail -= m->recv_head;
+		m->recv_head = 0;
+	}
+
+	ssize_t n;
+
+	if (m->shm) {
+		// The signal may be stale; an empty ring just rearms it
+		if (!rtma_shm_wait(m->shm, SOCKET_WAIT_READ, NONBLOCKING))
+			return;
+		n = (ssize_t)rtma_shm_read(m->shm, m->recv_buf + m->recv_tail, MM_RECV_BUFFER_SIZE - m->recv_tail);
+	}
+	else {
+		n = recv(m->fd, m->recv_buf + m->recv_tail, MM_RECV_BUFFER_SIZE - m->recv_tail, 0);
+	}
+
+	if (n == 0) {
+		mm_close(m);
+		return;
+	}
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			mm_close(m);
+		return;
+	}
+
+	m->recv_tail += n;
+
+	while (!m->closed && m->recv_tail - m->recv_head >= sizeof(RTMA_MSG_HEADER)) {
+		RTMA_MSG_HEADER header;
+		char* frame = m->recv_buf + m->recv_head;
+		memcpy(&header, frame, sizeof(header));
+
+		if (header.num_data_bytes < 0 || header.num_data_bytes > MAX_DATA_BYTES) {
+			fprintf(stderr, "rtma_mm: bad message from module %d, closing connection.\n", m->mod_id);
+			mm_close(m);
+			return;
+		}
+
+		size_t len = sizeof(RTMA_MSG_HEADER) + header.num_data_bytes;
+		if (m->recv_tail - m->recv_head < len)
+			break;
+
+		mm_handle_message(m, &header, frame);
+		m->recv_head += len;
+	}
+}
+
+static Module* mm_create_module(int fd, RtmaShm* shm) {
+	Module* m = new Module();
+	m->fd = fd;
+	m->shm = shm;
+	m->recv_buf = (char*)malloc(MM_RECV_BUFFER_SIZE);
+	m->out_size = MM_OUT_BUFFER_SIZE;
+	m->out_buf = (char*)malloc(m->out_size);
+
+	if (m->recv_buf == NULL || m->out_buf == NULL) {
+		perror("rtma_mm:malloc failed");
+		exit(EXIT_FAILURE);
+	}
+
+	stats.connections++;
+	return m;
+}
+
+static void mm_accept(int listen_fd) {
+	for (;;) {
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				perror("rtma_mm:accept");
+			return;
+		}
+
+		// Fails harmlessly on Unix domain sockets
+		int optval = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+		Module* m = mm_create_module(fd, NULL);
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = m;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+}
+
+// Shared memory modules are woken through their eventfd. Their socket only
+// reports the module going away.
+static void mm_accept_shm(int listen_fd) {
+	RtmaShm* shm;
+	int fd;
+
+	while ((shm = rtma_shm_accept(listen_fd, &fd)) != NULL) {
+		Module* m = mm_create_module(fd, shm);
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = m;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, rtma_shm_fd(shm), &ev);
+
+		ev.events = EPOLLRDHUP;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+}
+
+// Everything the module wrote before hanging up is still in its ring
+static void mm_drain_shm(Module* m) {
+	while (!m->closed && rtma_shm_readable(m->shm))
+		mm_read(m);
+}
+
+static int mm_listen(const char* addr, int port) {
+	struct addrinfo hints;
+	struct addrinfo* res = NULL;
+	char port_str[16];
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+	snprintf(port_str, sizeof(port_str), "%d", port);
+
+	int ret = getaddrinfo(addr, port_str, &hints, &res);
+	if (ret) {
+		fprintf(stderr, "rtma_mm: %s\n", gai_strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+
+	int fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+	if (fd < 0) {
+		perror("rtma_mm:socket");
+		exit(EXIT_FAILURE);
+	}
+
+	int optval = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+	if (bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, 1024) < 0) {
+		perror("rtma_mm:bind");
+		exit(EXIT_FAILURE);
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+// Path of a Unix domain socket, or an abstract name starting with '@'
+static int mm_listen_unix(const char* path) {
+	struct sockaddr_un addr;
+	size_t len = strlen(path);
+
+	if (len >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "rtma_mm: socket path too long: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path, len);
+	if (path[0] == '@')
+		addr.sun_path[0] = '\0';
+	else
+		unlink(path);	// Left over from a previous run
+
+	socklen_t addrlen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len + (path[0] == '@' ? 0 : 1));
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr*)&addr, addrlen) < 0 || listen(fd, 1024) < 0) {
+		perror("rtma_mm:bind");
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+static void mm_stop(int) {
+	running = 0;
+}
+
+void usage(void) {
+	printf("Usage: rtma_mm [-s ADDRESS] [-p PORT] [-u PATH] [-noshm] [-v]\n");
+	printf("- s string\n\tAddress to listen on (default 0.0.0.0)\n");
+	printf("- p int\n\tPort to listen on (default 7111)\n");
+	printf("- u string\n\tAlso listen on a Unix domain socket at PATH, or @NAME in the abstract namespace\n");
+	printf("- noshm\n\tDon't offer the shared memory transport\n");
+	printf("- v\n\tLog connects and disconnects\n");
+	printf("- h\n\tShow help message\n");
+}
+
+int main(int argc, char** argv) {
+	const char* addr = "0.0.0.0";
+	int port = 7111;
+	int use_shm = 1;
+	const char* unix_path = NULL;
+
+	const char* prog_name = argv[0];
+	char* flag;
+
+	while (--argc > 0 && (*++argv)[0] == '-') {
+		flag = &((*argv)[1]);
+
+		if (strcmp(flag, "s") == 0 && argc > 1) {
+			addr = *++argv;
+			argc--;
+		}
+		else if (strcmp(flag, "p") == 0 && argc > 1) {
+			port = atoi(*++argv);
+			argc--;
+		}
+		else if (strcmp(flag, "u") == 0 && argc > 1) {
+			unix_path = *++argv;
+			argc--;
+		}
+		else if (strcmp(flag, "noshm") == 0) {
+			use_shm = 0;
+		}
+		else if (strcmp(flag, "v") == 0) {
+			verbose = 1;
+		}
+		else if (strcmp(flag, "h") == 0) {
+			usage();
+			return 0;
+		}
+		else {
+			fprintf(stderr, "%s: unknown arg %s\n", prog_name, *argv);
+			usage();
+			return -1;
+		}
+	}
+
+	signal(SIGINT, mm_stop);
+	signal(SIGTERM, mm_stop);
+	signal(SIGPIPE, SIG_IGN);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("rtma_mm:epoll_create1");
+		return EXIT_FAILURE;
+	}
+
+	int listen_fd = mm_listen(addr, port);
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &tcp_listener;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+	int unix_fd = unix_path ? mm_listen_unix(unix_path) : -1;
+	if (unix_fd >= 0) {
+		ev.data.ptr = &unix_listener;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, unix_fd, &ev);
+	}
+
+	int shm_fd = use_shm ? rtma_shm_listen((uint16_t)port) : -1;
+	if (shm_fd >= 0) {
+		ev.data.ptr = &shm_listener;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, shm_fd, &ev);
+	}
+	else if (use_shm) {
+		fprintf(stderr, "rtma_mm: shared memory transport unavailable.\n");
+	}
+
+	printf("rtma_mm listening on %s:%d%s%s%s\n", addr, port, unix_fd >= 0 ? ", " : "", unix_fd >= 0 ? unix_path : "", shm_fd >= 0 ? " and shm://" : "");
+	fflush(stdout);
+
+	struct epoll_event events[MM_MAX_EVENTS];
+
+	while (running) {
+		int nfds = epoll_wait(epfd, events, MM_MAX_EVENTS, -1);
+
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("rtma_mm:epoll_wait");
+			break;
+		}
+
+		for (int i = 0; i < nfds; i++) {
+			void* source = events[i].data.ptr;
+
+			if (source == &tcp_listener) {
+				mm_accept(listen_fd);
+				continue;
+			}
+			if (source == &unix_listener) {
+				mm_accept(unix_fd);
+				continue;
+			}
+			if (source == &shm_listener) {
+				mm_accept_shm(shm_fd);
+				continue;
+			}
+
+			Module* m = (Module*)source;
+
+			if (m->closed)
+				continue;
+
+			if (m->shm && (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))) {
+				mm_drain_shm(m);
+				mm_close(m);
+			}
+			else if (events[i].events & EPOLLIN)
+				mm_read(m);
+			else if (events[i].events & (EPOLLERR | EPOLLHUP))
+				mm_close(m);
+
+			// A shared memory module also signals when it makes room
+			if (!m->closed && ((events[i].events & EPOLLOUT) || (m->shm && m->out_tail > m->out_head)))
+				mm_flush(m);
+		}
+
+		// Coalesced writes: everything queued for a module this iteration
+		// goes out together
+		for (Module* m : dirty_modules) {
+			m->dirty = 0;
+			if (!m->closed)
+				mm_flush(m);
+		}
+		dirty_modules.clear();
+
+		for (Module* m : closed_modules) {
+			free(m->recv_buf);
+			free(m->out_buf);
+			delete m;
+		}
+		closed_modules.clear();
+	}
+
+	printf("\n%lld messages in | %lld messages out | %0.1lf MB out | %lld writes | %lld dropped\n",
+		stats.msgs_in,
+		stats.msgs_out,
+		stats.bytes_out / 1e6,
+		stats.writes,
+		stats.dropped);
+
+	close(listen_fd);
+	if (unix_fd >= 0) {
+		close(unix_fd);
+		if (unix_path[0] != '@')
+			unlink(unix_path);
+	}
+	if (shm_fd >= 0)
+		close(shm_fd);
+	close(epfd);
+	return 0;
+}
@@ -0,0 +1,530 @@
+#include "rtma_outbound.h"
+#include "rtma_client_internal.h"
+#include "rtma_time.h"
+
+// Most queued messages gathered into one write
+#define RTMA_OUTBOUND_BATCH 64
+#define RTMA_OUTBOUND_INITIAL_RECORDS 1024
+// Policy slot of types that follow the default
+#define RTMA_OUTBOUND_DEFAULT 0xFF
+// Types below this are the manager's control messages. Their replies are
+// matched to requests in order, so they are never dropped or conflated.
+#define RTMA_OUTBOUND_CONTROL_TYPES 100
+
+typedef struct {
+	size_t offset;	// Start of the frame in buf
+	int len;
+	MSG_TYPE msg_type;
+	int dead;		// Dropped or conflated after it was queued
+	int reserved;
+}OutboundRecord;
+
+// Frames are appended to buf in queue order. Records head..tail-1 describe
+// them; the head record may be partly written already.
+struct OutboundQueue {
+	char* buf;
+	size_t buf_size;
+	size_t buf_tail;
+	OutboundRecord* records;
+	long long mask;
+	long long head;
+	long long tail;
+	size_t partial;		// Bytes of the head record already written
+	size_t high_watermark;
+	size_t low_watermark;
+	unsigned char* policies;	// Per msg_type, RTMA_OUTBOUND_DEFAULT for the default
+	int default_policy;
+	long long* newest;	// Record + 1 of the newest queued message per type, for conflation
+	RTMA_BACKPRESSURE_FN callback;
+	void* callback_ctx;
+	OutboundStats stats;	// bytes and backpressure are kept up to date
+};
+
+// Control messages and types outside the policy table always block
+static int rtma_outbound_policy(OutboundQueue* q, MSG_TYPE msg_type) {
+	if (msg_type < RTMA_OUTBOUND_CONTROL_TYPES || msg_type >= MAX_MESSAGE_TYPES)
+		return RTMA_OUTBOUND_BLOCK;
+
+	if (q->policies[msg_type] == RTMA_OUTBOUND_DEFAULT)
+		return q->default_policy;
+
+	return q->policies[msg_type];
+}
+
+static void rtma_outbound_update_backpressure(Client* c, OutboundQueue* q) {
+	if (q->stats.bytes > q->stats.high_water_bytes)
+		q->stats.high_water_bytes = q->stats.bytes;
+
+	if (!q->stats.backpressure && q->stats.bytes > q->high_watermark) {
+		q->stats.backpressure = TRUE;
+		q->stats.backpressure_events++;
+		if (q->callback)
+			q->callback(c, TRUE, q->callback_ctx);
+	}
+	else if (q->stats.backpressure && q->stats.bytes <= q->low_watermark) {
+		q->stats.backpressure = FALSE;
+		if (q->callback)
+			q->callback(c, FALSE, q->callback_ctx);
+	}
+}
+
+// A record that may still be dropped or rewritten: queued and not yet
+// started on
+static int rtma_outbound_pending(OutboundQueue* q, long long seq) {
+	return seq >= q->head && seq < q->tail && !(seq == q->head && q->partial > 0) && !q->records[seq & q->mask].dead;
+}
+
+static void rtma_outbound_kill(OutboundQueue* q, OutboundRecord* r) {
+	r->dead = TRUE;
+	q->stats.bytes -= r->len;
+}
+
+// Newest queued message of a conflated type that can still be replaced
+static OutboundRecord* rtma_outbound_newest(OutboundQueue* q, MSG_TYPE msg_type) {
+	long long seq = q->newest[msg_type] - 1;
+
+	if (!rtma_outbound_pending(q, seq) || q->records[seq & q->mask].msg_type != msg_type)
+		return NULL;
+
+	return &q->records[seq & q->mask];
+}
+
+// Make room for len more bytes of frames and one more record
+static int rtma_outbound_reserve(OutboundQueue* q, size_t len) {
+	if (q->tail - q->head > q->mask) {
+		long long size = (q->mask + 1) * 2;
+		OutboundRecord* records = (OutboundRecord*)malloc(size * sizeof(OutboundRecord));
+		if (records == NULL) {
+			perror("rtma_client_send_message:malloc failed");
+			return -1;
+		}
+
+		for (long long seq = q->head; seq < q->tail; seq++)
+			records[seq & (size - 1)] = q->records[seq & q->mask];
+
+		free(q->records);
+		q->records = records;
+		q->mask = size - 1;
+	}
+
+	if (q->buf_tail + len <= q->buf_size)
+		return 0;
+
+	// Move the queued frames to the front before growing
+	size_t start = q->head < q->tail ? q->records[q->head & q->mask].offset : q->buf_tail;
+	if (start > 0) {
+		memmove(q->buf, q->buf + start, q->buf_tail - start);
+		q->buf_tail -= start;
+		for (long long seq = q->head; seq < q->tail; seq++)
+			q->records[seq & q->mask].offset -= start;
+	}
+
+	if (q->buf_tail + len > q->buf_size) {
+		size_t size = q->buf_size * 2;
+		while (size < q->buf_tail + len)
+			size *= 2;
+
+		char* buf = (char*)realloc(q->buf, size);
+		if (buf == NULL) {
+			perror("rtma_client_send_message:realloc failed");
+			return -1;
+		}
+		q->buf = buf;
+		q->buf_size = size;
+	}
+
+	return 0;
+}
+
+// Copy a frame into the queue, continuing in the segments where the last
+// call stopped
+static long long rtma_outbound_append(OutboundQueue* q, const RTMA_MSG_HEADER* header, size_t data_len, const DataSegment* segments, int* seg, size_t* seg_offset) {
+	size_t len = sizeof(RTMA_MSG_HEADER) + data_len;
+
+	if (rtma_outbound_reserve(q, len))
+		return -1;
+
+	char* dst = q->buf + q->buf_tail;
+	memcpy(dst, header, sizeof(RTMA_MSG_HEADER));
+	dst += sizeof(RTMA_MSG_HEADER);
+
+	while (data_len > 0) {
+		size_t n = segments[*seg].len - *seg_offset;
+		if (n > data_len)
+			n = data_len;
+
+		memcpy(dst, (const char*)segments[*seg].data + *seg_offset, n);
+		dst += n;
+		data_len -= n;
+		*seg_offset += n;
+
+		if (*seg_offset == segments[*seg].len) {
+			(*seg)++;
+			*seg_offset = 0;
+		}
+	}
+
+	long long seq = q->tail++;
+	OutboundRecord* r = &q->records[seq & q->mask];
+	r->offset = q->buf_tail;
+	r->len = (int)len;
+	r->msg_type = header->msg_type;
+	r->dead = FALSE;
+
+	q->buf_tail += len;
+	q->stats.bytes += len;
+
+	return seq;
+}
+
+// Write out as much as the transport takes without blocking. Returns the
+// number of bytes still queued.
+size_t rtma_outbound_write(Client* c) {
+	OutboundQueue* q = c->outbound;
+
+	while (q->head < q->tail) {
+		socket_iovec_t iov[RTMA_OUTBOUND_BATCH];
+		int n = 0;
+		size_t len = 0;
+
+		for (long long seq = q->head; seq < q->tail && n < RTMA_OUTBOUND_BATCH; seq++) {
+			OutboundRecord* r = &q->records[seq & q->mask];
+			if (r->dead)
+				continue;
+
+			size_t skip = seq == q->head ? q->partial : 0;
+			SOCKET_IOVEC_SET(iov[n], q->buf + r->offset + skip, r->len - skip);
+			len += r->len - skip;
+			n++;
+		}
+
+		int nbytes = n > 0 ? rtma_client_try_writev(c, iov, n) : 0;
+		if (nbytes == SOCKET_ERROR) {
+			// Takes the queue with it
+			rtma_client_connection_lost(c);
+			return 0;
+		}
+
+		size_t written = (size_t)nbytes;
+		int full = written < len;
+
+		// Retire what went out, and dead records on the way
+		while (q->head < q->tail) {
+			OutboundRecord* r = &q->records[q->head & q->mask];
+
+			if (!r->dead) {
+				size_t remaining = r->len - q->partial;
+				if (written < remaining) {
+					q->partial += written;
+					q->stats.bytes -= written;
+					break;
+				}
+
+				written -= remaining;
+				q->stats.bytes -= remaining;
+				q->stats.sent++;
+			}
+
+			q->partial = 0;
+			q->head++;
+		}
+
+		if (full)
+			break;
+	}
+
+	if (q->head == q->tail) {
+		q->buf_tail = 0;
+		q->partial = 0;
+	}
+
+	rtma_outbound_update_backpressure(c, q);
+	return q->stats.bytes;
+}
+
+// Keep writing until at most target bytes are queued. Returns FALSE if the
+// timeout ran out or the connection went away first.
+static int rtma_outbound_wait(Client* c, size_t target, double timeout) {
+	double deadline = timeout > 0 ? rtma_time_now(RTMA_CLOCK_MONOTONIC) + timeout : 0.0;
+	double time_remaining = timeout;
+
+	while (rtma_outbound_write(c) > target) {
+		if (timeout == 0)
+			return FALSE;
+
+		if (timeout > 0) {
+			time_remaining = deadline - rtma_time_now(RTMA_CLOCK_MONOTONIC);
+			if (time_remaining <= 0)
+				return FALSE;
+		}
+
+		rtma_client_wait(c, SOCKET_WAIT_WRITE, time_remaining);
+	}
+
+	// A lost connection takes the queue with it
+	return c->sockfd != INVALID_SOCKET;
+}
+
+// Returns 0 once everything queued has been written, SOCKET_ERROR if the
+// connection went away first
+int rtma_outbound_drain(Client* c) {
+	return rtma_outbound_wait(c, 0, BLOCKING) ? 0 : SOCKET_ERROR;
+}
+
+// Queue a message under its type's policy and write out what the transport
+// takes. Returns the number of bytes queued, 0 if the message was dropped and
+// SOCKET_ERROR if the connection went away.
+int rtma_outbound_push(Client* c, const RTMA_MSG_HEADER* header, const DataSegment* segments, int num_segments, double timeout) {
+	OutboundQueue* q = c->outbound;
+	MSG_TYPE msg_type = header->msg_type;
+	size_t len = sizeof(RTMA_MSG_HEADER) + header->num_data_bytes;
+	int dynamic = header->num_data_bytes > MAX_DATA_BYTES;
+	int policy = dynamic ? RTMA_OUTBOUND_BLOCK : rtma_outbound_policy(q, msg_type);
+	int seg = 0;
+	size_t seg_offset = 0;
+
+	// Skip empty segments up front
+	while (seg < num_segments && segments[seg].len == 0)
+		seg++;
+
+	if (q->stats.backpressure)
+		rtma_outbound_write(c);
+
+	if (policy == RTMA_OUTBOUND_CONFLATE) {
+		OutboundRecord* r = rtma_outbound_newest(q, msg_type);
+
+		if (r != NULL && r->len == (int)len) {
+			// Same size, rewrite it in place and keep its position
+			memcpy(q->buf + r->offset, header, sizeof(RTMA_MSG_HEADER));
+			char* dst = q->buf + r->offset + sizeof(RTMA_MSG_HEADER);
+			for (; seg < num_segments; seg++) {
+				memcpy(dst, segments[seg].data, segments[seg].len);
+				dst += segments[seg].len;
+			}
+			q->stats.conflated++;
+			rtma_outbound_write(c);
+			return (int)len;
+		}
+
+		if (r != NULL) {
+			rtma_outbound_kill(q, r);
+			q->stats.conflated++;
+		}
+	}
+
+	if (q->stats.backpressure) {
+		switch (policy) {
+		case RTMA_OUTBOUND_DROP_NEWEST:
+			q->stats.dropped++;
+			return 0;
+
+		case RTMA_OUTBOUND_DROP_OLDEST: {
+			long long seq = q->head;
+			while (seq < q->tail && !(rtma_outbound_pending(q, seq) && q->records[seq & q->mask].msg_type == msg_type))
+				seq++;
+
+			q->stats.dropped++;
+			if (seq == q->tail)
+				return 0;
+			rtma_outbound_kill(q, &q->records[seq & q->mask]);
+			break;
+		}
+
+		case RTMA_OUTBOUND_BLOCK:
+			if (!rtma_outbound_wait(c, q->low_watermark, timeout)) {
+				q->stats.dropped++;
+				return c->sockfd == INVALID_SOCKET ? SOCKET_ERROR : 0;
+			}
+			break;
+		}
+	}
+
+	// Messages larger than MAX_DATA_BYTES go out as dynamic fragments
+	size_t remaining = header->num_data_bytes;
+	int is_dynamic = dynamic ? RTMA_DYNAMIC_FIRST : 0;
+	long long seq;
+
+	do {
+		RTMA_MSG_HEADER h = *header;
+		size_t fragment_len = remaining < MAX_DATA_BYTES ? remaining : MAX_DATA_BYTES;
+		remaining -= fragment_len;
+
+		if (is_dynamic) {
+			h.num_data_bytes = (int)fragment_len;
+			h.remaining_bytes = (int)remaining;
+			h.is_dynamic = is_dynamic;
+			is_dynamic = RTMA_DYNAMIC_NEXT;
+		}
+
+		seq = rtma_outbound_append(q, &h, fragment_len, segments, &seg, &seg_offset);
+		if (seq < 0) {
+			q->stats.dropped++;
+			return 0;
+		}
+
+		// Write as we go so that a large message does not pile up. The
+		// fragments queued so far went with a lost connection, the rest of
+		// the message must not follow them.
+		if (remaining > 0 && !rtma_outbound_wait(c, q->high_watermark, BLOCKING)) {
+			q->stats.dropped++;
+			return SOCKET_ERROR;
+		}
+	} while (remaining > 0);
+
+	q->stats.queued++;
+	if (policy == RTMA_OUTBOUND_CONFLATE)
+		q->newest[msg_type] = seq + 1;
+
+	rtma_outbound_write(c);
+	return c->sockfd == INVALID_SOCKET ? SOCKET_ERROR : (int)len;
+}
+
+// Discard everything queued, e.g. when the connection is gone
+void rtma_outbound_clear(Client* c) {
+	OutboundQueue* q = c->outbound;
+
+	q->head = q->tail;
+	q->partial = 0;
+	q->buf_tail = 0;
+	q->stats.bytes = 0;
+	rtma_outbound_update_backpressure(c, q);
+}
+
+void rtma_outbound_free(Client* c) {
+	OutboundQueue* q = c->outbound;
+
+	if (q == NULL)
+		return;
+
+	c->outbound = NULL;
+	free(q->buf);
+	free(q->records);
+	free(q->policies);
+	free(q->newest);
+	free(q);
+}
+
+// Route sends through the outbound queue. Watermarks are in bytes, 0 picks
+// the defaults. Cannot be combined with the send thread.
+int rtma_client_enable_outbound_queue(Client* c, size_t high_watermark, size_t low_watermark) {
+	if (c->outbound != NULL)
+		return 0;
+
+	if (c->send_queue != NULL) {
+		fprintf(stderr, "rtma_client_enable_outbound_queue: not available with the send thread.\n");
+		return -1;
+	}
+
+	if (high_watermark == 0)
+		high_watermark = RTMA_OUTBOUND_DEFAULT_HIGH_WATERMARK;
+	if (low_watermark == 0 || low_watermark > high_watermark)
+		low_watermark = high_watermark < RTMA_OUTBOUND_DEFAULT_LOW_WATERMARK ? high_watermark / 2 : RTMA_OUTBOUND_DEFAULT_LOW_WATERMARK;
+
+	OutboundQueue* q = (OutboundQueue*)calloc(1, sizeof(OutboundQueue));
+	if (q == NULL) {
+		perror("rtma_client_enable_outbound_queue:calloc failed");
+		return -1;
+	}
+
+	q->buf_size = high_watermark + 2 * sizeof(Message);
+	q->buf = (char*)malloc(q->buf_size);
+	q->records = (OutboundRecord*)malloc(RTMA_OUTBOUND_INITIAL_RECORDS * sizeof(OutboundRecord));
+	q->mask = RTMA_OUTBOUND_INITIAL_RECORDS - 1;
+	q->policies = (unsigned char*)malloc(MAX_MESSAGE_TYPES);
+	q->default_policy = RTMA_OUTBOUND_BLOCK;
+	q->high_watermark = high_watermark;
+	q->low_watermark = low_watermark;
+
+	if (q->buf == NULL || q->records == NULL || q->policies == NULL) {
+		perror("rtma_client_enable_outbound_queue:malloc failed");
+		c->outbound = q;
+		rtma_outbound_free(c);
+		return -1;
+	}
+
+	memset(q->policies, RTMA_OUTBOUND_DEFAULT, MAX_MESSAGE_TYPES);
+
+	// Nothing batched may be left behind the queue
+	rtma_client_end_batch(c);
+
+	c->outbound = q;
+	return 0;
+}
+
+// Write out everything queued and go back to blocking sends
+void rtma_client_disable_outbound_queue(Client* c) {
+	if (c->outbound == NULL)
+		return;
+
+	if (c->connected)
+		rtma_outbound_drain(c);
+
+	rtma_outbound_free(c);
+}
+
+// Policy for one message type, or for every type without its own with
+// RTMA_OUTBOUND_ALL_TYPES
+int rtma_client_set_outbound_policy(Client* c, MSG_TYPE msg_type, int policy) {
+	OutboundQueue* q = c->outbound;
+
+	if (q == NULL) {
+		fprintf(stderr, "rtma_client_set_outbound_policy: the outbound queue is not enabled.\n");
+		return -1;
+	}
+
+	if (policy < RTMA_OUTBOUND_BLOCK || policy > RTMA_OUTBOUND_CONFLATE) {
+		fprintf(stderr, "rtma_client_set_outbound_policy: invalid policy %d.\n", policy);
+		return -1;
+	}
+
+	if (msg_type != RTMA_OUTBOUND_ALL_TYPES && (msg_type < 0 || msg_type >= MAX_MESSAGE_TYPES)) {
+		fprintf(stderr, "rtma_client_set_outbound_policy: invalid message type %d.\n", msg_type);
+		return -1;
+	}
+
+	if (msg_type != RTMA_OUTBOUND_ALL_TYPES && msg_type < RTMA_OUTBOUND_CONTROL_TYPES && policy != RTMA_OUTBOUND_BLOCK) {
+		fprintf(stderr, "rtma_client_set_outbound_policy: control message type %d always blocks.\n", msg_type);
+		return -1;
+	}
+
+	if (policy == RTMA_OUTBOUND_CONFLATE && q->newest == NULL) {
+		q->newest = (long long*)calloc(MAX_MESSAGE_TYPES, sizeof(long long));
+		if (q->newest == NULL) {
+			perror("rtma_client_set_outbound_policy:calloc failed");
+			return -1;
+		}
+	}
+
+	if (msg_type == RTMA_OUTBOUND_ALL_TYPES)
+		q->default_policy = policy;
+	else
+		q->policies[msg_type] = (unsigned char)policy;
+
+	return 0;
+}
+
+void rtma_client_set_backpressure_callback(Client* c, RTMA_BACKPRESSURE_FN fn, void* ctx) {
+	if (c->outbound == NULL)
+		return;
+
+	c->outbound->callback = fn;
+	c->outbound->callback_ctx = ctx;
+}
+
+// Write out what the transport takes without blocking. For callers that
+// wait on the socket themselves. Returns the number of bytes still queued.
+size_t rtma_client_service_outbound(Client* c) {
+	if (c->outbound == NULL)
+		return 0;
+
+	return rtma_outbound_write(c);
+}
+
+void rtma_client_get_outbound_stats(Client* c, OutboundStats* stats) {
+	if (c->outbound == NULL) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+
+	*stats = c->outbound->stats;
+}
@@ -0,0 +1,311 @@
+#include "rtma_pool.h"
+#include "rtma_client_internal.h"
+#include "rtma_atomic.h"
+
+typedef struct {
+	int lock;
+	PooledMessage* free_list;
+	MessagePoolClassStats stats;
+} PoolClass;
+
+struct MessagePool {
+	PoolClass classes[RTMA_POOL_NUM_CLASSES];
+	int max_cached;
+	int oversize_lock;
+	int oversize_in_use;
+	int oversize_high_water;
+	long long oversize_acquires;
+};
+
+static int rtma_pool_size_class(size_t len) {
+	size_t size = RTMA_POOL_MIN_SIZE;
+
+	for (int i = 0; i < RTMA_POOL_NUM_CLASSES; i++, size <<= 2) {
+		if (len <= size)
+			return i;
+	}
+
+	return -1;
+}
+
+static PooledMessage* rtma_pool_new_buffer(MessagePool* pool, int size_class, size_t capacity) {
+	PooledMessage* msg = (PooledMessage*)malloc(sizeof(PooledMessage) + capacity);
+
+	if (msg == NULL) {
+		perror("rtma_message_pool_acquire:malloc failed");
+		exit(EXIT_FAILURE);
+	}
+
+	msg->data = (char*)(msg + 1);
+	msg->capacity = capacity;
+	msg->pool = pool;
+	msg->size_class = size_class;
+	msg->refcount = 0;
+	msg->next_free = NULL;
+
+	return msg;
+}
+
+MessagePool* rtma_create_message_pool(int max_cached_per_class) {
+	MessagePool* pool = (MessagePool*)calloc(1, sizeof(MessagePool));
+
+	if (pool == NULL) {
+		perror("rtma_create_message_pool:calloc failed");
+		exit(EXIT_FAILURE);
+	}
+
+	pool->max_cached = max_cached_per_class > 0 ? max_cached_per_class : RTMA_POOL_DEFAULT_CACHE;
+
+	size_t size = RTMA_POOL_MIN_SIZE;
+	for (int i = 0; i < RTMA_POOL_NUM_CLASSES; i++, size <<= 2)
+		pool->classes[i].stats.buffer_size = size;
+
+	return pool;
+}
+
+// Frees the cached buffers. Messages still referenced must not be released
+// after the pool is gone.
+void rtma_destroy_message_pool(MessagePool** pool) {
+	MessagePool* p = *pool;
+
+	if (p == NULL)
+		return;
+
+	for (int i = 0; i < RTMA_POOL_NUM_CLASSES; i++) {
+		PooledMessage* msg = p->classes[i].free_list;
+		while (msg) {
+			PooledMessage* next = msg->next_free;
+			free(msg);
+			msg = next;
+		}
+	}
+
+	free(p);
+	*pool = NULL;
+}
+
+// Pre-allocate count cached buffers for messages of len bytes so the first
+// burst does not hit malloc
+void rtma_message_pool_reserve(MessagePool* pool, size_t len, int count) {
+	int size_class = rtma_pool_size_class(len);
+
+	if (size_class < 0)
+		return;
+
+	PoolClass* pc = &pool->classes[size_class];
+
+	for (int i = 0; i < count; i++) {
+		PooledMessage* msg = rtma_pool_new_buffer(pool, size_class, pc->stats.buffer_size);
+
+		rtma_spin_lock(&pc->lock);
+		msg->next_free = pc->free_list;
+		pc->free_list = msg;
+		pc->stats.allocated++;
+		pc->stats.cached++;
+		rtma_spin_unlock(&pc->lock);
+	}
+}
+
+PooledMessage* rtma_message_pool_acquire(MessagePool* pool, size_t len) {
+	int size_class = rtma_pool_size_class(len);
+	PooledMessage* msg = NULL;
+
+	if (size_class < 0) {
+		msg = rtma_pool_new_buffer(pool, -1, len);
+
+		rtma_spin_lock(&pool->oversize_lock);
+		pool->oversize_acquires++;
+		if (++pool->oversize_in_use > pool->oversize_high_water)
+			pool->oversize_high_water = pool->oversize_in_use;
+		rtma_spin_unlock(&pool->oversize_lock);
+	}
+	else {
+		PoolClass* pc = &pool->classes[size_class];
+
+		rtma_spin_lock(&pc->lock);
+		msg = pc->free_list;
+		if (msg) {
+			pc->free_list = msg->next_free;
+			pc->stats.cached--;
+		}
+		else {
+			pc->stats.allocated++;
+			pc->stats.mallocs++;
+		}
+		pc->stats.acquires++;
+		if (++pc->stats.in_use > pc->stats.high_water)
+			pc->stats.high_water = pc->stats.in_use;
+		rtma_spin_unlock(&pc->lock);
+
+		if (msg == NULL)
+			msg = rtma_pool_new_buffer(pool, size_class, pc->stats.buffer_size);
+	}
+
+	memset(&msg->rtma_header, 0, sizeof(RTMA_MSG_HEADER));
+	msg->rtma_header.num_data_bytes = (int)len;
+	msg->refcount = 1;
+	msg->next_free = NULL;
+
+	return msg;
+}
+
+PooledMessage* rtma_pooled_message_ref(PooledMessage* msg) {
+	rtma_atomic_add(&msg->refcount, 1);
+	return msg;
+}
+
+// Drop one reference. The last reference returns the buffer to its pool.
+void rtma_pooled_message_release(PooledMessage* msg) {
+	if (msg == NULL || rtma_atomic_add(&msg->refcount, -1) > 0)
+		return;
+
+	MessagePool* pool = msg->pool;
+
+	if (msg->size_class < 0) {
+		rtma_spin_lock(&pool->oversize_lock);
+		pool->oversize_in_use--;
+		rtma_spin_unlock(&pool->oversize_lock);
+		free(msg);
+		return;
+	}
+
+	PoolClass* pc = &pool->classes[msg->size_class];
+
+	rtma_spin_lock(&pc->lock);
+	pc->stats.in_use--;
+	if (pc->stats.cached < pool->max_cached) {
+		msg->next_free = pc->free_list;
+		pc->free_list = msg;
+		pc->stats.cached++;
+		msg = NULL;
+	}
+	else {
+		pc->stats.allocated--;
+	}
+	rtma_spin_unlock(&pc->lock);
+
+	free(msg);
+}
+
+void rtma_message_pool_get_stats(MessagePool* pool, MessagePoolStats* stats) {
+	for (int i = 0; i < RTMA_POOL_NUM_CLASSES; i++) {
+		PoolClass* pc = &pool->classes[i];
+		rtma_spin_lock(&pc->lock);
+		stats->classes[i] = pc->stats;
+		rtma_spin_unlock(&pc->lock);
+	}
+
+	rtma_spin_lock(&pool->oversize_lock);
+	stats->oversize_in_use = pool->oversize_in_use;
+	stats->oversize_high_water = pool->oversize_high_water;
+	stats->oversize_acquires = pool->oversize_acquires;
+	rtma_spin_unlock(&pool->oversize_lock);
+}
+
+void rtma_message_pool_reset_high_water(MessagePool* pool) {
+	for (int i = 0; i < RTMA_POOL_NUM_CLASSES; i++) {
+		PoolClass* pc = &pool->classes[i];
+		rtma_spin_lock(&pc->lock);
+		pc->stats.high_water = pc->stats.in_use;
+		rtma_spin_unlock(&pc->lock);
+	}
+
+	rtma_spin_lock(&pool->oversize_lock);
+	pool->oversize_high_water = pool->oversize_in_use;
+	rtma_spin_unlock(&pool->oversize_lock);
+}
+
+void rtma_message_pool_print_stats(MessagePool* pool) {
+	MessagePoolStats stats;
+	rtma_message_pool_get_stats(pool, &stats);
+
+	printf("-----Message Pool-----\n\n");
+	printf("%10s %10s %10s %10s %10s %12s %10s\n", "size", "allocated", "in_use", "high_water", "cached", "acquires", "mallocs");
+	for (int i = 0; i < RTMA_POOL_NUM_CLASSES; i++) {
+		MessagePoolClassStats* s = &stats.classes[i];
+		printf("%10zu %10d %10d %10d %10d %12lld %10lld\n",
+			s->buffer_size,
+			s->allocated,
+			s->in_use,
+			s->high_water,
+			s->cached,
+			s->acquires,
+			s->mallocs);
+	}
+	printf("%10s %10s %10d %10d %10s %12lld %10lld\n",
+		"oversize",
+		"-",
+		stats.oversize_in_use,
+		stats.oversize_high_water,
+		"-",
+		stats.oversize_acquires,
+		stats.oversize_acquires);
+}
+
+/* CLIENT INTEGRATION */
+
+static void* rtma_pool_alloc_large(void* ctx, size_t len) {
+	PooledMessage* msg = rtma_message_pool_acquire((MessagePool*)ctx, len);
+	return msg->data;
+}
+
+static void rtma_pool_free_large(void* ctx, void* buf) {
+	(void)ctx;
+	if (buf != NULL)
+		rtma_pooled_message_release((PooledMessage*)buf - 1);
+}
+
+// Reassemble dynamic messages straight into pooled buffers so that
+// rtma_client_read_pooled_message can hand them out without a copy
+void rtma_client_use_message_pool(Client* c, MessagePool* pool) {
+	if (pool)
+		rtma_client_set_large_message_allocator(c, rtma_pool_alloc_large, rtma_pool_free_large, pool);
+	else
+		rtma_client_set_large_message_allocator(c, NULL, NULL, NULL);
+}
+
+MessagePool* rtma_client_get_message_pool(Client* c) {
+	return c->large_alloc == rtma_pool_alloc_large ? (MessagePool*)c->large_alloc_ctx : NULL;
+}
+
+PooledMessage* rtma_pool_copy_view(Client* c, MessagePool* pool, const MessageView* view) {
+	PooledMessage* pm;
+
+	if (view->rtma_header.is_dynamic && c->large_alloc == rtma_pool_alloc_large && c->large_alloc_ctx == pool) {
+		pm = rtma_pooled_message_ref((PooledMessage*)view->data - 1);
+	}
+	else {
+		pm = rtma_message_pool_acquire(pool, view->rtma_header.num_data_bytes);
+		memcpy(pm->data, view->data, view->rtma_header.num_data_bytes);
+	}
+
+	pm->rtma_header = view->rtma_header;
+	return pm;
+}
+
+// Read the next message into a right-sized pooled buffer that the caller
+// owns one reference to. Regular messages are copied out of the receive
+// buffer once. Dynamic messages reassembled in this pool, and messages the
+// receive thread queued in it, are handed over without copying.
+int rtma_client_read_pooled_message(Client* c, MessagePool* pool, PooledMessage** msg, double timeout) {
+	MessageView view;
+
+	if (!rtma_client_read_message_view(c, &view, timeout))
+		return NO_MESSAGE;
+
+	PooledMessage* pm = rtma_recv_queue_lent(c);
+	if (pm != NULL && pm->pool == pool)
+		pm = rtma_pooled_message_ref(pm);
+	else
+		pm = rtma_pool_copy_view(c, pool, &view);
+
+	rtma_client_release_message(c);
+
+	*msg = pm;
+	return GOT_MESSAGE;
+}
+
+int rtma_client_send_pooled_message_to_module(Client* c, PooledMessage* msg, int dest_mod_id, int dest_host_id, double timeout) {
+	DataSegment segment = { msg->data, (size_t)msg->rtma_header.num_data_bytes };
+	return rtma_client_send_segments_to_module(c, msg->rtma_header.msg_type, &segment, segment.len > 0 ? 1 : 0, dest_mod_id, dest_host_id, timeout);
+}
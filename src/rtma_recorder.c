@@ -0,0 +1,596 @@
+#include "rtma_recorder.h"
+#include <string.h>
+
+void rtma_client_set_recorder(Client* c, MessageRecorder* r) {
+	c->recorder = r;
+}
+
+#ifdef __UNIX__
+
+#include "rtma_atomic.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RTMA_RECORDER_MAGIC 0x52544d52	// "RMTR"
+#define RTMA_RECORDER_INDEX_MAGIC 0x58544d52	// "RMTX"
+#define RTMA_RECORDER_VERSION 1
+#define RTMA_RECORDER_SEGMENT_HEADER 64
+#define RTMA_RECORDER_ALIGN(n) (((n) + 7) & ~(size_t)7)
+// Pages of the mapping are faulted in this far ahead of the writer
+#define RTMA_RECORDER_POPULATE_BYTES (4 * 1024 * 1024)
+
+// One bit per msg_type below MAX_MESSAGE_TYPES and one for all others,
+// rounded up to 8 bytes
+#define RTMA_RECORDER_TYPE_BITS (MAX_MESSAGE_TYPES + 1)
+#define RTMA_RECORDER_TYPE_BYTES (((RTMA_RECORDER_TYPE_BITS + 63) / 64) * 8)
+
+typedef struct {
+	int size;		// Whole record including this prefix and padding, 0 at the end
+	int reserved;
+}RecordPrefix;
+
+typedef struct {
+	int magic;
+	int version;
+	int segment;
+	int reserved;
+	char pad[RTMA_RECORDER_SEGMENT_HEADER - 4 * sizeof(int)];
+}RecorderSegmentHeader;
+
+typedef struct {
+	int magic;
+	int version;
+	int entry_size;
+	int type_bits;
+}RecorderIndexHeader;
+
+typedef struct {
+	long long offset;		// Of the first record in the segment
+	long long bytes;
+	long long first_message;
+	double first_recv_time;
+	double max_recv_time;	// Latest recv_time up to and including this block
+	int segment;
+	int count;
+	unsigned char types[RTMA_RECORDER_TYPE_BYTES];
+}RecorderIndexEntry;
+
+struct MessageRecorder {
+	char* path;
+	size_t segment_size;
+	int segment;			// Open segment, -1 before the first message
+	int fd;
+	char* base;
+	size_t map_size;
+	size_t pos;				// Next record goes here
+	size_t populated;		// Mapping is faulted in up to here
+	FILE* index;
+	RecorderIndexEntry block;	// Being filled, count 0 while empty
+	RecorderStats stats;
+};
+
+struct MessageRecording {
+	char* path;
+	RecorderIndexEntry* entries;
+	int num_entries;
+	int next_entry;		// Index entry of the next block the reader enters
+	int segment;		// Mapped segment, -1 if none
+	char* base;
+	size_t size;
+	size_t pos;
+	int filtering;
+	unsigned char filter[RTMA_RECORDER_TYPE_BYTES];
+};
+
+static inline int rtma_recorder_type_bit(MSG_TYPE msg_type) {
+	return msg_type >= 0 && msg_type < MAX_MESSAGE_TYPES ? msg_type : MAX_MESSAGE_TYPES;
+}
+
+static char* rtma_recorder_segment_path(const char* path, int segment) {
+	size_t len = strlen(path) + 16;
+	char* name = (char*)malloc(len);
+	snprintf(name, len, "%s.%06d.seg", path, segment);
+	return name;
+}
+
+static FILE* rtma_recorder_open_index(const char* path, const char* mode) {
+	size_t len = strlen(path) + 8;
+	char* name = (char*)malloc(len);
+	snprintf(name, len, "%s.idx", path);
+
+	FILE* f = fopen(name, mode);
+	if (f == NULL && mode[0] == 'w')
+		perror(name);
+
+	free(name);
+	return f;
+}
+
+// Remove the segments of an earlier recording at path. Segments are reused
+// from the first on, so one the new recording never reaches would otherwise
+// pass for its continuation.
+static void rtma_recorder_remove_segments(const char* path) {
+	for (int segment = 0;; segment++) {
+		char* name = rtma_recorder_segment_path(path, segment);
+		int err = unlink(name) < 0 ? errno : 0;
+		if (err && err != ENOENT)
+			perror(name);
+		free(name);
+
+		if (err == ENOENT)
+			break;
+	}
+}
+
+MessageRecorder* rtma_create_recorder(const char* path, size_t segment_size) {
+	MessageRecorder* r = (MessageRecorder*)calloc(1, sizeof(MessageRecorder));
+	if (r == NULL) {
+		perror("rtma_create_recorder:calloc failed");
+		return NULL;
+	}
+
+	r->path = strdup(path);
+	r->segment_size = segment_size ? RTMA_RECORDER_ALIGN(segment_size) : RTMA_RECORDER_DEFAULT_SEGMENT_SIZE;
+	r->segment = -1;
+	r->fd = -1;
+
+	r->index = rtma_recorder_open_index(path, "wb");
+	if (r->index == NULL) {
+		free(r->path);
+		free(r);
+		return NULL;
+	}
+
+	rtma_recorder_remove_segments(path);
+
+	RecorderIndexHeader h = { RTMA_RECORDER_INDEX_MAGIC, RTMA_RECORDER_VERSION, (int)sizeof(RecorderIndexEntry), RTMA_RECORDER_TYPE_BITS };
+	fwrite(&h, sizeof(h), 1, r->index);
+	fflush(r->index);
+
+	return r;
+}
+
+static void rtma_recorder_close_block(MessageRecorder* r) {
+	if (r->block.count == 0)
+		return;
+
+	r->block.bytes = (long long)r->pos - r->block.offset;
+	r->block.max_recv_time = r->stats.last_recv_time;
+	fwrite(&r->block, sizeof(r->block), 1, r->index);
+	r->stats.index_entries++;
+	r->block.count = 0;
+}
+
+// Cut the segment down to what was written, keeping the zero prefix that
+// marks its end
+static void rtma_recorder_close_segment(MessageRecorder* r) {
+	if (r->base == NULL)
+		return;
+
+	munmap(r->base, r->map_size);
+	if (ftruncate(r->fd, (off_t)(r->pos + sizeof(RecordPrefix))) < 0)
+		perror("rtma_recorder:ftruncate");
+	close(r->fd);
+
+	r->base = NULL;
+	r->fd = -1;
+}
+
+// Preallocate and map the next segment, large enough for a record of len
+static int rtma_recorder_next_segment(MessageRecorder* r, size_t len) {
+	rtma_recorder_close_block(r);
+	rtma_recorder_close_segment(r);
+
+	size_t size = r->segment_size;
+	if (size < RTMA_RECORDER_SEGMENT_HEADER + len + sizeof(RecordPrefix))
+		size = RTMA_RECORDER_SEGMENT_HEADER + len + sizeof(RecordPrefix);
+
+	char* name = rtma_recorder_segment_path(r->path, r->segment + 1);
+	int fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		perror(name);
+		free(name);
+		return -1;
+	}
+
+	// Reserve the blocks up front so that running out of disk fails here
+	// rather than as SIGBUS on a store into the mapping
+	int err = ftruncate(fd, (off_t)size) < 0 ? errno : 0;
+#ifdef __linux__
+	if (err == 0) {
+		err = posix_fallocate(fd, 0, (off_t)size);
+		if (err == EOPNOTSUPP || err == EINVAL)
+			err = 0;
+	}
+#endif
+
+	char* base = err ? MAP_FAILED : (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "rtma_recorder: unable to allocate %zu bytes for %s: %s\n", size, name, strerror(err ? err : errno));
+		close(fd);
+		free(name);
+		return -1;
+	}
+	free(name);
+
+#ifdef MADV_SEQUENTIAL
+	madvise(base, size, MADV_SEQUENTIAL);
+#endif
+
+	r->segment++;
+	r->fd = fd;
+	r->base = base;
+	r->map_size = size;
+	r->pos = RTMA_RECORDER_SEGMENT_HEADER;
+	r->populated = 0;
+	r->stats.segments++;
+
+	RecorderSegmentHeader* h = (RecorderSegmentHeader*)base;
+	h->magic = RTMA_RECORDER_MAGIC;
+	h->version = RTMA_RECORDER_VERSION;
+	h->segment = r->segment;
+
+	return 0;
+}
+
+// Taking a page fault on every page the writer reaches costs more than
+// faulting them in a few MB at a time
+static void rtma_recorder_populate(MessageRecorder* r, size_t end) {
+#ifdef MADV_POPULATE_WRITE
+	while (r->populated < end && r->populated < r->map_size) {
+		size_t len = r->map_size - r->populated;
+		if (len > RTMA_RECORDER_POPULATE_BYTES)
+			len = RTMA_RECORDER_POPULATE_BYTES;
+
+		if (madvise(r->base + r->populated, len, MADV_POPULATE_WRITE) < 0) {
+			r->populated = r->map_size;	// Not supported by this kernel
+			break;
+		}
+		r->populated += len;
+	}
+#endif
+}
+
+// Append one message. Returns 0, or -1 if no segment could be allocated.
+int rtma_recorder_write(MessageRecorder* r, const RTMA_MSG_HEADER* header, const void* data) {
+	size_t len = RTMA_RECORDER_ALIGN(sizeof(RecordPrefix) + sizeof(RTMA_MSG_HEADER) + (size_t)header->num_data_bytes);
+
+	if (r->base == NULL || r->pos + len + sizeof(RecordPrefix) > r->map_size) {
+		if (rtma_recorder_next_segment(r, len))
+			return -1;
+	}
+
+	if (r->pos + len > r->populated)
+		rtma_recorder_populate(r, r->pos + len);
+
+	RecordPrefix* prefix = (RecordPrefix*)(r->base + r->pos);
+	memcpy(prefix + 1, header, sizeof(RTMA_MSG_HEADER));
+	memcpy((char*)(prefix + 1) + sizeof(RTMA_MSG_HEADER), data, header->num_data_bytes);
+	rtma_atomic_store(&prefix->size, (int)len);
+
+	RecorderIndexEntry* b = &r->block;
+	if (b->count == 0) {
+		b->segment = r->segment;
+		b->offset = (long long)r->pos;
+		b->first_message = r->stats.messages;
+		b->first_recv_time = header->recv_time;
+		memset(b->types, 0, sizeof(b->types));
+	}
+
+	int bit = rtma_recorder_type_bit(header->msg_type);
+	b->types[bit >> 3] |= (unsigned char)(1 << (bit & 7));
+	b->count++;
+
+	if (r->stats.messages == 0)
+		r->stats.first_recv_time = header->recv_time;
+	if (header->recv_time > r->stats.last_recv_time)
+		r->stats.last_recv_time = header->recv_time;
+	r->stats.messages++;
+	r->stats.bytes += (long long)len;
+	r->pos += len;
+
+	if (r->pos - (size_t)b->offset >= RTMA_RECORDER_INDEX_BYTES || header->recv_time - b->first_recv_time >= RTMA_RECORDER_INDEX_INTERVAL)
+		rtma_recorder_close_block(r);
+
+	return 0;
+}
+
+void rtma_recorder_flush(MessageRecorder* r) {
+	if (r->base)
+		msync(r->base, r->pos, MS_ASYNC);
+	fflush(r->index);
+}
+
+void rtma_recorder_get_stats(MessageRecorder* r, RecorderStats* stats) {
+	*stats = r->stats;
+}
+
+void rtma_destroy_recorder(MessageRecorder** r) {
+	MessageRecorder* rec = *r;
+
+	if (rec == NULL)
+		return;
+
+	rtma_recorder_close_block(rec);
+	rtma_recorder_close_segment(rec);
+	fclose(rec->index);
+	free(rec->path);
+	free(rec);
+	*r = NULL;
+}
+
+// Map segment and move to offset. Returns -1 if there is no such segment.
+static int rtma_recording_goto(MessageRecording* rec, int segment, size_t offset) {
+	if (segment != rec->segment) {
+		char* name = rtma_recorder_segment_path(rec->path, segment);
+		int fd = open(name, O_RDONLY | O_CLOEXEC);
+		free(name);
+		if (fd < 0)
+			return -1;
+
+		struct stat st;
+		char* base = MAP_FAILED;
+		if (fstat(fd, &st) == 0 && (size_t)st.st_size >= RTMA_RECORDER_SEGMENT_HEADER)
+			base = (char*)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+
+		if (base == MAP_FAILED)
+			return -1;
+
+		RecorderSegmentHeader* h = (RecorderSegmentHeader*)base;
+		if (h->magic != RTMA_RECORDER_MAGIC || h->version != RTMA_RECORDER_VERSION) {
+			fprintf(stderr, "rtma_recording: segment %d of %s is not a recording.\n", segment, rec->path);
+			munmap(base, (size_t)st.st_size);
+			return -1;
+		}
+
+#ifdef MADV_SEQUENTIAL
+		madvise(base, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+
+		if (rec->base)
+			munmap(rec->base, rec->size);
+		rec->base = base;
+		rec->size = (size_t)st.st_size;
+		rec->segment = segment;
+	}
+
+	rec->pos = offset;
+	return 0;
+}
+
+MessageRecording* rtma_open_recording(const char* path) {
+	MessageRecording* rec = (MessageRecording*)calloc(1, sizeof(MessageRecording));
+	if (rec == NULL) {
+		perror("rtma_open_recording:calloc failed");
+		return NULL;
+	}
+
+	rec->path = strdup(path);
+	rec->segment = -1;
+
+	// Without the index the recording can still be read front to back
+	FILE* f = rtma_recorder_open_index(path, "rb");
+	if (f) {
+		RecorderIndexHeader h;
+		if (fread(&h, sizeof(h), 1, f) == 1 && h.magic == RTMA_RECORDER_INDEX_MAGIC && h.version == RTMA_RECORDER_VERSION &&
+			h.entry_size == (int)sizeof(RecorderIndexEntry) && h.type_bits == RTMA_RECORDER_TYPE_BITS) {
+			int capacity = 0;
+			RecorderIndexEntry e;
+			while (fread(&e, sizeof(e), 1, f) == 1) {
+				if (rec->num_entries == capacity) {
+					capacity = capacity ? 2 * capacity : 256;
+					rec->entries = (RecorderIndexEntry*)realloc(rec->entries, capacity * sizeof(RecorderIndexEntry));
+				}
+				rec->entries[rec->num_entries++] = e;
+			}
+		}
+		else {
+			fprintf(stderr, "rtma_open_recording: ignoring unknown index format of %s.\n", path);
+		}
+		fclose(f);
+	}
+
+	if (rtma_recording_goto(rec, 0, RTMA_RECORDER_SEGMENT_HEADER)) {
+		fprintf(stderr, "rtma_open_recording: no recording at %s.\n", path);
+		rtma_close_recording(&rec);
+		return NULL;
+	}
+
+	return rec;
+}
+
+void rtma_close_recording(MessageRecording** rec) {
+	MessageRecording* r = *rec;
+
+	if (r == NULL)
+		return;
+
+	if (r->base)
+		munmap(r->base, r->size);
+	free(r->entries);
+	free(r->path);
+	free(r);
+	*rec = NULL;
+}
+
+static int rtma_recording_block_matches(MessageRecording* rec, const RecorderIndexEntry* e) {
+	for (int i = 0; i < RTMA_RECORDER_TYPE_BYTES; i++) {
+		if (e->types[i] & rec->filter[i])
+			return TRUE;
+	}
+	return FALSE;
+}
+
+int rtma_recording_next(MessageRecording* rec, MessageView* view) {
+	for (;;) {
+		// Entering an indexed block, skip it if none of its types pass the filter
+		if (rec->next_entry < rec->num_entries) {
+			RecorderIndexEntry* e = &rec->entries[rec->next_entry];
+
+			if (e->segment == rec->segment && (size_t)e->offset == rec->pos) {
+				rec->next_entry++;
+				if (rec->filtering && !rtma_recording_block_matches(rec, e) &&
+					rtma_recording_goto(rec, e->segment, (size_t)(e->offset + e->bytes)) == 0)
+					continue;
+			}
+		}
+
+		RecordPrefix* prefix = (RecordPrefix*)(rec->base + rec->pos);
+		int size = rec->pos + sizeof(RecordPrefix) <= rec->size ? rtma_atomic_load(&prefix->size) : 0;
+
+		if (size == 0) {
+			// End of the segment. The writer may still be filling this one.
+			if (rtma_recording_goto(rec, rec->segment + 1, RTMA_RECORDER_SEGMENT_HEADER))
+				return NO_MESSAGE;
+			continue;
+		}
+
+		if (size < (int)(sizeof(RecordPrefix) + sizeof(RTMA_MSG_HEADER)) || rec->pos + (size_t)size > rec->size) {
+			fprintf(stderr, "rtma_recording_next: corrupt record in segment %d of %s.\n", rec->segment, rec->path);
+			return NO_MESSAGE;
+		}
+
+		RTMA_MSG_HEADER* header = (RTMA_MSG_HEADER*)(prefix + 1);
+		rec->pos += size;
+
+		if (rec->filtering) {
+			int bit = rtma_recorder_type_bit(header->msg_type);
+			if (!(rec->filter[bit >> 3] & (1 << (bit & 7))))
+				continue;
+		}
+
+		memcpy(&view->rtma_header, header, sizeof(RTMA_MSG_HEADER));
+		view->data = (char*)(header + 1);
+		return GOT_MESSAGE;
+	}
+}
+
+void rtma_recording_rewind(MessageRecording* rec) {
+	rec->next_entry = 0;
+	rtma_recording_goto(rec, 0, RTMA_RECORDER_SEGMENT_HEADER);
+}
+
+// Binary search the index for the first block that reaches recv_time, then
+// scan it. Returns GOT_MESSAGE if a message at or after recv_time remains.
+int rtma_recording_seek_time(MessageRecording* rec, double recv_time) {
+	int lo = 0, hi = rec->num_entries;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (rec->entries[mid].max_recv_time < recv_time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	// Past the index only the unindexed tail is left to scan
+	if (lo == rec->num_entries && lo > 0)
+		lo--;
+
+	if (lo < rec->num_entries) {
+		rec->next_entry = lo;
+		if (rtma_recording_goto(rec, rec->entries[lo].segment, (size_t)rec->entries[lo].offset))
+			return NO_MESSAGE;
+	}
+	else {
+		rtma_recording_rewind(rec);
+	}
+
+	for (;;) {
+		int segment = rec->segment;
+		size_t pos = rec->pos;
+		int next_entry = rec->next_entry;
+		MessageView view;
+
+		if (!rtma_recording_next(rec, &view))
+			return NO_MESSAGE;
+
+		if (view.rtma_header.recv_time >= recv_time) {
+			rec->next_entry = next_entry;
+			rtma_recording_goto(rec, segment, pos);
+			return GOT_MESSAGE;
+		}
+	}
+}
+
+void rtma_recording_set_filter(MessageRecording* rec, const MSG_TYPE* msg_types, int count) {
+	memset(rec->filter, 0, sizeof(rec->filter));
+	rec->filtering = msg_types != NULL && count > 0;
+
+	for (int i = 0; i < count && msg_types; i++) {
+		int bit = rtma_recorder_type_bit(msg_types[i]);
+		rec->filter[bit >> 3] |= (unsigned char)(1 << (bit & 7));
+	}
+}
+
+void rtma_recording_get_stats(MessageRecording* rec, RecorderStats* stats) {
+	memset(stats, 0, sizeof(RecorderStats));
+	stats->index_entries = rec->num_entries;
+
+	for (int i = 0; i < rec->num_entries; i++) {
+		RecorderIndexEntry* e = &rec->entries[i];
+		stats->messages += e->count;
+		stats->bytes += e->bytes;
+		if (e->segment + 1 > stats->segments)
+			stats->segments = e->segment + 1;
+	}
+
+	if (rec->num_entries > 0) {
+		stats->first_recv_time = rec->entries[0].first_recv_time;
+		stats->last_recv_time = rec->entries[rec->num_entries - 1].max_recv_time;
+	}
+}
+
+#else
+
+// Not available on this platform
+
+MessageRecorder* rtma_create_recorder(const char* path, size_t segment_size) {
+	fprintf(stderr, "rtma_create_recorder: not supported on this platform.\n");
+	return NULL;
+}
+
+void rtma_destroy_recorder(MessageRecorder** r) {
+	*r = NULL;
+}
+
+int rtma_recorder_write(MessageRecorder* r, const RTMA_MSG_HEADER* header, const void* data) {
+	return -1;
+}
+
+void rtma_recorder_flush(MessageRecorder* r) {
+}
+
+void rtma_recorder_get_stats(MessageRecorder* r, RecorderStats* stats) {
+	memset(stats, 0, sizeof(RecorderStats));
+}
+
+MessageRecording* rtma_open_recording(const char* path) {
+	fprintf(stderr, "rtma_open_recording: not supported on this platform.\n");
+	return NULL;
+}
+
+void rtma_close_recording(MessageRecording** rec) {
+	*rec = NULL;
+}
+
+int rtma_recording_next(MessageRecording* rec, MessageView* view) {
+	return NO_MESSAGE;
+}
+
+int rtma_recording_seek_time(MessageRecording* rec, double recv_time) {
+	return NO_MESSAGE;
+}
+
+void rtma_recording_rewind(MessageRecording* rec) {
+}
+
+void rtma_recording_set_filter(MessageRecording* rec, const MSG_TYPE* msg_types, int count) {
+}
+
+void rtma_recording_get_stats(MessageRecording* rec, RecorderStats* stats) {
+	memset(stats, 0, sizeof(RecorderStats));
+}
+
+#endif //__UNIX__
@@ -0,0 +1,374 @@
+#include "rtma_recv_queue.h"
+#include "rtma_client_internal.h"
+#include "rtma_pool.h"
+#include "rtma_atomic.h"
+#include "rtma_thread.h"
+#include "rtma_time.h"
+
+// Polls of an empty queue before the reader goes to sleep
+#define RTMA_RECV_QUEUE_SPIN 2000
+// Longest either thread waits before looking again on its own, which also
+// bounds how long stopping the receive thread takes
+#define RTMA_RECV_QUEUE_MAX_SLEEP 0.1
+
+// Ring of message pointers with one producer, the receive thread, and one
+// consumer, the reading thread. Messages in [head, tail) are queued. The
+// consumer takes a message by advancing head with a CAS, so the producer can
+// take the oldest one the same way to drop it; whoever wins owns the message.
+struct RecvQueue {
+	long long head;
+	char pad0[64 - sizeof(long long)];
+	long long tail;	// Only advanced by the receive thread
+	long long received;
+	long long dropped;
+	char pad1[64 - 3 * sizeof(long long)];
+	int high_water;
+	int consumer_sleeping;
+	int producer_waiting;
+	int stop;
+	int closed;	// The receive thread found the connection gone
+	int policy;
+	long long mask;
+	PooledMessage** slots;
+	PooledMessage* pending;	// Message the receive thread could not queue before stopping
+	PooledMessage* lent;	// Message popped by the reader and not yet released
+	long long* latest;	// Position of the newest queued message of each conflated type
+	MessagePool* pool;
+	MessagePool* own_pool;	// Set when the client had no pool to share
+	Client* client;
+	rtma_mutex_t lock;
+	rtma_cond_t not_empty;
+	rtma_cond_t not_full;
+	rtma_thread_t thread;
+};
+
+static void rtma_recv_queue_wake(RecvQueue* q, int* sleeping, rtma_cond_t* cond) {
+	rtma_atomic_fence();
+	if (rtma_atomic_load(sleeping)) {
+		rtma_mutex_lock(&q->lock);
+		rtma_cond_signal(cond);
+		rtma_mutex_unlock(&q->lock);
+	}
+}
+
+static int rtma_recv_queue_conflated(RecvQueue* q, const RTMA_MSG_HEADER* h) {
+	return q->latest && !h->is_dynamic && h->msg_type >= 0 && h->msg_type < MAX_MESSAGE_TYPES &&
+		q->client->conflate_latest[h->msg_type] >= 0;
+}
+
+// TRUE if a newer message of the same conflated type was queued after pos
+static int rtma_recv_queue_superseded(RecvQueue* q, const PooledMessage* msg, long long pos) {
+	return rtma_recv_queue_conflated(q, &msg->rtma_header) &&
+		rtma_atomic_load64(&q->latest[msg->rtma_header.msg_type]) > pos;
+}
+
+static int rtma_recv_queue_full(RecvQueue* q) {
+	return q->tail - rtma_atomic_load64(&q->head) > q->mask;
+}
+
+// A blocked receive thread waits for the queue to drain to half, not for a
+// single slot, so that it does not have to be woken for every message
+static int rtma_recv_queue_above_half(RecvQueue* q) {
+	return rtma_atomic_load64(&q->tail) - rtma_atomic_load64(&q->head) > (q->mask + 1) / 2;
+}
+
+// Queue a message from the receive thread, making room as the policy says.
+// Returns FALSE if the thread was stopped while waiting for room; the message
+// is then left in pending.
+static int rtma_recv_queue_push(RecvQueue* q, PooledMessage* msg) {
+	rtma_atomic_store64(&q->received, q->received + 1);
+
+	while (rtma_recv_queue_full(q)) {
+		long long head = rtma_atomic_load64(&q->head);
+
+		if (q->policy == RTMA_RECV_QUEUE_DROP_NEWEST) {
+			rtma_pooled_message_release(msg);
+			rtma_atomic_store64(&q->dropped, q->dropped + 1);
+			return TRUE;
+		}
+
+		if (q->policy == RTMA_RECV_QUEUE_DROP_OLDEST) {
+			PooledMessage* oldest = q->slots[head & q->mask];
+			if (rtma_atomic_cas64(&q->head, head, head + 1)) {
+				rtma_pooled_message_release(oldest);
+				rtma_atomic_store64(&q->dropped, q->dropped + 1);
+			}
+			continue;
+		}
+
+		if (rtma_atomic_load(&q->stop)) {
+			q->pending = msg;
+			return FALSE;
+		}
+
+		rtma_mutex_lock(&q->lock);
+		rtma_atomic_store(&q->producer_waiting, 1);
+		rtma_atomic_fence();
+		if (rtma_recv_queue_above_half(q) && !rtma_atomic_load(&q->stop))
+			rtma_cond_wait(&q->not_full, &q->lock, RTMA_RECV_QUEUE_MAX_SLEEP);
+		rtma_atomic_store(&q->producer_waiting, 0);
+		rtma_mutex_unlock(&q->lock);
+	}
+
+	q->slots[q->tail & q->mask] = msg;
+	if (rtma_recv_queue_conflated(q, &msg->rtma_header))
+		rtma_atomic_store64(&q->latest[msg->rtma_header.msg_type], q->tail);
+	rtma_atomic_store64(&q->tail, q->tail + 1);
+
+	int depth = (int)(q->tail - rtma_atomic_load64(&q->head));
+	if (depth > q->high_water)
+		rtma_atomic_store(&q->high_water, depth);
+
+	rtma_recv_queue_wake(q, &q->consumer_sleeping, &q->not_empty);
+	return TRUE;
+}
+
+static RTMA_THREAD_FUNC(rtma_recv_queue_thread, arg) {
+	RecvQueue* q = (RecvQueue*)arg;
+	Client* c = q->client;
+	MessageView view;
+
+	while (!rtma_atomic_load(&q->stop)) {
+		int got = rtma_client_read_transport(c, &view, RTMA_RECV_QUEUE_MAX_SLEEP);
+
+		// The reader handles the loss once it has drained the queue
+		if (got == RTMA_CONNECTION_LOST) {
+			rtma_atomic_store(&q->closed, 1);
+			rtma_recv_queue_wake(q, &q->consumer_sleeping, &q->not_empty);
+			break;
+		}
+
+		if (!got)
+			continue;
+
+		PooledMessage* msg = rtma_pool_copy_view(c, q->pool, &view);
+		rtma_client_release_frame(c);
+
+		if (!rtma_recv_queue_push(q, msg))
+			break;
+	}
+
+	RTMA_THREAD_RETURN;
+}
+
+int rtma_recv_queue_pop(Client* c, MessageView* view, double timeout) {
+	RecvQueue* q = c->recv_queue;
+	double deadline = timeout > 0 ? rtma_time_now(RTMA_CLOCK_MONOTONIC) + timeout : 0.0;
+	int idle = 0;
+
+	for (;;) {
+		long long head = rtma_atomic_load64(&q->head);
+
+		if (head != rtma_atomic_load64(&q->tail)) {
+			PooledMessage* msg = q->slots[head & q->mask];
+
+			// Lost to the receive thread dropping the oldest message
+			if (!rtma_atomic_cas64(&q->head, head, head + 1))
+				continue;
+
+			if (q->policy == RTMA_RECV_QUEUE_BLOCK && !rtma_recv_queue_above_half(q))
+				rtma_recv_queue_wake(q, &q->producer_waiting, &q->not_full);
+
+			if (rtma_recv_queue_superseded(q, msg, head)) {
+				rtma_pooled_message_release(msg);
+				rtma_atomic_add64(&c->conflated, 1);
+				continue;
+			}
+
+			q->lent = msg;
+			view->rtma_header = msg->rtma_header;
+			view->data = msg->data;
+			return GOT_MESSAGE;
+		}
+
+		if (rtma_atomic_load(&q->closed))
+			return RTMA_CONNECTION_LOST;
+
+		if (timeout == 0)
+			return NO_MESSAGE;
+
+		if (++idle < RTMA_RECV_QUEUE_SPIN) {
+			rtma_cpu_relax();
+			continue;
+		}
+
+		double wait = RTMA_RECV_QUEUE_MAX_SLEEP;
+		if (timeout > 0) {
+			wait = deadline - rtma_time_now(RTMA_CLOCK_MONOTONIC);
+			if (wait <= 0)
+				return NO_MESSAGE;
+			if (wait > RTMA_RECV_QUEUE_MAX_SLEEP)
+				wait = RTMA_RECV_QUEUE_MAX_SLEEP;
+		}
+
+		rtma_mutex_lock(&q->lock);
+		rtma_atomic_store(&q->consumer_sleeping, 1);
+		rtma_atomic_fence();
+		if (rtma_atomic_load64(&q->head) == rtma_atomic_load64(&q->tail) && !rtma_atomic_load(&q->closed))
+			rtma_cond_wait(&q->not_empty, &q->lock, wait);
+		rtma_atomic_store(&q->consumer_sleeping, 0);
+		rtma_mutex_unlock(&q->lock);
+	}
+}
+
+void rtma_recv_queue_release(Client* c) {
+	RecvQueue* q = c->recv_queue;
+
+	rtma_pooled_message_release(q->lent);
+	q->lent = NULL;
+}
+
+int rtma_recv_queue_has_message(Client* c) {
+	RecvQueue* q = c->recv_queue;
+	return rtma_atomic_load64(&q->head) != rtma_atomic_load64(&q->tail);
+}
+
+PooledMessage* rtma_recv_queue_lent(Client* c) {
+	return c->recv_queue ? c->recv_queue->lent : NULL;
+}
+
+PooledMessage* rtma_recv_queue_take_lent(Client* c) {
+	RecvQueue* q = c->recv_queue;
+	PooledMessage* msg = q->lent;
+
+	q->lent = NULL;
+	return msg;
+}
+
+// Start reading the transport in the background. The client must be
+// connected. num_slots is rounded up to a power of two. Messages are queued
+// in the pool set with rtma_client_use_message_pool, if any, so that
+// rtma_client_read_pooled_message on that pool does not copy them again.
+int rtma_client_start_receive_thread(Client* c, int num_slots, int full_policy) {
+	if (c->recv_queue != NULL)
+		return 0;
+
+	if (!c->connected) {
+		fprintf(stderr, "rtma_client_start_receive_thread: client is not connected.\n");
+		return -1;
+	}
+
+	if (c->auto_reconnect) {
+		fprintf(stderr, "rtma_client_start_receive_thread: not available with auto reconnect.\n");
+		return -1;
+	}
+
+	if (num_slots <= 0)
+		num_slots = RTMA_RECV_QUEUE_DEFAULT_SLOTS;
+
+	int size = 2;
+	while (size < num_slots)
+		size <<= 1;
+
+	RecvQueue* q = (RecvQueue*)calloc(1, sizeof(RecvQueue));
+	PooledMessage** slots = (PooledMessage**)malloc(size * sizeof(PooledMessage*));
+	long long* latest = NULL;
+
+	if (c->conflate_latest)
+		latest = (long long*)calloc(MAX_MESSAGE_TYPES, sizeof(long long));
+
+	if (q == NULL || slots == NULL || (c->conflate_latest && latest == NULL)) {
+		perror("rtma_client_start_receive_thread:malloc failed");
+		free(q);
+		free(slots);
+		free(latest);
+		return -1;
+	}
+
+	q->slots = slots;
+	q->latest = latest;
+	q->mask = size - 1;
+	q->policy = full_policy;
+	q->client = c;
+	q->pool = rtma_client_get_message_pool(c);
+	if (q->pool == NULL)
+		q->pool = q->own_pool = rtma_create_message_pool(0);
+	rtma_mutex_init(&q->lock);
+	rtma_cond_init(&q->not_empty);
+	rtma_cond_init(&q->not_full);
+
+	// The receive buffer is handed over to the thread
+	rtma_client_release_message(c);
+
+	if (rtma_thread_create(&q->thread, rtma_recv_queue_thread, q)) {
+		fprintf(stderr, "rtma_client_start_receive_thread: unable to start thread.\n");
+		rtma_mutex_destroy(&q->lock);
+		rtma_cond_destroy(&q->not_empty);
+		rtma_cond_destroy(&q->not_full);
+		rtma_destroy_message_pool(&q->own_pool);
+		free(latest);
+		free(slots);
+		free(q);
+		return -1;
+	}
+
+	c->recv_queue = q;
+	return 0;
+}
+
+static void rtma_recv_queue_stash(Client* c, PooledMessage* msg) {
+	MessageView view;
+
+	view.rtma_header = msg->rtma_header;
+	view.data = msg->data;
+	rtma_client_stash_message(c, &view);
+	rtma_pooled_message_release(msg);
+}
+
+// Stop the receive thread and go back to reading the transport directly.
+// Messages still queued are kept for later reads, in order. Releases the
+// message currently lent out.
+void rtma_client_stop_receive_thread(Client* c) {
+	RecvQueue* q = c->recv_queue;
+
+	if (q == NULL)
+		return;
+
+	rtma_client_release_message(c);
+
+	rtma_mutex_lock(&q->lock);
+	rtma_atomic_store(&q->stop, 1);
+	rtma_cond_signal(&q->not_full);
+	rtma_mutex_unlock(&q->lock);
+
+	rtma_thread_join(q->thread);
+
+	c->recv_queue = NULL;
+
+	for (long long pos = q->head; pos < q->tail; pos++) {
+		PooledMessage* msg = q->slots[pos & q->mask];
+
+		if (rtma_recv_queue_superseded(q, msg, pos)) {
+			rtma_pooled_message_release(msg);
+			c->conflated++;
+			continue;
+		}
+		rtma_recv_queue_stash(c, msg);
+	}
+	if (q->pending)
+		rtma_recv_queue_stash(c, q->pending);
+
+	rtma_mutex_destroy(&q->lock);
+	rtma_cond_destroy(&q->not_empty);
+	rtma_cond_destroy(&q->not_full);
+	rtma_destroy_message_pool(&q->own_pool);
+	free(q->latest);
+	free(q->slots);
+	free(q);
+}
+
+void rtma_client_get_recv_queue_stats(Client* c, RecvQueueStats* stats) {
+	RecvQueue* q = c->recv_queue;
+
+	memset(stats, 0, sizeof(*stats));
+	if (q == NULL)
+		return;
+
+	long long depth = rtma_atomic_load64(&q->tail) - rtma_atomic_load64(&q->head);
+
+	stats->received = rtma_atomic_load64(&q->received);
+	stats->dropped = rtma_atomic_load64(&q->dropped);
+	stats->depth = (int)(depth < 0 ? 0 : depth);
+	stats->high_water = rtma_atomic_load(&q->high_water);
+	stats->capacity = (int)(q->mask + 1);
+}
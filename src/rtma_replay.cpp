@@ -0,0 +1,401 @@
+#include "rtma_client.h"
+#include "rtma_time.h"
+#include "rtma_histogram.h"
+#include "rtma_recorder.h"
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// Types below this belong to the message manager protocol (connect,
+// subscribe, exit, ...) and are only replayed when asked for with -t
+#define FIRST_USER_TYPE 100
+
+// Messages further in the future than this are waited for with a sleep, the
+// rest of the way spinning
+#define SPIN_AHEAD 0.0002
+
+#define SHARD_BY_SOURCE 0
+#define SHARD_BY_TYPE 1
+
+typedef struct {
+	const char* recording;
+	char* server;
+	int port;
+	double speed;		// 0 replays as fast as possible
+	double from;		// Seconds into the recording
+	double to;			// Seconds into the recording, 0 for the end
+	std::vector<MSG_TYPE> types;
+	std::vector<int> sources;
+	int num_shards;
+	int shard_by;
+	int batch_size;
+}ReplayOptions;
+
+typedef struct {
+	long long msgs;
+	long long bytes;
+	double first_send_time;	// Recorded send_time of the first message
+	double last_send_time;
+	double duration;		// Wall clock seconds from start to the last send
+	LatencyHistogram lateness;	// Send call behind the recorded schedule, ns
+}ShardResult;
+
+std::mutex print_mutex;
+
+int parse_list(const char* arg, std::vector<int>& values) {
+	values.clear();
+
+	while (*arg) {
+		char* end;
+		long v = strtol(arg, &end, 10);
+		if (end == arg)
+			return -1;
+		values.push_back((int)v);
+
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		arg = end;
+	}
+
+	return values.empty() ? -1 : 0;
+}
+
+static int replay_selected(const ReplayOptions* opt, const RTMA_MSG_HEADER* h, int shard) {
+	if (opt->types.empty()) {
+		if (h->msg_type < FIRST_USER_TYPE)
+			return FALSE;
+	}
+
+	if (!opt->sources.empty()) {
+		int found = FALSE;
+		for (int src : opt->sources) {
+			if (h->src_mod_id == src)
+				found = TRUE;
+		}
+		if (!found)
+			return FALSE;
+	}
+
+	// Shard -1 takes everything
+	if (opt->num_shards > 1 && shard >= 0) {
+		unsigned key = opt->shard_by == SHARD_BY_TYPE ? (unsigned)h->msg_type : (unsigned short)h->src_mod_id;
+		if ((int)(key % (unsigned)opt->num_shards) != shard)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+// Filter rec and position it at the start of the replayed range. Returns
+// the recv_time of the first message of the recording.
+static double replay_seek(MessageRecording* rec, const ReplayOptions* opt) {
+	if (opt->types.size())
+		rtma_recording_set_filter(rec, opt->types.data(), (int)opt->types.size());
+
+	RecorderStats stats;
+	rtma_recording_get_stats(rec, &stats);
+	double first = stats.first_recv_time;
+
+	// Without an index, e.g. while still being recorded, start at the first
+	// message
+	MessageView view;
+	if (!stats.index_entries && rtma_recording_next(rec, &view))
+		first = view.rtma_header.recv_time;
+
+	rtma_recording_seek_time(rec, first + opt->from);
+	return first;
+}
+
+// Recorded send_time of the first message replayed. Every shard schedules
+// against it so that together they keep the recorded timing.
+static int replay_find_start(const ReplayOptions* opt, double* start_send_time) {
+	MessageRecording* rec = rtma_open_recording(opt->recording);
+	if (rec == NULL)
+		return -1;
+
+	replay_seek(rec, opt);
+
+	MessageView view;
+	int found;
+	while ((found = rtma_recording_next(rec, &view)) && !replay_selected(opt, &view.rtma_header, -1))
+		continue;
+
+	if (found)
+		*start_send_time = view.rtma_header.send_time;
+
+	rtma_close_recording(&rec);
+	return found ? 0 : -1;
+}
+
+int replay_loop(int shard, const ReplayOptions* opt, double start_send_time, double start_wall, ShardResult* result) {
+	Client* c = rtma_create_client(0, 0);
+	if (rtma_client_connect(c, opt->server, opt->port) != RTMA_NO_ERROR) {
+		rtma_destroy_client(&c);
+		return -1;
+	}
+
+	MessageRecording* rec = rtma_open_recording(opt->recording);
+	if (rec == NULL) {
+		rtma_client_disconnect(c);
+		rtma_destroy_client(&c);
+		return -1;
+	}
+
+	double first = replay_seek(rec, opt);
+	double end_recv_time = opt->to > 0 ? first + opt->to : 0.0;
+	MessageView view;
+
+	memset(result, 0, sizeof(ShardResult));
+
+	// Messages that are due go out together; the batch is flushed before
+	// waiting for the next one
+	rtma_client_begin_batch(c);
+	rtma_client_set_batch_limits(c, 0, opt->batch_size, 0);
+
+	// All shards start together
+	double now = rtma_time_now(RTMA_CLOCK_MONOTONIC);
+	if (start_wall > now)
+		std::this_thread::sleep_for(std::chrono::duration<double>(start_wall - now));
+
+	while (rtma_recording_next(rec, &view)) {
+		RTMA_MSG_HEADER* h = &view.rtma_header;
+
+		if (end_recv_time > 0 && h->recv_time > end_recv_time)
+			break;
+		if (!replay_selected(opt, h, shard))
+			continue;
+
+		if (opt->speed > 0) {
+			double due = start_wall + (h->send_time - start_send_time) / opt->speed;
+
+			now = rtma_time_now(RTMA_CLOCK_MONOTONIC);
+			if (due > now) {
+				rtma_client_flush(c);
+				if (due - now > SPIN_AHEAD)
+					std::this_thread::sleep_for(std::chrono::duration<double>(due - now - SPIN_AHEAD));
+				while ((now = rtma_time_now(RTMA_CLOCK_MONOTONIC)) < due)
+					continue;
+			}
+			rtma_histogram_record(&result->lateness, (long long)((now - due) * 1e9));
+		}
+
+		if (rtma_client_send_message_to_module(c, h->msg_type, view.data, h->num_data_bytes, h->dest_mod_id, h->dest_host_id, BLOCKING) == SOCKET_ERROR) {
+			fprintf(stderr, "rtma_replay: shard %d lost its connection.\n", shard);
+			break;
+		}
+
+		if (result->msgs == 0)
+			result->first_send_time = h->send_time;
+		result->last_send_time = h->send_time;
+		result->msgs++;
+		result->bytes += sizeof(RTMA_MSG_HEADER) + h->num_data_bytes;
+	}
+
+	rtma_client_end_batch(c);
+	result->duration = rtma_time_now(RTMA_CLOCK_MONOTONIC) - start_wall;
+
+	rtma_close_recording(&rec);
+	rtma_client_disconnect(c);
+	rtma_destroy_client(&c);
+
+	std::lock_guard<std::mutex> lock(print_mutex);
+	printf("Shard[%d] -> %lld messages | %0.0lf messages/sec | %0.1lf MB/sec\n", shard, result->msgs,
+		result->duration > 0 ? result->msgs / result->duration : 0.0, result->duration > 0 ? result->bytes / 1e6 / result->duration : 0.0);
+
+	return 0;
+}
+
+void usage(void) {
+	printf("Usage: rtma_replay [-s server(127.0.0.1:7111)] [-speed FACTOR | -max] [-t TYPES] [-src MODULES] [-from SECONDS] [-to SECONDS] [-c CONNECTIONS] [-shard src|type] [-b BATCH_SIZE] RECORDING\n");
+	printf("\nRepublishes the messages of a recording made with rtma_recorder, with their recorded msg_type, payload and destination.\n\n");
+
+	printf("- speed float\n\tReplay at FACTOR times the recorded pace, following the send_time deltas (default 1)\n");
+	printf("- max\n\tReplay as fast as possible\n");
+	printf("- t list\n\tOnly replay these message types, e.g. 1234,1235. Without it types below %d are skipped\n", FIRST_USER_TYPE);
+	printf("- src list\n\tOnly replay messages sent by these modules\n");
+	printf("- from float\n\tStart this many seconds into the recording (default 0)\n");
+	printf("- to float\n\tStop this many seconds into the recording (default the end)\n");
+	printf("- c int\n\tNumber of publisher connections the stream is sharded across (default 1)\n");
+	printf("- shard string\n\tShard by source module (src), which keeps each module's messages in order, or by message type (default src)\n");
+	printf("- b int\n\tMost messages coalesced per write once replay falls behind (default 64)\n");
+	printf("- s string\n\tRTMA message manager address, optionally with the port as host:port (default 127.0.0.1). A path selects a Unix domain socket, a shm:// prefix the shared memory transport\n");
+	printf("- p int\n\tRTMA message manager port (default 7111)\n");
+	printf("- h\n\tShow help message\n");
+}
+
+int main(int argc, char** argv) {
+	char server[256] = "127.0.0.1";
+	ReplayOptions opt;
+	opt.recording = NULL;
+	opt.server = server;
+	opt.port = 7111;
+	opt.speed = 1.0;
+	opt.from = 0.0;
+	opt.to = 0.0;
+	opt.num_shards = 1;
+	opt.shard_by = SHARD_BY_SOURCE;
+	opt.batch_size = 64;
+
+	char* flag;
+	const char* prog_name = argv[0];
+
+	while (--argc > 0 && (*++argv)[0] == '-') {
+		flag = &((*argv)[1]);
+
+		if (argc < 2 && strcmp(flag, "max") && strcmp(flag, "h")) {
+			fprintf(stderr, "%s: missing value for %s\n", prog_name, *argv);
+			usage();
+			return -1;
+		}
+
+		if (strcmp(flag, "s") == 0) {
+			strncpy(server, *++argv, sizeof(server) - 1);
+			argc--;
+
+			// [shm://]host:port, but leave IPv6 addresses alone
+			char* host = strstr(server, "://") ? strstr(server, "://") + 3 : server;
+			char* colon = strrchr(host, ':');
+			if (colon && colon == strchr(host, ':')) {
+				*colon = '\0';
+				opt.port = atoi(colon + 1);
+			}
+		}
+		else if (strcmp(flag, "p") == 0) {
+			opt.port = atoi(*++argv);
+			argc--;
+		}
+		else if (strcmp(flag, "speed") == 0) {
+			opt.speed = atof(*++argv);
+			argc--;
+			if (opt.speed <= 0) {
+				fprintf(stderr, "%s: -speed must be positive, use -max to replay as fast as possible\n", prog_name);
+				return -1;
+			}
+		}
+		else if (strcmp(flag, "max") == 0) {
+			opt.speed = 0.0;
+		}
+		else if (strcmp(flag, "t") == 0) {
+			if (parse_list(*++argv, opt.types)) {
+				fprintf(stderr, "%s: bad value for -t: %s\n", prog_name, *argv);
+				return -1;
+			}
+			argc--;
+		}
+		else if (strcmp(flag, "src") == 0) {
+			if (parse_list(*++argv, opt.sources)) {
+				fprintf(stderr, "%s: bad value for -src: %s\n", prog_name, *argv);
+				return -1;
+			}
+			argc--;
+		}
+		else if (strcmp(flag, "from") == 0) {
+			opt.from = atof(*++argv);
+			argc--;
+		}
+		else if (strcmp(flag, "to") == 0) {
+			opt.to = atof(*++argv);
+			argc--;
+		}
+		else if (strcmp(flag, "c") == 0) {
+			opt.num_shards = atoi(*++argv);
+			argc--;
+			if (opt.num_shards < 1)
+				opt.num_shards = 1;
+		}
+		else if (strcmp(flag, "shard") == 0) {
+			++argv;
+			argc--;
+			if (strcmp(*argv, "src") == 0)
+				opt.shard_by = SHARD_BY_SOURCE;
+			else if (strcmp(*argv, "type") == 0)
+				opt.shard_by = SHARD_BY_TYPE;
+			else {
+				fprintf(stderr, "%s: unknown shard key %s\n", prog_name, *argv);
+				return -1;
+			}
+		}
+		else if (strcmp(flag, "b") == 0) {
+			opt.batch_size = atoi(*++argv);
+			argc--;
+			if (opt.batch_size < 1)
+				opt.batch_size = 1;
+		}
+		else if (strcmp(flag, "h") == 0) {
+			usage();
+			return 0;
+		}
+		else {
+			fprintf(stderr, "%s: unknown arg %s\n", prog_name, *argv);
+			usage();
+			return -1;
+		}
+	}
+
+	if (argc != 1) {
+		usage();
+		return -1;
+	}
+	opt.recording = *argv;
+
+	double start_send_time;
+	if (replay_find_start(&opt, &start_send_time)) {
+		fprintf(stderr, "%s: nothing to replay in %s\n", prog_name, opt.recording);
+		return -1;
+	}
+
+	std::vector<ShardResult> results(opt.num_shards);
+	std::vector<std::thread> shards;
+
+	// Leave the connections time to come up before the schedule starts
+	double start_wall = rtma_time_now(RTMA_CLOCK_MONOTONIC) + 0.1 + 0.01 * opt.num_shards;
+	for (int i = 0; i < opt.num_shards; i++)
+		shards.push_back(std::thread(replay_loop, i, &opt, start_send_time, start_wall, &results[i]));
+
+	for (auto& t : shards)
+		t.join();
+
+	ShardResult total;
+	memset(&total, 0, sizeof(total));
+	total.first_send_time = start_send_time;
+	total.last_send_time = start_send_time;
+
+	for (ShardResult& r : results) {
+		total.msgs += r.msgs;
+		total.bytes += r.bytes;
+		if (r.duration > total.duration)
+			total.duration = r.duration;
+		if (r.msgs && r.last_send_time > total.last_send_time)
+			total.last_send_time = r.last_send_time;
+
+		total.lateness.count += r.lateness.count;
+		total.lateness.sum_ns += r.lateness.sum_ns;
+		if (r.lateness.max_ns > total.lateness.max_ns)
+			total.lateness.max_ns = r.lateness.max_ns;
+		for (int b = 0; b < RTMA_HIST_NUM_BUCKETS; b++)
+			total.lateness.buckets[b] += r.lateness.buckets[b];
+	}
+
+	double recorded = total.last_send_time - total.first_send_time;
+	printf("\nReplayed %lld messages (%0.1lf MB) over %d connection%s in %0.3lf sec\n", total.msgs, total.bytes / 1e6, opt.num_shards, opt.num_shards > 1 ? "s" : "", total.duration);
+	printf("Achieved: %0.0lf messages/sec | %0.1lf MB/sec\n", total.duration > 0 ? total.msgs / total.duration : 0.0, total.duration > 0 ? total.bytes / 1e6 / total.duration : 0.0);
+	if (recorded > 0)
+		printf("Recorded: %0.0lf messages/sec over %0.3lf sec | replay ran at %0.2lfx\n", total.msgs / recorded, recorded, recorded / total.duration);
+
+	if (total.lateness.count) {
+		printf("Timing error us: mean %0.1lf | p50 %0.1lf | p99 %0.1lf | p99.9 %0.1lf | max %0.1lf\n",
+			total.lateness.sum_ns / 1e3 / total.lateness.count,
+			rtma_histogram_percentile(&total.lateness, 50.0) / 1e3,
+			rtma_histogram_percentile(&total.lateness, 99.0) / 1e3,
+			rtma_histogram_percentile(&total.lateness, 99.9) / 1e3,
+			total.lateness.max_ns / 1e3);
+	}
+
+	return 0;
+}
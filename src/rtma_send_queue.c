@@ -0,0 +1,395 @@
+#include "rtma_send_queue.h"
+#include "rtma_client_internal.h"
+#include "rtma_atomic.h"
+#include "rtma_thread.h"
+#include "rtma_time.h"
+
+// Most messages gathered into one write by the I/O thread
+#define RTMA_SEND_QUEUE_BATCH 64
+// Polls of an empty queue before the I/O thread goes to sleep
+#define RTMA_SEND_QUEUE_SPIN 2000
+// Longest a sleeping thread waits before looking again on its own
+#define RTMA_SEND_QUEUE_MAX_SLEEP 0.1
+
+typedef struct {
+	long long seq;	// Slot position when free, position + 1 once filled
+	int len;
+	int reserved;
+	char frame[sizeof(RTMA_MSG_HEADER) + MAX_DATA_BYTES];
+}SendSlot;
+
+// Bounded queue after Vyukov: producers claim positions with a CAS on
+// enqueue_pos and publish through the slot's sequence number, so neither side
+// takes a lock unless it has to sleep.
+struct SendQueue {
+	long long enqueue_pos;
+	char pad0[64 - sizeof(long long)];
+	long long dequeue_pos;	// Only advanced by the I/O thread
+	long long written_pos;	// Everything before this has been written
+	long long sent;
+	char pad1[64 - 3 * sizeof(long long)];
+	long long dropped;
+	long long failed;	// Messages the transport refused
+	int write_failed;	// The connection is gone, later sends fail right away
+	int consumer_sleeping;
+	int producers_waiting;
+	int stop;
+	int policy;
+	long long mask;
+	SendSlot* slots;
+	Client* client;
+	rtma_mutex_t lock;
+	rtma_cond_t not_empty;
+	rtma_cond_t not_full;
+	rtma_thread_t thread;
+};
+
+static void rtma_send_queue_wake_consumer(SendQueue* q) {
+	rtma_atomic_fence();
+	if (rtma_atomic_load(&q->consumer_sleeping)) {
+		rtma_mutex_lock(&q->lock);
+		rtma_cond_signal(&q->not_empty);
+		rtma_mutex_unlock(&q->lock);
+	}
+}
+
+// Slots are handed back in order, so count slots are free once the last of
+// them is
+static int rtma_send_queue_has_room(SendQueue* q, int count) {
+	long long last = rtma_atomic_load64(&q->enqueue_pos) + count - 1;
+	return rtma_atomic_load64(&q->slots[last & q->mask].seq) >= last;
+}
+
+// Claim count consecutive slots, at most the size of the queue, starting at
+// *claimed. Returns FALSE if the queue is too full and the policy or the
+// timeout says to give up.
+static int rtma_send_queue_claim(SendQueue* q, int count, long long* claimed, double timeout) {
+	double deadline = timeout > 0 ? rtma_time_now(RTMA_CLOCK_MONOTONIC) + timeout : 0.0;
+	long long pos = rtma_atomic_load64(&q->enqueue_pos);
+
+	for (;;) {
+		long long last = pos + count - 1;
+		long long diff = rtma_atomic_load64(&q->slots[pos & q->mask].seq) - pos;
+
+		if (diff == 0)
+			diff = rtma_atomic_load64(&q->slots[last & q->mask].seq) - last;
+
+		if (diff == 0) {
+			if (rtma_atomic_cas64(&q->enqueue_pos, pos, pos + count)) {
+				*claimed = pos;
+				return TRUE;
+			}
+		}
+		else if (diff < 0) {
+			// Full
+			if (q->policy == RTMA_SEND_QUEUE_DROP || timeout == 0)
+				return FALSE;
+
+			double wait = RTMA_SEND_QUEUE_MAX_SLEEP;
+			if (timeout > 0) {
+				wait = deadline - rtma_time_now(RTMA_CLOCK_MONOTONIC);
+				if (wait <= 0)
+					return FALSE;
+				if (wait > RTMA_SEND_QUEUE_MAX_SLEEP)
+					wait = RTMA_SEND_QUEUE_MAX_SLEEP;
+			}
+
+			rtma_atomic_add(&q->producers_waiting, 1);
+			rtma_atomic_fence();
+			rtma_mutex_lock(&q->lock);
+			if (!rtma_send_queue_has_room(q, count))
+				rtma_cond_wait(&q->not_full, &q->lock, wait);
+			rtma_mutex_unlock(&q->lock);
+			rtma_atomic_add(&q->producers_waiting, -1);
+		}
+
+		pos = rtma_atomic_load64(&q->enqueue_pos);
+	}
+}
+
+static void rtma_send_queue_publish(SendQueue* q, SendSlot* slot, long long pos, int len) {
+	slot->len = len;
+	rtma_atomic_store64(&slot->seq, pos + 1);
+	rtma_send_queue_wake_consumer(q);
+}
+
+// Copy len bytes from the segments, continuing where the last call stopped
+static void rtma_send_queue_gather(char* dst, size_t len, const DataSegment* segments, int* seg, size_t* seg_offset) {
+	while (len > 0) {
+		size_t n = segments[*seg].len - *seg_offset;
+		if (n > len)
+			n = len;
+
+		memcpy(dst, (const char*)segments[*seg].data + *seg_offset, n);
+		dst += n;
+		len -= n;
+		*seg_offset += n;
+
+		if (*seg_offset == segments[*seg].len) {
+			(*seg)++;
+			*seg_offset = 0;
+		}
+	}
+}
+
+// Queue a message, split into dynamic fragments when it is larger than a
+// slot. The slots for all fragments are claimed before any is published, so
+// a message is queued whole or dropped whole. Only a send that waits for
+// room without a limit takes messages larger than the queue, a queue full at
+// a time. Returns the number of bytes queued, SOCKET_ERROR once the
+// connection is gone.
+int rtma_send_queue_push(Client* c, const RTMA_MSG_HEADER* header, const DataSegment* segments, int num_segments, double timeout) {
+	SendQueue* q = c->send_queue;
+	size_t remaining = header->num_data_bytes;
+	int is_dynamic = remaining > MAX_DATA_BYTES ? RTMA_DYNAMIC_FIRST : 0;
+	int fragments = is_dynamic ? (int)((remaining + MAX_DATA_BYTES - 1) / MAX_DATA_BYTES) : 1;
+	int capacity = (int)(q->mask + 1);
+	int seg = 0;
+	size_t seg_offset = 0;
+	int nbytes = 0;
+
+	if (rtma_atomic_load(&q->write_failed))
+		return SOCKET_ERROR;
+
+	if (fragments > capacity && (q->policy == RTMA_SEND_QUEUE_DROP || timeout >= 0)) {
+		rtma_atomic_add64(&q->dropped, 1);
+		return 0;
+	}
+
+	// Skip empty segments up front
+	while (seg < num_segments && segments[seg].len == 0)
+		seg++;
+
+	do {
+		int count = fragments < capacity ? fragments : capacity;
+		long long pos;
+
+		// Later parts of an oversized message wait for as long as it takes
+		if (!rtma_send_queue_claim(q, count, &pos, timeout)) {
+			rtma_atomic_add64(&q->dropped, 1);
+			return 0;
+		}
+		fragments -= count;
+
+		for (int i = 0; i < count; i++) {
+			size_t fragment_len = remaining < MAX_DATA_BYTES ? remaining : MAX_DATA_BYTES;
+			SendSlot* slot = &q->slots[(pos + i) & q->mask];
+
+			remaining -= fragment_len;
+
+			RTMA_MSG_HEADER* h = (RTMA_MSG_HEADER*)slot->frame;
+			*h = *header;
+			if (is_dynamic) {
+				h->num_data_bytes = (int)fragment_len;
+				h->remaining_bytes = (int)remaining;
+				h->is_dynamic = is_dynamic;
+				is_dynamic = RTMA_DYNAMIC_NEXT;
+			}
+
+			rtma_send_queue_gather(slot->frame + sizeof(RTMA_MSG_HEADER), fragment_len, segments, &seg, &seg_offset);
+
+			int len = (int)(sizeof(RTMA_MSG_HEADER) + fragment_len);
+			rtma_send_queue_publish(q, slot, pos + i, len);
+			nbytes += len;
+		}
+	} while (fragments > 0);
+
+	return nbytes;
+}
+
+static int rtma_send_queue_ready(SendQueue* q) {
+	return rtma_atomic_load64(&q->slots[q->dequeue_pos & q->mask].seq) == q->dequeue_pos + 1;
+}
+
+static RTMA_THREAD_FUNC(rtma_send_queue_thread, arg) {
+	SendQueue* q = (SendQueue*)arg;
+	socket_iovec_t iov[RTMA_SEND_QUEUE_BATCH];
+	int idle = 0;
+
+	for (;;) {
+		int n = 0;
+		long long pos = q->dequeue_pos;
+
+		// Gather whatever is ready, in order
+		while (n < RTMA_SEND_QUEUE_BATCH) {
+			SendSlot* slot = &q->slots[(pos + n) & q->mask];
+			if (rtma_atomic_load64(&slot->seq) != pos + n + 1)
+				break;
+			SOCKET_IOVEC_SET(iov[n], slot->frame, slot->len);
+			n++;
+		}
+
+		if (n > 0) {
+			idle = 0;
+			q->dequeue_pos = pos + n;
+
+			// Sends fail from here on, the owner of the client drops the
+			// connection on its next flush
+			if (rtma_atomic_load(&q->write_failed) || rtma_client_writev(q->client, iov, n) == SOCKET_ERROR) {
+				rtma_atomic_store(&q->write_failed, 1);
+				rtma_atomic_store64(&q->failed, q->failed + n);
+			}
+			else {
+				rtma_atomic_store64(&q->sent, q->sent + n);
+			}
+
+			// Hand the slots back for the next lap
+			for (int i = 0; i < n; i++)
+				rtma_atomic_store64(&q->slots[(pos + i) & q->mask].seq, pos + i + q->mask + 1);
+			rtma_atomic_store64(&q->written_pos, pos + n);
+
+			rtma_atomic_fence();
+			if (rtma_atomic_load(&q->producers_waiting)) {
+				rtma_mutex_lock(&q->lock);
+				rtma_cond_broadcast(&q->not_full);
+				rtma_mutex_unlock(&q->lock);
+			}
+			continue;
+		}
+
+		// Producers still filling claimed slots keep the queue alive past stop
+		if (rtma_atomic_load(&q->stop) && rtma_atomic_load64(&q->enqueue_pos) == q->dequeue_pos)
+			break;
+
+		if (++idle < RTMA_SEND_QUEUE_SPIN) {
+			rtma_cpu_relax();
+			continue;
+		}
+
+		rtma_mutex_lock(&q->lock);
+		rtma_atomic_store(&q->consumer_sleeping, 1);
+		rtma_atomic_fence();
+		if (!rtma_send_queue_ready(q) && !rtma_atomic_load(&q->stop))
+			rtma_cond_wait(&q->not_empty, &q->lock, RTMA_SEND_QUEUE_MAX_SLEEP);
+		rtma_atomic_store(&q->consumer_sleeping, 0);
+		rtma_mutex_unlock(&q->lock);
+		idle = 0;
+	}
+
+	RTMA_THREAD_RETURN;
+}
+
+// Start routing sends from any thread through the queue. The client must be
+// connected. num_slots is rounded up to a power of two.
+int rtma_client_start_send_thread(Client* c, int num_slots, int full_policy) {
+	if (c->send_queue != NULL)
+		return 0;
+
+	if (!c->connected) {
+		fprintf(stderr, "rtma_client_start_send_thread: client is not connected.\n");
+		return -1;
+	}
+
+	if (c->outbound != NULL) {
+		fprintf(stderr, "rtma_client_start_send_thread: not available with the outbound queue.\n");
+		return -1;
+	}
+
+	if (c->auto_reconnect) {
+		fprintf(stderr, "rtma_client_start_send_thread: not available with auto reconnect.\n");
+		return -1;
+	}
+
+	if (num_slots <= 0)
+		num_slots = RTMA_SEND_QUEUE_DEFAULT_SLOTS;
+
+	int size = 2;
+	while (size < num_slots)
+		size <<= 1;
+
+	SendQueue* q = (SendQueue*)calloc(1, sizeof(SendQueue));
+	SendSlot* slots = (SendSlot*)malloc(size * sizeof(SendSlot));
+
+	if (q == NULL || slots == NULL) {
+		perror("rtma_client_start_send_thread:malloc failed");
+		free(q);
+		free(slots);
+		return -1;
+	}
+
+	for (int i = 0; i < size; i++)
+		slots[i].seq = i;
+
+	q->slots = slots;
+	q->mask = size - 1;
+	q->policy = full_policy;
+	q->client = c;
+	rtma_mutex_init(&q->lock);
+	rtma_cond_init(&q->not_empty);
+	rtma_cond_init(&q->not_full);
+
+	// Nothing batched may be left behind the queue
+	rtma_client_end_batch(c);
+
+	if (rtma_thread_create(&q->thread, rtma_send_queue_thread, q)) {
+		fprintf(stderr, "rtma_client_start_send_thread: unable to start thread.\n");
+		rtma_mutex_destroy(&q->lock);
+		rtma_cond_destroy(&q->not_empty);
+		rtma_cond_destroy(&q->not_full);
+		free(slots);
+		free(q);
+		return -1;
+	}
+
+	c->send_queue = q;
+	return 0;
+}
+
+// Wait until the send thread has written everything queued so far. Returns
+// TRUE once it has, FALSE when timeout runs out first and SOCKET_ERROR when
+// the connection is gone.
+int rtma_send_queue_drain(Client* c, double timeout) {
+	SendQueue* q = c->send_queue;
+	long long target = rtma_atomic_load64(&q->enqueue_pos);
+	double deadline = timeout > 0 ? rtma_time_now(RTMA_CLOCK_MONOTONIC) + timeout : 0.0;
+
+	rtma_send_queue_wake_consumer(q);
+	while (rtma_atomic_load64(&q->written_pos) < target) {
+		if (rtma_atomic_load(&q->write_failed))
+			return SOCKET_ERROR;
+		if (timeout == 0 || (timeout > 0 && rtma_time_now(RTMA_CLOCK_MONOTONIC) > deadline))
+			return FALSE;
+		rtma_thread_yield();
+	}
+
+	return rtma_atomic_load(&q->write_failed) ? SOCKET_ERROR : TRUE;
+}
+
+// Write out everything queued and stop the I/O thread. No other thread may
+// be sending on the client any more.
+void rtma_client_stop_send_thread(Client* c) {
+	SendQueue* q = c->send_queue;
+
+	if (q == NULL)
+		return;
+
+	rtma_mutex_lock(&q->lock);
+	rtma_atomic_store(&q->stop, 1);
+	rtma_cond_signal(&q->not_empty);
+	rtma_mutex_unlock(&q->lock);
+
+	rtma_thread_join(q->thread);
+
+	c->send_queue = NULL;
+	rtma_mutex_destroy(&q->lock);
+	rtma_cond_destroy(&q->not_empty);
+	rtma_cond_destroy(&q->not_full);
+	free(q->slots);
+	free(q);
+}
+
+void rtma_client_get_send_queue_stats(Client* c, SendQueueStats* stats) {
+	SendQueue* q = c->send_queue;
+
+	memset(stats, 0, sizeof(*stats));
+	if (q == NULL)
+		return;
+
+	long long depth = rtma_atomic_load64(&q->enqueue_pos) - rtma_atomic_load64(&q->written_pos);
+
+	stats->sent = rtma_atomic_load64(&q->sent);
+	stats->dropped = rtma_atomic_load64(&q->dropped);
+	stats->failed = rtma_atomic_load64(&q->failed);
+	stats->depth = (int)(depth < 0 ? 0 : depth);
+	stats->capacity = (int)(q->mask + 1);
+}
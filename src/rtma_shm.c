@@ -0,0 +1,572 @@
+#ifdef __linux__
+#define _GNU_SOURCE	// accept4, memfd_create
+#endif
+
+#include "rtma_shm.h"
+
+#ifdef __linux__
+
+#include "rtma_atomic.h"
+#include "rtma_time.h"
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define RTMA_SHM_MAGIC 0x524d5348	// "RMSH"
+#define RTMA_SHM_VERSION 1
+#define RTMA_SHM_CACHE_LINE 64
+
+// How often a writer blocked on a full ring checks that the reader is alive
+#define RTMA_SHM_LIVENESS_INTERVAL 0.1
+
+// writer_waiting values
+#define RTMA_SHM_WAIT_FUTEX 1
+#define RTMA_SHM_WAIT_SIGNAL 2
+
+// Ring control block. head belongs to the consumer and tail to the producer,
+// each on its own cache line. Both count bytes from the start and only ever
+// grow, so the fill level is tail - head.
+typedef struct {
+	long long head;
+	int reader_waiting;	// Consumer is about to sleep on its eventfd
+	char pad0[RTMA_SHM_CACHE_LINE - sizeof(long long) - sizeof(int)];
+	long long tail;
+	int writer_waiting;	// RTMA_SHM_WAIT_* while the producer waits for room
+	int space_seq;	// Futex word, bumped when room is made for a waiting producer
+	char pad1[RTMA_SHM_CACHE_LINE - sizeof(long long) - 2 * sizeof(int)];
+}RtmaShmRing;
+
+typedef struct {
+	int magic;
+	int version;
+	int ring_size;
+	char pad[RTMA_SHM_CACHE_LINE - 3 * sizeof(int)];
+}RtmaShmRegion;
+
+struct RtmaShm {
+	void* base;
+	size_t size;
+	RtmaShmRing* tx;
+	char* tx_data;
+	RtmaShmRing* rx;
+	char* rx_data;
+	size_t ring_size;
+	int wake_fd;	// Signalled by the peer
+	int peer_fd;	// Signals the peer
+	sockfd_t conn;	// Liveness socket, not owned
+};
+
+static void rtma_shm_abstract_addr(uint16_t port, struct sockaddr_un* addr, socklen_t* addrlen) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	// Leading NUL puts the name in the abstract namespace, no file to clean up
+	int n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "rtma_shm.%d", port);
+	*addrlen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + n);
+}
+
+static size_t rtma_shm_region_size(size_t ring_size) {
+	return sizeof(RtmaShmRegion) + 2 * (sizeof(RtmaShmRing) + ring_size);
+}
+
+// Ring 0 carries message manager to client, ring 1 client to message manager
+static RtmaShm* rtma_shm_map(int mem_fd, size_t ring_size, int is_client, int wake_fd, int peer_fd, sockfd_t conn) {
+	size_t size = rtma_shm_region_size(ring_size);
+	void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+
+	if (base == MAP_FAILED)
+		return NULL;
+
+	RtmaShm* shm = (RtmaShm*)calloc(1, sizeof(RtmaShm));
+	if (shm == NULL) {
+		munmap(base, size);
+		return NULL;
+	}
+
+	char* rings = (char*)base + sizeof(RtmaShmRegion);
+	RtmaShmRing* ring0 = (RtmaShmRing*)rings;
+	RtmaShmRing* ring1 = (RtmaShmRing*)(rings + sizeof(RtmaShmRing) + ring_size);
+
+	shm->base = base;
+	shm->size = size;
+	shm->ring_size = ring_size;
+	shm->tx = is_client ? ring1 : ring0;
+	shm->rx = is_client ? ring0 : ring1;
+	shm->tx_data = (char*)(shm->tx + 1);
+	shm->rx_data = (char*)(shm->rx + 1);
+	shm->wake_fd = wake_fd;
+	shm->peer_fd = peer_fd;
+	shm->conn = conn;
+
+	return shm;
+}
+
+static void rtma_shm_signal(int fd) {
+	uint64_t one = 1;
+	ssize_t ret;
+
+	do {
+		ret = write(fd, &one, sizeof(one));
+	} while (ret < 0 && errno == EINTR);
+}
+
+static void rtma_shm_drain(int fd) {
+	uint64_t count;
+	while (read(fd, &count, sizeof(count)) < 0 && errno == EINTR)
+		;
+}
+
+// The liveness socket never carries data, so readable means closed
+static int rtma_shm_peer_closed(RtmaShm* shm) {
+	struct pollfd pfd = { shm->conn, POLLIN, 0 };
+	return poll(&pfd, 1, 0) > 0;
+}
+
+sockfd_t rtma_shm_listen(uint16_t port) {
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+
+	sockfd_t fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return INVALID_SOCKET;
+
+	rtma_shm_abstract_addr(port, &addr, &addrlen);
+
+	if (bind(fd, (struct sockaddr*)&addr, addrlen) < 0 || listen(fd, 128) < 0) {
+		close(fd);
+		return INVALID_SOCKET;
+	}
+
+	return fd;
+}
+
+// Set up a region for the next pending client and pass it the memory and
+// both eventfds. Returns NULL if there is nobody to accept or setup failed.
+RtmaShm* rtma_shm_accept(sockfd_t listen_fd, sockfd_t* conn) {
+	sockfd_t fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	size_t ring_size = RTMA_SHM_RING_SIZE;
+	int mem_fd = memfd_create("rtma_shm", MFD_CLOEXEC);
+	int client_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	int server_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	RtmaShm* shm = NULL;
+
+	if (mem_fd < 0 || client_fd < 0 || server_fd < 0)
+		goto fail;
+
+	if (ftruncate(mem_fd, rtma_shm_region_size(ring_size)) < 0)
+		goto fail;
+
+	shm = rtma_shm_map(mem_fd, ring_size, FALSE, server_fd, client_fd, fd);
+	if (shm == NULL)
+		goto fail;
+
+	// Fresh memfd pages are zero, which is an empty ring on both sides.
+	// Both readers start out idle so that the first write signals them.
+	RtmaShmRegion* region = (RtmaShmRegion*)shm->base;
+	region->magic = RTMA_SHM_MAGIC;
+	region->version = RTMA_SHM_VERSION;
+	region->ring_size = (int)ring_size;
+	shm->tx->reader_waiting = 1;
+	shm->rx->reader_waiting = 1;
+
+	int fds[3] = { mem_fd, client_fd, server_fd };
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov;
+	struct msghdr msg;
+	int size = (int)ring_size;
+
+	memset(control, 0, sizeof(control));
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &size;
+	iov.iov_len = sizeof(size);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(size))
+		goto fail;
+
+	// The client keeps its own copies; the eventfd stays open here to signal it
+	close(mem_fd);
+	*conn = fd;
+	return shm;
+
+fail:
+	if (shm) {
+		munmap(shm->base, shm->size);
+		free(shm);
+	}
+	if (mem_fd >= 0)
+		close(mem_fd);
+	if (client_fd >= 0)
+		close(client_fd);
+	if (server_fd >= 0)
+		close(server_fd);
+	close(fd);
+	return NULL;
+}
+
+RtmaShm* rtma_shm_connect(uint16_t port, sockfd_t* conn) {
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+
+	sockfd_t fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+
+	rtma_shm_abstract_addr(port, &addr, &addrlen);
+
+	if (connect(fd, (struct sockaddr*)&addr, addrlen) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	// Don't hang on a listener that never answers
+	struct timeval tv = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	int fds[3] = { -1, -1, -1 };
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov;
+	struct msghdr msg;
+	int size = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &size;
+	iov.iov_len = sizeof(size);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t n;
+	do {
+		n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	} while (n < 0 && errno == EINTR);
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (n != sizeof(size) || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		close(fd);
+		return NULL;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	RtmaShm* shm = NULL;
+	if (size > 0 && (size & (size - 1)) == 0)
+		shm = rtma_shm_map(fds[0], (size_t)size, TRUE, fds[1], fds[2], fd);
+	close(fds[0]);
+
+	if (shm == NULL || ((RtmaShmRegion*)shm->base)->magic != RTMA_SHM_MAGIC || ((RtmaShmRegion*)shm->base)->version != RTMA_SHM_VERSION) {
+		if (shm) {
+			munmap(shm->base, shm->size);
+			free(shm);
+		}
+		close(fds[1]);
+		close(fds[2]);
+		close(fd);
+		return NULL;
+	}
+
+	*conn = fd;
+	return shm;
+}
+
+void rtma_shm_close(RtmaShm** shm) {
+	RtmaShm* s = *shm;
+
+	if (s == NULL)
+		return;
+
+	munmap(s->base, s->size);
+	close(s->wake_fd);
+	close(s->peer_fd);
+	free(s);
+	*shm = NULL;
+}
+
+int rtma_shm_fd(RtmaShm* shm) {
+	return shm->wake_fd;
+}
+
+size_t rtma_shm_readable(RtmaShm* shm) {
+	return (size_t)(rtma_atomic_load64(&shm->rx->tail) - shm->rx->head);
+}
+
+static size_t rtma_shm_space(RtmaShm* shm) {
+	return shm->ring_size - (size_t)(shm->tx->tail - rtma_atomic_load64(&shm->tx->head));
+}
+
+// Copy into the ring at the producer position without publishing it
+static void rtma_shm_put(RtmaShm* shm, long long pos, const char* src, size_t len) {
+	size_t offset = (size_t)pos & (shm->ring_size - 1);
+	size_t first = shm->ring_size - offset;
+
+	if (first > len)
+		first = len;
+
+	memcpy(shm->tx_data + offset, src, first);
+	memcpy(shm->tx_data, src + first, len - first);
+}
+
+// Wake the reader if it went to sleep on an empty ring. The fence orders the
+// tail update before the flag check against the reader's flag store before
+// its emptiness check, so one of the two always sees the other.
+// Returns TRUE if the reader was asleep and had to be signalled
+static int rtma_shm_wake_reader(RtmaShm* shm) {
+	rtma_atomic_fence();
+	if (rtma_atomic_load(&shm->tx->reader_waiting) && rtma_atomic_exchange(&shm->tx->reader_waiting, 0)) {
+		rtma_shm_signal(shm->peer_fd);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+void rtma_shm_notify(RtmaShm* shm) {
+	rtma_shm_wake_reader(shm);
+}
+
+size_t rtma_shm_write(RtmaShm* shm, const char* buf, size_t len) {
+	size_t space = rtma_shm_space(shm);
+
+	if (space < len) {
+		// Ask for a signal once the reader makes room, then look again in
+		// case it already did
+		rtma_atomic_store(&shm->tx->writer_waiting, RTMA_SHM_WAIT_SIGNAL);
+		rtma_atomic_fence();
+		space = rtma_shm_space(shm);
+	}
+
+	if (len > space)
+		len = space;
+
+	if (len > 0) {
+		rtma_shm_put(shm, shm->tx->tail, buf, len);
+		rtma_atomic_store64(&shm->tx->tail, shm->tx->tail + (long long)len);
+	}
+
+	return len;
+}
+
+// Sleep on the futex until the reader frees some of the ring. Returns 1 when
+// there is room, 0 on timeout and -1 if the reader went away.
+static int rtma_shm_wait_space(RtmaShm* shm, double timeout) {
+	RtmaShmRing* r = shm->tx;
+	double deadline = timeout > 0 ? rtma_time_now(RTMA_CLOCK_MONOTONIC) + timeout : 0.0;
+
+	for (;;) {
+		int seq = rtma_atomic_load(&r->space_seq);
+
+		rtma_atomic_store(&r->writer_waiting, RTMA_SHM_WAIT_FUTEX);
+		rtma_atomic_fence();
+
+		if (rtma_shm_space(shm) > 0)
+			return 1;
+		if (rtma_shm_peer_closed(shm))
+			return -1;
+		if (timeout == 0)
+			return 0;
+
+		double wait = RTMA_SHM_LIVENESS_INTERVAL;
+		if (timeout > 0) {
+			double remaining = deadline - rtma_time_now(RTMA_CLOCK_MONOTONIC);
+			if (remaining <= 0)
+				return 0;
+			if (remaining < wait)
+				wait = remaining;
+		}
+
+		struct timespec ts;
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (long)((wait - (double)ts.tv_sec) * 1e9);
+		syscall(SYS_futex, &r->space_seq, FUTEX_WAIT, seq, &ts, NULL, 0);
+	}
+}
+
+int rtma_shm_writev(RtmaShm* shm, socket_iovec_t* iov, int iovcnt) {
+	long long tail = shm->tx->tail;
+	long long start = tail;
+
+	for (int i = 0; i < iovcnt; i++) {
+		const char* src = SOCKET_IOVEC_BASE(iov[i]);
+		size_t len = SOCKET_IOVEC_LEN(iov[i]);
+
+		while (len > 0) {
+			size_t space = shm->ring_size - (size_t)(tail - rtma_atomic_load64(&shm->tx->head));
+
+			if (space == 0) {
+				// Let the reader at what is there before sleeping
+				rtma_atomic_store64(&shm->tx->tail, tail);
+				rtma_shm_notify(shm);
+				if (rtma_shm_wait_space(shm, BLOCKING) < 0)
+					return (int)(tail - start);
+				continue;
+			}
+
+			size_t n = len < space ? len : space;
+			rtma_shm_put(shm, tail, src, n);
+			tail += n;
+			src += n;
+			len -= n;
+		}
+	}
+
+	rtma_atomic_store64(&shm->tx->tail, tail);
+
+	// Writes into the ring of a dead reader would go unnoticed until it
+	// fills up. Look at the liveness socket when the reader was asleep or
+	// has fallen behind, the only times a dead one looks different. A
+	// reader that took everything before closing got the data.
+	if (rtma_shm_wake_reader(shm) || (size_t)(tail - rtma_atomic_load64(&shm->tx->head)) > shm->ring_size / 4) {
+		if (rtma_shm_peer_closed(shm) && rtma_atomic_load64(&shm->tx->head) != tail)
+			return 0;
+	}
+
+	return (int)(tail - start);
+}
+
+size_t rtma_shm_read(RtmaShm* shm, char* buf, size_t len) {
+	RtmaShmRing* r = shm->rx;
+	long long head = r->head;
+	size_t avail = (size_t)(rtma_atomic_load64(&r->tail) - head);
+
+	if (len > avail)
+		len = avail;
+	if (len == 0)
+		return 0;
+
+	size_t offset = (size_t)head & (shm->ring_size - 1);
+	size_t first = shm->ring_size - offset;
+	if (first > len)
+		first = len;
+
+	memcpy(buf, shm->rx_data + offset, first);
+	memcpy(buf + first, shm->rx_data, len - first);
+	rtma_atomic_store64(&r->head, head + (long long)len);
+
+	// Same pairing as rtma_shm_notify, for a writer waiting on room
+	rtma_atomic_fence();
+	if (rtma_atomic_load(&r->writer_waiting)) {
+		int waiting = rtma_atomic_exchange(&r->writer_waiting, 0);
+
+		if (waiting == RTMA_SHM_WAIT_FUTEX) {
+			rtma_atomic_add(&r->space_seq, 1);
+			syscall(SYS_futex, &r->space_seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+		}
+		else if (waiting == RTMA_SHM_WAIT_SIGNAL) {
+			rtma_shm_signal(shm->peer_fd);
+		}
+	}
+
+	return len;
+}
+
+static int rtma_shm_wait_readable(RtmaShm* shm, double timeout) {
+	double deadline = timeout > 0 ? rtma_time_now(RTMA_CLOCK_MONOTONIC) + timeout : 0.0;
+
+	for (;;) {
+		if (rtma_shm_readable(shm))
+			return 1;
+
+		// Consume old signals, then announce the wait and look once more.
+		// The descriptor stays readable while the flag is up and data is
+		// pending, which is what epoll users rely on.
+		rtma_shm_drain(shm->wake_fd);
+		rtma_atomic_store(&shm->rx->reader_waiting, 1);
+		rtma_atomic_fence();
+
+		if (rtma_shm_readable(shm)) {
+			// Unless the writer saw the flag and signalled, the descriptor
+			// was drained with data pending
+			if (rtma_atomic_exchange(&shm->rx->reader_waiting, 0))
+				rtma_shm_signal(shm->wake_fd);
+			return 1;
+		}
+
+		struct pollfd pfds[2] = { { shm->wake_fd, POLLIN, 0 }, { shm->conn, POLLIN, 0 } };
+		int ms = -1;
+
+		if (timeout == 0) {
+			ms = 0;
+		}
+		else if (timeout > 0) {
+			double remaining = deadline - rtma_time_now(RTMA_CLOCK_MONOTONIC);
+			ms = remaining > 0 ? (int)(remaining * 1000.0 + 0.999) : 0;
+		}
+
+		int status = poll(pfds, 2, ms);
+
+		if (status < 0 && errno != EINTR)
+			socket_error();
+		if (pfds[1].revents)
+			return 1;	// Peer closed
+		if (status == 0)
+			return rtma_shm_readable(shm) > 0;
+	}
+}
+
+int rtma_shm_wait(RtmaShm* shm, int events, double timeout) {
+	if (events & SOCKET_WAIT_WRITE)
+		return rtma_shm_wait_space(shm, timeout) != 0;
+
+	return rtma_shm_wait_readable(shm, timeout);
+}
+
+#else
+
+// Not available on this platform; clients stay on TCP
+
+RtmaShm* rtma_shm_connect(uint16_t port, sockfd_t* conn) {
+	return NULL;
+}
+
+sockfd_t rtma_shm_listen(uint16_t port) {
+	return INVALID_SOCKET;
+}
+
+RtmaShm* rtma_shm_accept(sockfd_t listen_fd, sockfd_t* conn) {
+	return NULL;
+}
+
+void rtma_shm_close(RtmaShm** shm) {
+	*shm = NULL;
+}
+
+int rtma_shm_fd(RtmaShm* shm) {
+	return -1;
+}
+
+size_t rtma_shm_readable(RtmaShm* shm) {
+	return 0;
+}
+
+int rtma_shm_writev(RtmaShm* shm, socket_iovec_t* iov, int iovcnt) {
+	return 0;
+}
+
+size_t rtma_shm_write(RtmaShm* shm, const char* buf, size_t len) {
+	return 0;
+}
+
+void rtma_shm_notify(RtmaShm* shm) {
+}
+
+size_t rtma_shm_read(RtmaShm* shm, char* buf, size_t len) {
+	return 0;
+}
+
+int rtma_shm_wait(RtmaShm* shm, int events, double timeout) {
+	return 0;
+}
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef _RTMA_THREAD_H
+#define _RTMA_THREAD_H
+
+// Minimal threads, mutexes and condition variables for the library's
+// background threads. Thread functions are declared with RTMA_THREAD_FUNC and
+// end with RTMA_THREAD_RETURN.
+
+#include "socket.h"
+
+#ifdef __WINDOWS__
+
+typedef HANDLE rtma_thread_t;
+typedef CRITICAL_SECTION rtma_mutex_t;
+typedef CONDITION_VARIABLE rtma_cond_t;
+
+#define RTMA_THREAD_FUNC(name, arg) DWORD WINAPI name(LPVOID arg)
+#define RTMA_THREAD_RETURN return 0
+
+static inline int rtma_thread_create(rtma_thread_t* t, LPTHREAD_START_ROUTINE fn, void* arg) {
+	*t = CreateThread(NULL, 0, fn, arg, 0, NULL);
+	return *t == NULL ? -1 : 0;
+}
+
+static inline void rtma_thread_join(rtma_thread_t t) {
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+}
+
+#define rtma_mutex_init(m) InitializeCriticalSection(m)
+#define rtma_mutex_destroy(m) DeleteCriticalSection(m)
+#define rtma_mutex_lock(m) EnterCriticalSection(m)
+#define rtma_mutex_unlock(m) LeaveCriticalSection(m)
+#define rtma_cond_init(c) InitializeConditionVariable(c)
+#define rtma_cond_destroy(c) ((void)0)
+#define rtma_cond_signal(c) WakeConditionVariable(c)
+#define rtma_cond_broadcast(c) WakeAllConditionVariable(c)
+
+static inline void rtma_cond_wait(rtma_cond_t* c, rtma_mutex_t* m, double timeout) {
+	SleepConditionVariableCS(c, m, timeout < 0 ? INFINITE : (DWORD)(timeout * 1000.0 + 0.999));
+}
+
+#define rtma_thread_yield() SwitchToThread()
+#define rtma_thread_sleep(seconds) Sleep((DWORD)((seconds) * 1000.0 + 0.999))
+
+#else
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+typedef pthread_t rtma_thread_t;
+typedef pthread_mutex_t rtma_mutex_t;
+typedef pthread_cond_t rtma_cond_t;
+
+#define RTMA_THREAD_FUNC(name, arg) void* name(void* arg)
+#define RTMA_THREAD_RETURN return NULL
+
+static inline int rtma_thread_create(rtma_thread_t* t, void* (*fn)(void*), void* arg) {
+	return pthread_create(t, NULL, fn, arg) ? -1 : 0;
+}
+
+static inline void rtma_thread_join(rtma_thread_t t) {
+	pthread_join(t, NULL);
+}
+
+#define rtma_mutex_init(m) pthread_mutex_init(m, NULL)
+#define rtma_mutex_destroy(m) pthread_mutex_destroy(m)
+#define rtma_mutex_lock(m) pthread_mutex_lock(m)
+#define rtma_mutex_unlock(m) pthread_mutex_unlock(m)
+#define rtma_cond_init(c) pthread_cond_init(c, NULL)
+#define rtma_cond_destroy(c) pthread_cond_destroy(c)
+#define rtma_cond_signal(c) pthread_cond_signal(c)
+#define rtma_cond_broadcast(c) pthread_cond_broadcast(c)
+
+// Waits at most timeout seconds, forever if negative
+static inline void rtma_cond_wait(rtma_cond_t* c, rtma_mutex_t* m, double timeout) {
+	if (timeout < 0) {
+		pthread_cond_wait(c, m);
+		return;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	long long ns = ts.tv_nsec + (long long)(timeout * 1e9);
+	ts.tv_sec += (time_t)(ns / 1000000000LL);
+	ts.tv_nsec = (long)(ns % 1000000000LL);
+	pthread_cond_timedwait(c, m, &ts);
+}
+
+#define rtma_thread_yield() sched_yield()
+
+static inline void rtma_thread_sleep(double seconds) {
+	struct timespec ts;
+	ts.tv_sec = (time_t)seconds;
+	ts.tv_nsec = (long)((seconds - (double)ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+#endif
+
+#endif //_RTMA_THREAD_H
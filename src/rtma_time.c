@@ -0,0 +1,208 @@
+#include "rtma_time.h"
+#include "rtma_atomic.h"
+
+#include <time.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+
+// Length of the one-off TSC calibration
+#define RTMA_TSC_CALIBRATION_TIME 0.02
+
+#define TSC_UNCALIBRATED 0
+#define TSC_CALIBRATING 1
+#define TSC_READY 2
+
+static int tsc_state = TSC_UNCALIBRATED;
+static int tsc_available = 0;
+static uint64_t tsc_base = 0;
+static double tsc_base_time = 0.0;
+static double tsc_seconds_per_tick = 0.0;
+static double tsc_frequency = 0.0;
+
+#ifdef __WINDOWS__
+static double qpc_seconds_per_tick = 0.0;
+#endif
+
+static double rtma_time_realtime(void) {
+#ifdef __WINDOWS__
+	FILETIME ft;
+	GetSystemTimePreciseAsFileTime(&ft);
+	ULONGLONG t = ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	// FILETIME counts 100 ns intervals since 1601
+	return (double)(t - 116444736000000000ULL) * 1e-7;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+static double rtma_time_monotonic(void) {
+#ifdef __WINDOWS__
+	LONGLONG t;
+	if (qpc_seconds_per_tick == 0.0) {
+		LONGLONG freq;
+		QueryPerformanceFrequency((LARGE_INTEGER*)&freq);
+		qpc_seconds_per_tick = 1.0 / (double)freq;
+	}
+	QueryPerformanceCounter((LARGE_INTEGER*)&t);
+	return (double)t * qpc_seconds_per_tick;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+static inline uint64_t rtma_time_read_tsc(void) {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	uint64_t ticks;
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+	return ticks;
+#else
+	return 0;
+#endif
+}
+
+// The counter must tick at a constant rate regardless of frequency scaling
+// and sleep states to be usable as a clock
+static int rtma_time_tsc_invariant(void) {
+#if defined(_MSC_VER)
+	int regs[4];
+	__cpuid(regs, 0x80000000);
+	if ((unsigned)regs[0] < 0x80000007)
+		return 0;
+	__cpuid(regs, 0x80000007);
+	return (regs[3] >> 8) & 1;
+#elif defined(__x86_64__) || defined(__i386__)
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid_max(0x80000000, NULL) < 0x80000007)
+		return 0;
+	__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+	return (edx >> 8) & 1;
+#elif defined(__aarch64__)
+	return 1;	// The generic timer is constant rate by definition
+#else
+	return 0;
+#endif
+}
+
+// Pair a counter reading with the monotonic clock. The counter is read on
+// both sides of the clock and the tightest of a few attempts is kept.
+static void rtma_time_sample(uint64_t* ticks, double* seconds) {
+	uint64_t best_span = UINT64_MAX;
+
+	for (int i = 0; i < 5; i++) {
+		uint64_t t0 = rtma_time_read_tsc();
+		double s = rtma_time_monotonic();
+		uint64_t t1 = rtma_time_read_tsc();
+
+		if (t1 - t0 < best_span) {
+			best_span = t1 - t0;
+			*ticks = t0 + (t1 - t0) / 2;
+			*seconds = s;
+		}
+	}
+}
+
+static void rtma_time_calibrate_tsc(void) {
+	if (!rtma_time_tsc_invariant())
+		return;
+
+	uint64_t ticks0, ticks1;
+	double start, end;
+
+	rtma_time_sample(&ticks0, &start);
+
+	// Busy wait so that the measurement is not at the mercy of the scheduler
+	while (rtma_time_monotonic() - start < RTMA_TSC_CALIBRATION_TIME)
+		rtma_cpu_relax();
+
+	rtma_time_sample(&ticks1, &end);
+
+	if (ticks1 <= ticks0 || end <= start)
+		return;
+
+	tsc_frequency = (double)(ticks1 - ticks0) / (end - start);
+	tsc_seconds_per_tick = 1.0 / tsc_frequency;
+	tsc_base = ticks1;
+	tsc_base_time = end;
+	tsc_available = 1;
+}
+
+// Calibrate the TSC clock unless that already happened. Safe to call from
+// several threads; only the first caller pays for the calibration.
+void rtma_time_calibrate(void) {
+	if (rtma_atomic_load(&tsc_state) == TSC_READY)
+		return;
+
+	if (rtma_atomic_cas(&tsc_state, TSC_UNCALIBRATED, TSC_CALIBRATING)) {
+		rtma_time_calibrate_tsc();
+		rtma_atomic_store(&tsc_state, TSC_READY);
+		return;
+	}
+
+	while (rtma_atomic_load(&tsc_state) != TSC_READY)
+		rtma_cpu_relax();
+}
+
+int rtma_time_tsc_available(void) {
+	rtma_time_calibrate();
+	return tsc_available;
+}
+
+// Ticks per second of the cycle counter, 0 if it is not used
+double rtma_time_tsc_frequency(void) {
+	rtma_time_calibrate();
+	return tsc_frequency;
+}
+
+double rtma_time_now(int clock) {
+	switch (clock) {
+	case RTMA_CLOCK_TSC:
+		if (rtma_atomic_load(&tsc_state) != TSC_READY)
+			rtma_time_calibrate();
+		if (tsc_available)
+			return tsc_base_time + (double)(int64_t)(rtma_time_read_tsc() - tsc_base) * tsc_seconds_per_tick;
+		return rtma_time_monotonic();
+	case RTMA_CLOCK_MONOTONIC:
+		return rtma_time_monotonic();
+	default:
+		return rtma_time_realtime();
+	}
+}
+
+const char* rtma_time_clock_name(int clock) {
+	switch (clock) {
+	case RTMA_CLOCK_REALTIME:
+		return "realtime";
+	case RTMA_CLOCK_MONOTONIC:
+		return "monotonic";
+	case RTMA_CLOCK_TSC:
+		return "tsc";
+	default:
+		return "unknown";
+	}
+}
+
+// Select the clock used for send_time, recv_time and timeouts. Set it before
+// connecting; all modules comparing timestamps must use compatible clocks.
+int rtma_client_set_clock(Client* c, int clock) {
+	if (clock < 0 || clock >= RTMA_NUM_CLOCKS) {
+		fprintf(stderr, "rtma_client_set_clock: unknown clock %d.\n", clock);
+		return -1;
+	}
+
+	if (clock == RTMA_CLOCK_TSC)
+		rtma_time_calibrate();
+
+	c->clock = clock;
+	return 0;
+}
@@ -48,7 +48,7 @@ void winsock_cleanup() {
 	WSACleanup();
 }
 
-//Print an error message and kill the program
+//Print an error message
 void socket_error(void) {
 	char    msg_buf[512];	// Buffer for text.
     DWORD   nchars;			// Number of chars returned.
@@ -69,9 +69,6 @@ void socket_error(void) {
 		fprintf(stderr, "%s", msg_buf);
 	else
 		fprintf(stderr,"No message for Error Code %d found.\n", err_code);
-
-
-	winsock_cleanup();
 }
 
 #endif //__WINDOWS__
@@ -80,7 +77,6 @@ void socket_error(void) {
 
 void socket_error(void) {
 	perror(strerror(errno));
-	exit(EXIT_FAILURE);
 }
 
 #endif //__UNIX__
@@ -92,25 +88,39 @@ sockfd_t socket_create(int family, int type, int protocol) {
 
 	if (sockfd == INVALID_SOCKET) {
 		socket_error();
+		return sockfd;
 	}
 
+#ifdef SO_NOSIGPIPE
+	int optval = 1;
+	setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, &optval, sizeof(optval));
+#endif
+
 	return sockfd;
 }
 
-void socket_connect(sockfd_t sockfd, const struct sockaddr *servaddr, socklen_t addrlen) {
+int socket_connect(sockfd_t sockfd, const struct sockaddr *servaddr, socklen_t addrlen) {
 	if (connect(sockfd, servaddr, addrlen) == SOCKET_ERROR) {
 		socket_error();
+		return SOCKET_ERROR;
 	}
+	return 0;
 }
 
-void socket_bind(sockfd_t sockfd, const struct sockaddr *addr, socklen_t addrlen) {
-	if (bind(sockfd, addr, addrlen) == SOCKET_ERROR) 	
+int socket_bind(sockfd_t sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+	if (bind(sockfd, addr, addrlen) == SOCKET_ERROR) {
 		socket_error();
+		return SOCKET_ERROR;
+	}
+	return 0;
 }
 
-void socket_listen(sockfd_t sockfd) {
-	if(listen(sockfd, 1024) == SOCKET_ERROR)
+int socket_listen(sockfd_t sockfd) {
+	if (listen(sockfd, 1024) == SOCKET_ERROR) {
 		socket_error();
+		return SOCKET_ERROR;
+	}
+	return 0;
 }
 
 sockfd_t socket_accept(sockfd_t sockfd, struct sockaddr *addr, socklen_t *addrlen) {
@@ -132,41 +142,173 @@ void socket_shutdown(sockfd_t sockfd, int how) {
 		socket_error();
 }
 
+// Returns the number of bytes read, 0 once the peer has closed the
+// connection and SOCKET_ERROR on errors
 int socket_recv(sockfd_t sockfd,  char *buf, int len, int flags) {
-	int nbytes = recv(sockfd, buf, len, flags);
-	if (nbytes == SOCKET_ERROR)
+	for (;;) {
+		int nbytes = (int)recv(sockfd, buf, len, flags);
+		if (nbytes != SOCKET_ERROR)
+			return nbytes;
+
+#ifdef __UNIX__
+		if (errno == EINTR)
+			continue;
+#endif
 		socket_error();
-	else if (nbytes == 0) {
-		fprintf(stderr, "Connection has been closed.\n");
-		exit(EXIT_FAILURE);
+		return SOCKET_ERROR;
 	}
-	else
-		return nbytes;
 }
 
 int socket_send(sockfd_t sockfd, const char *buf, int len, int flags) {
 	//flags: MSG_OOB, MSG_DONTROUTE
-	int nbytes = send(sockfd, buf, len, flags);
+	int nbytes = (int)send(sockfd, buf, len, flags | MSG_NOSIGNAL);
 	if (nbytes == SOCKET_ERROR)
 		socket_error();
-	else
-		return nbytes;
+
+	return nbytes;
 }
 
 int socket_sendall(sockfd_t sockfd, const char* buf, int len, int flags) {
 	//flags: MSG_OOB, MSG_DONTROUTE
 	int bytes_sent = 0;
-	int buf_len = len;
 
 	while (bytes_sent < len) {
-		bytes_sent += send(sockfd, buf, buf_len, flags);
-		buf += bytes_sent;
-		buf_len -= bytes_sent;
+		int nbytes = (int)send(sockfd, buf + bytes_sent, len - bytes_sent, flags | MSG_NOSIGNAL);
+
+		if (nbytes == SOCKET_ERROR) {
+#ifdef __UNIX__
+			if (errno == EINTR)
+				continue;
+#endif
+			socket_error();
+			return SOCKET_ERROR;
+		}
+
+		bytes_sent += nbytes;
 	}
 
 	return bytes_sent;
 }
 
+// Gather write of all buffers in iov. The iov array is used as scratch
+// space to track partial writes and is modified in place.
+int socket_sendallv(sockfd_t sockfd, socket_iovec_t* iov, int iovcnt, int flags) {
+	int bytes_sent = 0;
+
+	while (iovcnt > 0) {
+#ifdef __WINDOWS__
+		DWORD nbytes = 0;
+		if (WSASend(sockfd, iov, iovcnt, &nbytes, flags, NULL, NULL) == SOCKET_ERROR) {
+			socket_error();
+			return SOCKET_ERROR;
+		}
+#else
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+
+		ssize_t nbytes = sendmsg(sockfd, &msg, flags | MSG_NOSIGNAL);
+		if (nbytes == SOCKET_ERROR) {
+			if (errno == EINTR)
+				continue;
+			socket_error();
+			return SOCKET_ERROR;
+		}
+#endif
+		bytes_sent += (int)nbytes;
+
+		// Skip over the buffers that went out completely
+		while (iovcnt > 0 && (size_t)nbytes >= SOCKET_IOVEC_LEN(*iov)) {
+			nbytes -= SOCKET_IOVEC_LEN(*iov);
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0)
+			SOCKET_IOVEC_SET(*iov, SOCKET_IOVEC_BASE(*iov) + nbytes, SOCKET_IOVEC_LEN(*iov) - nbytes);
+	}
+
+	return bytes_sent;
+}
+
+// Write as much of iov as the socket takes without blocking. Returns the
+// number of bytes written, 0 if the socket buffer is full.
+int socket_trysendv(sockfd_t sockfd, socket_iovec_t* iov, int iovcnt) {
+#ifdef __WINDOWS__
+	// Winsock has no per-call non-blocking flag, so only write once the
+	// socket reports room
+	if (!socket_wait(sockfd, SOCKET_WAIT_WRITE, 0))
+		return 0;
+
+	DWORD nbytes = 0;
+	if (WSASend(sockfd, iov, iovcnt, &nbytes, 0, NULL, NULL) == SOCKET_ERROR) {
+		socket_error();
+		return SOCKET_ERROR;
+	}
+	return (int)nbytes;
+#else
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	for (;;) {
+		ssize_t nbytes = sendmsg(sockfd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (nbytes != SOCKET_ERROR)
+			return (int)nbytes;
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		if (errno != EINTR) {
+			socket_error();
+			return SOCKET_ERROR;
+		}
+	}
+#endif
+}
+
+// Wait until the socket is readable or writable. Negative timeout waits
+// forever. Returns 1 when ready and 0 on timeout. Uses poll on unix so
+// descriptors above FD_SETSIZE work.
+int socket_wait(sockfd_t sockfd, int events, double timeout) {
+	int status;
+#ifdef __WINDOWS__
+	struct timeval wait, * pWait = NULL;
+	if (timeout >= 0) {
+		wait.tv_sec = (long)timeout;
+		wait.tv_usec = (long)((timeout - (double)wait.tv_sec) * 1000000.0);
+		pWait = &wait;
+	}
+
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(sockfd, &fds);
+
+	if (events & SOCKET_WAIT_WRITE)
+		status = select(0, NULL, &fds, NULL, pWait);
+	else
+		status = select(0, &fds, NULL, NULL, pWait);
+#else
+	struct pollfd pfd;
+	pfd.fd = sockfd;
+	pfd.events = (short)(((events & SOCKET_WAIT_READ) ? POLLIN : 0) | ((events & SOCKET_WAIT_WRITE) ? POLLOUT : 0));
+	pfd.revents = 0;
+
+	// Round up so that sub-millisecond timeouts still block briefly
+	int ms = timeout < 0 ? -1 : (int)(timeout * 1000.0 + 0.999);
+
+	do {
+		status = poll(&pfd, 1, ms);
+	} while (status == SOCKET_ERROR && errno == EINTR);
+#endif
+
+	if (status == SOCKET_ERROR)
+		socket_error();
+
+	return status > 0;
+}
+
 #ifdef __WINDOWS__
 	#define OPTVAL_CAST(x) (char *)(x)
 #else
@@ -199,8 +341,8 @@ sa_family_t get_address_family(const char *node) {
 	int ret = getaddrinfo(node, NULL, &hints, &res);
 
 	if (ret) {
-		perror(gai_strerror(ret));
-		exit(1);
+		fprintf(stderr, "%s: %s\n", node, gai_strerror(ret));
+		return AF_UNSPEC;
 	}
 	
 	sa_family_t addr_family = res->ai_family;
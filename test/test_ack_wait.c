@@ -0,0 +1,174 @@
+// Waiting on acknowledgements: BLOCKING waits, borrowed messages kept valid
+// while a wait reads on, and a full request history
+#include "test_util.h"
+
+#define MT_DATA 3100
+#define MT_FILL 3101
+#define MT_LARGE 3102
+#define MT_END 3103
+
+#define NUM_FILL 100
+#define FILL_LEN 4000
+#define LARGE_LEN (3 * MAX_DATA_BYTES + 5)
+
+static void fill(char* buf, size_t len, int msg_count) {
+	for (size_t i = 0; i < len; i++)
+		buf[i] = (char)(i * 7 + msg_count);
+}
+
+static int check_fill(const char* buf, size_t len, int msg_count) {
+	for (size_t i = 0; i < len; i++) {
+		if (buf[i] != (char)(i * 7 + msg_count))
+			return 0;
+	}
+	return 1;
+}
+
+static void send_message(int fd, MSG_TYPE msg_type, int msg_count, size_t len) {
+	static char buf[LARGE_LEN];
+	size_t offset = 0;
+
+	fill(buf, len, msg_count);
+	do {
+		size_t n = len - offset < MAX_DATA_BYTES ? len - offset : MAX_DATA_BYTES;
+		RTMA_MSG_HEADER h = test_header(msg_type, 100, (int)n);
+		h.msg_count = msg_count;
+		if (len > MAX_DATA_BYTES) {
+			h.remaining_bytes = (int)(len - offset - n);
+			h.is_dynamic = offset == 0 ? RTMA_DYNAMIC_FIRST : RTMA_DYNAMIC_NEXT;
+		}
+		test_write_frame(fd, &h, buf + offset);
+		offset += n;
+	} while (offset < len);
+}
+
+static int read_request(int fd) {
+	RTMA_MSG_HEADER h;
+	char data[MAX_DATA_BYTES];
+	return test_read_frame(fd, &h, data) == 0 ? h.msg_type : -1;
+}
+
+static void script(FakeServer* s, int fd) {
+	// Late acknowledgements for BLOCKING waits
+	test_sleep(0.3);
+	test_send_ack(fd, s->mod_id);
+
+	read_request(fd);
+	test_sleep(0.3);
+	test_send_ack(fd, s->mod_id);
+
+	// Enough traffic during each subscribe to move every buffer around
+	send_message(fd, MT_DATA, 1, 3000);
+	read_request(fd);
+	for (int i = 0; i < NUM_FILL; i++)
+		send_message(fd, MT_FILL, 100 + i, FILL_LEN);
+	test_send_ack(fd, s->mod_id);
+
+	read_request(fd);
+	for (int i = 0; i < NUM_FILL; i++)
+		send_message(fd, MT_FILL, 100 + NUM_FILL + i, FILL_LEN);
+	test_send_ack(fd, s->mod_id);
+
+	send_message(fd, MT_LARGE, 2, LARGE_LEN);
+	read_request(fd);
+	send_message(fd, MT_LARGE, 3, LARGE_LEN);
+	test_send_ack(fd, s->mod_id);
+
+	// Acknowledge all but the last of a history and a half of requests
+	for (int i = 0; i <= RTMA_REQUEST_HISTORY; i++)
+		read_request(fd);
+	for (int i = 0; i < RTMA_REQUEST_HISTORY; i++)
+		test_send_ack(fd, s->mod_id);
+	send_message(fd, MT_END, 0, 0);
+
+	while (read_request(fd) >= 0)
+		;
+}
+
+static void test_blocking(Client* c) {
+	Message msg;
+	CHECK(rtma_client_wait_for_acknowledgement(c, &msg, BLOCKING) == GOT_MESSAGE);
+	CHECK(msg.rtma_header.msg_type == MT_ACKNOWLEDGE);
+
+	MSG_TYPE msg_type = MT_DATA;
+	int id = rtma_client_send_request(c, MT_SUBSCRIBE, &msg_type, sizeof(msg_type), BLOCKING);
+	CHECK(id > 0);
+	CHECK(rtma_client_wait_for_request(c, id, BLOCKING) == RTMA_NO_ERROR);
+}
+
+static void test_held_views(Client* c) {
+	MessageView view;
+
+	// Lent out of the receive buffer
+	CHECK(rtma_client_read_message_view(c, &view, 2.0) == GOT_MESSAGE);
+	CHECK(view.rtma_header.msg_type == MT_DATA);
+	rtma_client_subscribe(c, MT_FILL);
+	CHECK(view.rtma_header.num_data_bytes == 3000 && check_fill(view.data, 3000, 1));
+
+	// Lent out of the stash
+	CHECK(rtma_client_read_message_view(c, &view, 2.0) == GOT_MESSAGE);
+	CHECK(view.rtma_header.msg_type == MT_FILL && view.rtma_header.msg_count == 100);
+	rtma_client_subscribe(c, MT_LARGE);
+	CHECK(check_fill(view.data, FILL_LEN, 100));
+
+	for (int i = 1; i < 2 * NUM_FILL; i++) {
+		CHECK(rtma_client_read_message_view(c, &view, 2.0) == GOT_MESSAGE);
+		CHECK(view.rtma_header.msg_type == MT_FILL && view.rtma_header.msg_count == 100 + i);
+		CHECK(check_fill(view.data, FILL_LEN, 100 + i));
+	}
+
+	// Lent out of a reassembly buffer
+	CHECK(rtma_client_read_message_view(c, &view, 2.0) == GOT_MESSAGE);
+	CHECK(view.rtma_header.msg_type == MT_LARGE && view.rtma_header.msg_count == 2);
+	rtma_client_subscribe(c, MT_END);
+	CHECK(view.rtma_header.num_data_bytes == LARGE_LEN && check_fill(view.data, LARGE_LEN, 2));
+
+	CHECK(rtma_client_read_message_view(c, &view, 2.0) == GOT_MESSAGE);
+	CHECK(view.rtma_header.msg_type == MT_LARGE && view.rtma_header.msg_count == 3);
+	CHECK(view.rtma_header.num_data_bytes == LARGE_LEN && check_fill(view.data, LARGE_LEN, 3));
+}
+
+// The oldest request is given up on to make room, its late acknowledgement
+// must not complete the newest
+static void test_full_history(Client* c) {
+	MessageView view;
+	int first_id = 0;
+	int id;
+
+	for (int i = 0; i < RTMA_REQUEST_HISTORY; i++) {
+		MSG_TYPE msg_type = 5000 + i;
+		id = rtma_client_send_request(c, MT_SUBSCRIBE, &msg_type, sizeof(msg_type), 0.3);
+		if (i == 0)
+			first_id = id;
+	}
+
+	MSG_TYPE msg_type = 5000 + RTMA_REQUEST_HISTORY;
+	id = rtma_client_send_request(c, MT_SUBSCRIBE, &msg_type, sizeof(msg_type), 1.0);
+	CHECK(id == first_id + RTMA_REQUEST_HISTORY);
+
+	CHECK(rtma_client_wait_for_request(c, id, BLOCKING) == RTMA_ERROR_ACK_TIMEOUT);
+	CHECK(rtma_client_poll_request(c, first_id + 1) == RTMA_NO_ERROR);
+	CHECK(rtma_client_poll_request(c, id - 1) == RTMA_NO_ERROR);
+
+	CHECK(rtma_client_read_message_view(c, &view, 2.0) == GOT_MESSAGE);
+	CHECK(view.rtma_header.msg_type == MT_END);
+}
+
+int main(void) {
+	FakeServer s;
+
+	CHECK(fake_server_start(&s, script, NULL) == 0);
+	Client* c = fake_server_connect(&s);
+	CHECK(c != NULL);
+	if (c == NULL)
+		return test_result("test_ack_wait");
+
+	test_blocking(c);
+	test_held_views(c);
+	test_full_history(c);
+
+	rtma_client_disconnect(c);
+	rtma_destroy_client(&c);
+	fake_server_stop(&s);
+	return test_result("test_ack_wait");
+}
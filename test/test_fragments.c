@@ -0,0 +1,121 @@
+// Reassembly of dynamic messages that lost fragments on the way
+#include "test_util.h"
+
+#define MT_LARGE 3000
+#define MT_END 3001
+
+static void fill(char* buf, size_t len, int msg_count) {
+	for (size_t i = 0; i < len; i++)
+		buf[i] = (char)(i * 7 + msg_count);
+}
+
+static int check_fill(const char* buf, size_t len, int msg_count) {
+	for (size_t i = 0; i < len; i++) {
+		if (buf[i] != (char)(i * 7 + msg_count))
+			return 0;
+	}
+	return 1;
+}
+
+// Fragment number index of a message of len bytes
+static void send_fragment(int fd, int msg_count, size_t len, int index) {
+	static char buf[4 * MAX_DATA_BYTES];
+	size_t offset = (size_t)index * MAX_DATA_BYTES;
+	size_t n = len - offset < MAX_DATA_BYTES ? len - offset : MAX_DATA_BYTES;
+
+	fill(buf, len, msg_count);
+	RTMA_MSG_HEADER h = test_header(MT_LARGE, 100, (int)n);
+	h.msg_count = msg_count;
+	h.remaining_bytes = (int)(len - offset - n);
+	h.is_dynamic = index == 0 ? RTMA_DYNAMIC_FIRST : RTMA_DYNAMIC_NEXT;
+	test_write_frame(fd, &h, buf + offset);
+}
+
+static void send_message(int fd, int msg_count, size_t len) {
+	for (int i = 0; (size_t)i * MAX_DATA_BYTES < len; i++)
+		send_fragment(fd, msg_count, len, i);
+}
+
+static void send_end(int fd) {
+	RTMA_MSG_HEADER h = test_header(MT_END, 100, 0);
+	test_write_frame(fd, &h, NULL);
+}
+
+static void script(FakeServer* s, int fd) {
+	char data[MAX_DATA_BYTES];
+	RTMA_MSG_HEADER h;
+
+	// Middle fragment lost, then a complete message
+	send_fragment(fd, 1, 3 * MAX_DATA_BYTES, 0);
+	send_fragment(fd, 1, 3 * MAX_DATA_BYTES, 2);
+	send_message(fd, 2, 10000);
+	send_end(fd);
+
+	// Last fragment lost from more messages than there are assembly slots
+	for (int i = 0; i < RTMA_MAX_ASSEMBLIES + 2; i++)
+		send_fragment(fd, 10 + i, 2 * MAX_DATA_BYTES, 0);
+	send_message(fd, 30, 3 * MAX_DATA_BYTES);
+	send_end(fd);
+
+	// Sender restarted the message after the first fragment
+	send_fragment(fd, 40, 2 * MAX_DATA_BYTES + 1, 0);
+	send_message(fd, 40, 2 * MAX_DATA_BYTES + 1);
+	send_end(fd);
+
+	// Fragment claims more bytes than the first announced
+	send_fragment(fd, 50, 2 * MAX_DATA_BYTES, 0);
+	send_fragment(fd, 50, 3 * MAX_DATA_BYTES, 1);
+	send_end(fd);
+
+	// Hold the connection until the client is done
+	while (test_read_frame(fd, &h, data) == 0)
+		;
+}
+
+// Read messages up to the next MT_END. Returns the number of MT_LARGE
+// messages, the last one in msg_count and len.
+static int read_until_end(Client* c, int* msg_count, size_t* len, int* intact) {
+	MessageView view;
+	int count = 0;
+
+	while (rtma_client_read_message_view(c, &view, 2.0) == GOT_MESSAGE) {
+		if (view.rtma_header.msg_type == MT_END)
+			return count;
+		if (view.rtma_header.msg_type == MT_LARGE) {
+			count++;
+			*msg_count = view.rtma_header.msg_count;
+			*len = view.rtma_header.num_data_bytes;
+			*intact = check_fill(view.data, *len, *msg_count);
+		}
+	}
+	return -1;
+}
+
+int main(void) {
+	FakeServer s;
+	int msg_count = 0;
+	size_t len = 0;
+	int intact = 0;
+
+	CHECK(fake_server_start(&s, script, NULL) == 0);
+	Client* c = fake_server_connect(&s);
+	CHECK(c != NULL);
+	if (c == NULL)
+		return test_result("test_fragments");
+
+	CHECK(read_until_end(c, &msg_count, &len, &intact) == 1);
+	CHECK(msg_count == 2 && len == 10000 && intact);
+
+	CHECK(read_until_end(c, &msg_count, &len, &intact) == 1);
+	CHECK(msg_count == 30 && len == 3 * MAX_DATA_BYTES && intact);
+
+	CHECK(read_until_end(c, &msg_count, &len, &intact) == 1);
+	CHECK(msg_count == 40 && len == 2 * MAX_DATA_BYTES + 1 && intact);
+
+	CHECK(read_until_end(c, &msg_count, &len, &intact) == 0);
+
+	rtma_client_disconnect(c);
+	rtma_destroy_client(&c);
+	fake_server_stop(&s);
+	return test_result("test_fragments");
+}
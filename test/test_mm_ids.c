@@ -0,0 +1,45 @@
+// rtma_mm refuses module ids that are out of range or already connected
+#include "test_util.h"
+
+#define MM_PORT 7191
+#define MT_PING 3300
+
+int main(void) {
+	Message msg;
+
+	pid_t mm = test_start_mm(MM_PORT);
+	CHECK(mm > 0);
+	if (mm <= 0)
+		return test_result("test_mm_ids");
+
+	Client* a = rtma_create_client(200, 0);
+	CHECK(rtma_client_connect(a, "127.0.0.1", MM_PORT) == RTMA_NO_ERROR);
+
+	Client* dup = rtma_create_client(200, 0);
+	CHECK(rtma_client_connect(dup, "127.0.0.1", MM_PORT) != RTMA_NO_ERROR);
+	rtma_destroy_client(&dup);
+
+	Client* neg = rtma_create_client(-30000, 0);
+	CHECK(rtma_client_connect(neg, "127.0.0.1", MM_PORT) != RTMA_NO_ERROR);
+	rtma_destroy_client(&neg);
+
+	CHECK(test_mm_alive(mm));
+
+	// The first module still owns its id and gets its messages
+	Client* d = rtma_create_client(0, 0);
+	CHECK(rtma_client_connect(d, "127.0.0.1", MM_PORT) == RTMA_NO_ERROR);
+	CHECK(d->module_id >= 100 && d->module_id != 200);
+
+	MSG_TYPE msg_type = MT_PING;
+	CHECK(rtma_client_subscribe_many(a, &msg_type, 1, NULL) == 0);
+	CHECK(rtma_client_send_message_to_module(d, MT_PING, NULL, 0, 200, HID_LOCAL_HOST, BLOCKING) > 0);
+	CHECK(rtma_client_read_message(a, &msg, 2.0) == GOT_MESSAGE);
+	CHECK(msg.rtma_header.msg_type == MT_PING && msg.rtma_header.src_mod_id == d->module_id);
+
+	rtma_client_disconnect(a);
+	rtma_client_disconnect(d);
+	rtma_destroy_client(&a);
+	rtma_destroy_client(&d);
+	test_stop_mm(mm);
+	return test_result("test_mm_ids");
+}
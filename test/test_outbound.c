@@ -0,0 +1,90 @@
+// Outbound queue policies leave control messages alone, and a lost
+// connection is reported by flush
+#include "test_util.h"
+#include "rtma_outbound.h"
+
+#define MT_DATA 3400
+#define MT_END 3401
+#define MT_OUT_OF_RANGE (MAX_MESSAGE_TYPES + 5)
+
+#define NUM_DATA 4000
+#define DATA_LEN 4000
+
+typedef struct {
+	int subscribes;
+	int data;
+	int out_of_range;
+}Received;
+
+static void script(FakeServer* s, int fd) {
+	Received* r = (Received*)s->arg;
+	char data[MAX_DATA_BYTES];
+	RTMA_MSG_HEADER h;
+
+	// Let the socket fill up so that sends queue behind it
+	test_sleep(0.2);
+
+	while (test_read_frame(fd, &h, data) == 0 && h.msg_type != MT_END) {
+		if (h.msg_type == MT_SUBSCRIBE) {
+			r->subscribes++;
+			test_send_ack(fd, s->mod_id);
+		}
+		else if (h.msg_type == MT_DATA) {
+			r->data++;
+		}
+		else if (h.msg_type == MT_OUT_OF_RANGE) {
+			r->out_of_range++;
+		}
+	}
+}
+
+int main(void) {
+	static char payload[DATA_LEN];
+	FakeServer s;
+	Received received = { 0 };
+
+	CHECK(fake_server_start(&s, script, &received) == 0);
+	Client* c = fake_server_connect(&s);
+	CHECK(c != NULL);
+	if (c == NULL)
+		return test_result("test_outbound");
+
+	CHECK(rtma_client_enable_outbound_queue(c, 64 * 1024 * 1024, 0) == 0);
+	CHECK(rtma_client_set_outbound_policy(c, RTMA_OUTBOUND_ALL_TYPES, RTMA_OUTBOUND_CONFLATE) == 0);
+	CHECK(rtma_client_set_outbound_policy(c, MT_DATA, RTMA_OUTBOUND_BLOCK) == 0);
+	CHECK(rtma_client_set_outbound_policy(c, MT_SUBSCRIBE, RTMA_OUTBOUND_CONFLATE) != 0);
+
+	for (int i = 0; i < NUM_DATA; i++)
+		rtma_client_send_message(c, MT_DATA, payload, DATA_LEN);
+
+	// Queued behind the data, same size, and both acknowledged
+	MSG_TYPE types[2] = { 3500, 3501 };
+	int first = rtma_client_send_request(c, MT_SUBSCRIBE, &types[0], sizeof(MSG_TYPE), 5.0);
+	int second = rtma_client_send_request(c, MT_SUBSCRIBE, &types[1], sizeof(MSG_TYPE), 5.0);
+	CHECK(rtma_client_wait_for_request(c, second, 5.0) == RTMA_NO_ERROR);
+	CHECK(rtma_client_poll_request(c, first) == RTMA_NO_ERROR);
+
+	// Outside the policy table, queued like any blocking type
+	CHECK(rtma_client_send_message(c, MT_OUT_OF_RANGE, payload, 8) > 0);
+	CHECK(rtma_client_send_message(c, MT_OUT_OF_RANGE, payload, 8) > 0);
+
+	rtma_client_send_signal(c, MT_END);
+	CHECK(rtma_client_flush(c) == 0);
+	fake_server_stop(&s);
+
+	CHECK(received.subscribes == 2);
+	CHECK(received.data == NUM_DATA);
+	CHECK(received.out_of_range == 2);
+
+	// The manager is gone
+	int lost = FALSE;
+	for (int i = 0; i < 1000 && !lost; i++) {
+		rtma_client_send_message(c, MT_DATA, payload, DATA_LEN);
+		lost = rtma_client_flush(c) == SOCKET_ERROR;
+	}
+	CHECK(lost);
+
+	rtma_client_disconnect(c);
+	rtma_destroy_client(&c);
+	return test_result("test_outbound");
+}
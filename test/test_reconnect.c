@@ -0,0 +1,153 @@
+// Reconnecting with more subscriptions than the request history holds, and
+// reconnecting from an event loop without stalling its other sources
+#include "test_util.h"
+#include "rtma_event_loop.h"
+#include "rtma_time.h"
+
+#define MM_PORT 7192
+#define MT_FIRST 4000
+#define NUM_TYPES 3000
+#define MT_LAST (MT_FIRST + NUM_TYPES - 1)
+
+static MSG_TYPE types[NUM_TYPES];
+
+static Client* connect_subscriber(void) {
+	Client* c = rtma_create_client(0, 0);
+	rtma_client_set_auto_reconnect(c, TRUE, 2.0);
+	CHECK(rtma_client_connect(c, "127.0.0.1", MM_PORT) == RTMA_NO_ERROR);
+	CHECK(rtma_client_subscribe_many(c, types, NUM_TYPES, NULL) == 0);
+	return c;
+}
+
+// Takes connections without ever answering MT_CONNECT
+static int listen_silently(uint16_t port) {
+	struct sockaddr_in addr;
+	int one = 1;
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void test_many_subscriptions(pid_t* mm) {
+	Message msg;
+	Client* sub = connect_subscriber();
+
+	test_stop_mm(*mm);
+	*mm = test_start_mm(MM_PORT);
+
+	rtma_client_read_message(sub, &msg, 0.2);
+	CHECK(rtma_client_reconnect(sub, 2.0) == RTMA_NO_ERROR);
+	CHECK(sub->reconnects == 1);
+
+	Client* pub = rtma_create_client(0, 0);
+	CHECK(rtma_client_connect(pub, "127.0.0.1", MM_PORT) == RTMA_NO_ERROR);
+	CHECK(rtma_client_send_signal(pub, MT_FIRST) > 0);
+	CHECK(rtma_client_send_signal(pub, MT_LAST) > 0);
+
+	CHECK(rtma_client_read_message(sub, &msg, 2.0) == GOT_MESSAGE && msg.rtma_header.msg_type == MT_FIRST);
+	CHECK(rtma_client_read_message(sub, &msg, 2.0) == GOT_MESSAGE && msg.rtma_header.msg_type == MT_LAST);
+
+	rtma_client_disconnect(pub);
+	rtma_destroy_client(&pub);
+	rtma_client_disconnect(sub);
+	rtma_destroy_client(&sub);
+}
+
+static void on_tick(EventLoop* loop, int timer_id, void* ctx) {
+	(*(int*)ctx)++;
+}
+
+static void on_last(EventLoop* loop, Client* c, MessageView* msg, void* ctx) {
+	(*(int*)ctx)++;
+}
+
+static void run_for(EventLoop* loop, double seconds, int* until) {
+	double end = rtma_time_now(RTMA_CLOCK_MONOTONIC) + seconds;
+	while (rtma_time_now(RTMA_CLOCK_MONOTONIC) < end && !(until && *until))
+		rtma_event_loop_run_once(loop, 0.01);
+}
+
+static void test_event_loop(pid_t* mm) {
+	int ticks = 0;
+	int got = 0;
+	Client* sub = connect_subscriber();
+	EventLoop* loop = rtma_create_event_loop();
+
+	CHECK(rtma_event_loop_add_client(loop, sub) == 0);
+	CHECK(rtma_event_loop_add_timer(loop, 0.01, TRUE, on_tick, &ticks) >= 0);
+	rtma_event_loop_set_handler(loop, MT_LAST, on_last, &got);
+
+	// The manager is back but does not answer, the timer keeps going
+	test_stop_mm(*mm);
+	*mm = -1;
+	int silent = listen_silently(MM_PORT);
+	CHECK(silent >= 0);
+
+	run_for(loop, 0.5, NULL);
+	CHECK(ticks >= 20);
+	CHECK(!sub->connected);
+
+	close(silent);
+	*mm = test_start_mm(MM_PORT);
+	CHECK(*mm > 0);
+
+	// Restored over several turns of the loop
+	Client* pub = rtma_create_client(0, 0);
+	CHECK(rtma_client_connect(pub, "127.0.0.1", MM_PORT) == RTMA_NO_ERROR);
+	for (int i = 0; i < 100 && !got; i++) {
+		rtma_client_send_signal(pub, MT_LAST);
+		run_for(loop, 0.05, &got);
+	}
+	CHECK(got > 0);
+	CHECK(sub->reconnects == 1);
+
+	rtma_event_loop_remove_client(loop, sub);
+	rtma_destroy_event_loop(&loop);
+	rtma_client_disconnect(pub);
+	rtma_destroy_client(&pub);
+	rtma_client_disconnect(sub);
+	rtma_destroy_client(&sub);
+}
+
+int main(void) {
+	char log[4096];
+
+	for (int i = 0; i < NUM_TYPES; i++)
+		types[i] = MT_FIRST + i;
+
+	pid_t mm = test_start_mm(MM_PORT);
+	CHECK(mm > 0);
+	if (mm <= 0)
+		return test_result("test_reconnect");
+
+	// Keep what the client reports
+	FILE* err = tmpfile();
+	int saved = dup(STDERR_FILENO);
+	fflush(stderr);
+	dup2(fileno(err), STDERR_FILENO);
+
+	test_many_subscriptions(&mm);
+	test_event_loop(&mm);
+
+	fflush(stderr);
+	dup2(saved, STDERR_FILENO);
+	rewind(err);
+	size_t n = fread(log, 1, sizeof(log) - 1, err);
+	log[n] = '\0';
+	fclose(err);
+	fputs(log, stderr);
+	CHECK(strstr(log, "not all subscriptions were restored") == NULL);
+
+	test_stop_mm(mm);
+	return test_result("test_reconnect");
+}
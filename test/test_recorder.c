@@ -0,0 +1,63 @@
+// A new recording replaces an earlier, longer one at the same path
+#include "test_util.h"
+#include "rtma_recorder.h"
+
+#define MT_DATA 3600
+#define SEGMENT_SIZE 4096
+
+static void record(const char* path, int count) {
+	char data[256];
+	MessageRecorder* r = rtma_create_recorder(path, SEGMENT_SIZE);
+	CHECK(r != NULL);
+	if (r == NULL)
+		return;
+
+	memset(data, 0, sizeof(data));
+	for (int i = 0; i < count; i++) {
+		RTMA_MSG_HEADER h = test_header(MT_DATA, 100, sizeof(data));
+		h.msg_count = i;
+		h.recv_time = 1.0 + i;
+		CHECK(rtma_recorder_write(r, &h, data) == 0);
+	}
+	rtma_destroy_recorder(&r);
+}
+
+static int count_messages(const char* path) {
+	MessageView view;
+	int count = 0;
+
+	MessageRecording* rec = rtma_open_recording(path);
+	CHECK(rec != NULL);
+	if (rec == NULL)
+		return -1;
+
+	while (rtma_recording_next(rec, &view) == GOT_MESSAGE) {
+		CHECK(view.rtma_header.msg_count == count);
+		count++;
+	}
+	rtma_close_recording(&rec);
+	return count;
+}
+
+int main(void) {
+	char dir[] = "/tmp/test_recorder.XXXXXX";
+	char path[64];
+	char seg[96];
+
+	CHECK(mkdtemp(dir) != NULL);
+	snprintf(path, sizeof(path), "%s/rec", dir);
+
+	record(path, 100);
+	CHECK(count_messages(path) == 100);
+
+	record(path, 3);
+	CHECK(count_messages(path) == 3);
+
+	snprintf(seg, sizeof(seg), "%s.000001.seg", path);
+	CHECK(access(seg, F_OK) != 0);
+
+	char cmd[96];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	CHECK(system(cmd) == 0);
+	return test_result("test_recorder");
+}
@@ -0,0 +1,65 @@
+// The send thread queues messages whole and gives up on a dead connection
+#include "test_util.h"
+#include "rtma_send_queue.h"
+
+#define MT_LARGE 3200
+#define MT_END 3201
+
+#define NUM_SLOTS 4
+
+static char payload[6 * MAX_DATA_BYTES];
+
+// Count the fragments of each message up to MT_END, then hang up
+static void script(FakeServer* s, int fd) {
+	int* counts = (int*)s->arg;
+	char data[MAX_DATA_BYTES];
+	RTMA_MSG_HEADER h;
+
+	while (test_read_frame(fd, &h, data) == 0 && h.msg_type != MT_END) {
+		if (h.msg_type == MT_LARGE && h.msg_count >= 0 && h.msg_count < 8)
+			counts[h.msg_count]++;
+	}
+}
+
+int main(void) {
+	FakeServer s;
+	int counts[8] = { 0 };
+	SendQueueStats stats;
+
+	CHECK(fake_server_start(&s, script, counts) == 0);
+	Client* c = fake_server_connect(&s);
+	CHECK(c != NULL);
+	if (c == NULL)
+		return test_result("test_send_queue");
+
+	CHECK(rtma_client_start_send_thread(c, NUM_SLOTS, RTMA_SEND_QUEUE_DROP) == 0);
+
+	// More fragments than slots: dropped whole, never cut short
+	int first = c->msg_count;
+	CHECK(rtma_client_send_message(c, MT_LARGE, payload, 5 * MAX_DATA_BYTES) == 0);
+	CHECK(rtma_client_send_message(c, MT_LARGE, payload, 3 * MAX_DATA_BYTES) > 0);
+	CHECK(rtma_client_flush(c) == 0);
+
+	rtma_client_get_send_queue_stats(c, &stats);
+	CHECK(stats.dropped == 1 && stats.sent == 3 && stats.failed == 0);
+
+	// Once the manager is gone a flush reports it instead of waiting forever
+	rtma_client_send_signal(c, MT_END);
+	CHECK(rtma_client_flush(c) == 0);
+	fake_server_stop(&s);
+
+	int lost = FALSE;
+	for (int i = 0; i < 100 && !lost; i++) {
+		rtma_client_send_message(c, MT_LARGE, payload, MAX_DATA_BYTES);
+		lost = rtma_client_flush(c) == SOCKET_ERROR;
+	}
+	CHECK(lost);
+	CHECK(c->send_queue == NULL && !c->connected);
+
+	CHECK(counts[(first + 1) & 7] == 0);
+	CHECK(counts[(first + 2) & 7] == 3);
+
+	rtma_client_disconnect(c);
+	rtma_destroy_client(&c);
+	return test_result("test_send_queue");
+}
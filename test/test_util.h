@@ -0,0 +1,237 @@
+#ifndef _TEST_UTIL_H
+#define _TEST_UTIL_H
+
+// Helpers for the regression tests in this directory. Unix only.
+//
+// A test either talks to a fake message manager, a thread that accepts one
+// client on a loopback port and plays a script of raw frames at it, or to a
+// real bin/rtma_mm started next to the test binary.
+
+#include "rtma_client.h"
+
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		test_failures++; \
+	} \
+} while (0)
+
+// Print the result and give the exit status of the test
+static int test_result(const char* name) {
+	printf("%s: %s\n", name, test_failures ? "FAILED" : "passed");
+	return test_failures ? 1 : 0;
+}
+
+static void test_sleep(double seconds) {
+	usleep((useconds_t)(seconds * 1e6));
+}
+
+static int test_write_all(int fd, const void* buf, size_t len) {
+	const char* p = (const char*)buf;
+	while (len > 0) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int test_read_all(int fd, void* buf, size_t len) {
+	char* p = (char*)buf;
+	while (len > 0) {
+		ssize_t n = recv(fd, p, len, 0);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Read one frame, data has to hold MAX_DATA_BYTES
+static int test_read_frame(int fd, RTMA_MSG_HEADER* h, void* data) {
+	if (test_read_all(fd, h, sizeof(RTMA_MSG_HEADER)) != 0)
+		return -1;
+	if (h->num_data_bytes < 0 || h->num_data_bytes > MAX_DATA_BYTES)
+		return -1;
+	return test_read_all(fd, data, h->num_data_bytes);
+}
+
+static int test_write_frame(int fd, const RTMA_MSG_HEADER* h, const void* data) {
+	if (test_write_all(fd, h, sizeof(RTMA_MSG_HEADER)) != 0)
+		return -1;
+	return test_write_all(fd, data, h->num_data_bytes);
+}
+
+// Header of a message from the manager to module dest_mod_id
+static RTMA_MSG_HEADER test_header(MSG_TYPE msg_type, MODULE_ID dest_mod_id, int num_data_bytes) {
+	RTMA_MSG_HEADER h;
+	memset(&h, 0, sizeof(h));
+	h.msg_type = msg_type;
+	h.src_mod_id = MID_MESSAGE_MANAGER;
+	h.dest_mod_id = dest_mod_id;
+	h.num_data_bytes = num_data_bytes;
+	return h;
+}
+
+static int test_send_ack(int fd, MODULE_ID dest_mod_id) {
+	RTMA_MSG_HEADER h = test_header(MT_ACKNOWLEDGE, dest_mod_id, 0);
+	return test_write_frame(fd, &h, NULL);
+}
+
+typedef struct FakeServer FakeServer;
+typedef void (*FAKE_SERVER_SCRIPT)(FakeServer* s, int fd);
+
+// Accepts one client, acknowledges its MT_CONNECT and runs script on the
+// connection
+struct FakeServer {
+	int listen_fd;
+	uint16_t port;
+	pthread_t thread;
+	FAKE_SERVER_SCRIPT script;
+	void* arg;
+	MODULE_ID mod_id;	// Module id given to the client
+};
+
+static void* fake_server_thread(void* arg) {
+	FakeServer* s = (FakeServer*)arg;
+	RTMA_MSG_HEADER h;
+	char data[MAX_DATA_BYTES];
+
+	int fd = accept(s->listen_fd, NULL, NULL);
+	if (fd < 0)
+		return NULL;
+
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (test_read_frame(fd, &h, data) == 0 && h.msg_type == MT_CONNECT) {
+		if (h.src_mod_id != 0)
+			s->mod_id = h.src_mod_id;
+		if (test_send_ack(fd, s->mod_id) == 0)
+			s->script(s, fd);
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static int fake_server_start(FakeServer* s, FAKE_SERVER_SCRIPT script, void* arg) {
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+
+	memset(s, 0, sizeof(*s));
+	s->script = script;
+	s->arg = arg;
+	s->mod_id = 100;
+
+	s->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (s->listen_fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	if (bind(s->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(s->listen_fd, 1) != 0 ||
+		getsockname(s->listen_fd, (struct sockaddr*)&addr, &addrlen) != 0) {
+		close(s->listen_fd);
+		return -1;
+	}
+
+	s->port = ntohs(addr.sin_port);
+	if (pthread_create(&s->thread, NULL, fake_server_thread, s) != 0) {
+		close(s->listen_fd);
+		return -1;
+	}
+	return 0;
+}
+
+static void fake_server_stop(FakeServer* s) {
+	pthread_join(s->thread, NULL);
+	close(s->listen_fd);
+}
+
+// Connect a new client to the fake server
+static Client* fake_server_connect(FakeServer* s) {
+	Client* c = rtma_create_client(0, 0);
+	if (rtma_client_connect(c, "127.0.0.1", s->port) != RTMA_NO_ERROR)
+		rtma_destroy_client(&c);
+	return c;
+}
+
+// Start bin/rtma_mm, which sits next to the test binaries, on port and wait
+// until it takes connections. Returns its pid, -1 on failure.
+static pid_t test_start_mm(uint16_t port) {
+	char exe[PATH_MAX];
+	char mm[PATH_MAX + 16];
+	char port_arg[16];
+
+	ssize_t n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (n <= 0)
+		return -1;
+	exe[n] = '\0';
+	snprintf(mm, sizeof(mm), "%s/rtma_mm", dirname(exe));
+	snprintf(port_arg, sizeof(port_arg), "%u", port);
+
+	pid_t pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0) {
+		execl(mm, mm, "-s", "127.0.0.1", "-p", port_arg, "-noshm", (char*)NULL);
+		_exit(127);
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	for (int i = 0; i < 500; i++) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		int ok = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+		close(fd);
+		if (ok)
+			return pid;
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			return -1;
+		test_sleep(0.01);
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+static void test_stop_mm(pid_t pid) {
+	if (pid <= 0)
+		return;
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+// True while the process has not exited
+static int test_mm_alive(pid_t pid) {
+	return pid > 0 && waitpid(pid, NULL, WNOHANG) == 0;
+}
+
+#endif //_TEST_UTIL_H